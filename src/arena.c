@@ -0,0 +1,173 @@
+#include <czmq.h>
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+typedef struct _block_t {
+    struct _block_t *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__ ((aligned (ARENA_ALIGNMENT)));
+} block_t;
+
+struct _arena_t {
+    block_t *first;
+    block_t *current;
+    size_t block_size;
+    size_t used;
+    size_t reserved;
+};
+
+static block_t *
+block_new (size_t size)
+{
+    block_t *block = (block_t *) malloc (sizeof (block_t) + size);
+    assert (block);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+arena_t *
+arena_new (size_t block_size)
+{
+    arena_t *self = (arena_t *) zmalloc (sizeof (arena_t));
+    assert (self);
+    self->block_size = block_size;
+    self->first = self->current = block_new (block_size);
+    self->reserved = block_size;
+    return self;
+}
+
+void
+arena_destroy (arena_t **self_p)
+{
+    arena_t *self = *self_p;
+    if (self == NULL)
+        return;
+    block_t *block = self->first;
+    while (block) {
+        block_t *next = block->next;
+        free (block);
+        block = next;
+    }
+    free (self);
+    *self_p = NULL;
+}
+
+void *
+arena_alloc (arena_t *self, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    block_t *block = self->current;
+    if (block->used + size > block->size) {
+        // move on to the next block kept from before the last reset, unless
+        // it's too small, in which case a new one is linked in before it
+        block_t *next = block->next;
+        if (next == NULL || next->size < size) {
+            size_t block_size = size > self->block_size ? size : self->block_size;
+            block_t *new_block = block_new (block_size);
+            new_block->next = next;
+            block->next = new_block;
+            self->reserved += block_size;
+            next = new_block;
+        }
+        block = self->current = next;
+    }
+    void *p = block->data + block->used;
+    block->used += size;
+    self->used += size;
+    memset (p, 0, size);
+    return p;
+}
+
+char *
+arena_strndup (arena_t *self, const char *str, size_t len)
+{
+    char *copy = (char *) arena_alloc (self, len + 1);
+    memcpy (copy, str, len);
+    return copy;
+}
+
+void
+arena_reset (arena_t *self)
+{
+    for (block_t *block = self->first; block; block = block->next) {
+        block->used = 0;
+        if (block == self->current)
+            break;
+    }
+    self->current = self->first;
+    self->used = 0;
+}
+
+size_t
+arena_used (arena_t *self)
+{
+    return self->used;
+}
+
+size_t
+arena_reserved (arena_t *self)
+{
+    return self->reserved;
+}
+
+void
+arena_test (int verbose)
+{
+    printf (" * arena: ");
+    if (verbose)
+        printf ("\n");
+
+    arena_t *arena = arena_new (256);
+    assert (arena);
+    assert (arena_used (arena) == 0);
+    assert (arena_reserved (arena) == 256);
+
+    //  allocations are aligned and zeroed
+    char *a = (char *) arena_alloc (arena, 3);
+    char *b = (char *) arena_alloc (arena, 20);
+    assert (((uintptr_t) a) % ARENA_ALIGNMENT == 0);
+    assert (((uintptr_t) b) % ARENA_ALIGNMENT == 0);
+    assert (b == a + 16);
+    assert (arena_used (arena) == 48);
+    for (int i = 0; i < 20; i++)
+        assert (b [i] == 0);
+
+    char *s = arena_strndup (arena, "boursin cheese", 7);
+    assert (streq (s, "boursin"));
+
+    //  filling the first block moves on to a new one
+    for (int i = 0; i < 20; i++)
+        memset (arena_alloc (arena, 32), 'x', 32);
+    assert (arena_reserved (arena) == 3 * 256);
+
+    //  oversized allocations get a block of their own
+    char *big = (char *) arena_alloc (arena, 1000);
+    memset (big, 'y', 1000);
+    size_t reserved = arena_reserved (arena);
+    assert (reserved == 3 * 256 + 1008);
+
+    //  blocks are kept and reused after a reset
+    arena_reset (arena);
+    assert (arena_used (arena) == 0);
+    char *c = (char *) arena_alloc (arena, 3);
+    assert (c == a);
+    assert (c [0] == 0);
+    for (int i = 0; i < 20; i++) {
+        char *p = (char *) arena_alloc (arena, 32);
+        for (int j = 0; j < 32; j++)
+            assert (p [j] == 0);
+    }
+    big = (char *) arena_alloc (arena, 1000);
+    for (int i = 0; i < 1000; i++)
+        assert (big [i] == 0);
+    assert (arena_reserved (arena) == reserved);
+
+    arena_destroy (&arena);
+    assert (arena == NULL);
+
+    printf ("OK\n");
+}
@@ -0,0 +1,38 @@
+#ifndef __ARENA_H_INCLUDED__
+#define __ARENA_H_INCLUDED__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A bump allocator for short lived objects. Memory handed out by the arena is
+// zeroed and 16 byte aligned. Individual allocations can't be freed: resetting
+// the arena releases all of them at once, but keeps the blocks for reuse.
+
+typedef struct _arena_t arena_t;
+
+extern arena_t* arena_new (size_t block_size);
+
+extern void arena_destroy (arena_t **self_p);
+
+extern void* arena_alloc (arena_t *self, size_t size);
+
+extern char* arena_strndup (arena_t *self, const char *str, size_t len);
+
+extern void arena_reset (arena_t *self);
+
+// number of bytes allocated since the last reset
+extern size_t arena_used (arena_t *self);
+
+// number of bytes reserved in blocks
+extern size_t arena_reserved (arena_t *self);
+
+extern void arena_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,8 +9,16 @@
 #include <getopt.h>
 #include "logjam-util.h"
 #include "zring.h"
-
-int verbose = 0;
+#include "json-view.h"
+#include "arena.h"
+#include "mpmc-queue.h"
+#include "simd-kernels.h"
+#include "dump-file.h"
+#include "importer-jsonbson.h"
+#include "importer-resources.h"
+#include "importer-counters.h"
+#include "importer-namespaces.h"
+#include "importer-aggtable.h"
 
 static void print_usage(char * const *argv)
 {
@@ -37,7 +45,7 @@ static void process_arguments(int argc, char * const *argv)
     while ((c = getopt_long(argc, argv, "v", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
-            verbose = 1;
+            verbose = true;
             break;
         case 0:
             print_usage(argv);
@@ -64,5 +72,15 @@ int main(int argc, char * const *argv)
     process_arguments(argc, argv);
     zring_test(verbose);
     logjam_util_test(verbose);
+    json_view_test(verbose);
+    arena_test(verbose);
+    mpmc_queue_test(verbose);
+    simd_kernels_test(verbose);
+    dump_file_test(verbose);
+    importer_jsonbson_test(verbose);
+    importer_resources_test(verbose);
+    importer_counters_test(verbose);
+    importer_namespaces_test(verbose);
+    importer_aggtable_test(verbose);
     return 0;
 }
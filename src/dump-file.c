@@ -0,0 +1,525 @@
+#include <czmq.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include "dump-file.h"
+
+#define FILE_MAGIC "LOGJAMDF"
+#define INDEX_MAGIC "LJDINDEX"
+#define MAGIC_SIZE 8
+#define FILE_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 16
+#define INDEX_ENTRY_SIZE 16
+#define FOOTER_SIZE 24
+
+struct _dump_writer_t {
+    int fd;
+    uint64_t offset;            //  of the next record
+    byte *index;                //  encoded index entries
+    size_t count;
+    size_t capacity;
+    bool failed;                //  a partial record could not be removed
+};
+
+struct _dump_reader_t {
+    int fd;
+    const byte *data;
+    size_t size;
+    const byte *pos;
+    const byte *records_end;
+    const byte *index;          //  NULL if the file has no index
+    size_t count;
+};
+
+static inline void
+put_le32 (byte *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p [i] = (byte) (v >> (8 * i));
+}
+
+static inline void
+put_le64 (byte *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p [i] = (byte) (v >> (8 * i));
+}
+
+static inline uint32_t
+get_le32 (const byte *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = (v << 8) | p [i];
+    return v;
+}
+
+static inline uint64_t
+get_le64 (const byte *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p [i];
+    return v;
+}
+
+//  writes all buffers, coping with short writes
+static int
+write_all (int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t written = writev (fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (byte *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+dump_writer_t *
+dump_writer_new (const char *path)
+{
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    byte header [FILE_HEADER_SIZE] = {0};
+    memcpy (header, FILE_MAGIC, MAGIC_SIZE);
+    put_le32 (header + MAGIC_SIZE, DUMP_FILE_VERSION);
+    struct iovec iov = { header, sizeof (header) };
+    if (write_all (fd, &iov, 1)) {
+        int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    dump_writer_t *self = (dump_writer_t *) zmalloc (sizeof (dump_writer_t));
+    assert (self);
+    self->fd = fd;
+    self->offset = FILE_HEADER_SIZE;
+    self->capacity = 1024;
+    self->index = (byte *) zmalloc (self->capacity * INDEX_ENTRY_SIZE);
+    assert (self->index);
+    return self;
+}
+
+int
+dump_writer_destroy (dump_writer_t **self_p)
+{
+    dump_writer_t *self = *self_p;
+    if (self == NULL)
+        return 0;
+
+    //  the file ends with a partial record, so an index would be useless
+    if (self->failed) {
+        close (self->fd);
+        free (self->index);
+        free (self);
+        *self_p = NULL;
+        return -1;
+    }
+
+    byte footer [FOOTER_SIZE];
+    put_le64 (footer, self->offset);
+    put_le64 (footer + 8, self->count);
+    memcpy (footer + 16, INDEX_MAGIC, MAGIC_SIZE);
+    struct iovec iov [2] = {
+        { self->index, self->count * INDEX_ENTRY_SIZE },
+        { footer, sizeof (footer) }
+    };
+    int rc = write_all (self->fd, iov, 2);
+    if (close (self->fd))
+        rc = -1;
+
+    free (self->index);
+    free (self);
+    *self_p = NULL;
+    return rc;
+}
+
+int
+dump_writer_write (dump_writer_t *self, zmsg_t *msg, uint64_t created_ms)
+{
+    if (self->failed) {
+        errno = EIO;
+        return -1;
+    }
+    size_t frame_count = zmsg_size (msg);
+    if (frame_count == 0 || frame_count > DUMP_FILE_MAX_FRAMES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    //  one iovec for the record header, followed by the frames
+    byte header [RECORD_HEADER_SIZE + 4 * DUMP_FILE_MAX_FRAMES];
+    struct iovec iov [1 + DUMP_FILE_MAX_FRAMES];
+    size_t header_size = RECORD_HEADER_SIZE + 4 * frame_count;
+    size_t record_size = header_size;
+    int iovcnt = 1;
+    size_t i = 0;
+    zframe_t *frame = zmsg_first (msg);
+    while (frame) {
+        size_t size = zframe_size (frame);
+        put_le32 (header + RECORD_HEADER_SIZE + 4 * i++, size);
+        record_size += size;
+        if (size > 0) {
+            iov [iovcnt].iov_base = zframe_data (frame);
+            iov [iovcnt].iov_len = size;
+            iovcnt++;
+        }
+        frame = zmsg_next (msg);
+    }
+    if (record_size > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    put_le32 (header, record_size);
+    put_le32 (header + 4, frame_count);
+    put_le64 (header + 8, created_ms);
+    iov [0].iov_base = header;
+    iov [0].iov_len = header_size;
+
+    if (write_all (self->fd, iov, iovcnt)) {
+        //  remove what was written of the record, so that later records
+        //  start at the offset recorded in the index
+        int saved_errno = errno;
+        if (ftruncate (self->fd, self->offset)
+        ||  lseek (self->fd, self->offset, SEEK_SET) == (off_t) -1)
+            self->failed = true;
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (self->count == self->capacity) {
+        self->capacity *= 2;
+        self->index = (byte *) realloc (self->index, self->capacity * INDEX_ENTRY_SIZE);
+        assert (self->index);
+    }
+    byte *entry = self->index + self->count * INDEX_ENTRY_SIZE;
+    put_le64 (entry, self->offset);
+    put_le64 (entry + 8, created_ms);
+    self->count++;
+    self->offset += record_size;
+    return 0;
+}
+
+size_t
+dump_writer_count (dump_writer_t *self)
+{
+    return self->count;
+}
+
+//  the index is only used if the footer and all index entries are intact
+static void
+s_reader_load_index (dump_reader_t *self)
+{
+    self->records_end = self->data + self->size;
+    if (self->size < FILE_HEADER_SIZE + FOOTER_SIZE)
+        return;
+    const byte *footer = self->data + self->size - FOOTER_SIZE;
+    if (memcmp (footer + 16, INDEX_MAGIC, MAGIC_SIZE))
+        return;
+    uint64_t index_offset = get_le64 (footer);
+    uint64_t count = get_le64 (footer + 8);
+    if (index_offset < FILE_HEADER_SIZE || index_offset > self->size - FOOTER_SIZE)
+        return;
+    if ((self->size - FOOTER_SIZE - index_offset) / INDEX_ENTRY_SIZE != count
+    ||  (self->size - FOOTER_SIZE - index_offset) % INDEX_ENTRY_SIZE != 0)
+        return;
+    self->records_end = self->data + index_offset;
+    self->index = self->data + index_offset;
+    self->count = count;
+}
+
+dump_reader_t *
+dump_reader_new (const char *path)
+{
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat (fd, &st)) {
+        int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if ((size_t) st.st_size < FILE_HEADER_SIZE) {
+        close (fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (memcmp (data, FILE_MAGIC, MAGIC_SIZE)
+    ||  get_le32 ((byte *) data + MAGIC_SIZE) != DUMP_FILE_VERSION) {
+        munmap (data, st.st_size);
+        close (fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+    dump_reader_t *self = (dump_reader_t *) zmalloc (sizeof (dump_reader_t));
+    assert (self);
+    self->fd = fd;
+    self->data = (const byte *) data;
+    self->size = st.st_size;
+    self->pos = self->data + FILE_HEADER_SIZE;
+    s_reader_load_index (self);
+    return self;
+}
+
+void
+dump_reader_destroy (dump_reader_t **self_p)
+{
+    dump_reader_t *self = *self_p;
+    if (self == NULL)
+        return;
+    munmap ((void *) self->data, self->size);
+    close (self->fd);
+    free (self);
+    *self_p = NULL;
+}
+
+int
+dump_reader_next (dump_reader_t *self, dump_record_t *record)
+{
+    if (self->pos == self->records_end)
+        return 0;
+    size_t left = self->records_end - self->pos;
+    if (left < RECORD_HEADER_SIZE)
+        return -1;
+
+    const byte *p = self->pos;
+    size_t record_size = get_le32 (p);
+    size_t frame_count = get_le32 (p + 4);
+    if (record_size > left
+    ||  frame_count == 0 || frame_count > DUMP_FILE_MAX_FRAMES
+    ||  RECORD_HEADER_SIZE + 4 * frame_count > record_size)
+        return -1;
+
+    const byte *end = p + record_size;
+    const byte *sizes = p + RECORD_HEADER_SIZE;
+    const byte *frame = sizes + 4 * frame_count;
+    for (size_t i = 0; i < frame_count; i++) {
+        size_t size = get_le32 (sizes + 4 * i);
+        if (size > (size_t) (end - frame))
+            return -1;
+        record->data [i] = frame;
+        record->size [i] = size;
+        frame += size;
+    }
+    if (frame != end)
+        return -1;
+
+    record->frame_count = frame_count;
+    record->created_ms = get_le64 (p + 8);
+    self->pos = end;
+    return 1;
+}
+
+void
+dump_reader_rewind (dump_reader_t *self)
+{
+    self->pos = self->data + FILE_HEADER_SIZE;
+}
+
+int
+dump_reader_seek_time (dump_reader_t *self, uint64_t created_ms)
+{
+    if (!self->index)
+        return -1;
+    //  creation times are not necessarily monotonic, so don't bisect
+    for (size_t i = 0; i < self->count; i++) {
+        const byte *entry = self->index + i * INDEX_ENTRY_SIZE;
+        if (get_le64 (entry + 8) >= created_ms) {
+            uint64_t offset = get_le64 (entry);
+            if (offset < FILE_HEADER_SIZE || offset >= (uint64_t) (self->records_end - self->data))
+                return -1;
+            self->pos = self->data + offset;
+            return 0;
+        }
+    }
+    self->pos = self->records_end;
+    return 0;
+}
+
+bool
+dump_reader_has_index (dump_reader_t *self)
+{
+    return self->index != NULL;
+}
+
+size_t
+dump_reader_count (dump_reader_t *self)
+{
+    return self->count;
+}
+
+uint64_t
+dump_reader_created_ms (dump_reader_t *self, size_t i)
+{
+    assert (i < self->count);
+    return get_le64 (self->index + i * INDEX_ENTRY_SIZE + 8);
+}
+
+int
+dump_reader_fd (dump_reader_t *self)
+{
+    return self->fd;
+}
+
+static void
+s_test_write_message (dump_writer_t *writer, const char *topic, const char *body, uint64_t created_ms)
+{
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addstr (msg, "app-env");
+    zmsg_addstr (msg, topic);
+    zmsg_addstr (msg, body);
+    zmsg_addmem (msg, NULL, 0);
+    int rc = dump_writer_write (writer, msg, created_ms);
+    assert (rc == 0);
+    zmsg_destroy (&msg);
+}
+
+static void
+s_test_check_record (dump_record_t *record, const char *topic, const char *body, uint64_t created_ms)
+{
+    assert (record->frame_count == 4);
+    assert (record->created_ms == created_ms);
+    assert (record->size [0] == 7 && memcmp (record->data [0], "app-env", 7) == 0);
+    assert (record->size [1] == strlen (topic) && memcmp (record->data [1], topic, strlen (topic)) == 0);
+    assert (record->size [2] == strlen (body) && memcmp (record->data [2], body, strlen (body)) == 0);
+    assert (record->size [3] == 0);
+}
+
+void
+dump_file_test (int verbose)
+{
+    printf (" * dump_file: ");
+    if (verbose)
+        printf ("\n");
+
+    char path [] = "/tmp/logjam-dump-file-test-XXXXXX";
+    int fd = mkstemp (path);
+    assert (fd >= 0);
+    close (fd);
+
+    dump_writer_t *writer = dump_writer_new (path);
+    assert (writer);
+    s_test_write_message (writer, "logs", "{\"a\":1}", 1000);
+    s_test_write_message (writer, "logs", "{\"b\":2}", 2000);
+    s_test_write_message (writer, "javascript", "{}", 3000);
+    assert (dump_writer_count (writer) == 3);
+    int rc = dump_writer_destroy (&writer);
+    assert (rc == 0);
+    assert (writer == NULL);
+
+    //  records come back in order, followed by the end of file
+    dump_reader_t *reader = dump_reader_new (path);
+    assert (reader);
+    assert (dump_reader_has_index (reader));
+    assert (dump_reader_count (reader) == 3);
+    assert (dump_reader_created_ms (reader, 2) == 3000);
+    dump_record_t record;
+    for (int round = 0; round < 2; round++) {
+        assert (dump_reader_next (reader, &record) == 1);
+        s_test_check_record (&record, "logs", "{\"a\":1}", 1000);
+        assert (dump_reader_next (reader, &record) == 1);
+        s_test_check_record (&record, "logs", "{\"b\":2}", 2000);
+        assert (dump_reader_next (reader, &record) == 1);
+        s_test_check_record (&record, "javascript", "{}", 3000);
+        assert (dump_reader_next (reader, &record) == 0);
+        dump_reader_rewind (reader);
+    }
+
+    //  seeking uses the index
+    assert (dump_reader_seek_time (reader, 1500) == 0);
+    assert (dump_reader_next (reader, &record) == 1);
+    s_test_check_record (&record, "logs", "{\"b\":2}", 2000);
+    assert (dump_reader_seek_time (reader, 5000) == 0);
+    assert (dump_reader_next (reader, &record) == 0);
+    dump_reader_destroy (&reader);
+    assert (reader == NULL);
+
+    //  without an index, complete records can still be read
+    size_t first_record_size = RECORD_HEADER_SIZE + 4 * 4 + 7 + 4 + 7;
+    rc = truncate (path, FILE_HEADER_SIZE + first_record_size + 5);
+    assert (rc == 0);
+    reader = dump_reader_new (path);
+    assert (reader);
+    assert (!dump_reader_has_index (reader));
+    assert (dump_reader_seek_time (reader, 0) == -1);
+    assert (dump_reader_next (reader, &record) == 1);
+    s_test_check_record (&record, "logs", "{\"a\":1}", 1000);
+    assert (dump_reader_next (reader, &record) == -1);
+    dump_reader_destroy (&reader);
+
+    //  a failed write doesn't leave part of the record in the file
+    struct rlimit saved_limit;
+    rc = getrlimit (RLIMIT_FSIZE, &saved_limit);
+    assert (rc == 0);
+    void (*saved_handler) (int) = signal (SIGXFSZ, SIG_IGN);
+    writer = dump_writer_new (path);
+    assert (writer);
+    s_test_write_message (writer, "logs", "{\"a\":1}", 1000);
+    struct rlimit limit = saved_limit;
+    limit.rlim_cur = FILE_HEADER_SIZE + first_record_size + 10;
+    rc = setrlimit (RLIMIT_FSIZE, &limit);
+    assert (rc == 0);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addstr (msg, "app-env");
+    zmsg_addstr (msg, "logs");
+    zmsg_addstr (msg, "{\"too\":\"large for the file size limit\"}");
+    rc = dump_writer_write (writer, msg, 1500);
+    assert (rc == -1 && errno == EFBIG);
+    zmsg_destroy (&msg);
+    rc = setrlimit (RLIMIT_FSIZE, &saved_limit);
+    assert (rc == 0);
+    signal (SIGXFSZ, saved_handler);
+    s_test_write_message (writer, "logs", "{\"b\":2}", 2000);
+    rc = dump_writer_destroy (&writer);
+    assert (rc == 0);
+    reader = dump_reader_new (path);
+    assert (reader);
+    assert (dump_reader_count (reader) == 2);
+    assert (dump_reader_next (reader, &record) == 1);
+    s_test_check_record (&record, "logs", "{\"a\":1}", 1000);
+    assert (dump_reader_next (reader, &record) == 1);
+    s_test_check_record (&record, "logs", "{\"b\":2}", 2000);
+    assert (dump_reader_next (reader, &record) == 0);
+    dump_reader_destroy (&reader);
+
+    //  files in the old format are rejected
+    FILE *file = fopen (path, "w");
+    assert (file);
+    size_t frame_count = 4;
+    fwrite (&frame_count, sizeof (frame_count), 1, file);
+    fwrite (&frame_count, sizeof (frame_count), 1, file);
+    fclose (file);
+    reader = dump_reader_new (path);
+    assert (reader == NULL);
+    assert (errno == EINVAL);
+
+    unlink (path);
+    printf ("OK\n");
+}
@@ -0,0 +1,87 @@
+#ifndef __DUMP_FILE_H_INCLUDED__
+#define __DUMP_FILE_H_INCLUDED__
+
+#include <czmq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Files written by logjam-dump and read by logjam-replay. All integers are
+// stored little endian, so dump files can be moved between machines.
+//
+//   file    = header *record [index footer]
+//   header  = "LOGJAMDF" version(4) reserved(4)
+//   record  = record-size(4) frame-count(4) created-ms(8) frame-count*frame-size(4) *frame-data
+//   index   = message-count*(record-offset(8) created-ms(8))
+//   footer  = index-offset(8) message-count(8) "LJDINDEX"
+//
+// record-size includes the record header. The index gets written when the
+// writer is closed. Readers of files without an index (e.g. of a dump which
+// was killed) can still read all complete records.
+//
+// Files written by earlier versions of logjam-dump have no header. They can
+// be read with zmsg_loadx.
+
+#define DUMP_FILE_VERSION 2
+#define DUMP_FILE_MAX_FRAMES 16
+
+typedef struct _dump_writer_t dump_writer_t;
+typedef struct _dump_reader_t dump_reader_t;
+
+// frames point into the mapped file and stay valid until the reader is destroyed
+typedef struct {
+    size_t frame_count;
+    uint64_t created_ms;
+    const void *data[DUMP_FILE_MAX_FRAMES];
+    size_t size[DUMP_FILE_MAX_FRAMES];
+} dump_record_t;
+
+// returns NULL and sets errno if the file can't be created
+extern dump_writer_t* dump_writer_new (const char *path);
+
+// writes the index and closes the file
+extern int dump_writer_destroy (dump_writer_t **self_p);
+
+// writes all frames of the message with a single system call.
+// returns 0 if OK, else -1.
+extern int dump_writer_write (dump_writer_t *self, zmsg_t *msg, uint64_t created_ms);
+
+extern size_t dump_writer_count (dump_writer_t *self);
+
+// maps the file into memory. returns NULL and sets errno if the file can't
+// be opened, and sets errno to EINVAL if it isn't a dump file of the current
+// version.
+extern dump_reader_t* dump_reader_new (const char *path);
+
+extern void dump_reader_destroy (dump_reader_t **self_p);
+
+// returns 1 if a record was read, 0 at the end of the file and -1 if the file
+// is corrupted
+extern int dump_reader_next (dump_reader_t *self, dump_record_t *record);
+
+// continue reading at the first record
+extern void dump_reader_rewind (dump_reader_t *self);
+
+// positions the reader at the first indexed record created at or after the
+// given time. returns -1 if the file has no index.
+extern int dump_reader_seek_time (dump_reader_t *self, uint64_t created_ms);
+
+// returns false if the file has no index
+extern bool dump_reader_has_index (dump_reader_t *self);
+
+// number of records listed in the index
+extern size_t dump_reader_count (dump_reader_t *self);
+
+// creation time of the i-th indexed record
+extern uint64_t dump_reader_created_ms (dump_reader_t *self, size_t i);
+
+extern int dump_reader_fd (dump_reader_t *self);
+
+extern void dump_file_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
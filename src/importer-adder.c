@@ -4,116 +4,122 @@
 #include "importer-adder.h"
 #include "importer-processor.h"
 #include "importer-resources.h"
+#include "simd-kernels.h"
 
 /*
- * connections: n_w = num_writers, n_p = num_parsers, "o" = bind, "[<>v^]" = connect
+ * connections: "o" = bind, "[<>v^]" = connect
  *
  *                            controller
  *                                |
  *                               PIPE
- *                  DEALER  REP   |
- *      controller  o---------< adder
+ *                                |
+ *                              adder
  */
 
-// Adder is a simple agent which merges parser results. It connects to
-// an inproc REP socket on which it receives requests to merge a list
-// of parser results and sends the merged data back.
+// Adders merge parser results. The controller hands a list of parser
+// results to adders_reduce, which puts them into a shared work queue.
+// Every adder repeatedly takes two results from the queue, merges them
+// and puts the merged result back, so merges on different tree levels
+// proceed in parallel as soon as their inputs are ready. The controller
+// only waits for the final result.
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t work_done;
+    zlist_t *ready;          // results waiting to be merged
+    size_t in_flight;        // merges currently executed by adders
+    bool shutdown;
+} reduction = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_available = PTHREAD_COND_INITIALIZER,
+    .work_done = PTHREAD_COND_INITIALIZER,
+};
 
 static
-zsock_t* adder_reply_socket_new()
+bool reduction_take_pair(zhash_t **target, zhash_t **source)
 {
-    zsock_t *socket = zsock_new(ZMQ_REP);
-    assert(socket);
-    int rc = zsock_connect(socket, "inproc://adders");
-    log_zmq_error(rc, __FILE__, __LINE__);
-    assert(rc == 0);
-    return socket;
+    bool found = false;
+    pthread_mutex_lock(&reduction.mutex);
+    if (!reduction.shutdown && (reduction.ready == NULL || zlist_size(reduction.ready) < 2)) {
+        // wait at most one second
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&reduction.work_available, &reduction.mutex, &deadline);
+    }
+    if (!reduction.shutdown && reduction.ready && zlist_size(reduction.ready) >= 2) {
+        *target = zlist_pop(reduction.ready);
+        *source = zlist_pop(reduction.ready);
+        reduction.in_flight++;
+        found = true;
+    }
+    pthread_mutex_unlock(&reduction.mutex);
+    return found;
 }
 
 static
-void merge_quants(zhash_t *target, zhash_t *source)
+void reduction_put_result(zhash_t *result)
 {
-    size_t *source_quants = NULL;
-
-    while ( (source_quants = zhash_first(source)) ) {
-        const char* key = zhash_cursor(source);
-        assert(key);
-        size_t *dest = zhash_lookup(target, key);
-        if (dest) {
-            for (int i=0; i <= last_resource_offset; i++) {
-                size_t c = source_quants[i];
-                if (c)
-                    dest[i] += c;
-            }
-        } else {
-            zhash_insert(target, key, source_quants);
-            zhash_freefn(target, key, free);
-            zhash_freefn(source, key, NULL);
-        }
-        zhash_delete(source, key);
-    }
+    pthread_mutex_lock(&reduction.mutex);
+    zlist_append(reduction.ready, result);
+    reduction.in_flight--;
+    if (zlist_size(reduction.ready) >= 2)
+        pthread_cond_broadcast(&reduction.work_available);
+    else if (reduction.in_flight == 0)
+        pthread_cond_signal(&reduction.work_done);
+    pthread_mutex_unlock(&reduction.mutex);
 }
 
 static
-void merge_histograms(zhash_t *target, zhash_t *source)
+bool reduction_is_shut_down()
 {
-    size_t *source_histogram = NULL;
-
-    while ( (source_histogram = zhash_first(source)) ) {
-        const char* key = zhash_cursor(source);
-        assert(key);
-        size_t *dest = zhash_lookup(target, key);
-        if (dest) {
-            for (int i=0; i < HISTOGRAM_SIZE; i++) {
-                size_t c = source_histogram[i];
-                if (c)
-                    dest[i] += c;
-            }
-        } else {
-            zhash_insert(target, key, source_histogram);
-            zhash_freefn(target, key, free);
-            zhash_freefn(source, key, NULL);
-        }
-        zhash_delete(source, key);
-    }
+    pthread_mutex_lock(&reduction.mutex);
+    bool shutdown = reduction.shutdown;
+    pthread_mutex_unlock(&reduction.mutex);
+    return shutdown;
+}
+
+zhash_t* adders_reduce(zlist_t *processors)
+{
+    size_t n = zlist_size(processors);
+    assert(n > 0);
+    if (n == 1)
+        return zlist_pop(processors);
+
+    pthread_mutex_lock(&reduction.mutex);
+    if (reduction.ready == NULL)
+        reduction.ready = zlist_new();
+    assert(zlist_size(reduction.ready) == 0 && reduction.in_flight == 0);
+    zhash_t *p;
+    while ( (p = zlist_pop(processors)) )
+        zlist_append(reduction.ready, p);
+    pthread_cond_broadcast(&reduction.work_available);
+    while (zlist_size(reduction.ready) > 1 || reduction.in_flight > 0)
+        pthread_cond_wait(&reduction.work_done, &reduction.mutex);
+    zhash_t *root = zlist_pop(reduction.ready);
+    pthread_mutex_unlock(&reduction.mutex);
+    return root;
+}
+
+void adders_shutdown()
+{
+    pthread_mutex_lock(&reduction.mutex);
+    reduction.shutdown = true;
+    pthread_cond_broadcast(&reduction.work_available);
+    pthread_mutex_unlock(&reduction.mutex);
 }
 
 static
-void merge_modules(zhash_t* target, zhash_t *source)
+void add_histograms(void *target, void *source)
 {
-    char *source_module = NULL;
-
-    while ( (source_module = zhash_first(source)) ) {
-        const char* module = zhash_cursor(source);
-        assert(module);
-        char *dest_module = zhash_lookup(target, module);
-        if (!dest_module) {
-            zhash_insert(target, module, source_module);
-            zhash_freefn(target, module, free);
-            zhash_freefn(source, module, NULL);
-        }
-        zhash_delete(source, module);
-    }
+    simd_add_counts(target, source, HISTOGRAM_SIZE);
 }
 
 static
-void merge_increments(zhash_t* target, zhash_t *source)
+void add_increments(void *target, void *source)
 {
-    increments_t *source_increments = NULL;
-
-    while ( (source_increments = zhash_first(source)) ) {
-        const char* namespace = zhash_cursor(source);
-        assert(namespace);
-        increments_t *dest_increments = zhash_lookup(target, namespace);
-        if (dest_increments) {
-            increments_add(dest_increments, source_increments);
-        } else {
-            zhash_insert(target, namespace, source_increments);
-            zhash_freefn(target, namespace, increments_destroy);
-            zhash_freefn(source, namespace, NULL);
-        }
-        zhash_delete(source, namespace);
-    }
+    increments_add(target, source);
 }
 
 static
@@ -154,11 +160,12 @@ void merge_processors(zhash_t *target, zhash_t *source)
             // printf("[D] combining %s\n", dest_processor->db_name);
             assert( streq(dest_processor->db_name, source_processor->db_name) );
             dest_processor->request_count += source_processor->request_count;
-            merge_modules(dest_processor->modules, source_processor->modules);
-            merge_increments(dest_processor->totals, source_processor->totals);
-            merge_increments(dest_processor->minutes, source_processor->minutes);
-            merge_quants(dest_processor->quants, source_processor->quants);
-            merge_histograms(dest_processor->histograms, source_processor->histograms);
+            uint32_t *ns_map = namespaces_merge(dest_processor->namespaces, source_processor->namespaces);
+            agg_table_merge(dest_processor->totals, source_processor->totals, ns_map, add_increments);
+            agg_table_merge(dest_processor->minutes, source_processor->minutes, ns_map, add_increments);
+            agg_table_merge(dest_processor->quants, source_processor->quants, ns_map, agg_quants_add);
+            agg_table_merge(dest_processor->histograms, source_processor->histograms, ns_map, add_histograms);
+            free(ns_map);
             merge_agents(dest_processor->agents, source_processor->agents);
         } else {
             zhash_insert(target, db_name, source_processor);
@@ -169,19 +176,6 @@ void merge_processors(zhash_t *target, zhash_t *source)
     }
 }
 
-static
-zmsg_t* handle_addition(zmsg_t* msg)
-{
-    zhash_t *source = zmsg_popptr(msg);
-    zhash_t *target = zmsg_popptr(msg);
-    merge_processors(target, source);
-    zhash_destroy(&source);
-    zmsg_t *result = zmsg_new();
-    assert(result);
-    zmsg_addptr(result, target);
-    return result;
-}
-
 void adder(zsock_t *pipe, void *args)
 {
     size_t id = (size_t) args;
@@ -193,54 +187,28 @@ void adder(zsock_t *pipe, void *args)
     if (!quiet)
         printf("[I] adder[%zu]: starting\n", id);
 
-    zsock_t *additions = adder_reply_socket_new();
-
     // signal readyiness
     zsock_signal(pipe, 0);
 
-    zpoller_t *poller = zpoller_new(pipe, additions, NULL);
-    assert(poller);
-
-    while (!zsys_interrupted) {
-        // printf("adder[%zu]: polling\n", id);
-        // wait at most one second
-        void *socket = zpoller_wait(poller, 1000);
-        zmsg_t *msg = NULL;
-        if (socket == additions) {
-            msg = zmsg_recv(additions);
-            zmsg_t *answer = handle_addition(msg);
-            int rc = zmsg_send_and_destroy(&answer, additions);
-            assert(rc == 0);
-        }
-        else if (socket == pipe) {
-            msg = zmsg_recv(socket);
-            char *cmd = zmsg_popstr(msg);
-            if (streq(cmd, "$TERM")) {
-                // printf("[D] adder[%zu]: received $TERM command\n", id);
-                zmsg_destroy(&msg);
-                free(cmd);
-                break;
-            } else {
-                printf("[E] adder[%zu]: received unknown command: %s\n", id, cmd);
-                assert(false);
-            }
-        }
-        else if (socket) {
-            // if socket is not null, something is horribly broken
-            printf("[E] adder[%zu]: broken poller. committing suicide.\n", id);
-            assert(false);
-        }
-        else {
-            // probably interrupted by signal handler
-            // if so, loop will terminate on condition !zsys_interrupted
+    // interrupts are ignored: the controller might be waiting for a reduction to
+    // finish. it shuts down the adders before destroying them.
+    while (true) {
+        zhash_t *target, *source;
+        if (reduction_take_pair(&target, &source)) {
+            merge_processors(target, source);
+            zhash_destroy(&source);
+            reduction_put_result(target);
+        } else if (reduction_is_shut_down()) {
+            break;
         }
-        zmsg_destroy(&msg);
     }
 
     if (!quiet)
         printf("[I] adder[%zu]: shutting down\n", id);
 
-    zsock_destroy(&additions);
+    // wait for $TERM from the controller
+    zmsg_t *msg = zmsg_recv(pipe);
+    zmsg_destroy(&msg);
 
     if (!quiet)
         printf("[I] adder[%zu]: terminated\n", id);
@@ -8,6 +8,8 @@ extern "C" {
 #endif
 
 extern void adder(zsock_t *pipe, void *args);
+extern zhash_t* adders_reduce(zlist_t *processors);
+extern void adders_shutdown();
 
 #ifdef __cplusplus
 }
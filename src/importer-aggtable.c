@@ -0,0 +1,552 @@
+#include "importer-aggtable.h"
+#include "importer-resources.h"
+#include "simd-kernels.h"
+#include <math.h>
+#include <float.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define INITIAL_AGG_TABLE_CAPACITY 64
+
+const double agg_buckets[HISTOGRAM_SIZE+1] = {
+    1,            //    1   ms               1 object            1   KB
+    3,            //    3   ms               3 objects           3   KB
+    10,           //   10   ms              10 objects          10   KB
+    30,           //   30   ms              30 objects          30   KB
+    100,          //  100   ms             100 objects         100   KB
+    300,          //  300   ms             300 objects         300   KB
+    1000,         //    1   second          1K objects       ~   1   MB
+    3000,         //    3   seconds         2K objects       ~   2.9 MB
+    10000,        //   10   seconds        10K objects       ~   9.7 MB
+    30000,        //   30   seconds        30K objects       ~  29.3 MB
+    100000,       //  100   seconds       100K objects       ~  97.6 MB
+    300000,       //    5   minutes       300K objects       ~ 293   MB
+    1000000,      // ~ 17   minutes         1M objects       ~ 976   MB
+    3000000,      //   50   minutes         3M objects       ~   2.9 GB
+    10000000,     //  ~ 2.6 hours          10M objects       ~   9.7 GB
+    30000000,     //  ~ 8.3 hours          30M objects       ~  28.9 GB
+    100000000,    //  ~ 1.2 days          100M objects       ~  96.3 GB
+    300000000,    //    3.5 days          300M objects       ~ 289   GB
+    1000000000,   //   11.6 days            1B objects       ~ 963   GB
+    3000000000,   //   34.7 days            3B objects       ~   2.8 TB
+    10000000000,  //  116   days           10B objects       ~   9.4 TB
+    30000000000,  //  347   days           30B objects       ~  28.2 TB
+    0
+};
+
+agg_quants_t* agg_quants_new(char kind)
+{
+    size_t first, last;
+    switch (kind) {
+    case 't':
+        first = 0;
+        last = last_time_resource_offset;
+        break;
+    case 'm':
+        first = last = allocated_objects_index;
+        break;
+    case 'b':
+        first = last = allocated_bytes_index;
+        break;
+    case 'f':
+        first = last_heap_resource_offset + 1;
+        last = last_frontend_resource_offset;
+        break;
+    default:
+        fprintf(stderr, "[E] unknown quants kind: %c\n", kind);
+        assert(false);
+    }
+    size_t count = last - first + 1;
+    agg_quants_t *quants = zmalloc(sizeof(agg_quants_t) + count * sizeof(uint32_t));
+    assert(quants);
+    quants->first = first;
+    quants->count = count;
+    return quants;
+}
+
+void agg_quants_add(void *target, void *source)
+{
+    agg_quants_t *dest = target, *src = source;
+    assert(dest->first == src->first && dest->count == src->count);
+    simd_add_counts32(dest->counts, src->counts, dest->count);
+}
+
+// The bucket index of a value is the number of bucket bounds smaller than the value,
+// not counting the last one, so that larger values end up in the last bucket. Padding
+// the bounds with infinity to a power of two allows an unrolled binary search without
+// branches. NaN compares false against all bounds and ends up in the first bucket.
+#define BUCKET_SEARCH_SIZE 32
+
+static const double bucket_bounds[BUCKET_SEARCH_SIZE] = {
+    1, 3, 10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000, 300000,
+    1000000, 3000000, 10000000, 30000000, 100000000, 300000000,
+    1000000000, 3000000000, 10000000000,
+    INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY,
+    INFINITY, INFINITY, INFINITY, INFINITY
+};
+
+size_t agg_bucket_index(double value)
+{
+    const double *b = bucket_bounds;
+    size_t i = 0;
+    i += (b[i+15] < value) << 4;
+    i += (b[i+7] < value) << 3;
+    i += (b[i+3] < value) << 2;
+    i += (b[i+1] < value) << 1;
+    i += (b[i] < value);
+    return i;
+}
+
+void agg_bucket_indexes(const double *values, size_t n, uint8_t *indexes)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    // counts the bounds smaller than two values at once. comparisons yield all
+    // ones (-1) per lane when true, so subtracting the mask increments the count.
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        __m128i count = _mm_setzero_si128();
+        for (size_t j = 0; j < HISTOGRAM_SIZE - 1; j++) {
+            __m128d mask = _mm_cmplt_pd(_mm_set1_pd(bucket_bounds[j]), v);
+            count = _mm_sub_epi64(count, _mm_castpd_si128(mask));
+        }
+        indexes[i] = _mm_cvtsi128_si32(count);
+        indexes[i+1] = _mm_cvtsi128_si32(_mm_unpackhi_epi64(count, count));
+    }
+#endif
+    for (; i < n; i++)
+        indexes[i] = agg_bucket_index(values[i]);
+}
+
+static inline uint32_t agg_key_hash(agg_key_t key)
+{
+    // finalizer of splitmix64
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (uint32_t)key;
+}
+
+agg_table_t* agg_table_new(agg_free_fn *free_fn, namespaces_t *namespaces)
+{
+    agg_table_t *table = zmalloc(sizeof(agg_table_t));
+    assert(table);
+    table->free_fn = free_fn;
+    table->namespaces = namespaces_ref(namespaces);
+    return table;
+}
+
+void agg_table_destroy(agg_table_t **table_p)
+{
+    agg_table_t *table = *table_p;
+    if (table == NULL)
+        return;
+    if (table->free_fn) {
+        for (uint32_t i = 0; i < table->capacity; i++) {
+            void *value = table->entries[i].value;
+            if (value)
+                table->free_fn(value);
+        }
+    }
+    free(table->entries);
+    namespaces_destroy(&table->namespaces);
+    free(table);
+    *table_p = NULL;
+}
+
+static
+void agg_table_grow(agg_table_t *table)
+{
+    uint32_t old_capacity = table->capacity;
+    agg_entry_t *old_entries = table->entries;
+    uint32_t new_capacity = old_capacity ? 2 * old_capacity : INITIAL_AGG_TABLE_CAPACITY;
+    agg_entry_t *new_entries = zmalloc(new_capacity * sizeof(agg_entry_t));
+    assert(new_entries);
+    uint32_t mask = new_capacity - 1;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        agg_entry_t *e = &old_entries[i];
+        if (e->value) {
+            uint32_t j = agg_key_hash(e->key) & mask;
+            while (new_entries[j].value)
+                j = (j + 1) & mask;
+            new_entries[j] = *e;
+        }
+    }
+    free(old_entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+}
+
+static
+agg_entry_t* agg_table_find(agg_table_t *table, agg_key_t key)
+{
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = agg_key_hash(key) & mask;
+    agg_entry_t *e;
+    while ((e = &table->entries[i])->value) {
+        if (e->key == key)
+            break;
+        i = (i + 1) & mask;
+    }
+    return e;
+}
+
+void* agg_table_lookup(agg_table_t *table, agg_key_t key)
+{
+    if (table->count == 0)
+        return NULL;
+    return agg_table_find(table, key)->value;
+}
+
+void agg_table_insert(agg_table_t *table, agg_key_t key, void *value)
+{
+    assert(value);
+    // keep the load factor below 3/4
+    if (4 * (table->count + 1) > 3 * table->capacity)
+        agg_table_grow(table);
+    agg_entry_t *e = agg_table_find(table, key);
+    assert(e->value == NULL);
+    e->key = key;
+    e->value = value;
+    table->count++;
+}
+
+// Merges source into target. Values missing from target are moved over,
+// all others are combined using the given merge function. Source is left
+// empty, but still needs to be destroyed by the caller. ns_map maps source
+// namespace ids to target namespace ids (see namespaces_merge).
+void agg_table_merge(agg_table_t *target, agg_table_t *source, uint32_t *ns_map, agg_merge_fn *merge)
+{
+    for (uint32_t i = 0; i < source->capacity; i++) {
+        agg_entry_t *e = &source->entries[i];
+        if (e->value == NULL)
+            continue;
+        uint32_t target_ns = ns_map[agg_key_namespace(e->key)];
+        agg_key_t key = agg_key(target_ns, agg_key_minute(e->key), agg_key_sub(e->key));
+        void *stored = agg_table_lookup(target, key);
+        if (stored) {
+            merge(stored, e->value);
+            if (source->free_fn)
+                source->free_fn(e->value);
+        } else {
+            agg_table_insert(target, key, e->value);
+        }
+        e->value = NULL;
+    }
+    source->count = 0;
+}
+
+void agg_table_each(agg_table_t *table, agg_entry_fn *fn, void *arg)
+{
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        agg_entry_t *e = &table->entries[i];
+        if (e->value)
+            fn(namespaces_name(table->namespaces, agg_key_namespace(e->key)), e->key, e->value, arg);
+    }
+}
+
+static
+void test_add_ints(void *target, void *source)
+{
+    *(int*)target += *(int*)source;
+}
+
+static
+int* test_int(int value)
+{
+    int *p = malloc(sizeof(int));
+    assert(p);
+    *p = value;
+    return p;
+}
+
+static
+void test_sum_entry(const char *namespace, agg_key_t key, void *value, void *arg)
+{
+    int *sum = arg;
+    // namespace ids are resolved through the interner of the table
+    assert(strncmp(namespace, "Page", 4) == 0 || streq(namespace, "all_pages"));
+    *sum += *(int*)value;
+}
+
+static
+void test_agg_keys(int verbose)
+{
+    const uint32_t namespaces[] = { 0, 1, 0xffff, 0x10000, UINT32_MAX - 1 };
+    const uint16_t minutes[] = { 0, 1, 1439, 0xffff };
+    const uint16_t subs[] = { 0, 1, 0xff, 0x100, 0xffff };
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 4; j++) {
+            for (int k = 0; k < 5; k++) {
+                agg_key_t key = agg_key(namespaces[i], minutes[j], subs[k]);
+                assert(agg_key_namespace(key) == namespaces[i]);
+                assert(agg_key_minute(key) == minutes[j]);
+                assert(agg_key_sub(key) == subs[k]);
+            }
+            agg_key_t key = agg_histogram_key(namespaces[i], minutes[j], last_resource_offset);
+            assert(agg_key_namespace(key) == namespaces[i]);
+            assert(agg_key_minute(key) == minutes[j]);
+            assert(agg_key_sub(key) == last_resource_offset);
+        }
+        const char kinds[] = { 't', 'm', 'b', 'f' };
+        for (int k = 0; k < 4; k++) {
+            for (int bucket = 0; bucket <= HISTOGRAM_SIZE; bucket++) {
+                agg_key_t key = agg_quant_key(namespaces[i], kinds[k], bucket);
+                assert(agg_key_namespace(key) == namespaces[i]);
+                assert(agg_key_minute(key) == 0);
+                assert(agg_key_quant_kind(key) == kinds[k]);
+                assert(agg_key_quant_bucket(key) == bucket);
+            }
+        }
+    }
+    // all fields take part in comparisons
+    assert(agg_key(1, 0, 0) != agg_key(0, 1, 0));
+    assert(agg_key(0, 1, 0) != agg_key(0, 0, 1));
+    assert(agg_quant_key(0, 't', 1) != agg_quant_key(0, 'm', 1));
+}
+
+static
+void test_agg_table(int verbose)
+{
+    namespaces_t *namespaces = namespaces_new();
+    namespaces_t *other_namespaces = namespaces_new();
+    enum { pages = 100, minutes = 60 };
+    uint32_t ids[pages], other_ids[pages];
+    for (int p = 0; p < pages; p++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Page%d", p);
+        ids[p] = namespaces_intern(namespaces, name);
+        // the other interner sees the pages in reverse order
+        snprintf(name, sizeof(name), "Page%d", pages - 1 - p);
+        other_ids[pages - 1 - p] = namespaces_intern(other_namespaces, name);
+    }
+
+    // enough entries to grow the table many times
+    agg_table_t *table = agg_table_new(free, namespaces);
+    for (int p = 0; p < pages; p++)
+        for (int m = 0; m < minutes; m++)
+            agg_table_insert(table, agg_key(ids[p], m, p), test_int(1));
+    assert(agg_table_size(table) == pages * minutes);
+    assert(table->capacity >= 4 * table->count / 3);
+    for (int p = 0; p < pages; p++) {
+        for (int m = 0; m < minutes; m++)
+            assert(*(int*)agg_table_lookup(table, agg_key(ids[p], m, p)) == 1);
+        assert(agg_table_lookup(table, agg_key(ids[p], minutes, p)) == NULL);
+        assert(agg_table_lookup(table, agg_key(ids[p], 0, p + 1)) == NULL);
+    }
+    assert(agg_table_lookup(table, agg_key(ALL_PAGES_NAMESPACE, 0, 0)) == NULL);
+
+    // the source table overlaps with the first half of the pages
+    agg_table_t *source = agg_table_new(free, other_namespaces);
+    for (int p = 0; p < pages; p++)
+        for (int m = minutes / 2; m < minutes + minutes / 2; m++)
+            agg_table_insert(source, agg_key(other_ids[p], m, p), test_int(2));
+    agg_table_insert(source, agg_key(ALL_PAGES_NAMESPACE, 0, 0), test_int(5));
+    uint32_t *ns_map = namespaces_merge(namespaces, other_namespaces);
+    agg_table_merge(table, source, ns_map, test_add_ints);
+    free(ns_map);
+    assert(agg_table_size(source) == 0);
+    agg_table_destroy(&source);
+    assert(source == NULL);
+
+    assert(agg_table_size(table) == pages * (minutes + minutes / 2) + 1);
+    for (int p = 0; p < pages; p++) {
+        for (int m = 0; m < minutes + minutes / 2; m++) {
+            int expected = m < minutes / 2 ? 1 : m < minutes ? 3 : 2;
+            assert(*(int*)agg_table_lookup(table, agg_key(ids[p], m, p)) == expected);
+        }
+    }
+    assert(*(int*)agg_table_lookup(table, agg_key(ALL_PAGES_NAMESPACE, 0, 0)) == 5);
+
+    int sum = 0;
+    agg_table_each(table, test_sum_entry, &sum);
+    assert(sum == pages * minutes + 2 * pages * minutes + 5);
+    if (verbose)
+        printf("   %u entries, capacity %u\n", table->count, table->capacity);
+
+    agg_table_destroy(&table);
+    assert(table == NULL);
+    namespaces_destroy(&namespaces);
+    namespaces_destroy(&other_namespaces);
+}
+
+// the linear scan agg_bucket_index replaced
+static
+size_t test_bucket_index_linear(double value)
+{
+    const double *p = agg_buckets;
+    size_t i = 0;
+    while (*p < value && *(p+1) != 0) {
+        i++;
+        p++;
+    }
+    return i;
+}
+
+static
+void test_agg_bucket_indexes(int verbose)
+{
+    // every bound, its neighbours and values between bounds, plus special values
+    double values[8 * HISTOGRAM_SIZE + 16];
+    size_t n = 0;
+    for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+        double b = agg_buckets[i];
+        values[n++] = b;
+        values[n++] = nextafter(b, -INFINITY);
+        values[n++] = nextafter(b, INFINITY);
+        values[n++] = b - 0.5;
+        values[n++] = b + 0.5;
+        values[n++] = 2 * b;
+    }
+    const double special[] = { 0, -0.0, -1, 0.5, DBL_MIN, -DBL_MAX, DBL_MAX, INFINITY, -INFINITY, NAN };
+    for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+        values[n++] = special[i];
+    assert(n <= sizeof(values) / sizeof(values[0]));
+
+    // batches of all lengths, so that both the paired and the single value code run
+    uint8_t indexes[sizeof(values) / sizeof(values[0])];
+    for (size_t len = 0; len <= n; len++) {
+        memset(indexes, 0xff, sizeof(indexes));
+        agg_bucket_indexes(values + n - len, len, indexes);
+        for (size_t i = 0; i < len; i++)
+            assert(indexes[i] == agg_bucket_index(values[n - len + i]));
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t index = agg_bucket_index(values[i]);
+        assert(index == test_bucket_index_linear(values[i]));
+        assert(index < HISTOGRAM_SIZE);
+        if (verbose && i < 6 * HISTOGRAM_SIZE && i % 6 == 0)
+            printf("   bucket of %.0f: %zu\n", values[i], index);
+    }
+}
+
+// quants as stored before they were partitioned by kind: a size_t counter for every resource
+#define TEST_FULL_QUANTS_SIZE (sizeof(size_t) * (last_resource_offset + 1))
+
+static
+void test_add_full_quants(void *target, void *source)
+{
+    simd_add_counts(target, source, last_resource_offset + 1);
+}
+
+// records a quant in both representations, like the processor does
+static
+void test_add_quant(agg_table_t *quants, agg_table_t *full_quants, uint32_t ns, size_t resource_idx, char kind, uint8_t bucket)
+{
+    agg_key_t key = agg_quant_key(ns, kind, bucket);
+    agg_quants_t *stored = agg_table_lookup(quants, key);
+    if (stored == NULL) {
+        stored = agg_quants_new(kind);
+        agg_table_insert(quants, key, stored);
+    }
+    agg_quants_incr(stored, resource_idx);
+    size_t *full = agg_table_lookup(full_quants, key);
+    if (full == NULL) {
+        full = zmalloc(TEST_FULL_QUANTS_SIZE);
+        agg_table_insert(full_quants, key, full);
+    }
+    full[resource_idx]++;
+}
+
+static
+void test_fill_quants(agg_table_t *quants, agg_table_t *full_quants, uint32_t *ids, int pages, int requests)
+{
+    const char kinds[] = { 't', 'm', 'b', 'f' };
+    for (int r = 0; r < requests; r++) {
+        char kind = kinds[rand() % 4];
+        size_t resource_idx;
+        switch (kind) {
+        case 't': resource_idx = rand() % (last_time_resource_offset + 1); break;
+        case 'm': resource_idx = allocated_objects_index; break;
+        case 'b': resource_idx = allocated_bytes_index; break;
+        default: resource_idx = last_heap_resource_offset + 1 + rand() % (last_frontend_resource_offset - last_heap_resource_offset);
+        }
+        uint8_t bucket = rand() % HISTOGRAM_SIZE;
+        test_add_quant(quants, full_quants, ids[rand() % pages], resource_idx, kind, bucket);
+        test_add_quant(quants, full_quants, ALL_PAGES_NAMESPACE, resource_idx, kind, bucket);
+    }
+}
+
+typedef struct {
+    agg_table_t *quants;
+    size_t compared;
+} quants_comparison_t;
+
+static
+void test_compare_quants(const char *namespace, agg_key_t key, void *value, void *arg)
+{
+    quants_comparison_t *comparison = arg;
+    size_t *full = value;
+    agg_quants_t *quants = agg_table_lookup(comparison->quants, key);
+    assert(quants);
+    for (size_t i = 0; i <= last_resource_offset; i++) {
+        if (i >= quants->first && i < quants->first + quants->count)
+            assert(quants->counts[i - quants->first] == full[i]);
+        else
+            assert(full[i] == 0);
+    }
+    comparison->compared++;
+}
+
+static
+void test_agg_quants_merge(int verbose)
+{
+    enum { pages = 20 };
+    namespaces_t *namespaces = namespaces_new();
+    namespaces_t *other_namespaces = namespaces_new();
+    uint32_t ids[pages], other_ids[pages];
+    for (int p = 0; p < pages; p++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Page%d", p);
+        ids[p] = namespaces_intern(namespaces, name);
+        // only some pages are known to both interners, with different ids
+        snprintf(name, sizeof(name), "Page%d", p + pages / 2);
+        other_ids[p] = namespaces_intern(other_namespaces, name);
+    }
+
+    srand(4711);
+    agg_table_t *quants = agg_table_new(free, namespaces);
+    agg_table_t *full_quants = agg_table_new(free, namespaces);
+    test_fill_quants(quants, full_quants, ids, pages, 5000);
+    agg_table_t *other_quants = agg_table_new(free, other_namespaces);
+    agg_table_t *other_full_quants = agg_table_new(free, other_namespaces);
+    test_fill_quants(other_quants, other_full_quants, other_ids, pages, 5000);
+
+    // the merge done by the adders, with and without partitioning by kind
+    uint32_t *ns_map = namespaces_merge(namespaces, other_namespaces);
+    agg_table_merge(quants, other_quants, ns_map, agg_quants_add);
+    agg_table_merge(full_quants, other_full_quants, ns_map, test_add_full_quants);
+    free(ns_map);
+
+    assert(agg_table_size(quants) == agg_table_size(full_quants));
+    quants_comparison_t comparison = { .quants = quants };
+    agg_table_each(full_quants, test_compare_quants, &comparison);
+    assert(comparison.compared == agg_table_size(quants));
+    if (verbose)
+        printf("   compared %zu merged quants\n", comparison.compared);
+
+    agg_table_destroy(&quants);
+    agg_table_destroy(&full_quants);
+    agg_table_destroy(&other_quants);
+    agg_table_destroy(&other_full_quants);
+    namespaces_destroy(&namespaces);
+    namespaces_destroy(&other_namespaces);
+}
+
+void importer_aggtable_test(int verbose)
+{
+    printf(" * importer-aggtable: ");
+    if (verbose)
+        printf("\n");
+
+    setup_test_resource_maps();
+    test_agg_keys(verbose);
+    test_agg_table(verbose);
+    test_agg_bucket_indexes(verbose);
+    test_agg_quants_merge(verbose);
+
+    printf("OK\n");
+}
@@ -0,0 +1,108 @@
+#ifndef __LOGJAM_IMPORTER_AGGTABLE_H_INCLUDED__
+#define __LOGJAM_IMPORTER_AGGTABLE_H_INCLUDED__
+
+#include "importer-common.h"
+#include "importer-namespaces.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hash table for totals, minutes, quants and histograms, keyed by a binary
+// composite key instead of formatted strings. Namespace ids in keys refer
+// to the namespaces interner of the processor owning the table.
+
+// namespace id (32 bits) | minute of day (16 bits) | sub key (16 bits)
+typedef uint64_t agg_key_t;
+
+static inline agg_key_t agg_key(uint32_t ns, uint16_t minute, uint16_t sub)
+{
+    return ((uint64_t)ns << 32) | ((uint32_t)minute << 16) | sub;
+}
+
+static inline uint32_t agg_key_namespace(agg_key_t key) { return key >> 32; }
+static inline uint16_t agg_key_minute(agg_key_t key) { return (key >> 16) & 0xffff; }
+static inline uint16_t agg_key_sub(agg_key_t key) { return key & 0xffff; }
+
+// quants use the sub key for kind and bucket index
+static inline agg_key_t agg_quant_key(uint32_t ns, char kind, uint8_t bucket)
+{
+    return agg_key(ns, 0, ((uint8_t)kind << 8) | bucket);
+}
+
+static inline char agg_key_quant_kind(agg_key_t key) { return (key >> 8) & 0xff; }
+static inline uint8_t agg_key_quant_bucket(agg_key_t key) { return key & 0xff; }
+
+// histograms use the sub key for the resource index
+static inline agg_key_t agg_histogram_key(uint32_t ns, uint16_t minute, size_t resource_idx)
+{
+    assert(resource_idx <= 0xffff);
+    return agg_key(ns, minute, resource_idx);
+}
+
+typedef struct {
+    agg_key_t key;
+    void *value;               // NULL means empty
+} agg_entry_t;
+
+typedef void (agg_free_fn) (void *value);
+typedef void (agg_merge_fn) (void *target, void *source);
+typedef void (agg_entry_fn) (const char *namespace, agg_key_t key, void *value, void *arg);
+
+typedef struct {
+    agg_entry_t *entries;
+    uint32_t capacity;         // zero or a power of two
+    uint32_t count;
+    agg_free_fn *free_fn;
+    namespaces_t *namespaces;
+} agg_table_t;
+
+extern agg_table_t* agg_table_new(agg_free_fn *free_fn, namespaces_t *namespaces);
+extern void agg_table_destroy(agg_table_t **table);
+extern void* agg_table_lookup(agg_table_t *table, agg_key_t key);
+extern void agg_table_insert(agg_table_t *table, agg_key_t key, void *value);
+extern void agg_table_merge(agg_table_t *target, agg_table_t *source, uint32_t *ns_map, agg_merge_fn *merge);
+extern void agg_table_each(agg_table_t *table, agg_entry_fn *fn, void *arg);
+
+static inline size_t agg_table_size(agg_table_t *table)
+{
+    return table->count;
+}
+
+// Quants count requests per page, kind and bucket for each resource. A kind only
+// ever covers a contiguous range of resources, so only that range is stored.
+typedef struct {
+    uint16_t first;          // resource index of counts[0]
+    uint16_t count;
+    uint32_t counts[];
+} agg_quants_t;
+
+extern agg_quants_t* agg_quants_new(char kind);
+// agg_merge_fn for quants tables
+extern void agg_quants_add(void *target, void *source);
+
+static inline void agg_quants_incr(agg_quants_t *quants, size_t resource_idx)
+{
+    assert(resource_idx >= quants->first && resource_idx < quants->first + quants->count);
+    quants->counts[resource_idx - quants->first]++;
+}
+
+// buckets for quants and histograms
+extern const double agg_buckets[HISTOGRAM_SIZE+1];
+extern size_t agg_bucket_index(double value);
+// computes the bucket indexes of n values in one pass
+extern void agg_bucket_indexes(const double *values, size_t n, uint8_t *indexes);
+
+static inline double agg_bucket_value(size_t i)
+{
+    assert(i < HISTOGRAM_SIZE);
+    return agg_buckets[i];
+}
+
+extern void importer_aggtable_test(int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
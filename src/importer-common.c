@@ -5,6 +5,8 @@ bool verbose = false;
 bool debug = false;
 bool quiet = false;
 bool send_statsd_msgs = true;
+bool route_by_stream = false;
+bool use_json_view = false;
 
 int queued_updates = 0;
 int queued_inserts = 0;
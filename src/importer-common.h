@@ -66,6 +66,8 @@ extern bool verbose;
 extern bool debug;
 extern bool quiet;
 extern bool send_statsd_msgs;
+extern bool route_by_stream;
+extern bool use_json_view;
 
 #define ISO_DATE_STR_LEN 11
 extern char iso_date_today[ISO_DATE_STR_LEN];
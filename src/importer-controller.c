@@ -19,7 +19,7 @@
  *                 --- PIPE ---  indexer
  *                 --- PIPE ---  subscribers(n_s)
  *                 --- PIPE ---  parsers(n_p)
- *                 --- PIPE ---  adders(n_s)
+ *                 --- PIPE ---  adders(n_a)
  *  controller:    --- PIPE ---  writers(n_w)
  *                 --- PIPE ---  updaters(n_u)
  *                 --- PIPE ---  tracker
@@ -29,17 +29,14 @@
  *                 PUSH    PULL
  *                 o----------<  updaters(n_u)
  *
- *                 DEALER   REP
- *                 o----------<  adders(n_a)
- *
  *                 PUSH    PULL
  *                 >----------o  live stream publisher
 */
 
 // The controller creates all other threads, collects data from the parsers every second,
 // combines the data, sends db update requests to the updaters and also feeds the live stream.
-// The data from the parsers is collected using the pipes, but maybe we should have an
-// independent socket for this. The controller send ticks to the watchdog, which aborts
+// The data from the parsers is collected through per parser slots (see parser_collect_shard)
+// and merged by the adders (see adders_reduce). The controller send ticks to the watchdog, which aborts
 // the whole process if it doesn't receive ticks for ten consecutive seconds.
 
 unsigned long num_subscribers = 1;
@@ -63,7 +60,6 @@ typedef struct {
     zactor_t *prom_collector;
     zsock_t *updates_socket;
     size_t updates_blocked;
-    zsock_t *adder_socket;
     zsock_t *live_stream_socket;
     size_t ticks;
     statsd_client_t *statsd_client;
@@ -72,22 +68,7 @@ typedef struct {
 
 
 static
-void extract_parser_state(zmsg_t* msg, zhash_t **processors, size_t *parsed_msgs_count, frontend_stats_t *fe_stats)
-{
-    zframe_t *first = zmsg_first(msg);
-    zframe_t *second = zmsg_next(msg);
-    zframe_t *third = zmsg_next(msg);
-    assert(zframe_size(first) == sizeof(zhash_t*));
-    memcpy(&*processors, zframe_data(first), sizeof(zhash_t*));
-    assert(zframe_size(second) == sizeof(size_t));
-    memcpy(parsed_msgs_count, zframe_data(second), sizeof(size_t));
-    assert(zframe_size(third) == sizeof(frontend_stats_t));
-    memcpy(fe_stats, zframe_data(third), sizeof(frontend_stats_t));
-}
-
-
-static
-void publish_totals(stream_info_t *stream_info, zhash_t *totals, zsock_t *live_stream_socket)
+void publish_totals(stream_info_t *stream_info, agg_table_t *totals, zsock_t *live_stream_socket)
 {
     size_t n = stream_info->app_len + 1 + stream_info->env_len;
     zhash_t *known_modules = stream_info->known_modules;
@@ -106,7 +87,12 @@ void publish_totals(stream_info_t *stream_info, zhash_t *totals, zsock_t *live_s
 
         // printf("[D] publishing totals for module: %s, key: %s\n", module, key);
         json_object *json = json_object_new_object();
-        increments_t *incs = totals ? zhash_lookup(totals, namespace) : NULL;
+        increments_t *incs = NULL;
+        if (totals) {
+            uint32_t ns = namespaces_lookup(totals->namespaces, namespace);
+            if (ns != NO_NAMESPACE)
+                incs = agg_table_lookup(totals, agg_key(ns, 0, 0));
+        }
         if (incs) {
             json_object_object_add(json, "count", json_object_new_int(incs->backend_request_count));
             json_object_object_add(json, "page_count", json_object_new_int(incs->page_request_count));
@@ -135,7 +121,7 @@ void publish_totals_for_every_known_stream(controller_state_t *state, zhash_t *p
     processor_state_t* processor = zhash_first(processors);
     while (processor) {
         stream_info_t *stream_info = processor->stream_info;
-        update_known_modules(stream_info, processor->modules);
+        update_known_modules(stream_info, processor->namespaces);
         zhash_insert(published_streams, stream_info->key, (void*)1);
         publish_totals(stream_info, processor->totals, state->live_stream_socket);
         processor = zhash_next(processors);
@@ -153,41 +139,6 @@ void publish_totals_for_every_known_stream(controller_state_t *state, zhash_t *p
     zhash_destroy(&published_streams);
 }
 
-static
-void merge_processors(controller_state_t *state, zlist_t *additions)
-{
-    int l = zlist_size(additions);
-    while (l>1) {
-        int n = l / 2;
-        for (int i = 0; i < n; i++ ) {
-            zhash_t *p1 = zlist_pop(additions);
-            zhash_t *p2 = zlist_pop(additions);
-            zmsg_t *request = zmsg_new();
-            // empty envelope REP socket
-            zmsg_addstr(request, "");
-            zmsg_addptr(request, p1);
-            zmsg_addptr(request, p2);
-            int rc = zmsg_send_with_retry(&request, state->adder_socket);
-            assert(rc==0);
-        }
-        for (int i = 0; i < n; i++ ) {
-            zmsg_t *reply = zmsg_recv_with_retry(state->adder_socket);
-            assert(reply);
-            // discard empty reply envelope
-            char *empty = zmsg_popstr(reply);
-            if (empty) {
-                assert( streq(empty, "") );
-                free(empty);
-            }
-            zhash_t *p = zmsg_popptr(reply);
-            zlist_append(additions, p);
-            zmsg_destroy(&reply);
-        }
-        l = zlist_size(additions);
-    }
-
-}
-
 static
 void forward_updates(controller_state_t *state, zhash_t *processor)
 {
@@ -273,17 +224,60 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
     zlist_destroy(&db_names);
 }
 
+// When routing by stream, parsers process disjoint sets of streams, except for
+// streams spread over a parser group. So we move all processors into a single
+// hash and leave only colliding processors behind for the adders to merge.
+static
+void union_processors(zlist_t *additions)
+{
+    zhash_t *result = zlist_pop(additions);
+    zlist_t *leftovers = zlist_new();
+    zhash_t *source;
+    while ( (source = zlist_pop(additions)) ) {
+        zlist_t *db_names = zhash_keys(source);
+        const char *db_name = zlist_first(db_names);
+        while (db_name) {
+            if (zhash_lookup(result, db_name) == NULL) {
+                zhash_insert(result, db_name, zhash_lookup(source, db_name));
+                zhash_freefn(result, db_name, processor_destroy);
+                zhash_freefn(source, db_name, NULL);
+                zhash_delete(source, db_name);
+            }
+            db_name = zlist_next(db_names);
+        }
+        zlist_destroy(&db_names);
+        if (zhash_size(source) > 0)
+            zlist_append(leftovers, source);
+        else
+            zhash_destroy(&source);
+    }
+    zlist_append(additions, result);
+    while ( (source = zlist_pop(leftovers)) )
+        zlist_append(additions, source);
+    zlist_destroy(&leftovers);
+}
+
 static
 int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
 {
     int64_t start_time_ms = zclock_mono();
     controller_state_t *state = arg;
-    zhash_t *processors[num_parsers];
-    size_t parsed_msgs_counts[num_parsers];
-    frontend_stats_t fe_stats[num_parsers];
+    parser_shard_t *shards[num_parsers];
 
     state->ticks++;
 
+    // collect the shards the parsers published on the last tick. this
+    // doesn't block: parsers which haven't published yet are skipped and
+    // their data will be collected on the next tick.
+    for (size_t i=0; i<num_parsers; i++) {
+        shards[i] = parser_collect_shard(i);
+    }
+
+    // tell parsers to publish their current shard
+    for (size_t i=0; i<num_parsers; i++) {
+        zstr_send(state->parsers[i], "tick");
+    }
+
     // tell tracker, subscribers, live stream publisher and  stats server to tick
     zstr_send(state->statsd_server, "tick");
     for (size_t i=0; i<num_subscribers; i++) {
@@ -292,34 +286,31 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
     zstr_send(state->tracker, "tick");
     zstr_send(state->live_stream_publisher, "tick");
 
-    // printf("[D] controller: collecting data from parsers: tick[%zu]\n", state->ticks);
-    for (size_t i=0; i<num_parsers; i++) {
-        zactor_t* parser = state->parsers[i];
-        zstr_send(parser, "tick");
-        zmsg_t *response = zmsg_recv(parser);
-        if (response) {
-            extract_parser_state(response, &processors[i], &parsed_msgs_counts[i], &fe_stats[i]);
-            zmsg_destroy(&response);
-        }
-    }
-
     zlist_t *additions = zlist_new();
-    zlist_append(additions, processors[0]);
 
     // printf("[D] controller: combining processors states\n");
-    size_t parsed_msgs_count = parsed_msgs_counts[0];
-    frontend_stats_t front_stats = fe_stats[0];
-    for (int i=1; i<num_parsers; i++) {
-        parsed_msgs_count += parsed_msgs_counts[i];
-        front_stats.received += fe_stats[i].received;
-        front_stats.dropped += fe_stats[i].dropped;
+    size_t parsed_msgs_count = 0;
+    frontend_stats_t front_stats;
+    memset(&front_stats, 0, sizeof(front_stats));
+    for (int i=0; i<num_parsers; i++) {
+        parser_shard_t *shard = shards[i];
+        if (shard == NULL)
+            continue;
+        parsed_msgs_count += shard->parsed_msgs_count;
+        front_stats.received += shard->fe_stats.received;
+        front_stats.dropped += shard->fe_stats.dropped;
         for (int j=0; j<FE_MSG_NUM_REASONS; j++)
-            front_stats.drop_reasons[j] += fe_stats[i].drop_reasons[j];
-        zlist_append(additions, processors[i]);
+            front_stats.drop_reasons[j] += shard->fe_stats.drop_reasons[j];
+        zlist_append(additions, shard->processors);
+        shard->processors = NULL;
+        parser_shard_destroy(&shards[i]);
     }
+    if (zlist_size(additions) == 0)
+        zlist_append(additions, zhash_new());
+    else if (route_by_stream)
+        union_processors(additions);
 
-    merge_processors(state, additions);
-    zhash_t *processor = zlist_pop(additions);
+    zhash_t *processor = adders_reduce(additions);
     zlist_destroy(&additions);
 
     // publish on live stream (need to do this while we still own the processor)
@@ -340,7 +331,8 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
     zlist_append(state->collected_processors, processor);
     // combine stats of collected processor from last tick with current one
     if (zlist_size(state->collected_processors) > 1) {
-        merge_processors(state, state->collected_processors);
+        zhash_t *combined = adders_reduce(state->collected_processors);
+        zlist_append(state->collected_processors, combined);
     }
 
     // forward to stats_updaters
@@ -441,16 +433,10 @@ bool controller_create_actors(controller_state_t *state)
     int rc = zsock_bind(state->updates_socket, "inproc://stats-updates");
     assert(rc == 0);
 
-    // create socket for adders
-    state->adder_socket = zsock_new(ZMQ_DEALER);
-    assert(state->adder_socket);
-    zsock_set_sndtimeo(state->adder_socket, 10);
-    rc = zsock_bind(state->adder_socket, "inproc://adders");
-    assert(rc == 0);
-
     // connect to live stream
     state->live_stream_socket = live_stream_client_socket_new(state->config);
 
+    request_writer_queue_init();
     for (size_t i=0; i<num_writers; i++) {
         state->writers[i] = request_writer_new(state->config, i);
     }
@@ -461,6 +447,8 @@ bool controller_create_actors(controller_state_t *state)
         state->parsers[i] = parser_new(state->config, i);
     }
     num_adders = num_parsers / 2;
+    if (num_adders == 0)
+        num_adders = 1;
     for (size_t i=0; i<num_adders; i++) {
         state->adders[i] = zactor_new(adder, (void*)i);
     }
@@ -487,16 +475,42 @@ void controller_destroy_actors(controller_state_t *state)
         parser_destroy(&state->parsers[i]);
     }
 
+    // shards published after the last tick haven't been collected yet. reduce
+    // them while the adders are still running, so that they end up in the
+    // collected processors like the shards of every other tick.
+    zlist_t *additions = zlist_new();
+    for (size_t i=0; i<num_parsers; i++) {
+        parser_shard_t *shard = parser_collect_shard(i);
+        if (shard == NULL)
+            continue;
+        zlist_append(additions, shard->processors);
+        shard->processors = NULL;
+        parser_shard_destroy(&shard);
+    }
+    if (zlist_size(additions) > 0) {
+        if (verbose) printf("[D] controller: reducing %zu uncollected parser shards\n", zlist_size(additions));
+        if (route_by_stream)
+            union_processors(additions);
+        zlist_append(state->collected_processors, adders_reduce(additions));
+        if (zlist_size(state->collected_processors) > 1) {
+            zhash_t *combined = adders_reduce(state->collected_processors);
+            zlist_append(state->collected_processors, combined);
+        }
+    }
+    zlist_destroy(&additions);
+
     for (size_t i=0; i<num_writers; i++) {
         if (verbose) printf("[D] controller: destroying writer[%zu]\n", i);
         zactor_destroy(&state->writers[i]);
     }
+    request_writer_queue_destroy();
 
     for (size_t i=0; i<num_updaters; i++) {
         if (verbose) printf("[D] controller: destroying updater[%zu]\n", i);
         zactor_destroy(&state->updaters[i]);
     }
 
+    adders_shutdown();
     for (size_t i=0; i<num_adders; i++) {
         if (verbose) printf("[D] controller: destroying adder[%zu]\n", i);
         zactor_destroy(&state->adders[i]);
@@ -523,9 +537,6 @@ void controller_destroy_actors(controller_state_t *state)
     if (verbose) printf("[D] controller: destroying updates socket\n");
     zsock_destroy(&state->updates_socket);
 
-    if (verbose) printf("[D] controller: destroying adder socket\n");
-    zsock_destroy(&state->adder_socket);
-
     // shut down mongo client
     if (!dryrun)
         mongoc_cleanup();
@@ -626,13 +637,7 @@ int run_controller_loop(zconfig_t* config, size_t io_threads)
     zloop_destroy(&loop);
     assert(loop == NULL);
 
-    zhash_t *p = NULL;
  exit:
-    // free collected processors
-    while ( (p = zlist_pop(state.collected_processors) )) {
-        zhash_destroy(&p);
-    }
-    zlist_destroy(&state.collected_processors);
     // create apocalypse timer
     if (start_shutdown_timer() == -1)
         printf("[W] controller: could not start shutdown timer\n");
@@ -641,7 +646,15 @@ int run_controller_loop(zconfig_t* config, size_t io_threads)
 
     // destroy actors and statsd_client
     controller_destroy_actors(&state);
+
+    // free collected processors
+    zhash_t *p;
+    while ( (p = zlist_pop(state.collected_processors) )) {
+        zhash_destroy(&p);
+    }
+    zlist_destroy(&state.collected_processors);
     statsd_client_destroy(&state.statsd_client);
+    compression_dictionaries_destroy();
 
     // wait for actors to finish
     zsys_shutdown();
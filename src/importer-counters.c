@@ -0,0 +1,340 @@
+#include "importer-counters.h"
+
+static const int known_response_codes[NUM_KNOWN_RESPONSE_CODES] = {
+    200, 201, 202, 204, 206,
+    301, 302, 303, 304, 307,
+    400, 401, 403, 404, 405, 406, 409, 410, 412, 413, 415, 422, 429, 499,
+    500, 501, 502, 503, 504
+};
+
+static const char* fixed_counter_names[NUM_FIXED_COUNTERS] = {
+    "apdex.happy", "apdex.satisfied", "apdex.tolerating", "apdex.frustrated",
+    "fapdex.happy", "fapdex.satisfied", "fapdex.tolerating", "fapdex.frustrated",
+    "papdex.happy", "papdex.satisfied", "papdex.tolerating", "papdex.frustrated",
+    "xapdex.happy", "xapdex.satisfied", "xapdex.tolerating", "xapdex.frustrated",
+    "severity.0", "severity.1", "severity.2", "severity.3", "severity.4", "severity.5",
+    "response.200", "response.201", "response.202", "response.204", "response.206",
+    "response.301", "response.302", "response.303", "response.304", "response.307",
+    "response.400", "response.401", "response.403", "response.404", "response.405",
+    "response.406", "response.409", "response.410", "response.412", "response.413",
+    "response.415", "response.422", "response.429", "response.499",
+    "response.500", "response.501", "response.502", "response.503", "response.504"
+};
+
+#define INITIAL_COUNTERS_CAPACITY 8
+#define INITIAL_COUNTER_KEYS_SIZE 256
+
+const char* counter_slot_name(int slot)
+{
+    assert(slot >= 0 && slot < NUM_FIXED_COUNTERS);
+    return fixed_counter_names[slot];
+}
+
+static inline uint32_t counter_key_hash(const char *key, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static inline const char* counter_entry_key(counters_t *counters, counter_entry_t *e)
+{
+    return counters->keys + e->key - 1;
+}
+
+void counters_release(counters_t *counters)
+{
+    free(counters->entries);
+    free(counters->keys);
+    counters->entries = NULL;
+    counters->keys = NULL;
+    counters->capacity = counters->count = 0;
+    counters->keys_size = counters->keys_used = 0;
+}
+
+static
+uint32_t counters_intern_key(counters_t *counters, const char *key, size_t len)
+{
+    size_t needed = counters->keys_used + len + 1;
+    if (needed > counters->keys_size) {
+        size_t new_size = counters->keys_size ? 2 * counters->keys_size : INITIAL_COUNTER_KEYS_SIZE;
+        while (new_size < needed)
+            new_size *= 2;
+        counters->keys = realloc(counters->keys, new_size);
+        assert(counters->keys);
+        counters->keys_size = new_size;
+    }
+    uint32_t offset = counters->keys_used;
+    memcpy(counters->keys + offset, key, len);
+    counters->keys[offset + len] = '\0';
+    counters->keys_used += len + 1;
+    return offset + 1;
+}
+
+static
+void counters_grow(counters_t *counters)
+{
+    uint32_t old_capacity = counters->capacity;
+    counter_entry_t *old_entries = counters->entries;
+    uint32_t new_capacity = old_capacity ? 2 * old_capacity : INITIAL_COUNTERS_CAPACITY;
+    counter_entry_t *new_entries = zmalloc(new_capacity * sizeof(counter_entry_t));
+    assert(new_entries);
+    uint32_t mask = new_capacity - 1;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        counter_entry_t *e = &old_entries[i];
+        if (e->key) {
+            uint32_t j = e->hash & mask;
+            while (new_entries[j].key)
+                j = (j + 1) & mask;
+            new_entries[j] = *e;
+        }
+    }
+    free(old_entries);
+    counters->entries = new_entries;
+    counters->capacity = new_capacity;
+}
+
+static
+void counters_update_hashed_key(counters_t *counters, const char *key, size_t len, uint32_t hash, int value, bool add)
+{
+    // keep the load factor below 3/4
+    if (4 * (counters->count + 1) > 3 * counters->capacity)
+        counters_grow(counters);
+
+    uint32_t mask = counters->capacity - 1;
+    uint32_t i = hash & mask;
+    counter_entry_t *e;
+    while ((e = &counters->entries[i])->key) {
+        if (e->hash == hash && e->key_len == len && !memcmp(counter_entry_key(counters, e), key, len)) {
+            e->value = add ? e->value + value : value;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    e->hash = hash;
+    e->key_len = len;
+    e->key = counters_intern_key(counters, key, len);
+    e->value = value;
+    counters->count++;
+}
+
+void counters_add_key(counters_t *counters, const char *key, size_t key_len, int value)
+{
+    counters_update_hashed_key(counters, key, key_len, counter_key_hash(key, key_len), value, true);
+}
+
+void counters_set_key(counters_t *counters, const char *key, size_t key_len, int value)
+{
+    counters_update_hashed_key(counters, key, key_len, counter_key_hash(key, key_len), value, false);
+}
+
+static
+int response_code_slot(int response_code)
+{
+    int lo = 0, hi = NUM_KNOWN_RESPONSE_CODES - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int code = known_response_codes[mid];
+        if (code == response_code)
+            return COUNTER_RESPONSE_FIRST + mid;
+        else if (code < response_code)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+void counters_add_response_code(counters_t *counters, int response_code, int value)
+{
+    int slot = response_code_slot(response_code);
+    if (slot >= 0) {
+        counters->fixed[slot] += value;
+    } else {
+        char rsp[256];
+        int n = snprintf(rsp, 256, "response.%d", response_code);
+        counters_add_key(counters, rsp, n, value);
+    }
+}
+
+void counters_add_severity(counters_t *counters, int severity, int value)
+{
+    if (severity >= 0 && severity <= 5) {
+        counters->fixed[COUNTER_SEVERITY_0 + severity] += value;
+    } else {
+        char sev[256];
+        int n = snprintf(sev, 256, "severity.%d", severity);
+        counters_add_key(counters, sev, n, value);
+    }
+}
+
+void counters_add(counters_t *target, counters_t *source)
+{
+    for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+        target->fixed[i] += source->fixed[i];
+
+    for (uint32_t i = 0; i < source->capacity; i++) {
+        counter_entry_t *e = &source->entries[i];
+        if (e->key)
+            counters_update_hashed_key(target, counter_entry_key(source, e), e->key_len, e->hash, e->value, true);
+    }
+}
+
+void counters_copy(counters_t *target, counters_t *source)
+{
+    memcpy(target->fixed, source->fixed, sizeof(target->fixed));
+    target->entries = NULL;
+    target->keys = NULL;
+    target->capacity = target->count = 0;
+    target->keys_size = target->keys_used = 0;
+    if (source->capacity) {
+        size_t entries_size = source->capacity * sizeof(counter_entry_t);
+        target->entries = malloc(entries_size);
+        assert(target->entries);
+        memcpy(target->entries, source->entries, entries_size);
+        target->capacity = source->capacity;
+        target->count = source->count;
+    }
+    if (source->keys_used) {
+        target->keys = malloc(source->keys_used);
+        assert(target->keys);
+        memcpy(target->keys, source->keys, source->keys_used);
+        target->keys_size = target->keys_used = source->keys_used;
+    }
+}
+
+void counters_each(counters_t *counters, counter_fn *fn, void *arg)
+{
+    for (int i = 0; i < NUM_FIXED_COUNTERS; i++) {
+        int value = counters->fixed[i];
+        if (value) {
+            const char *name = fixed_counter_names[i];
+            fn(name, strlen(name), value, arg);
+        }
+    }
+    for (uint32_t i = 0; i < counters->capacity; i++) {
+        counter_entry_t *e = &counters->entries[i];
+        if (e->key)
+            fn(counter_entry_key(counters, e), e->key_len, e->value, arg);
+    }
+}
+
+static
+void dump_counter(const char *key, size_t key_len, int value, void *arg)
+{
+    FILE *f = arg;
+    fprintf(f, " %.*s:%d", (int)key_len, key, value);
+}
+
+void dump_counters(FILE *f, const char *prefix, counters_t *counters)
+{
+    fprintf(f, "%s", prefix);
+    counters_each(counters, dump_counter, f);
+    fprintf(f, "\n");
+}
+
+static
+void collect_counter(const char *key, size_t key_len, int value, void *arg)
+{
+    zhash_t *collected = arg;
+    char name[256];
+    assert(key_len < sizeof(name));
+    memcpy(name, key, key_len);
+    name[key_len] = '\0';
+    assert(strlen(name) == key_len);
+    // each key is reported once
+    assert(zhash_insert(collected, name, (void*)(intptr_t)value) == 0);
+}
+
+static
+int collected_value(zhash_t *collected, const char *key)
+{
+    return (int)(intptr_t) zhash_lookup(collected, key);
+}
+
+void importer_counters_test(int verbose)
+{
+    printf(" * importer-counters: ");
+    if (verbose)
+        printf("\n");
+
+    counters_t counters;
+    memset(&counters, 0, sizeof(counters));
+
+    // well known counters use fixed slots, all others go into the hash table
+    counters_incr(&counters, COUNTER_APDEX_HAPPY);
+    counters_add_response_code(&counters, 200, 2);
+    counters_add_response_code(&counters, 504, 1);
+    counters_add_response_code(&counters, 418, 3);
+    counters_add_severity(&counters, 5, 1);
+    counters_add_severity(&counters, 6, 4);
+    assert(counters.fixed[COUNTER_APDEX_HAPPY] == 1);
+    assert(counters.fixed[COUNTER_RESPONSE_FIRST] == 2);
+    assert(counters.fixed[NUM_FIXED_COUNTERS - 1] == 1);
+    assert(counters.fixed[COUNTER_SEVERITY_0 + 5] == 1);
+    assert(counters.count == 2);
+    assert(streq(counter_slot_name(COUNTER_RESPONSE_FIRST), "response.200"));
+    assert(streq(counter_slot_name(NUM_FIXED_COUNTERS - 1), "response.504"));
+
+    // enough keys to grow the table and the key arena several times
+    const int n = 1000;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n; i++) {
+            char key[64];
+            int len = snprintf(key, sizeof(key), "exceptions.Some::Fairly::Long::Error%d", i);
+            counters_add_key(&counters, key, len, i);
+        }
+    }
+    assert(counters.count == n + 2);
+    assert(counters.capacity >= 4 * counters.count / 3);
+    const char *error7 = "exceptions.Some::Fairly::Long::Error7";
+    counters_set_key(&counters, error7, strlen(error7), 1);
+    // keys don't need to be NUL terminated
+    counters_add_key(&counters, "exceptions.Some::Fairly::Long::Error71", strlen(error7), 1);
+
+    zhash_t *collected = zhash_new();
+    counters_each(&counters, collect_counter, collected);
+    assert(zhash_size(collected) == n + 2 + 4);
+    assert(collected_value(collected, "apdex.happy") == 1);
+    assert(collected_value(collected, "response.200") == 2);
+    assert(collected_value(collected, "response.418") == 3);
+    assert(collected_value(collected, "severity.6") == 4);
+    assert(collected_value(collected, "exceptions.Some::Fairly::Long::Error7") == 2);
+    assert(collected_value(collected, "exceptions.Some::Fairly::Long::Error999") == 2 * 999);
+    zhash_destroy(&collected);
+
+    // copies are independent of the original, adding combines both tables
+    counters_t copy;
+    counters_copy(&copy, &counters);
+    counters_t other;
+    memset(&other, 0, sizeof(other));
+    counters_add_response_code(&other, 418, 1);
+    counters_add_key(&other, "exceptions.Other", 16, 5);
+    counters_add(&copy, &other);
+    counters_add(&copy, &counters);
+    collected = zhash_new();
+    counters_each(&copy, collect_counter, collected);
+    assert(zhash_size(collected) == n + 2 + 4 + 1);
+    assert(collected_value(collected, "apdex.happy") == 2);
+    assert(collected_value(collected, "response.418") == 7);
+    assert(collected_value(collected, "exceptions.Other") == 5);
+    assert(collected_value(collected, "exceptions.Some::Fairly::Long::Error999") == 4 * 999);
+    zhash_destroy(&collected);
+    assert(counters.count == n + 2);
+
+    if (verbose) {
+        printf("   %u keys, capacity %u, key arena %u bytes\n", copy.count, copy.capacity, copy.keys_size);
+        dump_counters(stdout, "   other:", &other);
+    }
+
+    counters_release(&other);
+    counters_release(&copy);
+    counters_release(&counters);
+    assert(counters.entries == NULL && counters.count == 0);
+
+    printf("OK\n");
+}
@@ -0,0 +1,83 @@
+#ifndef __LOGJAM_IMPORTER_COUNTERS_H_INCLUDED__
+#define __LOGJAM_IMPORTER_COUNTERS_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counters of increments which are not resource metrics (apdex, response codes, severities,
+// exceptions, callers, ...). Well known counters live in fixed slots. All other keys are
+// interned into a key arena owned by the table and counted in an open addressed hash table.
+
+enum counter_slot {
+    COUNTER_APDEX_HAPPY,
+    COUNTER_APDEX_SATISFIED,
+    COUNTER_APDEX_TOLERATING,
+    COUNTER_APDEX_FRUSTRATED,
+    COUNTER_FAPDEX_HAPPY,
+    COUNTER_FAPDEX_SATISFIED,
+    COUNTER_FAPDEX_TOLERATING,
+    COUNTER_FAPDEX_FRUSTRATED,
+    COUNTER_PAPDEX_HAPPY,
+    COUNTER_PAPDEX_SATISFIED,
+    COUNTER_PAPDEX_TOLERATING,
+    COUNTER_PAPDEX_FRUSTRATED,
+    COUNTER_XAPDEX_HAPPY,
+    COUNTER_XAPDEX_SATISFIED,
+    COUNTER_XAPDEX_TOLERATING,
+    COUNTER_XAPDEX_FRUSTRATED,
+    COUNTER_SEVERITY_0,
+    COUNTER_SEVERITY_1,
+    COUNTER_SEVERITY_2,
+    COUNTER_SEVERITY_3,
+    COUNTER_SEVERITY_4,
+    COUNTER_SEVERITY_5,
+    COUNTER_RESPONSE_FIRST
+};
+
+#define NUM_KNOWN_RESPONSE_CODES 29
+#define NUM_FIXED_COUNTERS (COUNTER_RESPONSE_FIRST + NUM_KNOWN_RESPONSE_CODES)
+
+typedef struct {
+    uint32_t hash;
+    uint32_t key;      // offset of the key in the key arena plus one, zero means empty
+    uint32_t key_len;
+    int value;
+} counter_entry_t;
+
+typedef struct {
+    int fixed[NUM_FIXED_COUNTERS];
+    counter_entry_t *entries;
+    uint32_t capacity;       // zero or a power of two
+    uint32_t count;
+    char *keys;
+    uint32_t keys_size;
+    uint32_t keys_used;
+} counters_t;
+
+typedef void (counter_fn) (const char *key, size_t key_len, int value, void *arg);
+
+extern void counters_release(counters_t *counters);
+extern void counters_copy(counters_t *target, counters_t *source);
+extern void counters_add(counters_t *target, counters_t *source);
+extern void counters_add_key(counters_t *counters, const char *key, size_t key_len, int value);
+extern void counters_set_key(counters_t *counters, const char *key, size_t key_len, int value);
+extern void counters_add_response_code(counters_t *counters, int response_code, int value);
+extern void counters_add_severity(counters_t *counters, int severity, int value);
+extern void counters_each(counters_t *counters, counter_fn *fn, void *arg);
+extern const char* counter_slot_name(int slot);
+extern void dump_counters(FILE *f, const char *prefix, counters_t *counters);
+extern void importer_counters_test(int verbose);
+
+static inline void counters_incr(counters_t *counters, enum counter_slot slot)
+{
+    counters->fixed[slot]++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,13 +1,14 @@
 #include "importer-common.h"
 #include "importer-resources.h"
 #include "importer-increments.h"
+#include "simd-kernels.h"
 
 
-void dump_metrics(metric_pair_t *metrics)
+void dump_metrics(metrics_t *metrics)
 {
     for (size_t i=0; i<=last_resource_offset; i++) {
-        if (metrics[i].val > 0) {
-            printf("[D] %s:%f:sq(%f):max(%f)\n", int_to_resource[i], metrics[i].val, metrics[i].val_squared, metrics[i].val_max);
+        if (metrics->val[i] > 0) {
+            printf("[D] %s:%f:sq(%f):max(%f)\n", int_to_resource[i], metrics->val[i], metrics->val_squared[i], metrics->val_max[i]);
         }
     }
 }
@@ -19,11 +20,19 @@ void dump_increments(const char *action, increments_t *increments)
     printf("[D] backend requests: %zu\n", increments->backend_request_count);
     printf("[D] page requests: %zu\n", increments->page_request_count);
     printf("[D] ajax requests: %zu\n", increments->ajax_request_count);
-    dump_metrics(increments->metrics);
-    dump_json_object(stdout, "[D]", increments->others);
+    dump_metrics(&increments->metrics);
+    dump_counters(stdout, "[D]", &increments->others);
 }
 
-#define METRICS_ARRAY_SIZE (sizeof(metric_pair_t) * (last_resource_offset + 1))
+#define METRICS_ARRAY_SIZE (3 * METRICS_STRIDE * sizeof(double))
+
+static inline
+void metrics_init(metrics_t *metrics, double *block)
+{
+    metrics->val = block;
+    metrics->val_squared = block + METRICS_STRIDE;
+    metrics->val_max = block + 2 * METRICS_STRIDE;
+}
 
 increments_t* increments_new()
 {
@@ -31,9 +40,8 @@ increments_t* increments_new()
     increments_t* increments = zmalloc(inc_size);
 
     const size_t metrics_size = METRICS_ARRAY_SIZE;
-    increments->metrics = zmalloc(metrics_size);
+    metrics_init(&increments->metrics, zmalloc(metrics_size));
 
-    increments->others = json_object_new_object();
     return increments;
 }
 
@@ -41,38 +49,44 @@ void increments_destroy(void *increments)
 {
     // void* because of zhash_destroy
     increments_t *incs = increments;
-    json_object_put(incs->others);
-    free(incs->metrics);
+    counters_release(&incs->others);
+    free(incs->metrics.val);
     free(incs);
 }
 
+increments_t* increments_new_in_arena(arena_t *arena)
+{
+    increments_t* increments = arena_alloc(arena, sizeof(increments_t));
+    metrics_init(&increments->metrics, arena_alloc(arena, METRICS_ARRAY_SIZE));
+    return increments;
+}
+
+void increments_release(increments_t *increments)
+{
+    counters_release(&increments->others);
+}
+
 increments_t* increments_clone(increments_t* increments)
 {
     increments_t* new_increments = increments_new();
     new_increments->backend_request_count = increments->backend_request_count;
     new_increments->page_request_count = increments->page_request_count;
     new_increments->ajax_request_count = increments->ajax_request_count;
-    memcpy(new_increments->metrics, increments->metrics, METRICS_ARRAY_SIZE);
-    json_object_object_foreach(increments->others, key, value) {
-        json_object_get(value);
-        json_object_object_add(new_increments->others, key, value);
-    }
+    memcpy(new_increments->metrics.val, increments->metrics.val, METRICS_ARRAY_SIZE);
+    counters_copy(&new_increments->others, &increments->others);
     return new_increments;
 }
 
-// TODO: this is horribly inefficient. redesign logjam protocol
-// so that metrics come in a sub hash (or several)
+// walks the keys of the request once and maps them to resource indexes using
+// the perfect hash set up by setup_resource_maps
 void increments_fill_metrics(increments_t *increments, json_object *request)
 {
-    const int n = last_resource_offset;
-    for (size_t i=0; i <= n; i++) {
-        json_object* metrics_value;
-        if (json_object_object_get_ex(request, int_to_resource[i], &metrics_value)) {
+    json_object_object_foreach(request, key, metrics_value) {
+        for (int i = resource_index(key); i >= 0; i = resource_next_duplicate[i]) {
             double v = json_object_get_double(metrics_value);
-            metric_pair_t *p = &increments->metrics[i];
-            p->val = v;
-            p->val_squared = v*v;
-            p->val_max = v;
+            increments->metrics.val[i] = v;
+            increments->metrics.val_squared[i] = v*v;
+            increments->metrics.val_max[i] = v;
         }
     }
 }
@@ -81,112 +95,105 @@ void increments_add_metrics_to_json(increments_t *increments, json_object *jobj)
 {
     const int n = last_resource_offset;
     for (size_t i=0; i <= n; i++) {
-        metric_pair_t *p = &increments->metrics[i];
-        double v = p->val;
+        double v = increments->metrics.val[i];
         if (v > 0) {
             json_object_object_add(jobj, int_to_resource[i], json_object_new_double(v));
         }
     }
 }
 
-#define NEW_INT1 (json_object_new_int(1))
-
 
 const char* increments_fill_apdex(increments_t *increments, double total_time)
 {
-    json_object *others = increments->others;
+    counters_t *others = &increments->others;
 
     if (total_time < 100) {
-        json_object_object_add(others, "apdex.happy", NEW_INT1);
-        json_object_object_add(others, "apdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_APDEX_HAPPY);
+        counters_incr(others, COUNTER_APDEX_SATISFIED);
         return "satisfied";
     } else if (total_time < 500) {
-        json_object_object_add(others, "apdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_APDEX_SATISFIED);
         return "satisfied";
     } else if (total_time < 2000) {
-        json_object_object_add(others, "apdex.tolerating", NEW_INT1);
+        counters_incr(others, COUNTER_APDEX_TOLERATING);
         return "tolerating";
     } else {
-        json_object_object_add(others, "apdex.frustrated", NEW_INT1);
+        counters_incr(others, COUNTER_APDEX_FRUSTRATED);
         return "frustrated";
     }
 }
 
 const char* increments_fill_frontend_apdex(increments_t *increments, double total_time)
 {
-    json_object *others = increments->others;
+    counters_t *others = &increments->others;
 
     if (total_time < 500) {
-        json_object_object_add(others, "fapdex.happy", NEW_INT1);
-        json_object_object_add(others, "fapdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_FAPDEX_HAPPY);
+        counters_incr(others, COUNTER_FAPDEX_SATISFIED);
         return "satisfied";
     }
     else if (total_time < 2000) {
-        json_object_object_add(others, "fapdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_FAPDEX_SATISFIED);
         return "satisfied";
     } else if (total_time < 8000) {
-        json_object_object_add(others, "fapdex.tolerating", NEW_INT1);
+        counters_incr(others, COUNTER_FAPDEX_TOLERATING);
         return "tolerating";
     } else {
-        json_object_object_add(others, "fapdex.frustrated", NEW_INT1);
+        counters_incr(others, COUNTER_FAPDEX_FRUSTRATED);
         return "frustrated";
     }
 }
 
 const char* increments_fill_page_apdex(increments_t *increments, double total_time)
 {
-    json_object *others = increments->others;
+    counters_t *others = &increments->others;
 
     if (total_time < 500) {
-        json_object_object_add(others, "papdex.happy", NEW_INT1);
-        json_object_object_add(others, "papdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_PAPDEX_HAPPY);
+        counters_incr(others, COUNTER_PAPDEX_SATISFIED);
         return "satisfied";
     }
     else if (total_time < 2000) {
-        json_object_object_add(others, "papdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_PAPDEX_SATISFIED);
         return "satisfied";
     } else if (total_time < 8000) {
-        json_object_object_add(others, "papdex.tolerating", NEW_INT1);
+        counters_incr(others, COUNTER_PAPDEX_TOLERATING);
         return "tolerating";
     } else {
-        json_object_object_add(others, "papdex.frustrated", NEW_INT1);
+        counters_incr(others, COUNTER_PAPDEX_FRUSTRATED);
         return "frustrated";
     }
 }
 
 const char* increments_fill_ajax_apdex(increments_t *increments, double total_time)
 {
-    json_object *others = increments->others;
+    counters_t *others = &increments->others;
 
     if (total_time < 500) {
-        json_object_object_add(others, "xapdex.happy", NEW_INT1);
-        json_object_object_add(others, "xapdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_XAPDEX_HAPPY);
+        counters_incr(others, COUNTER_XAPDEX_SATISFIED);
         return "satisfied";
     }
     else if (total_time < 2000) {
-        json_object_object_add(others, "xapdex.satisfied", NEW_INT1);
+        counters_incr(others, COUNTER_XAPDEX_SATISFIED);
         return "satisfied";
     } else if (total_time < 8000) {
-        json_object_object_add(others, "xapdex.tolerating", NEW_INT1);
+        counters_incr(others, COUNTER_XAPDEX_TOLERATING);
         return "tolerating";
     } else {
-        json_object_object_add(others, "xapdex.frustrated", NEW_INT1);
+        counters_incr(others, COUNTER_XAPDEX_FRUSTRATED);
         return "frustrated";
     }
 }
 
 void increments_fill_response_code(increments_t *increments, request_data_t *request_data)
 {
-    char rsp[256];
-    snprintf(rsp, 256, "response.%d", request_data->response_code);
-    json_object_object_add(increments->others, rsp, NEW_INT1);
+    counters_add_response_code(&increments->others, request_data->response_code, 1);
 }
 
 void increments_fill_severity(increments_t *increments, request_data_t *request_data)
 {
-    char sev[256];
-    snprintf(sev, 256, "severity.%d", request_data->severity);
-    json_object_object_add(increments->others, sev, NEW_INT1);
+    counters_add_severity(&increments->others, request_data->severity, 1);
 }
 
 void increments_fill_exceptions(increments_t *increments, json_object *exceptions)
@@ -210,7 +217,7 @@ void increments_fill_exceptions(increments_t *increments, json_object *exception
             json_object* new_ex = json_object_new_string(ex_str_dup+11);
             json_object_array_put_idx(exceptions, i, new_ex);
         }
-        json_object_object_add(increments->others, ex_str_dup, NEW_INT1);
+        counters_set_key(&increments->others, ex_str_dup, n+11, 1);
     }
 }
 
@@ -235,7 +242,7 @@ void increments_fill_soft_exceptions(increments_t *increments, json_object *soft
       json_object* new_ex = json_object_new_string(ex_str_dup+16);
       json_object_array_put_idx(soft_exceptions, i, new_ex);
     }
-    json_object_object_add(increments->others, ex_str_dup, NEW_INT1);
+    counters_set_key(&increments->others, ex_str_dup, n+16, 1);
   }
 }
 
@@ -245,9 +252,9 @@ void increments_fill_js_exception(increments_t *increments, const char *js_excep
     int l = 14;
     char xbuffer[l+3*n+1];
     strcpy(xbuffer, "js_exceptions.");
-    uri_replace_dots_and_dollars(xbuffer+l, js_exception);
+    int m = uri_replace_dots_and_dollars(xbuffer+l, js_exception);
     // printf("[D] JS EXCEPTION: %s\n", xbuffer);
-    json_object_object_add(increments->others, xbuffer, NEW_INT1);
+    counters_set_key(&increments->others, xbuffer, l+m, 1);
 }
 
 void increments_fill_caller_info(increments_t *increments, json_object *request)
@@ -269,9 +276,9 @@ void increments_fill_caller_info(increments_t *increments, json_object *request)
                 strcpy(caller_name, "callers.");
                 int real_app_len = copy_replace_dots_and_dollars(caller_name + 8, app);
                 caller_name[real_app_len + 8] = '-';
-                copy_replace_dots_and_dollars(caller_name + 8 + real_app_len + 1, caller_action);
+                int real_action_len = copy_replace_dots_and_dollars(caller_name + 8 + real_app_len + 1, caller_action);
                 // printf("[D] CALLER: %s\n", caller_name);
-                json_object_object_add(increments->others, caller_name, NEW_INT1);
+                counters_set_key(&increments->others, caller_name, 8 + real_app_len + 1 + real_action_len, 1);
             }
         }
     }
@@ -296,9 +303,9 @@ void increments_fill_sender_info(increments_t *increments, json_object *request)
                 strcpy(sender_name, "senders.");
                 int real_app_len = copy_replace_dots_and_dollars(sender_name + 8, app);
                 sender_name[real_app_len + 8] = '-';
-                copy_replace_dots_and_dollars(sender_name + 8 + real_app_len + 1, sender_action);
+                int real_action_len = copy_replace_dots_and_dollars(sender_name + 8 + real_app_len + 1, sender_action);
                 // printf("[D] SENDER: %s\n", sender_name);
-                json_object_object_add(increments->others, sender_name, NEW_INT1);
+                counters_set_key(&increments->others, sender_name, 8 + real_app_len + 1 + real_action_len, 1);
             }
         }
     }
@@ -309,46 +316,8 @@ void increments_add(increments_t *stored_increments, increments_t* increments)
     stored_increments->backend_request_count += increments->backend_request_count;
     stored_increments->page_request_count += increments->page_request_count;
     stored_increments->ajax_request_count += increments->ajax_request_count;
-    for (size_t i=0; i<=last_resource_offset; i++) {
-        metric_pair_t *stored = &(stored_increments->metrics[i]);
-        metric_pair_t *addend = &(increments->metrics[i]);
-        stored->val += addend->val;
-        stored->val_squared += addend->val_squared;
-        if (stored->val_max < addend->val_max)
-            stored->val_max = addend->val_max;
-    }
-    json_object_object_foreach(increments->others, key, value) {
-        json_object *stored_obj = NULL;
-        json_object *new_obj = NULL;
-        bool perform_addition = json_object_object_get_ex(stored_increments->others, key, &stored_obj);
-        enum json_type type = json_object_get_type(value);
-        switch (type) {
-        case json_type_double: {
-            double addend = json_object_get_double(value);
-            if (perform_addition) {
-                double stored = json_object_get_double(stored_obj);
-                new_obj = json_object_new_double(stored + addend);
-            } else {
-                new_obj = json_object_new_double(addend);
-            }
-            break;
-        }
-        case json_type_int: {
-            int addend = json_object_get_int(value);
-            if (perform_addition) {
-                int stored = json_object_get_int(stored_obj);
-                new_obj = json_object_new_int(stored + addend);
-            } else {
-                new_obj = json_object_new_int(addend);
-            }
-            break;
-        }
-        default:
-            fprintf(stderr, "[E] unknown increment type: %s, for key: %s\n", json_type_to_name(type), key);
-            dump_json_object(stderr, "[E]", increments->others);
-        }
-        if (new_obj) {
-            json_object_object_add(stored_increments->others, key, new_obj);
-        }
-    }
+    // val and val_squared are adjacent
+    simd_add_doubles(stored_increments->metrics.val, increments->metrics.val, 2 * METRICS_STRIDE);
+    simd_max_doubles(stored_increments->metrics.val_max, increments->metrics.val_max, METRICS_STRIDE);
+    counters_add(&stored_increments->others, &increments->others);
 }
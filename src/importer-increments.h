@@ -2,6 +2,8 @@
 #define __LOGJAM_IMPORTER_INCREMENTS_H_INCLUDED__
 
 #include "importer-common.h"
+#include "importer-counters.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,23 +11,31 @@ extern "C" {
 
 // TODO: support integer values (for call metrics)
 
+// Metric values in struct of arrays layout, indexed by resource. All three arrays
+// live in one allocation, in this order, each padded to METRICS_STRIDE entries, so
+// that val and val_squared can be added with a single kernel call.
 typedef struct {
-    double val;
-    double val_squared;
-    double val_max;
-} metric_pair_t;
+    double *val;
+    double *val_squared;
+    double *val_max;
+} metrics_t;
+
+// number of doubles in each metrics array (rounded up to a multiple of 4 for AVX)
+#define METRICS_STRIDE ((last_resource_offset + 4) & ~(size_t)3)
 
 typedef struct {
     size_t backend_request_count;
     size_t page_request_count;
     size_t ajax_request_count;
-    metric_pair_t *metrics;
-    json_object *others;
+    metrics_t metrics;
+    counters_t others;
 } increments_t;
 
 typedef struct {
     const char* page;
     const char* module;
+    uint32_t page_ns;
+    uint32_t module_ns;
     double total_time;
     int response_code;
     int severity;
@@ -37,6 +47,10 @@ typedef struct {
 
 extern increments_t* increments_new();
 extern void increments_destroy(void *increments);
+// increments only needed while processing a single message, allocated from the arena.
+// increments_release frees what lives outside of the arena.
+extern increments_t* increments_new_in_arena(arena_t *arena);
+extern void increments_release(increments_t *increments);
 extern increments_t* increments_clone(increments_t* increments);
 extern void increments_add(increments_t *stored_increments, increments_t* increments);
 extern void increments_fill_metrics(increments_t *increments, json_object *request);
@@ -53,7 +67,7 @@ extern void increments_fill_js_exception(increments_t *increments, const char *j
 extern void increments_fill_caller_info(increments_t *increments, json_object *request);
 extern void increments_fill_sender_info(increments_t *increments, json_object *request);
 
-extern void dump_metrics(metric_pair_t *metrics);
+extern void dump_metrics(metrics_t *metrics);
 extern void dump_increments(const char *action, increments_t *increments);
 
 #ifdef __cplusplus
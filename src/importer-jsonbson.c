@@ -0,0 +1,719 @@
+#include "importer-jsonbson.h"
+#include <math.h>
+
+// JSON text is transcoded by a recursive descent parser, which appends values to the
+// BSON document as soon as they have been read, so no intermediate tree gets built.
+// Strings are unescaped into a scratch buffer, which never needs to be larger than the
+// input. Passing a NULL document skips values without appending them.
+
+typedef struct {
+    const char *context;       // used in log messages
+    const char *p;             // current position
+    const char *end;           // end of input
+    char *scratch;             // buffer for unescaped strings
+} json_reader_t;
+
+// keys are sanitized in buffers on the stack, unless they are larger than this.
+// their size is controlled by clients, and writers run on threads with small stacks.
+#define KEY_BUFFER_SIZE 256
+
+static
+bool transcode_value(json_reader_t *r, bson_t *b, const char *key, int key_len);
+
+static
+bool transcode_members(json_reader_t *r, bson_t *b, json_bson_filter_fn *filter, void *arg);
+
+static inline
+void skip_whitespace(json_reader_t *r)
+{
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t'))
+        r->p++;
+}
+
+static inline
+bool consume(json_reader_t *r, char c)
+{
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == c) {
+        r->p++;
+        return true;
+    }
+    return false;
+}
+
+static inline
+bool consume_literal(json_reader_t *r, const char *literal, size_t n)
+{
+    if (r->end - r->p < n || memcmp(r->p, literal, n))
+        return false;
+    r->p += n;
+    return true;
+}
+
+static
+bool read_hex4(json_reader_t *r, uint32_t *code_point)
+{
+    if (r->end - r->p < 4)
+        return false;
+    uint32_t cp = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *r->p++;
+        cp <<= 4;
+        if (c >= '0' && c <= '9')
+            cp |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            cp |= c - 'A' + 10;
+        else
+            return false;
+    }
+    *code_point = cp;
+    return true;
+}
+
+static
+size_t encode_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    } else {
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+}
+
+// returns the unescaped string, which either points into the input or into the scratch buffer
+static
+bool read_string(json_reader_t *r, const char **str, size_t *len)
+{
+    if (!consume(r, '"'))
+        return false;
+
+    // fast path: strings without escape sequences
+    const char *start = r->p;
+    while (r->p < r->end && *r->p != '"' && *r->p != '\\')
+        r->p++;
+    if (r->p >= r->end)
+        return false;
+    if (*r->p == '"') {
+        *str = start;
+        *len = r->p++ - start;
+        return true;
+    }
+
+    char *out = r->scratch;
+    size_t n = r->p - start;
+    memcpy(out, start, n);
+    while (r->p < r->end) {
+        char c = *r->p++;
+        if (c == '"') {
+            *str = out;
+            *len = n;
+            return true;
+        }
+        if (c != '\\') {
+            out[n++] = c;
+            continue;
+        }
+        if (r->p >= r->end)
+            return false;
+        switch (c = *r->p++) {
+        case '"':
+        case '\\':
+        case '/':
+            out[n++] = c;
+            break;
+        case 'b': out[n++] = '\b'; break;
+        case 'f': out[n++] = '\f'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 'r': out[n++] = '\r'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'u': {
+            uint32_t cp;
+            if (!read_hex4(r, &cp))
+                return false;
+            // combine surrogate pairs
+            if (cp >= 0xD800 && cp <= 0xDBFF && r->end - r->p >= 6 && r->p[0] == '\\' && r->p[1] == 'u') {
+                const char *low_start = r->p;
+                uint32_t low;
+                r->p += 2;
+                if (read_hex4(r, &low) && low >= 0xDC00 && low <= 0xDFFF)
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                else
+                    r->p = low_start;
+            }
+            n += encode_utf8(out + n, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+static inline
+char* key_buffer(char *buffer, size_t size)
+{
+    if (size <= KEY_BUFFER_SIZE)
+        return buffer;
+    char *heap_buffer = malloc(size);
+    assert(heap_buffer);
+    return heap_buffer;
+}
+
+static inline
+void key_buffer_release(char *key, char *buffer)
+{
+    if (key != buffer)
+        free(key);
+}
+
+// replaces dots and dollars and converts invalid utf8. returns the sanitized key,
+// which must be released with key_buffer_release.
+static
+char* sanitize_key(const char *key, size_t n, char *buffer, int *len)
+{
+    // dots expand to three bytes
+    char *safe_key = key_buffer(buffer, 3*n+1);
+    *len = copy_replace_dots_and_dollars(safe_key, key);
+    if (!bson_utf8_validate(safe_key, *len, false)) {
+        char *converted = malloc(6 * *len + 1);
+        assert(converted);
+        *len = convert_to_win1252(safe_key, *len, converted);
+        key_buffer_release(safe_key, buffer);
+        safe_key = converted;
+    }
+    return safe_key;
+}
+
+static
+int bson_append_win1252(bson_t *b, const char *key, size_t key_len, const char* val, size_t val_len)
+{
+    char *utf8 = malloc(6*val_len+1);
+    assert(utf8);
+    int new_len = convert_to_win1252(val, val_len, utf8);
+    int rc = bson_append_utf8(b, key, key_len, utf8, new_len);
+    free(utf8);
+    return rc;
+}
+
+static
+void append_string(json_reader_t *r, bson_t *b, const char *key, int key_len, const char *str, size_t n)
+{
+    if (bson_utf8_validate(str, n, false /* disallow embedded null characters */)) {
+        bson_append_utf8(b, key, key_len, str, n);
+    } else {
+        fprintf(stderr,
+                "[W] invalid utf8. context: %s,  key: %s, value[len=%d]: %*s\n",
+                r->context, key, (int)n, (int)n, str);
+        bson_append_win1252(b, key, key_len, str, n);
+    }
+}
+
+static
+bool transcode_number(json_reader_t *r, bson_t *b, const char *key, int key_len)
+{
+    if (consume_literal(r, "NaN", 3)) {
+        if (b)
+            bson_append_double(b, key, key_len, NAN);
+        return true;
+    }
+    if (consume_literal(r, "Infinity", 8)) {
+        if (b)
+            bson_append_double(b, key, key_len, INFINITY);
+        return true;
+    }
+    if (consume_literal(r, "-Infinity", 9)) {
+        if (b)
+            bson_append_double(b, key, key_len, -INFINITY);
+        return true;
+    }
+
+    char number[64];
+    size_t n = 0;
+    bool is_double = false;
+    while (r->p < r->end && n < sizeof(number) - 1) {
+        char c = *r->p;
+        if (c == '.' || c == 'e' || c == 'E')
+            is_double = true;
+        else if (!(c >= '0' && c <= '9') && c != '-' && c != '+')
+            break;
+        number[n++] = c;
+        r->p++;
+    }
+    number[n] = '\0';
+    if (n == 0 || n == sizeof(number) - 1)
+        return false;
+
+    char *number_end;
+    if (is_double) {
+        double d = strtod(number, &number_end);
+        if (b)
+            bson_append_double(b, key, key_len, d);
+    } else {
+        // saturates on overflow, like json-c
+        int64_t i = strtoll(number, &number_end, 10);
+        if (b)
+            bson_append_int64(b, key, key_len, i);
+    }
+    return *number_end == '\0';
+}
+
+static
+bool transcode_elements(json_reader_t *r, bson_t *b)
+{
+    if (consume(r, ']'))
+        return true;
+    uint32_t i = 0;
+    do {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "%u", i++);
+        if (!transcode_value(r, b, key, key_len))
+            return false;
+    } while (consume(r, ','));
+    return consume(r, ']');
+}
+
+static
+bool transcode_value(json_reader_t *r, bson_t *b, const char *key, int key_len)
+{
+    skip_whitespace(r);
+    if (r->p >= r->end)
+        return false;
+
+    switch (*r->p) {
+    case '{': {
+        r->p++;
+        if (b == NULL)
+            return transcode_members(r, NULL, NULL, NULL);
+        bson_t child;
+        bson_append_document_begin(b, key, key_len, &child);
+        bool ok = transcode_members(r, &child, NULL, NULL);
+        bson_append_document_end(b, &child);
+        return ok;
+    }
+    case '[': {
+        r->p++;
+        if (b == NULL)
+            return transcode_elements(r, NULL);
+        bson_t child;
+        bson_append_array_begin(b, key, key_len, &child);
+        bool ok = transcode_elements(r, &child);
+        bson_append_array_end(b, &child);
+        return ok;
+    }
+    case '"': {
+        const char *str;
+        size_t n;
+        if (!read_string(r, &str, &n))
+            return false;
+        if (b)
+            append_string(r, b, key, key_len, str, n);
+        return true;
+    }
+    case 't':
+        if (!consume_literal(r, "true", 4))
+            return false;
+        if (b)
+            bson_append_bool(b, key, key_len, true);
+        return true;
+    case 'f':
+        if (!consume_literal(r, "false", 5))
+            return false;
+        if (b)
+            bson_append_bool(b, key, key_len, false);
+        return true;
+    case 'n':
+        if (!consume_literal(r, "null", 4))
+            return false;
+        if (b)
+            bson_append_null(b, key, key_len);
+        return true;
+    default:
+        return transcode_number(r, b, key, key_len);
+    }
+}
+
+// the opening brace has already been consumed
+static
+bool transcode_members(json_reader_t *r, bson_t *b, json_bson_filter_fn *filter, void *arg)
+{
+    if (consume(r, '}'))
+        return true;
+    do {
+        const char *raw_key;
+        size_t n;
+        if (!read_string(r, &raw_key, &n))
+            return false;
+        // the scratch buffer gets reused for the value
+        char buffer[KEY_BUFFER_SIZE];
+        char *key = key_buffer(buffer, n+1);
+        memcpy(key, raw_key, n);
+        key[n] = '\0';
+        if (!consume(r, ':')) {
+            key_buffer_release(key, buffer);
+            return false;
+        }
+
+        bson_t *target = b;
+        if (filter) {
+            skip_whitespace(r);
+            if (r->p >= r->end) {
+                key_buffer_release(key, buffer);
+                return false;
+            }
+            if (*r->p == '{')
+                target = filter(key, json_type_object, arg) ? b : NULL;
+            else if (*r->p == '[')
+                target = filter(key, json_type_array, arg) ? b : NULL;
+            else
+                target = NULL;
+        }
+
+        bool ok;
+        if (target) {
+            char safe_buffer[KEY_BUFFER_SIZE];
+            int len;
+            char *safe_key = sanitize_key(key, n, safe_buffer, &len);
+            ok = transcode_value(r, target, safe_key, len);
+            key_buffer_release(safe_key, safe_buffer);
+        } else {
+            ok = transcode_value(r, NULL, NULL, 0);
+        }
+        key_buffer_release(key, buffer);
+        if (!ok)
+            return false;
+    } while (consume(r, ','));
+    return consume(r, '}');
+}
+
+bool json_to_bson_transcode(const char *context, const char *json, size_t len, bson_t *b,
+                            json_bson_filter_fn *filter, void *arg)
+{
+    json_reader_t reader = {
+        .context = context,
+        .p = json,
+        .end = json + len,
+        .scratch = zmalloc(len + 1),
+    };
+    bool ok = consume(&reader, '{') && transcode_members(&reader, b, filter, arg);
+    free(reader.scratch);
+    return ok;
+}
+
+//TODO: optimize this!
+static
+void json_key_to_bson_key(const char* context, bson_t *b, json_object *val, const char *key)
+{
+    char buffer[KEY_BUFFER_SIZE];
+    int len;
+    char *safe_key = sanitize_key(key, strlen(key), buffer, &len);
+    // printf("[D] safe_key: %s\n", safe_key);
+
+    enum json_type type = json_object_get_type(val);
+    switch (type) {
+    case json_type_boolean:
+        bson_append_bool(b, safe_key, len, json_object_get_boolean(val));
+        break;
+    case json_type_double:
+        bson_append_double(b, safe_key, len, json_object_get_double(val));
+        break;
+    case json_type_int:
+        bson_append_int64(b, safe_key, len, json_object_get_int64(val));
+        break;
+    case json_type_object: {
+        bson_t *sub = bson_new();
+        json_object_to_bson(context, val, sub);
+        bson_append_document(b, safe_key, len, sub);
+        bson_destroy(sub);
+        break;
+    }
+    case json_type_array: {
+        bson_t *sub = bson_new();
+        int array_len = json_object_array_length(val);
+        for (int pos = 0; pos < array_len; pos++) {
+            char nk[100];
+            sprintf(nk, "%d", pos);
+            json_key_to_bson_key(context, sub, json_object_array_get_idx(val, pos), nk);
+        }
+        bson_append_array(b, safe_key, len, sub);
+        bson_destroy(sub);
+        break;
+    }
+    case json_type_string: {
+        const char *str = json_object_get_string(val);
+        size_t n = json_object_get_string_len(val);
+        if (bson_utf8_validate(str, n, false /* disallow embedded null characters */)) {
+            bson_append_utf8(b, safe_key, len, str, n);
+        } else {
+            fprintf(stderr,
+                    "[W] invalid utf8. context: %s,  key: %s, value[len=%d]: %*s\n",
+                    context, safe_key, (int)n, (int)n, str);
+            // bson_append_binary(b, safe_key, len, BSON_SUBTYPE_BINARY, (uint8_t*)str, n);
+            bson_append_win1252(b, safe_key, len, str, n);
+        }
+        break;
+    }
+    case json_type_null:
+        bson_append_null(b, safe_key, len);
+        break;
+    default:
+        fprintf(stderr, "[E] unexpected json type: %s\n", json_type_to_name(type));
+        break;
+    }
+    key_buffer_release(safe_key, buffer);
+}
+
+void json_object_to_bson(const char *context, json_object *j, bson_t* b)
+{
+  json_object_object_foreach(j, key, val) {
+      json_key_to_bson_key(context, b, val, key);
+  }
+}
+
+// Top level containers are transcoded directly from the raw message, as long as the
+// request still holds the object built from the raw message for them. Members added,
+// replaced or removed by the processor or the writer are taken from the tree.
+typedef struct {
+    json_object *request;
+    json_object *raw_members;
+    zhash_t *occurrences;      // number of transcodable occurrences of each key
+    zlist_t *transcoded;       // keys of the transcoded containers, in order
+    bool duplicates;
+} transcode_filter_t;
+
+static
+bool transcode_unmodified_container(const char *key, enum json_type type, void *arg)
+{
+    transcode_filter_t *filter = arg;
+    json_object *value, *raw_value;
+    if (!json_object_object_get_ex(filter->request, key, &value) || json_object_get_type(value) != type)
+        return false;
+    if (!json_object_object_get_ex(filter->raw_members, key, &raw_value) || raw_value != value)
+        return false;
+    // json-c keeps the last of duplicate keys, which can't be told apart from the
+    // others here, so the tree provides the value of duplicates
+    size_t occurrences = (size_t) zhash_lookup(filter->occurrences, key);
+    zhash_update(filter->occurrences, key, (void*)(occurrences + 1));
+    if (occurrences) {
+        filter->duplicates = true;
+        return false;
+    }
+    zlist_append(filter->transcoded, (void*)key);
+    return true;
+}
+
+static inline
+bool transcoded_once(transcode_filter_t *filter, const char *key)
+{
+    return (size_t) zhash_lookup(filter->occurrences, key) == 1;
+}
+
+static
+void json_object_to_bson_except_transcoded(const char *context, json_object *j, bson_t* b, transcode_filter_t *filter)
+{
+  json_object_object_foreach(j, key, val) {
+      if (!transcoded_once(filter, key))
+          json_key_to_bson_key(context, b, val, key);
+  }
+}
+
+// appends the transcoded containers, leaving out the first occurrence of duplicate keys
+static
+void append_transcoded_containers(bson_t *document, bson_t *containers, transcode_filter_t *filter)
+{
+    if (!filter->duplicates) {
+        bson_concat(document, containers);
+        return;
+    }
+    bson_iter_t iter;
+    bson_iter_init(&iter, containers);
+    const char *key = zlist_first(filter->transcoded);
+    while (bson_iter_next(&iter)) {
+        if (transcoded_once(filter, key))
+            bson_append_iter(document, NULL, 0, &iter);
+        key = zlist_next(filter->transcoded);
+    }
+}
+
+void request_to_bson(const char *context, json_object *request, const char *raw, size_t raw_len,
+                     json_object *raw_members, bson_t *document)
+{
+    if (raw_len > 0 && raw_members) {
+        bson_t *containers = bson_sized_new(raw_len);
+        transcode_filter_t filter = {
+            .request = request,
+            .raw_members = raw_members,
+            .occurrences = zhash_new(),
+            .transcoded = zlist_new(),
+        };
+        zlist_autofree(filter.transcoded);
+        bool ok = json_to_bson_transcode(context, raw, raw_len, containers, transcode_unmodified_container, &filter);
+        if (ok) {
+            json_object_to_bson_except_transcoded(context, request, document, &filter);
+            append_transcoded_containers(document, containers, &filter);
+        } else
+            fprintf(stderr, "[W] could not transcode raw request: %s\n", context);
+        bson_destroy(containers);
+        zhash_destroy(&filter.occurrences);
+        zlist_destroy(&filter.transcoded);
+        if (ok)
+            return;
+    }
+    json_object_to_bson(context, request, document);
+}
+
+static
+void assert_same_members(bson_t *document, bson_t *expected)
+{
+    assert(bson_count_keys(document) == bson_count_keys(expected));
+    bson_iter_t expected_iter;
+    assert(bson_iter_init(&expected_iter, expected));
+    while (bson_iter_next(&expected_iter)) {
+        bson_iter_t iter;
+        assert(bson_iter_init_find(&iter, document, bson_iter_key(&expected_iter)));
+        bson_t *member = bson_new();
+        bson_t *expected_member = bson_new();
+        bson_append_iter(member, NULL, 0, &iter);
+        bson_append_iter(expected_member, NULL, 0, &expected_iter);
+        assert(bson_equal(member, expected_member));
+        bson_destroy(member);
+        bson_destroy(expected_member);
+    }
+}
+
+static
+void assert_utf8_member(bson_t *document, const char *path, const char *value)
+{
+    bson_iter_t iter, member;
+    assert(bson_iter_init(&iter, document) && bson_iter_find_descendant(&iter, path, &member));
+    assert(streq(bson_iter_utf8(&member, NULL), value));
+}
+
+static
+void test_request_to_bson_matches_tree(int verbose)
+{
+    const char *raw = "{\"action\":\"Foo#bar\",\"exceptions\":[\"Foo::Bar.baz\"],"
+        "\"soft_exceptions\":[\"$Soft.error\"],\"request_info\":{\"method\":\"get\"},"
+        "\"lines\":[[1,\"hello\"]],\"params\":{\"a\":1},\"session\":[1],\"params\":{\"b\":\"c\"},"
+        "\"session\":{\"d\":\"e\"},\"metrics\":[],\"removed\":{\"f\":1}}";
+
+    // the request built by parser_complete_request: members the processor reads come from
+    // a separately extracted request, everything else from the raw message
+    json_object *request = json_tokener_parse(raw);
+    assert(request);
+    json_object *raw_members = json_object_new_object();
+    json_object_object_foreach(request, key, value) {
+        json_object_object_add(raw_members, key, json_object_get(value));
+    }
+    json_object *processed = json_tokener_parse(raw);
+    assert(processed);
+
+    // what the processor does to exception names and http methods
+    const char *sanitized[] = { "exceptions", "soft_exceptions" };
+    for (int i = 0; i < 2; i++) {
+        json_object *exceptions;
+        assert(json_object_object_get_ex(processed, sanitized[i], &exceptions));
+        char *name = strdup(json_object_get_string(json_object_array_get_idx(exceptions, 0)));
+        replace_dots_and_dollars(name);
+        json_object_array_put_idx(exceptions, 0, json_object_new_string(name));
+        free(name);
+    }
+    json_object *request_info, *method;
+    assert(json_object_object_get_ex(processed, "request_info", &request_info));
+    assert(json_object_object_get_ex(request_info, "method", &method));
+    char *p = (char*) json_object_get_string(method);
+    for (; *p; p++)
+        *p = toupper(*p);
+
+    const char *overlaid[] = { "action", "exceptions", "soft_exceptions", "request_info" };
+    for (int i = 0; i < 4; i++) {
+        json_object *value;
+        assert(json_object_object_get_ex(processed, overlaid[i], &value));
+        json_object_object_add(request, overlaid[i], json_object_get(value));
+    }
+    // what the writer does
+    json_object_object_add(request, "metrics", json_object_new_array());
+    json_object_object_del(request, "removed");
+
+    bson_t *expected = bson_new();
+    json_object_to_bson("test", request, expected);
+    bson_t *document = bson_new();
+    request_to_bson("test", request, raw, strlen(raw), raw_members, document);
+    if (verbose) {
+        char *json = bson_as_json(document, NULL);
+        printf("   %s\n", json);
+        bson_free(json);
+    }
+
+    assert_same_members(document, expected);
+    assert_utf8_member(document, "exceptions.0", "Foo::Bar_baz");
+    assert_utf8_member(document, "request_info.method", "GET");
+    // json-c keeps the last of duplicate keys
+    assert_utf8_member(document, "params.b", "c");
+    assert_utf8_member(document, "session.d", "e");
+
+    bson_destroy(document);
+    bson_destroy(expected);
+    json_object_put(raw_members);
+    json_object_put(processed);
+    json_object_put(request);
+}
+
+static
+void test_transcode_long_keys(int verbose)
+{
+    // keys which don't fit into the stack buffers, with and without invalid utf8
+    size_t n = 4 * KEY_BUFFER_SIZE;
+    char *raw = zmalloc(4 * n + 64);
+    char *p = raw + sprintf(raw, "{\"params\":{\"");
+    for (size_t i = 0; i < n; i++)
+        *p++ = i % 2 ? '.' : '$';
+    p += sprintf(p, "\":1,\"");
+    for (size_t i = 0; i < n; i++)
+        *p++ = i % 2 ? '.' : (char)0xE4;
+    p += sprintf(p, "\":2}}");
+    size_t len = p - raw;
+
+    json_tokener *tokener = json_tokener_new();
+    json_object *request = json_tokener_parse_ex(tokener, raw, len);
+    assert(request);
+    json_tokener_free(tokener);
+    bson_t *expected = bson_new();
+    json_object_to_bson("test", request, expected);
+    bson_t *document = bson_new();
+    assert(json_to_bson_transcode("test", raw, len, document, NULL, NULL));
+    assert(bson_equal(document, expected));
+    if (verbose)
+        printf("   transcoded keys of %zu bytes\n", n);
+
+    bson_destroy(document);
+    bson_destroy(expected);
+    json_object_put(request);
+    free(raw);
+}
+
+void importer_jsonbson_test(int verbose)
+{
+    printf(" * importer-jsonbson: ");
+    if (verbose)
+        printf("\n");
+    test_request_to_bson_matches_tree(verbose);
+    test_transcode_long_keys(verbose);
+    printf("OK\n");
+}
@@ -0,0 +1,38 @@
+#ifndef __LOGJAM_IMPORTER_JSONBSON_H_INCLUDED__
+#define __LOGJAM_IMPORTER_JSONBSON_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// decides whether a top level member with a value of the given type (json_type_object
+// or json_type_array) gets transcoded. key is unescaped and NUL terminated.
+typedef bool (json_bson_filter_fn) (const char *key, enum json_type type, void *arg);
+
+// Transcodes the members of the JSON object in json[0..len) directly into b, applying
+// the same key sanitization and utf8 handling as the json-c based conversion. Only
+// top level object and array members accepted by filter are transcoded. Returns false
+// if json could not be parsed, in which case b contains partial results.
+extern bool json_to_bson_transcode(const char *context, const char *json, size_t len, bson_t *b,
+                                   json_bson_filter_fn *filter, void *arg);
+
+// converts a json-c object, sanitizing keys and fixing invalid utf8
+extern void json_object_to_bson(const char *context, json_object *j, bson_t *b);
+
+// Converts a request to BSON. Top level containers (lines, params, ...) are transcoded
+// directly from the raw message if the request still holds the object raw_members
+// lists for them, i.e. the one which was built from the raw message. All other
+// members are taken from the json-c tree. Falls back to the tree if raw_members is
+// NULL or the raw message can't be transcoded.
+extern void request_to_bson(const char *context, json_object *request, const char *raw, size_t raw_len,
+                            json_object *raw_members, bson_t *document);
+
+extern void importer_jsonbson_test(int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,6 +6,10 @@ const char *databases[MAX_DATABASES];
 mongoc_write_concern_t *wc_no_wait = NULL;
 mongoc_write_concern_t *wc_wait = NULL;
 
+size_t update_batch_size = DEFAULT_UPDATE_BATCH_SIZE;
+size_t insert_batch_size = DEFAULT_INSERT_BATCH_SIZE;
+size_t insert_batch_bytes = DEFAULT_INSERT_BATCH_BYTES;
+
 static
 void my_mongo_log_handler(mongoc_log_level_t log_level, const char *log_domain, const char *message, void *user_data)
 {
@@ -54,6 +58,23 @@ void initialize_mongo_db_globals(zconfig_t* config)
     else
         mongoc_write_concern_set_w(wc_no_wait, MONGOC_WRITE_CONCERN_W_DEFAULT);
 
+    char *batch_size = zconfig_resolve(config, "backend/update_batch_size", NULL);
+    if (batch_size) {
+        update_batch_size = strtoul(batch_size, NULL, 0);
+        if (update_batch_size == 0)
+            update_batch_size = 1;
+    }
+
+    char *insert_size = zconfig_resolve(config, "backend/insert_batch_size", NULL);
+    if (insert_size) {
+        insert_batch_size = strtoul(insert_size, NULL, 0);
+        if (insert_batch_size == 0)
+            insert_batch_size = 1;
+    }
+    char *insert_bytes = zconfig_resolve(config, "backend/insert_batch_bytes", NULL);
+    if (insert_bytes)
+        insert_batch_bytes = strtoul(insert_bytes, NULL, 0);
+
     zconfig_t* dbs = zconfig_locate(config, "backend/databases");
     if (dbs) {
         zconfig_t *db = zconfig_child(dbs);
@@ -135,3 +156,33 @@ int mongo_client_ping(mongoc_client_t *client)
 #endif
     return available;
 }
+
+size_t mongo_each_write_error(const bson_t *reply, mongo_write_error_fn *fn, void *arg)
+{
+    size_t count = 0;
+    bson_iter_t iter, errors;
+    if (!bson_iter_init_find(&iter, reply, "writeErrors") || !BSON_ITER_HOLDS_ARRAY(&iter) || !bson_iter_recurse(&iter, &errors))
+        return 0;
+
+    while (bson_iter_next(&errors)) {
+        bson_iter_t error;
+        int32_t index = -1, code = 0;
+        const char *message = "";
+        if (!BSON_ITER_HOLDS_DOCUMENT(&errors) || !bson_iter_recurse(&errors, &error))
+            continue;
+        while (bson_iter_next(&error)) {
+            const char *key = bson_iter_key(&error);
+            if (streq(key, "index") && BSON_ITER_HOLDS_INT32(&error))
+                index = bson_iter_int32(&error);
+            else if (streq(key, "code") && BSON_ITER_HOLDS_INT32(&error))
+                code = bson_iter_int32(&error);
+            else if (streq(key, "errmsg") && BSON_ITER_HOLDS_UTF8(&error))
+                message = bson_iter_utf8(&error, NULL);
+        }
+        if (index < 0)
+            continue;
+        fn(index, code, message, arg);
+        count++;
+    }
+    return count;
+}
@@ -13,10 +13,24 @@ extern const char *databases[MAX_DATABASES];
 extern mongoc_write_concern_t *wc_no_wait;
 extern mongoc_write_concern_t *wc_wait;
 
+// maximum number of updates sent to the database in one bulk operation
+#define DEFAULT_UPDATE_BATCH_SIZE 1000
+extern size_t update_batch_size;
+
+// maximum number of documents and bytes sent to the database in one bulk insert
+#define DEFAULT_INSERT_BATCH_SIZE 100
+#define DEFAULT_INSERT_BATCH_BYTES (4 * 1024 * 1024)
+extern size_t insert_batch_size;
+extern size_t insert_batch_bytes;
+
 extern void initialize_mongo_db_globals(zconfig_t* config);
 extern void ensure_known_database(mongoc_client_t *client, const char* db_name);
 extern int mongo_client_ping(mongoc_client_t *client);
 
+// calls fn for each element of the writeErrors array of a bulk operation reply
+typedef void (mongo_write_error_fn) (uint32_t index, int code, const char *message, void *arg);
+extern size_t mongo_each_write_error(const bson_t *reply, mongo_write_error_fn *fn, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
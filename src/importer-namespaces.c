@@ -0,0 +1,189 @@
+#include "importer-namespaces.h"
+
+#define INITIAL_NAMESPACES_CAPACITY 16
+
+namespaces_t* namespaces_new()
+{
+    namespaces_t *namespaces = zmalloc(sizeof(namespaces_t));
+    assert(namespaces);
+    namespaces->refcount = 1;
+    uint32_t all_pages = namespaces_intern(namespaces, "all_pages");
+    assert(all_pages == ALL_PAGES_NAMESPACE);
+    return namespaces;
+}
+
+namespaces_t* namespaces_ref(namespaces_t *namespaces)
+{
+    __sync_add_and_fetch(&namespaces->refcount, 1);
+    return namespaces;
+}
+
+void namespaces_destroy(namespaces_t **namespaces_p)
+{
+    namespaces_t *namespaces = *namespaces_p;
+    if (namespaces == NULL)
+        return;
+    *namespaces_p = NULL;
+    if (__sync_sub_and_fetch(&namespaces->refcount, 1) > 0)
+        return;
+    for (uint32_t i = 0; i < namespaces->count; i++)
+        free(namespaces->names[i]);
+    free(namespaces->names);
+    free(namespaces->hashes);
+    free(namespaces->flags);
+    free(namespaces->index);
+    free(namespaces);
+}
+
+static
+void namespaces_rehash(namespaces_t *namespaces)
+{
+    uint32_t capacity = namespaces->index_capacity ? 2 * namespaces->index_capacity : 2 * INITIAL_NAMESPACES_CAPACITY;
+    uint32_t *index = zmalloc(capacity * sizeof(uint32_t));
+    assert(index);
+    uint32_t mask = capacity - 1;
+    for (uint32_t id = 0; id < namespaces->count; id++) {
+        uint32_t i = namespaces->hashes[id] & mask;
+        while (index[i])
+            i = (i + 1) & mask;
+        index[i] = id + 1;
+    }
+    free(namespaces->index);
+    namespaces->index = index;
+    namespaces->index_capacity = capacity;
+}
+
+static
+uint32_t* namespaces_find_slot(namespaces_t *namespaces, const char *name, size_t len, uint32_t hash)
+{
+    uint32_t mask = namespaces->index_capacity - 1;
+    uint32_t i = hash & mask;
+    uint32_t *slot;
+    while (*(slot = &namespaces->index[i])) {
+        uint32_t id = *slot - 1;
+        if (namespaces->hashes[id] == hash && !strcmp(namespaces->names[id], name))
+            break;
+        i = (i + 1) & mask;
+    }
+    return slot;
+}
+
+uint32_t namespaces_lookup(namespaces_t *namespaces, const char *name)
+{
+    if (namespaces->count == 0)
+        return NO_NAMESPACE;
+    size_t len;
+    uint32_t hash = namespace_hash(name, &len);
+    uint32_t *slot = namespaces_find_slot(namespaces, name, len, hash);
+    return *slot ? *slot - 1 : NO_NAMESPACE;
+}
+
+uint32_t namespaces_intern(namespaces_t *namespaces, const char *name)
+{
+    // keep the load factor of the index at or below 1/2
+    if (2 * (namespaces->count + 1) > namespaces->index_capacity)
+        namespaces_rehash(namespaces);
+
+    size_t len;
+    uint32_t hash = namespace_hash(name, &len);
+    uint32_t *slot = namespaces_find_slot(namespaces, name, len, hash);
+    if (*slot)
+        return *slot - 1;
+
+    if (namespaces->count == namespaces->names_capacity) {
+        uint32_t capacity = namespaces->names_capacity ? 2 * namespaces->names_capacity : INITIAL_NAMESPACES_CAPACITY;
+        namespaces->names = realloc(namespaces->names, capacity * sizeof(char*));
+        namespaces->hashes = realloc(namespaces->hashes, capacity * sizeof(uint32_t));
+        namespaces->flags = realloc(namespaces->flags, capacity * sizeof(uint8_t));
+        assert(namespaces->names && namespaces->hashes && namespaces->flags);
+        namespaces->names_capacity = capacity;
+    }
+    uint32_t id = namespaces->count++;
+    char *copy = malloc(len + 1);
+    assert(copy);
+    memcpy(copy, name, len + 1);
+    namespaces->names[id] = copy;
+    namespaces->hashes[id] = hash;
+    namespaces->flags[id] = 0;
+    *slot = id + 1;
+    return id;
+}
+
+// Interns all names of source into target, including their flags. Returns
+// an array mapping source ids to target ids, which must be freed by the caller.
+uint32_t* namespaces_merge(namespaces_t *target, namespaces_t *source)
+{
+    uint32_t *map = malloc((source->count + 1) * sizeof(uint32_t));
+    assert(map);
+    for (uint32_t id = 0; id < source->count; id++) {
+        uint32_t target_id = namespaces_intern(target, source->names[id]);
+        target->flags[target_id] |= source->flags[id];
+        map[id] = target_id;
+    }
+    return map;
+}
+
+void importer_namespaces_test(int verbose)
+{
+    printf(" * importer-namespaces: ");
+    if (verbose)
+        printf("\n");
+
+    namespaces_t *namespaces = namespaces_new();
+    assert(namespaces->count == 1);
+    assert(namespaces_lookup(namespaces, "all_pages") == ALL_PAGES_NAMESPACE);
+    assert(streq(namespaces_name(namespaces, ALL_PAGES_NAMESPACE), "all_pages"));
+
+    // enough names to grow the names arrays and the index several times
+    const uint32_t n = 1000;
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < n; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "Controller%u#action", i);
+            assert(namespaces_intern(namespaces, name) == i + 1);
+        }
+    }
+    assert(namespaces->count == n + 1);
+    assert(namespaces->index_capacity >= 2 * namespaces->count);
+    for (uint32_t i = 0; i < n; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "Controller%u#action", i);
+        assert(namespaces_lookup(namespaces, name) == i + 1);
+        assert(streq(namespaces_name(namespaces, i + 1), name));
+    }
+    const char *misses[] = { "", "Controller", "Controller1000#action", "controller1#action", "Controller1#action ", NULL };
+    for (const char **m = misses; *m; m++)
+        assert(namespaces_lookup(namespaces, *m) == NO_NAMESPACE);
+
+    uint32_t module = namespaces_intern(namespaces, "::Controller");
+    namespaces_set_flags(namespaces, module, NAMESPACE_MODULE);
+    assert(namespaces_has_flags(namespaces, module, NAMESPACE_MODULE));
+    assert(!namespaces_has_flags(namespaces, 1, NAMESPACE_MODULE));
+
+    // merging interns the names of the source into the target, with their flags
+    namespaces_t *other = namespaces_new();
+    uint32_t shared = namespaces_intern(other, "Controller7#action");
+    uint32_t added = namespaces_intern(other, "Other#action");
+    uint32_t other_module = namespaces_intern(other, "::Other");
+    namespaces_set_flags(other, other_module, NAMESPACE_MODULE);
+    uint32_t *map = namespaces_merge(namespaces, other);
+    assert(map[ALL_PAGES_NAMESPACE] == ALL_PAGES_NAMESPACE);
+    assert(map[shared] == 8);
+    assert(map[added] == n + 2);
+    assert(map[other_module] == n + 3);
+    assert(namespaces_has_flags(namespaces, map[other_module], NAMESPACE_MODULE));
+    assert(!namespaces_has_flags(namespaces, map[added], NAMESPACE_MODULE));
+    free(map);
+
+    // references keep the interner alive
+    namespaces_t *ref = namespaces_ref(namespaces);
+    namespaces_destroy(&namespaces);
+    assert(namespaces == NULL);
+    assert(streq(namespaces_name(ref, n + 2), "Other#action"));
+    if (verbose)
+        printf("   %u names, index capacity %u\n", ref->count, ref->index_capacity);
+    namespaces_destroy(&ref);
+    namespaces_destroy(&other);
+
+    printf("OK\n");
+}
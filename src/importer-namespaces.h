@@ -0,0 +1,77 @@
+#ifndef __LOGJAM_IMPORTER_NAMESPACES_H_INCLUDED__
+#define __LOGJAM_IMPORTER_NAMESPACES_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// String interner handing out small, dense integer ids for page and
+// module names. Ids are only meaningful relative to the interner which
+// created them. Each processor owns one interner, which is shared by all
+// of its tables and reference counted, as the tables are handed off to
+// different updater threads.
+
+#define NAMESPACE_MODULE 1
+
+typedef struct {
+    int refcount;
+    char **names;
+    uint32_t *hashes;
+    uint8_t *flags;
+    uint32_t count;
+    uint32_t names_capacity;
+    uint32_t *index;           // ids plus one, zero means empty
+    uint32_t index_capacity;   // zero or a power of two
+} namespaces_t;
+
+#define NO_NAMESPACE UINT32_MAX
+
+// interned by namespaces_new, so it always has the same id
+#define ALL_PAGES_NAMESPACE 0
+
+extern namespaces_t* namespaces_new();
+extern void namespaces_destroy(namespaces_t **namespaces);
+extern namespaces_t* namespaces_ref(namespaces_t *namespaces);
+extern uint32_t namespaces_intern(namespaces_t *namespaces, const char *name);
+extern uint32_t namespaces_lookup(namespaces_t *namespaces, const char *name);
+extern uint32_t* namespaces_merge(namespaces_t *target, namespaces_t *source);
+extern void importer_namespaces_test(int verbose);
+
+static inline const char* namespaces_name(namespaces_t *namespaces, uint32_t id)
+{
+    assert(id < namespaces->count);
+    return namespaces->names[id];
+}
+
+static inline uint32_t namespace_hash(const char *s, size_t *len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    const char *p = s;
+    while (*p) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619U;
+    }
+    *len = p - s;
+    return h;
+}
+
+static inline void namespaces_set_flags(namespaces_t *namespaces, uint32_t id, uint8_t flags)
+{
+    assert(id < namespaces->count);
+    namespaces->flags[id] |= flags;
+}
+
+static inline bool namespaces_has_flags(namespaces_t *namespaces, uint32_t id, uint8_t flags)
+{
+    assert(id < namespaces->count);
+    return (namespaces->flags[id] & flags) == flags;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
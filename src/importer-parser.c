@@ -3,6 +3,7 @@
 #include "importer-processor.h"
 #include "importer-parser.h"
 #include "prometheus-client.h"
+#include "importer-resources.h"
 
 /*
  * connections: n_w = num_writers, n_p = num_parsers, "[<>^v]" = connect, "o" = bind
@@ -39,7 +40,7 @@ void connect_multiple(zsock_t* socket, const char* name, int which)
 }
 
 static
-zsock_t* parser_pull_socket_new()
+zsock_t* parser_pull_socket_new(size_t id)
 {
     int rc;
     zsock_t *socket = zsock_new(ZMQ_PULL);
@@ -48,7 +49,10 @@ zsock_t* parser_pull_socket_new()
     // TODO: this is a hack. better let controller coordinate this
     for (int j = 0; j < num_subscribers; j++) {
         for (int i=0; i<10; i++) {
-            rc = zsock_connect(socket, "inproc://subscriber-%d", j);
+            if (route_by_stream)
+                rc = zsock_connect(socket, "inproc://subscriber-%d-parser-%zu", j, id);
+            else
+                rc = zsock_connect(socket, "inproc://subscriber-%d", j);
             if (rc == 0) break;
             zclock_sleep(100);
         }
@@ -125,8 +129,119 @@ time_t valid_database_date(const char *date)
         return res;
 }
 
+static inline
+bool read_digits(const char *s, int n, int *value)
+{
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        v = 10 * v + (s[i] - '0');
+    }
+    *value = v;
+    return true;
+}
+
+// parses the fixed format "yyyy-mm-dd[T ]HH:MM:SS" prefix of a started_at date.
+// returns the number of seconds since midnight, or -1 if the format doesn't match.
+static
+int parse_started_at_time_of_day(const char *date)
+{
+    int year, month, day, hour, minute, second;
+    if (!read_digits(date, 4, &year) || date[4] != '-'
+        || !read_digits(date+5, 2, &month) || date[7] != '-'
+        || !read_digits(date+8, 2, &day) || (date[10] != 'T' && date[10] != ' ')
+        || !read_digits(date+11, 2, &hour) || date[13] != ':'
+        || !read_digits(date+14, 2, &minute) || date[16] != ':'
+        || !read_digits(date+17, 2, &second))
+        return -1;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return -1;
+    return 3600 * hour + 60 * minute + second;
+}
+
+static
+processor_cache_entry_t* processor_cache_slot(parser_state_t *state, const char *stream, size_t stream_len, const char *date)
+{
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < stream_len; i++) {
+        h ^= (unsigned char)stream[i];
+        h *= 16777619U;
+    }
+    for (size_t i = 0; i < 10; i++) {
+        h ^= (unsigned char)date[i];
+        h *= 16777619U;
+    }
+    return &state->processor_cache[h % PROCESSOR_CACHE_SIZE];
+}
+
+static
+void processor_cache_clear(parser_state_t *state)
+{
+    for (size_t i = 0; i < PROCESSOR_CACHE_SIZE; i++)
+        state->processor_cache[i].processor = NULL;
+}
+
+static
+void processor_cache_destroy(parser_state_t *state)
+{
+    for (size_t i = 0; i < PROCESSOR_CACHE_SIZE; i++)
+        free(state->processor_cache[i].stream);
+    memset(state->processor_cache, 0, sizeof(state->processor_cache));
+}
+
+static
+processor_state_t* processor_create_uncached(zframe_t* stream_frame, parser_state_t* parser_state, json_object *request, time_t *started_at);
+
+// Cache hits only need to check the time of day part of started_at for clock drift.
+// Everything else, including all error reporting, is left to processor_create_uncached.
 static
 processor_state_t* processor_create(zframe_t* stream_frame, parser_state_t* parser_state, json_object *request)
+{
+    const char *stream = (char*)zframe_data(stream_frame);
+    size_t stream_len = zframe_size(stream_frame);
+
+    json_object* started_at_value;
+    const char *date_str = NULL;
+    int time_of_day = -1;
+    if (json_object_object_get_ex(request, "started_at", &started_at_value)
+        && (date_str = json_object_get_string(started_at_value))
+        && strlen(date_str) >= 19)
+        time_of_day = parse_started_at_time_of_day(date_str);
+    time_t started_at;
+    if (time_of_day < 0)
+        return processor_create_uncached(stream_frame, parser_state, request, &started_at);
+
+    processor_cache_entry_t *entry = processor_cache_slot(parser_state, stream, stream_len, date_str);
+    if (entry->processor
+        && entry->stream_len == stream_len
+        && !memcmp(entry->date, date_str, 10)
+        && !memcmp(entry->stream, stream, stream_len)) {
+        started_at = entry->midnight + time_of_day;
+        if (abs((int) difftime(started_at, time_last_tick)) <= INVALID_MSG_AGE_THRESHOLD)
+            return entry->processor;
+        return processor_create_uncached(stream_frame, parser_state, request, &started_at);
+    }
+
+    processor_state_t *p = processor_create_uncached(stream_frame, parser_state, request, &started_at);
+    if (p) {
+        if (entry->stream_len < stream_len || entry->stream == NULL) {
+            free(entry->stream);
+            entry->stream = malloc(stream_len);
+            assert(entry->stream);
+        }
+        memcpy(entry->stream, stream, stream_len);
+        entry->stream_len = stream_len;
+        memcpy(entry->date, date_str, 10);
+        entry->midnight = started_at - time_of_day;
+        entry->processor = p;
+    }
+    return p;
+}
+
+static
+processor_state_t* processor_create_uncached(zframe_t* stream_frame, parser_state_t* parser_state, json_object *request, time_t *started_at)
 {
     size_t n = zframe_size(stream_frame);
     char db_name[n+100];
@@ -151,7 +266,7 @@ processor_state_t* processor_create(zframe_t* stream_frame, parser_state_t* pars
         return NULL;
     }
     const char *date_str = json_object_get_string(started_at_value);
-    if (INVALID_DATE == valid_database_date(date_str)) {
+    if (INVALID_DATE == (*started_at = valid_database_date(date_str))) {
         db_name[n+7] = '\0';
         json_object* action_object;
         const char* action = NULL;
@@ -184,6 +299,119 @@ processor_state_t* processor_create(zframe_t* stream_frame, parser_state_t* pars
     return p;
 }
 
+// Top level members of backend requests read by processor_add_request, besides
+// the resources. Everything else is only needed when the request gets stored.
+static const char *request_schema_keys[] = {
+    "action", "logjam_action", "page", "code", "severity", "started_at",
+    "exceptions", "soft_exceptions", "heap_growth",
+    "allocated_memory", "allocated_objects", "allocated_bytes",
+    "caller_id", "caller_action", "sender_id", "sender_action",
+    "request_id", "request_info", "user_agent", "host", "cluster", "datacenter",
+    NULL
+};
+
+typedef struct {
+    json_view_t *view;
+    json_object *request;
+    bool with_lines;
+} schema_extraction_t;
+
+static
+bool request_schema_member(const char *key, bool with_lines)
+{
+    if (resource_index(key) >= 0)
+        return true;
+    // lines are only scanned when the request comes without a severity
+    if (with_lines && !strcmp(key, "lines"))
+        return true;
+    for (const char **k = request_schema_keys; *k; k++)
+        if (!strcmp(key, *k))
+            return true;
+    return false;
+}
+
+static
+bool extract_schema_member(const char *key, size_t key_len, json_view_value_t value, void *arg)
+{
+    schema_extraction_t *extraction = arg;
+    if (request_schema_member(key, extraction->with_lines))
+        json_object_object_add(extraction->request, key, json_view_to_json_object(extraction->view, value));
+    return true;
+}
+
+static
+json_object* parser_extract_request_schema(parser_state_t *state)
+{
+    json_view_value_t root = json_view_root(state->view);
+    json_view_value_t severity;
+    schema_extraction_t extraction = {
+        .view = state->view,
+        .request = json_object_new_object(),
+        .with_lines = !json_view_object_get(state->view, root, "severity", &severity),
+    };
+    json_view_object_foreach(state->view, root, extract_schema_member, &extraction);
+    return extraction.request;
+}
+
+static
+json_object* parser_parse_json(parser_state_t *state, const char *body, size_t body_len, bool backend_request)
+{
+    state->partial_request = false;
+    if (use_json_view && json_view_parse(state->view, body, body_len)) {
+        if (backend_request) {
+            state->partial_request = true;
+            return parser_extract_request_schema(state);
+        }
+        return json_view_to_json_object(state->view, json_view_root(state->view));
+    }
+    // the json-c tokener reports errors and handles documents the view rejects
+    return parse_json_data(body, body_len, state->tokener);
+}
+
+typedef struct {
+    json_object *partial;
+    json_object *full;
+    bool with_lines;
+} schema_overlay_t;
+
+static
+bool remove_deleted_member(const char *key, size_t key_len, json_view_value_t value, void *arg)
+{
+    schema_overlay_t *overlay = arg;
+    json_object *ignored;
+    if (request_schema_member(key, overlay->with_lines) && !json_object_object_get_ex(overlay->partial, key, &ignored))
+        json_object_object_del(overlay->full, key);
+    return true;
+}
+
+json_object* parser_complete_request(parser_state_t *state, json_object *request, json_object **raw_members)
+{
+    *raw_members = NULL;
+    if (!state->partial_request)
+        return json_object_get(request);
+
+    // the view still indexes the body of the request being processed
+    json_view_value_t root = json_view_root(state->view);
+    json_view_value_t severity;
+    schema_overlay_t overlay = {
+        .partial = request,
+        .full = json_view_to_json_object(state->view, root),
+        .with_lines = !json_view_object_get(state->view, root, "severity", &severity),
+    };
+    // members removed by the processor
+    json_view_object_foreach(state->view, root, remove_deleted_member, &overlay);
+    // the writer transcodes members from the raw body as long as they are still these
+    *raw_members = json_object_new_object();
+    json_object_object_foreach(overlay.full, raw_key, raw_value) {
+        json_object_object_add(*raw_members, raw_key, json_object_get(raw_value));
+    }
+    // members added or replaced by the processor
+    json_object_object_foreach(request, key, value) {
+        json_object_object_add(overlay.full, key, json_object_get(value));
+    }
+    return overlay.full;
+}
+
 static
 void parse_msg_and_forward_interesting_requests(zmsg_t *msg, parser_state_t *parser_state)
 {
@@ -207,7 +435,8 @@ void parse_msg_and_forward_interesting_requests(zmsg_t *msg, parser_state_t *par
     char *body;
     size_t body_len;
     if (meta.compression_method) {
-        int rc = decompress_frame(body_frame, meta.compression_method, parser_state->decompression_buffer, &body, &body_len);
+        int rc = decompressor_run(parser_state->decompressor, body_frame, meta.compression_method,
+                                  (char*) zframe_data(stream_frame), zframe_size(stream_frame), &body, &body_len);
         if (!rc) {
             char *app_env = (char*) zframe_data(stream_frame);
             int n = zframe_size(stream_frame);
@@ -222,11 +451,13 @@ void parse_msg_and_forward_interesting_requests(zmsg_t *msg, parser_state_t *par
         body_len = zframe_size(body_frame);
     }
 
-    json_object *request = parse_json_data(body, body_len, parser_state->tokener);
+    char *topic_str = (char*) zframe_data(topic_frame);
+    int n = zframe_size(topic_frame);
+    bool backend_request = n >= 4 && !strncmp("logs", topic_str, 4);
+
+    json_object *request = parser_parse_json(parser_state, body, body_len, backend_request);
     if (request != NULL) {
         // dump_json_object(stdout, "[D] ", request);
-        char *topic_str = (char*) zframe_data(topic_frame);
-        int n = zframe_size(topic_frame);
         processor_state_t *processor = processor_create(stream_frame, parser_state, request);
 
         if (processor == NULL) {
@@ -235,8 +466,10 @@ void parse_msg_and_forward_interesting_requests(zmsg_t *msg, parser_state_t *par
             return;
         }
         processor->request_count++;
+        parser_state->body = body;
+        parser_state->body_len = body_len;
 
-        if (n >= 4 && !strncmp("logs", topic_str, 4))
+        if (backend_request)
             processor_add_request(processor, parser_state, request);
         else if (n >= 10 && !strncmp("javascript", topic_str, 10))
             processor_add_js_exception(processor, parser_state, request);
@@ -273,6 +506,46 @@ zhash_t* processor_hash_new()
     return hash;
 }
 
+// Slots holding the last published shard of each parser. The parser is
+// the only producer and the controller the only consumer of a slot.
+static parser_shard_t *published_shards[MAX_PARSERS];
+
+static
+bool parser_publish_shard(parser_state_t *state)
+{
+    parser_shard_t *shard = zmalloc(sizeof(*shard));
+    assert(shard);
+    shard->processors = state->processors;
+    shard->parsed_msgs_count = state->parsed_msgs_count;
+    shard->fe_stats = state->fe_stats;
+    if (__sync_bool_compare_and_swap(&published_shards[state->id], NULL, shard))
+        return true;
+    // the controller has not yet collected the previous shard, so we keep
+    // accumulating into the current one and try again on the next tick
+    free(shard);
+    return false;
+}
+
+parser_shard_t* parser_collect_shard(size_t id)
+{
+    assert(id < MAX_PARSERS);
+    parser_shard_t *shard;
+    do {
+        shard = published_shards[id];
+    } while (shard && !__sync_bool_compare_and_swap(&published_shards[id], shard, NULL));
+    return shard;
+}
+
+void parser_shard_destroy(parser_shard_t **shard_p)
+{
+    parser_shard_t *shard = *shard_p;
+    if (shard == NULL)
+        return;
+    zhash_destroy(&shard->processors);
+    free(shard);
+    *shard_p = NULL;
+}
+
 static
 parser_state_t* parser_state_new(zconfig_t* config, size_t id)
 {
@@ -280,15 +553,17 @@ parser_state_t* parser_state_new(zconfig_t* config, size_t id)
     state->config = config;
     state->id = id;
     snprintf(state->me, 16, "parser[%zu]", id);
-    state->pull_socket = parser_pull_socket_new();
+    state->pull_socket = parser_pull_socket_new(id);
     state->push_socket = parser_push_socket_new();
     state->prom_collector_socket = parser_prom_collector_socket_new();
     state->indexer_socket = parser_indexer_socket_new();
     assert( state->tokener = json_tokener_new() );
+    state->view = json_view_new();
+    state->arena = arena_new(PARSER_ARENA_BLOCK_SIZE);
     state->processors = processor_hash_new();
     state->tracker = tracker_new();
     state->statsd_client = statsd_client_new(config, state->me);
-    state->decompression_buffer = zchunk_new(NULL, INITIAL_DECOMPRESSION_BUFFER_SIZE);
+    state->decompressor = decompressor_new(INITIAL_DECOMPRESSION_BUFFER_SIZE);
     return state;
 }
 
@@ -301,10 +576,13 @@ void parser_state_destroy(parser_state_t **state_p)
     zsock_destroy(&state->push_socket);
     zsock_destroy(&state->indexer_socket);
     zsock_destroy(&state->prom_collector_socket);
+    processor_cache_destroy(state);
     zhash_destroy(&state->processors);
     tracker_destroy(&state->tracker);
     statsd_client_destroy(&state->statsd_client);
-    zchunk_destroy(&state->decompression_buffer);
+    decompressor_destroy(&state->decompressor);
+    json_view_destroy(&state->view);
+    arena_destroy(&state->arena);
     free(state);
     *state_p = NULL;
 }
@@ -335,18 +613,18 @@ void parser(zsock_t *pipe, void *args)
             char *cmd = zmsg_popstr(msg);
             zmsg_destroy(&msg);
             if (streq(cmd, "tick")) {
-                if (state->parsed_msgs_count && verbose)
-                    printf("[I] parser [%zu]: tick (%zu messages, %zu frontend)\n", id, state->parsed_msgs_count, state->fe_stats.received);
-                statsd_client_count(state->statsd_client, "importer.parses.count", state->parsed_msgs_count);
-                prometheus_client_count_msgs_parsed(state->parsed_msgs_count);
-                zmsg_t *answer = zmsg_new();
-                zmsg_addptr(answer, state->processors);
-                zmsg_addmem(answer, &state->parsed_msgs_count, sizeof(state->parsed_msgs_count));
-                zmsg_addmem(answer, &state->fe_stats, sizeof(state->fe_stats));
-                zmsg_send_with_retry(&answer, state->pipe);
-                state->parsed_msgs_count = 0;
-                memset(&state->fe_stats, 0 , sizeof(state->fe_stats));
-                state->processors = processor_hash_new();
+                if (parser_publish_shard(state)) {
+                    if (state->parsed_msgs_count && verbose)
+                        printf("[I] parser [%zu]: tick (%zu messages, %zu frontend)\n", id, state->parsed_msgs_count, state->fe_stats.received);
+                    statsd_client_count(state->statsd_client, "importer.parses.count", state->parsed_msgs_count);
+                    prometheus_client_count_msgs_parsed(state->parsed_msgs_count);
+                    state->parsed_msgs_count = 0;
+                    memset(&state->fe_stats, 0 , sizeof(state->fe_stats));
+                    state->processors = processor_hash_new();
+                    processor_cache_clear(state);
+                } else {
+                    fprintf(stderr, "[W] parser [%zu]: previous shard not yet collected\n", id);
+                }
                 free(cmd);
             } else if (streq(cmd, "$TERM")) {
                 // printf("[D] parser [%zu]: received $TERM command\n", id);
@@ -363,6 +641,7 @@ void parser(zsock_t *pipe, void *args)
                 state->parsed_msgs_count++;
                 parse_msg_and_forward_interesting_requests(msg, state);
                 zmsg_destroy(&msg);
+                arena_reset(state->arena);
             } else {
                 // msg == NULL, probably interrupted by signal handler
                 break;
@@ -4,6 +4,8 @@
 #include "importer-common.h"
 #include "importer-tracker.h"
 #include "statsd-client.h"
+#include "json-view.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +15,9 @@ extern "C" {
 // this needs to be revisited if we move to percentiles
 #define FE_MSG_OUTLIER_THRESHOLD_MS 60000
 
+// a single block is enough to process most messages
+#define PARSER_ARENA_BLOCK_SIZE (64 * 1024)
+
 enum fe_msg_drop_reason {
     FE_MSG_ACCEPTED   = 0, // not dropped at all. must be zero.
     FE_MSG_OUTLIER    = 1, // page_time larger than FE_MSG_OUTLIER_THRESHOLD_MS
@@ -36,6 +41,26 @@ typedef struct {
     size_t fe_drop_reasons[FE_MSG_NUM_REASONS];  // how many we dropped for a specific reason
 } user_agent_stats_t;
 
+// Parser results for one tick. Parsers publish them through a lock free
+// single slot per parser, from which the controller collects them.
+typedef struct {
+    zhash_t *processors;
+    size_t parsed_msgs_count;
+    frontend_stats_t fe_stats;
+} parser_shard_t;
+
+// Maps (stream, date) pairs to processors, so that the processor for a message
+// can be found without running strptime/mktime and building the db name.
+#define PROCESSOR_CACHE_SIZE 64
+
+typedef struct {
+    char *stream;             // contents of the stream frame
+    size_t stream_len;
+    char date[10];            // yyyy-mm-dd
+    time_t midnight;          // start of date in local time
+    void *processor;          // processor_state_t*, NULL if the entry is unused
+} processor_cache_entry_t;
+
 typedef struct {
     size_t id;
     char me[16];
@@ -47,15 +72,29 @@ typedef struct {
     zsock_t *push_socket;
     zsock_t *indexer_socket;
     json_tokener* tokener;
+    json_view_t *view;                        // used instead of the tokener when use_json_view is set
+    bool partial_request;                     // request only holds the members the processor reads
+    arena_t *arena;                           // for objects not outliving the current message
     zhash_t *processors;
+    processor_cache_entry_t processor_cache[PROCESSOR_CACHE_SIZE];  // refers to processors
     uuid_tracker_t *tracker;
     statsd_client_t *statsd_client;
-    zchunk_t *decompression_buffer;
+    decompressor_t *decompressor;
+    const char *body;                         // raw (decompressed) body of the message being processed
+    size_t body_len;
     zsock_t *prom_collector_socket;
 } parser_state_t;
 
 extern zactor_t* parser_new(zconfig_t *config, size_t id);
 extern void parser_destroy(zactor_t **parser_p);
+extern parser_shard_t* parser_collect_shard(size_t id);
+extern void parser_shard_destroy(parser_shard_t **shard_p);
+
+// returns a new reference to the complete request, including the changes the
+// processor made to the partially extracted one. raw_members is set to an object
+// referencing the members which were built from the view and not seen by the
+// processor, or to NULL if the request wasn't extracted partially.
+extern json_object* parser_complete_request(parser_state_t *state, json_object *request, json_object **raw_members);
 
 #ifdef __cplusplus
 }
@@ -5,6 +5,8 @@
 #include "importer-livestream.h"
 #include "importer-streaminfo.h"
 #include "importer-resources.h"
+#include "importer-aggtable.h"
+#include "importer-requestwriter.h"
 #include "prom-collector.h"
 
 #define DB_PREFIX "logjam-"
@@ -30,12 +32,12 @@ processor_state_t* processor_new(char *db_name)
     p->db_name = strdup(db_name);
     p->stream_info = stream_info;
     p->request_count = 0;
-    p->modules = zhash_new();
-    p->totals = zhash_new();
-    p->minutes = zhash_new();
-    p->quants = zhash_new();
+    p->namespaces = namespaces_new();
+    p->totals = agg_table_new(increments_destroy, p->namespaces);
+    p->minutes = agg_table_new(increments_destroy, p->namespaces);
+    p->quants = agg_table_new(free, p->namespaces);
     p->agents = zhash_new();
-    p->histograms = zhash_new();
+    p->histograms = agg_table_new(free, p->namespaces);
     return p;
 }
 
@@ -45,34 +47,36 @@ void processor_destroy(void* processor)
     processor_state_t* p = processor;
     // printf("[D] destroying processor: %s. requests: %zu\n", p->db_name, p->request_count);
     free(p->db_name);
-    zhash_destroy(&p->modules);
-    zhash_destroy(&p->totals);
-    zhash_destroy(&p->minutes);
-    zhash_destroy(&p->quants);
+    agg_table_destroy(&p->totals);
+    agg_table_destroy(&p->minutes);
+    agg_table_destroy(&p->quants);
     zhash_destroy(&p->agents);
-    zhash_destroy(&p->histograms);
+    agg_table_destroy(&p->histograms);
+    namespaces_destroy(&p->namespaces);
     free(p);
 }
 
 static
-void dump_modules_hash(zhash_t *modules)
+void dump_modules(namespaces_t *namespaces)
 {
-    const char* module = zhash_first(modules);
-    while (module) {
-        printf("[D] module: %s\n", module);
-        module = zhash_next(modules);
+    for (uint32_t id = 0; id < namespaces->count; id++) {
+        if (namespaces_has_flags(namespaces, id, NAMESPACE_MODULE))
+            printf("[D] module: %s\n", namespaces_name(namespaces, id));
     }
 }
 
 static
-void dump_increments_hash(zhash_t *increments_hash)
+void dump_totals_entry(const char *namespace, agg_key_t key, void *value, void *arg)
 {
-    increments_t *increments = zhash_first(increments_hash);
-    while (increments) {
-        const char *action = zhash_cursor(increments_hash);
-        dump_increments(action, increments);
-        increments = zhash_next(increments_hash);
-    }
+    dump_increments(namespace, value);
+}
+
+static
+void dump_minutes_entry(const char *namespace, agg_key_t key, void *value, void *arg)
+{
+    char action[2000];
+    snprintf(action, 2000, "%d-%s", agg_key_minute(key), namespace);
+    dump_increments(action, value);
 }
 
 static
@@ -81,9 +85,9 @@ void processor_dump_state(processor_state_t *self)
     puts("[D] ================================================");
     printf("[D] db_name: %s\n", self->db_name);
     printf("[D] processed requests: %zu\n", self->request_count);
-    dump_modules_hash(self->modules);
-    dump_increments_hash(self->totals);
-    dump_increments_hash(self->minutes);
+    dump_modules(self->namespaces);
+    agg_table_each(self->totals, dump_totals_entry, NULL);
+    agg_table_each(self->minutes, dump_minutes_entry, NULL);
 }
 
 
@@ -129,7 +133,7 @@ const char* processor_setup_page(processor_state_t *self, json_object *request)
 }
 
 static
-const char* processor_setup_module(processor_state_t *self, const char *page)
+const char* processor_setup_module(processor_state_t *self, const char *page, uint32_t *module_ns)
 {
     int max_mod_len = strlen(page);
     char module_str[max_mod_len+1];
@@ -149,13 +153,11 @@ const char* processor_setup_module(processor_state_t *self, const char *page)
             module_str[mod_len+2] = '\0';
         }
     }
-    char *module = zhash_lookup(self->modules, module_str);
-    if (module == NULL) {
-        module = strdup(module_str);
-        int rc = zhash_insert(self->modules, module, module);
-        assert(rc == 0);
-        zhash_freefn(self->modules, module, free);
-    }
+    uint32_t id = namespaces_intern(self->namespaces, module_str);
+    namespaces_set_flags(self->namespaces, id, NAMESPACE_MODULE);
+    const char *module = namespaces_name(self->namespaces, id);
+    if (module_ns)
+        *module_ns = id;
     // printf("[D] page: %s\n", page);
     // printf("[D] module: %s\n", module);
     return module;
@@ -403,16 +405,14 @@ json_object* processor_setup_soft_exceptions(processor_state_t *self, json_objec
 }
 
 static
-void processor_add_totals(processor_state_t *self, const char* namespace, increments_t *increments)
+void processor_add_totals(processor_state_t *self, uint32_t ns, increments_t *increments)
 {
-    increments_t *stored_increments = zhash_lookup(self->totals, namespace);
+    agg_key_t key = agg_key(ns, 0, 0);
+    increments_t *stored_increments = agg_table_lookup(self->totals, key);
     if (stored_increments) {
         increments_add(stored_increments, increments);
     } else {
-        increments_t *duped_increments = increments_clone(increments);
-        int rc = zhash_insert(self->totals, namespace, duped_increments);
-        assert(rc == 0);
-        assert(zhash_freefn(self->totals, namespace, increments_destroy));
+        agg_table_insert(self->totals, key, increments_clone(increments));
     }
 }
 
@@ -482,123 +482,69 @@ void processor_add_user_agent(processor_state_t *self, const char* agent, enum f
 }
 
 static
-void processor_add_minutes(processor_state_t *self, const char* namespace, size_t minute, increments_t *increments)
+void processor_add_minutes(processor_state_t *self, uint32_t ns, size_t minute, increments_t *increments)
 {
-    char key[2000];
-    snprintf(key, 2000, "%lu-%s", minute, namespace);
-    increments_t *stored_increments = zhash_lookup(self->minutes, key);
+    agg_key_t key = agg_key(ns, minute, 0);
+    increments_t *stored_increments = agg_table_lookup(self->minutes, key);
     if (stored_increments) {
         increments_add(stored_increments, increments);
     } else {
-        increments_t *duped_increments = increments_clone(increments);
-        int rc = zhash_insert(self->minutes, key, duped_increments);
-        assert(rc == 0);
-        assert(zhash_freefn(self->minutes, key, increments_destroy));
+        agg_table_insert(self->minutes, key, increments_clone(increments));
     }
 }
 
-#define QUANTS_ARRAY_SIZE (sizeof(size_t) * (last_resource_offset + 1))
-
 static
-void add_quant(const char* namespace, size_t resource_idx, char kind, size_t quant, zhash_t* quants)
+void add_quant(agg_table_t* quants, uint32_t ns, size_t resource_idx, char kind, size_t bucket)
 {
-    char key[2000];
-    sprintf(key, "%c-%zu-%s", kind, quant, namespace);
-    // printf("[D] QUANT-KEY: %s\n", key);
-    size_t *stored = zhash_lookup(quants, key);
+    agg_key_t key = agg_quant_key(ns, kind, bucket);
+    agg_quants_t *stored = agg_table_lookup(quants, key);
     if (stored == NULL) {
-        stored = zmalloc(QUANTS_ARRAY_SIZE);
-        zhash_insert(quants, key, stored);
-        zhash_freefn(quants, key, free);
-    }
-    stored[resource_idx]++;
-}
-
-static double buckets[HISTOGRAM_SIZE+1] = {
-    1,            //    1   ms               1 object            1   KB
-    3,            //    3   ms               3 objects           3   KB
-    10,           //   10   ms              10 objects          10   KB
-    30,           //   30   ms              30 objects          30   KB
-    100,          //  100   ms             100 objects         100   KB
-    300,          //  300   ms             300 objects         300   KB
-    1000,         //    1   second          1K objects       ~   1   MB
-    3000,         //    3   seconds         2K objects       ~   2.9 MB
-    10000,        //   10   seconds        10K objects       ~   9.7 MB
-    30000,        //   30   seconds        30K objects       ~  29.3 MB
-    100000,       //  100   seconds       100K objects       ~  97.6 MB
-    300000,       //    5   minutes       300K objects       ~ 293   MB
-    1000000,      // ~ 17   minutes         1M objects       ~ 976   MB
-    3000000,      //   50   minutes         3M objects       ~   2.9 GB
-    10000000,     //  ~ 2.6 hours          10M objects       ~   9.7 GB
-    30000000,     //  ~ 8.3 hours          30M objects       ~  28.9 GB
-    100000000,    //  ~ 1.2 days          100M objects       ~  96.3 GB
-    300000000,    //    3.5 days          300M objects       ~ 289   GB
-    1000000000,   //   11.6 days            1B objects       ~ 963   GB
-    3000000000,   //   34.7 days            3B objects       ~   2.8 TB
-    10000000000,  //  116   days           10B objects       ~   9.4 TB
-    30000000000,  //  347   days           30B objects       ~  28.2 TB
-    0
-};
-
-
-static inline size_t find_bucket(double value)
-{
-    double *p = buckets;
-    while (*p < value && *(p+1) != 0) p++;
-    assert(*p);
-    return *p;
-}
-
-static inline size_t find_bucket_index(double value)
-{
-    double *p = buckets;
-    size_t i = 0;
-    while (*p < value && *(p+1) != 0) {
-        i++;
-        p++;
-    }
-    assert(*p);
-    return i;
+        stored = agg_quants_new(kind);
+        agg_table_insert(quants, key, stored);
+    }
+    agg_quants_incr(stored, resource_idx);
 }
 
 static
-void processor_add_quants(processor_state_t *self, const char* namespace, increments_t *increments)
+void processor_add_quants(processor_state_t *self, uint32_t ns, increments_t *increments)
 {
+    size_t n = 0;
+    size_t resources[last_resource_offset + 1];
+    char kinds[last_resource_offset + 1];
+    double values[last_resource_offset + 1];
     for (size_t i=0; i<=last_resource_offset; i++){
-        double val = increments->metrics[i].val;
+        double val = increments->metrics.val[i];
         if (val > 0) {
             char kind;
-            double d;
-            double bucket;
             // printf("[D] trying to add quant: %zu=%s\n", i, i2r(i));
             if (i <= last_time_resource_offset) {
                 kind = 't';
-                bucket = find_bucket(val);
-                d = 1;
             } else if (i == allocated_objects_index) {
                 kind = 'm';
-                d = 1;
             } else if (i == allocated_bytes_index) {
-                kind = 'm';
-                d = 1024;
+                // stored as kind 'm' with bucket values scaled by 1024
+                kind = 'b';
+                val /= 1024;
             } else if ((i > last_heap_resource_offset) && (i <= last_frontend_resource_offset)) {
                 kind = 'f';
-                d = 1;
             } else {
                 // printf("[D] skipping quant: %s\n", i2r(i));
                 continue;
             }
-            // This is stupid, but historic. We should actually store just the bucket
-            // index and let the API in logjam convert bucket indexes to real values.
-            if (d != 1)
-                bucket = find_bucket(val/d) * d;
-            else
-                bucket = find_bucket(val);
-            // printf("[D] determined bucket for %s, kind %c, for %f to be %f (factor %f)\n", i2r(i), kind, val, bucket, d);
-            add_quant(namespace, i, kind, bucket, self->quants);
-            add_quant("all_pages", i, kind, bucket, self->quants);
+            resources[n] = i;
+            kinds[n] = kind;
+            values[n] = val;
+            n++;
         }
     }
+
+    uint8_t buckets[n + 1];
+    agg_bucket_indexes(values, n, buckets);
+    for (size_t j=0; j<n; j++) {
+        // printf("[D] determined bucket for %s, kind %c, for %f to be %d\n", i2r(resources[j]), kinds[j], values[j], buckets[j]);
+        add_quant(self->quants, ns, resources[j], kinds[j], buckets[j]);
+        add_quant(self->quants, ALL_PAGES_NAMESPACE, resources[j], kinds[j], buckets[j]);
+    }
 }
 
 void dump_histogram(const char* key, size_t *h)
@@ -613,42 +559,40 @@ void dump_histogram(const char* key, size_t *h)
     printf("[D] HISTOGRAM: %s = [%s]\n", key, line);
 }
 
-void dump_histograms(zhash_t* histograms)
+static
+void dump_histogram_entry(const char *namespace, agg_key_t key, void *value, void *arg)
 {
-    size_t *h = zhash_first(histograms);
-    while (h) {
-        const char* key = zhash_cursor(histograms);
-        dump_histogram(key, h);
-        h = zhash_next(histograms);
-    }
+    char name[2000];
+    snprintf(name, 2000, "%d-%s-%s", agg_key_minute(key), i2r(agg_key_sub(key)), namespace);
+    dump_histogram(name, value);
+}
+
+void dump_histograms(agg_table_t* histograms)
+{
+    agg_table_each(histograms, dump_histogram_entry, NULL);
 }
 
 
 static
-void processor_add_histogram(processor_state_t *self, const char* namespace, int minute, const char* resource, int time_index, increments_t *increments, json_object *request)
+void processor_add_histogram(processor_state_t *self, uint32_t ns, int minute, int time_index, increments_t *increments, json_object *request)
 {
-    char key[2000];
-    snprintf(key, 2000, "%d-%s-%s", minute, resource, namespace);
-    // printf("[D] HISTOGRAM-KEY: %s\n", key);
-
-    double time = increments->metrics[time_index].val;
+    double time = increments->metrics.val[time_index];
     if (time == 0) {
-        fprintf(stderr, "[E] HISTOGRAM: expected %s to be greater zero\n", resource);
+        fprintf(stderr, "[E] HISTOGRAM: expected %s to be greater zero\n", i2r(time_index));
         dump_json_object(stderr, "[E] REQUEST", request);
-        dump_increments(namespace, increments);
+        dump_increments(namespaces_name(self->namespaces, ns), increments);
         return;
     }
 
-    size_t *histogram = zhash_lookup(self->histograms, key);
+    agg_key_t key = agg_histogram_key(ns, minute, time_index);
+    size_t *histogram = agg_table_lookup(self->histograms, key);
     if (histogram == NULL) {
         histogram = zmalloc(HISTOGRAM_SIZE * sizeof(size_t));
-        zhash_insert(self->histograms, key, histogram);
-        zhash_freefn(self->histograms, key, free);
+        agg_table_insert(self->histograms, key, histogram);
     }
-    size_t i = find_bucket_index(time);
+    size_t i = agg_bucket_index(time);
     assert(i < HISTOGRAM_SIZE);
     histogram[i]++;
-    // dump_histogram(key, histogram);
     // dump_histograms(self->histograms);
 }
 
@@ -865,7 +809,8 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
     // dump_json_object(stdout, "[D] REQUEST", request);
     request_data_t request_data;
     request_data.page = processor_setup_page(self, request);
-    request_data.module = processor_setup_module(self, request_data.page);
+    request_data.page_ns = namespaces_intern(self->namespaces, request_data.page);
+    request_data.module = processor_setup_module(self, request_data.page, &request_data.module_ns);
     request_data.response_code = processor_setup_response_code(self, request);
     request_data.severity = processor_setup_severity(self, request);
     request_data.minute = processor_setup_minute(self, request);
@@ -877,7 +822,7 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
     processor_setup_allocated_memory(self, request);
     request_data.heap_growth = processor_setup_heap_growth(self, request);
 
-    increments_t* increments = increments_new();
+    increments_t* increments = increments_new_in_arena(pstate->arena);
     increments->backend_request_count = 1;
     increments_fill_metrics(increments, request);
     increments_fill_apdex(increments, request_data.total_time);
@@ -888,21 +833,21 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
     increments_fill_exceptions(increments, request_data.exceptions);
     increments_fill_soft_exceptions(increments, request_data.soft_exceptions);
 
-    processor_add_totals(self, request_data.page, increments);
-    processor_add_totals(self, request_data.module, increments);
-    processor_add_totals(self, "all_pages", increments);
+    processor_add_totals(self, request_data.page_ns, increments);
+    processor_add_totals(self, request_data.module_ns, increments);
+    processor_add_totals(self, ALL_PAGES_NAMESPACE, increments);
 
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
-    processor_add_minutes(self, request_data.module, request_data.minute, increments);
-    processor_add_minutes(self, "all_pages", request_data.minute, increments);
+    processor_add_minutes(self, request_data.page_ns, request_data.minute, increments);
+    processor_add_minutes(self, request_data.module_ns, request_data.minute, increments);
+    processor_add_minutes(self, ALL_PAGES_NAMESPACE, request_data.minute, increments);
 
-    processor_add_quants(self, request_data.page, increments);
+    processor_add_quants(self, request_data.page_ns, increments);
 
-    processor_add_histogram(self, request_data.page, request_data.minute, "total_time", total_time_index, increments, request);
-    processor_add_histogram(self, request_data.module, request_data.minute, "total_time", total_time_index, increments, request);
-    processor_add_histogram(self, "all_pages", request_data.minute, "total_time", total_time_index, increments, request);
+    processor_add_histogram(self, request_data.page_ns, request_data.minute, total_time_index, increments, request);
+    processor_add_histogram(self, request_data.module_ns, request_data.minute, total_time_index, increments, request);
+    processor_add_histogram(self, ALL_PAGES_NAMESPACE, request_data.minute, total_time_index, increments, request);
 
-    increments_destroy(increments);
+    increments_release(increments);
 
     processor_add_agent(self, request);
 
@@ -929,19 +874,14 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
 
     sampling_reason_t sampling_reason = interesting_request(&request_data, request, self->stream_info);
     if (sampling_reason && !throttle_request(self->stream_info)) {
-        json_object_get(request);
-        zmsg_t *msg = zmsg_new();
-        zmsg_addstr(msg, self->db_name);
-        zmsg_addstr(msg, "r");
-        zmsg_addstr(msg, request_data.module);
-        zmsg_addptr(msg, request);
-        zmsg_addptr(msg, self->stream_info);
-        zmsg_addmem(msg, &sampling_reason, sizeof(sampling_reason_t));
-        if (!output_socket_ready(pstate->push_socket, 0)) {
-            fprintf(stderr, "[W] parser [%zu]: push socket not ready\n", pstate->id);
-        }
-        zmsg_send_with_retry(&msg, pstate->push_socket);
-        __sync_add_and_fetch(&queued_inserts, 1);
+        // unsampled requests never need the members the processor doesn't read
+        json_object *raw_members;
+        json_object *stored_request = parser_complete_request(pstate, request, &raw_members);
+        writer_task_t *task = writer_task_new('r', self->db_name, request_data.module, stored_request, self->stream_info);
+        task->sampling_reason = sampling_reason;
+        // lets the writer transcode the request without walking the json-c tree
+        writer_task_set_raw(task, pstate->body, pstate->body_len, raw_members);
+        writer_task_submit(task, pstate->push_socket);
     }
 
     forward_request_to_prom_collector(self, pstate, request, &request_data);
@@ -998,51 +938,41 @@ void processor_add_js_exception(processor_state_t *self, parser_state_t *pstate,
     }
 
     int minute = processor_setup_minute(self, request);
-    const char *module = processor_setup_module(self, page);
+    uint32_t module_ns;
+    const char *module = processor_setup_module(self, page, &module_ns);
 
-    increments_t* increments = increments_new();
+    increments_t* increments = increments_new_in_arena(pstate->arena);
     increments_fill_js_exception(increments, js_exception);
 
-    processor_add_totals(self, "all_pages", increments);
-    processor_add_minutes(self, "all_pages", minute, increments);
+    processor_add_totals(self, ALL_PAGES_NAMESPACE, increments);
+    processor_add_minutes(self, ALL_PAGES_NAMESPACE, minute, increments);
 
     if (strstr(page, "#unknown_method") == NULL) {
-        processor_add_totals(self, page, increments);
-        processor_add_minutes(self, page, minute, increments);
+        uint32_t page_ns = namespaces_intern(self->namespaces, page);
+        processor_add_totals(self, page_ns, increments);
+        processor_add_minutes(self, page_ns, minute, increments);
     }
 
     if (strcmp(module, "Unknown") != 0) {
-        processor_add_totals(self, module, increments);
-        processor_add_minutes(self, module, minute, increments);
+        processor_add_totals(self, module_ns, increments);
+        processor_add_minutes(self, module_ns, minute, increments);
     }
 
-    increments_destroy(increments);
+    increments_release(increments);
     free(page);
     free(js_exception);
 
     json_object_get(request);
-    zmsg_t *msg = zmsg_new();
-    zmsg_addstr(msg, self->db_name);
-    zmsg_addstr(msg, "j");
-    zmsg_addstr(msg, module);
-    zmsg_addptr(msg, request);
-    zmsg_addptr(msg, self->stream_info);
-    zmsg_send_with_retry(&msg, pstate->push_socket);
-    __sync_add_and_fetch(&queued_inserts, 1);
+    writer_task_t *task = writer_task_new('j', self->db_name, module, request, self->stream_info);
+    writer_task_submit(task, pstate->push_socket);
 }
 
 void processor_add_event(processor_state_t *self, parser_state_t *pstate, json_object *request)
 {
     processor_setup_minute(self, request);
     json_object_get(request);
-    zmsg_t *msg = zmsg_new();
-    zmsg_addstr(msg, self->db_name);
-    zmsg_addstr(msg, "e");
-    zmsg_addstr(msg, "");
-    zmsg_addptr(msg, request);
-    zmsg_addptr(msg, self->stream_info);
-    zmsg_send_with_retry(&msg, pstate->push_socket);
-    __sync_add_and_fetch(&queued_inserts, 1);
+    writer_task_t *task = writer_task_new('e', self->db_name, "", request, self->stream_info);
+    writer_task_submit(task, pstate->push_socket);
 }
 
 static inline
@@ -1367,7 +1297,8 @@ enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, par
 
     request_data_t request_data;
     request_data.page = processor_setup_page(self, request);
-    request_data.module = processor_setup_module(self, request_data.page);
+    request_data.page_ns = namespaces_intern(self->namespaces, request_data.page);
+    request_data.module = processor_setup_module(self, request_data.page, &request_data.module_ns);
     request_data.minute = processor_setup_minute(self, request);
     request_data.total_time = processor_setup_time(self, request, "page_time", "frontend_time");
 
@@ -1380,31 +1311,31 @@ enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, par
         return reason;
     }
 
-    increments_t* increments = increments_new();
+    increments_t* increments = increments_new_in_arena(pstate->arena);
     increments->page_request_count = 1;
     increments_fill_metrics(increments, request);
     increments_fill_frontend_apdex(increments, request_data.total_time);
     const char* satisfaction = increments_fill_page_apdex(increments, timings[fe_apdex_attr_index]);
 
-    processor_add_totals(self, request_data.page, increments);
-    processor_add_totals(self, request_data.module, increments);
-    processor_add_totals(self, "all_pages", increments);
+    processor_add_totals(self, request_data.page_ns, increments);
+    processor_add_totals(self, request_data.module_ns, increments);
+    processor_add_totals(self, ALL_PAGES_NAMESPACE, increments);
 
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
-    processor_add_minutes(self, request_data.module, request_data.minute, increments);
-    processor_add_minutes(self, "all_pages", request_data.minute, increments);
+    processor_add_minutes(self, request_data.page_ns, request_data.minute, increments);
+    processor_add_minutes(self, request_data.module_ns, request_data.minute, increments);
+    processor_add_minutes(self, ALL_PAGES_NAMESPACE, request_data.minute, increments);
 
-    processor_add_quants(self, request_data.page, increments);
+    processor_add_quants(self, request_data.page_ns, increments);
 
-    processor_add_histogram(self, request_data.page, request_data.minute, "page_time", page_time_index, increments, request);
-    processor_add_histogram(self, request_data.module, request_data.minute, "page_time", page_time_index, increments, request);
-    processor_add_histogram(self, "all_pages", request_data.minute, "page_time", page_time_index, increments, request);
+    processor_add_histogram(self, request_data.page_ns, request_data.minute, page_time_index, increments, request);
+    processor_add_histogram(self, request_data.module_ns, request_data.minute, page_time_index, increments, request);
+    processor_add_histogram(self, ALL_PAGES_NAMESPACE, request_data.minute, page_time_index, increments, request);
 
     // dump_increments("add_frontend_data", increments);
 
     send_statsd_updates_for_page(self->stream_info->yek, pstate->statsd_client, mtimes, satisfaction);
 
-    increments_destroy(increments);
+    increments_release(increments);
 
     // TODO: store interesting requests
     reason = FE_MSG_ACCEPTED;
@@ -1466,7 +1397,8 @@ enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_
 
     request_data_t request_data;
     request_data.page = processor_setup_page(self, request);
-    request_data.module = processor_setup_module(self, request_data.page);
+    request_data.page_ns = namespaces_intern(self->namespaces, request_data.page);
+    request_data.module = processor_setup_module(self, request_data.page, &request_data.module_ns);
     request_data.minute = processor_setup_minute(self, request);
     request_data.total_time = processor_setup_time(self, request, "ajax_time", "frontend_time");
 
@@ -1479,31 +1411,31 @@ enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_
         return reason;
     }
 
-    increments_t* increments = increments_new();
+    increments_t* increments = increments_new_in_arena(pstate->arena);
     increments->ajax_request_count = 1;
     increments_fill_metrics(increments, request);
     increments_fill_frontend_apdex(increments, request_data.total_time);
     const char* satisfaction = increments_fill_ajax_apdex(increments, request_data.total_time);
 
-    processor_add_totals(self, request_data.page, increments);
-    processor_add_totals(self, request_data.module, increments);
-    processor_add_totals(self, "all_pages", increments);
+    processor_add_totals(self, request_data.page_ns, increments);
+    processor_add_totals(self, request_data.module_ns, increments);
+    processor_add_totals(self, ALL_PAGES_NAMESPACE, increments);
 
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
-    processor_add_minutes(self, request_data.module, request_data.minute, increments);
-    processor_add_minutes(self, "all_pages", request_data.minute, increments);
+    processor_add_minutes(self, request_data.page_ns, request_data.minute, increments);
+    processor_add_minutes(self, request_data.module_ns, request_data.minute, increments);
+    processor_add_minutes(self, ALL_PAGES_NAMESPACE, request_data.minute, increments);
 
-    processor_add_quants(self, request_data.page, increments);
+    processor_add_quants(self, request_data.page_ns, increments);
 
-    processor_add_histogram(self, request_data.page, request_data.minute, "ajax_time", ajax_time_index, increments, request);
-    processor_add_histogram(self, request_data.module, request_data.minute, "ajax_time", ajax_time_index, increments, request);
-    processor_add_histogram(self, "all_pages", request_data.minute, "ajax_time", ajax_time_index, increments, request);
+    processor_add_histogram(self, request_data.page_ns, request_data.minute, ajax_time_index, increments, request);
+    processor_add_histogram(self, request_data.module_ns, request_data.minute, ajax_time_index, increments, request);
+    processor_add_histogram(self, ALL_PAGES_NAMESPACE, request_data.minute, ajax_time_index, increments, request);
 
     send_statsd_updates_for_ajax(self->stream_info->yek, pstate->statsd_client, request_data.total_time, satisfaction);
 
     // dump_increments("add_ajax_data", increments);
 
-    increments_destroy(increments);
+    increments_release(increments);
 
     // TODO: store interesting requests
     reason = FE_MSG_ACCEPTED;
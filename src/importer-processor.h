@@ -3,6 +3,7 @@
 
 #include "importer-parser.h"
 #include "importer-streaminfo.h"
+#include "importer-aggtable.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,11 +13,11 @@ typedef struct {
     char *db_name;
     stream_info_t* stream_info;
     size_t request_count;
-    zhash_t *modules;
-    zhash_t *totals;
-    zhash_t *minutes;
-    zhash_t *quants;
-    zhash_t *histograms;
+    namespaces_t *namespaces;
+    agg_table_t *totals;
+    agg_table_t *minutes;
+    agg_table_t *quants;
+    agg_table_t *histograms;
     zhash_t *agents;
 } processor_state_t;
 
@@ -29,7 +30,7 @@ extern enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *se
 extern enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_state_t *pstate, json_object *request, zmsg_t *msg);
 extern int processor_set_frontend_apdex_attribute(const char *attr);
 extern void dump_histogram(const char* key, size_t *h);
-extern void dump_histograms(zhash_t* histograms);
+extern void dump_histograms(agg_table_t* histograms);
 
 #ifdef __cplusplus
 }
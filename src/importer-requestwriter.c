@@ -3,6 +3,8 @@
 #include "importer-indexer.h"
 #include "importer-resources.h"
 #include "importer-mongoutils.h"
+#include "importer-jsonbson.h"
+#include "mpmc-queue.h"
 #include "statsd-client.h"
 #include "prometheus-client.h"
 
@@ -17,7 +19,19 @@
  *
  */
 
-// It might be better to insert a load balancer device between parsers and requests writers.
+// Tasks don't travel over the PUSH/PULL connection: parsers put them into a lock free
+// queue shared by all writers. Empty messages sent over the connection only serve as a
+// doorbell, which parsers ring when at least one writer waits for work.
+
+#define WRITER_TASK_BATCH_SIZE 100
+
+static mpmc_queue_t *task_queue = NULL;
+static mpmc_queue_t *task_pool = NULL;
+static int idle_writers = 0;
+
+// Documents are buffered per database and collection and sent to the database as one
+// unordered bulk insert when insert_batch_size documents or insert_batch_bytes bytes
+// have been collected, and on every tick.
 
 typedef struct {
     zconfig_t* config;
@@ -28,6 +42,10 @@ typedef struct {
     zhash_t *metrics_collections;
     zhash_t *jse_collections;
     zhash_t *events_collections;
+    zhash_t *request_buffers;
+    zhash_t *metrics_buffers;
+    zhash_t *jse_buffers;
+    zhash_t *events_buffers;
     zsock_t *pipe;         // actor command pipe
     zsock_t *pull_socket;
     zsock_t *live_stream_socket;
@@ -37,6 +55,129 @@ typedef struct {
     statsd_client_t *statsd_client;
 } request_writer_state_t;
 
+typedef struct {
+    bson_t *document;
+    bson_t **dependents;         // documents to insert only after document has been inserted
+    size_t num_dependents;
+} buffered_document_t;
+
+typedef struct insert_buffer {
+    const char *kind;                          // document kind, used in log messages
+    char *db_name;
+    mongoc_collection_t *collection;
+    struct insert_buffer *dependents_buffer;   // receives dependents of successfully inserted documents
+    request_writer_state_t *state;
+    buffered_document_t *entries;
+    size_t count;
+    size_t bytes;
+    size_t *pending;                           // used by insert_buffer_flush
+    size_t *retries;
+    bool *failed;
+} insert_buffer_t;
+
+
+void request_writer_queue_init()
+{
+    task_queue = mpmc_queue_new(WRITER_QUEUE_CAPACITY);
+    task_pool = mpmc_queue_new(WRITER_QUEUE_CAPACITY);
+}
+
+static
+void writer_task_destroy(writer_task_t **task_p)
+{
+    writer_task_t *task = *task_p;
+    if (task->request)
+        json_object_put(task->request);
+    if (task->raw_members)
+        json_object_put(task->raw_members);
+    free(task->raw);
+    free(task);
+    *task_p = NULL;
+}
+
+void request_writer_queue_destroy()
+{
+    writer_task_t *task;
+    size_t dropped = 0;
+    while ((task = mpmc_queue_pop(task_queue))) {
+        writer_task_destroy(&task);
+        dropped++;
+    }
+    if (dropped)
+        fprintf(stderr, "[W] writer: dropped %zu unprocessed tasks\n", dropped);
+    while ((task = mpmc_queue_pop(task_pool)))
+        writer_task_destroy(&task);
+    mpmc_queue_destroy(&task_queue);
+    mpmc_queue_destroy(&task_pool);
+}
+
+static
+void copy_task_name(char *target, const char *name, const char *kind)
+{
+    size_t n = strlen(name);
+    if (n >= WRITER_TASK_NAME_SIZE) {
+        fprintf(stderr, "[W] writer: truncating %s: %s\n", kind, name);
+        n = WRITER_TASK_NAME_SIZE - 1;
+    }
+    memcpy(target, name, n);
+    target[n] = '\0';
+}
+
+writer_task_t* writer_task_new(char type, const char *db_name, const char *module, json_object *request, stream_info_t *stream_info)
+{
+    writer_task_t *task = mpmc_queue_pop(task_pool);
+    if (task == NULL) {
+        task = zmalloc(sizeof(*task));
+        assert(task);
+    }
+    task->type = type;
+    task->sampling_reason = 0;
+    task->request = request;
+    task->stream_info = stream_info;
+    task->raw_len = 0;
+    task->raw_members = NULL;
+    copy_task_name(task->db_name, db_name, "db name");
+    copy_task_name(task->module, module, "module");
+    return task;
+}
+
+void writer_task_set_raw(writer_task_t *task, const char *raw, size_t raw_len, json_object *raw_members)
+{
+    if (raw_members == NULL)
+        return;
+    task->raw_members = raw_members;
+    if (task->raw_size < raw_len) {
+        free(task->raw);
+        task->raw = malloc(raw_len);
+        assert(task->raw);
+        task->raw_size = raw_len;
+    }
+    memcpy(task->raw, raw, raw_len);
+    task->raw_len = raw_len;
+}
+
+void writer_task_submit(writer_task_t *task, zsock_t *doorbell)
+{
+    __sync_add_and_fetch(&queued_inserts, 1);
+    if (!mpmc_queue_push(task_queue, task)) {
+        fprintf(stderr, "[W] writer: task queue full\n");
+        do {
+            zclock_sleep(1);
+        } while (!mpmc_queue_push(task_queue, task));
+    }
+    // full barrier: either we see the writer idle, or it sees the task
+    if (__sync_add_and_fetch(&idle_writers, 0) > 0)
+        zmq_send(zsock_resolve(doorbell), "", 0, ZMQ_DONTWAIT);
+}
+
+static
+void writer_task_release(writer_task_t *task)
+{
+    task->request = NULL;
+    task->raw_members = NULL;
+    if (!mpmc_queue_push(task_pool, task))
+        writer_task_destroy(&task);
+}
 
 static
 zsock_t* request_writer_pull_socket_new(int i)
@@ -112,91 +253,175 @@ mongoc_collection_t* request_writer_get_events_collection(request_writer_state_t
 }
 
 static
-int bson_append_win1252(bson_t *b, const char *key, size_t key_len, const char* val, size_t val_len)
+insert_buffer_t* insert_buffer_new(request_writer_state_t *state, const char *kind, const char *db_name, mongoc_collection_t *collection)
 {
-    char utf8[6*val_len+1];
-    int new_len = convert_to_win1252(val, val_len, utf8);
-    return bson_append_utf8(b, key, key_len, utf8, new_len);
+    insert_buffer_t *buffer = zmalloc(sizeof(*buffer));
+    buffer->kind = kind;
+    buffer->db_name = strdup(db_name);
+    buffer->collection = collection;
+    buffer->state = state;
+    buffer->entries = zmalloc(insert_batch_size * sizeof(buffered_document_t));
+    buffer->pending = zmalloc(insert_batch_size * sizeof(size_t));
+    buffer->retries = zmalloc(insert_batch_size * sizeof(size_t));
+    buffer->failed = zmalloc(insert_batch_size * sizeof(bool));
+    return buffer;
 }
 
+static
+void insert_buffer_destroy(insert_buffer_t **buffer_p)
+{
+    insert_buffer_t *buffer = *buffer_p;
+    // buffers are always flushed before they get destroyed
+    assert(buffer->count == 0);
+    free(buffer->entries);
+    free(buffer->pending);
+    free(buffer->retries);
+    free(buffer->failed);
+    free(buffer->db_name);
+    free(buffer);
+    *buffer_p = NULL;
+}
 
 static
-void json_object_to_bson(const char* context, json_object *j, bson_t *b);
+insert_buffer_t* request_writer_get_buffer(request_writer_state_t *self, zhash_t *buffers, const char *kind, const char *db_name, mongoc_collection_t *collection)
+{
+    insert_buffer_t *buffer = zhash_lookup(buffers, db_name);
+    if (buffer == NULL) {
+        buffer = insert_buffer_new(self, kind, db_name, collection);
+        zhash_insert(buffers, db_name, buffer);
+        zhash_freefn(buffers, db_name, (zhash_free_fn*)insert_buffer_destroy);
+    }
+    return buffer;
+}
+
+typedef struct {
+    insert_buffer_t *buffer;
+    size_t *pending;   // buffer indexes of the documents sent in the last bulk operation
+    size_t n;          // number of documents sent in the last bulk operation
+    size_t *retries;   // buffer indexes of documents which need to be retried
+    size_t num_retries;
+    bool retry;        // whether Toku lock failures should be retried
+    bool *failed;      // documents which could not be inserted
+} insert_errors_t;
 
-//TODO: optimize this!
 static
-void json_key_to_bson_key(const char* context, bson_t *b, json_object *val, const char *key)
-{
-    size_t n = strlen(key);
-    char safe_key[4*n+1];
-    int len = copy_replace_dots_and_dollars(safe_key, key);
-
-    if (!bson_utf8_validate(safe_key, len, false)) {
-        char tmp[6*len+1];
-        len = convert_to_win1252(safe_key, len, tmp);
-        strcpy(safe_key, tmp);
-    }
-    // printf("[D] safe_key: %s\n", safe_key);
-
-    enum json_type type = json_object_get_type(val);
-    switch (type) {
-    case json_type_boolean:
-        bson_append_bool(b, safe_key, len, json_object_get_boolean(val));
-        break;
-    case json_type_double:
-        bson_append_double(b, safe_key, len, json_object_get_double(val));
-        break;
-    case json_type_int:
-        bson_append_int64(b, safe_key, len, json_object_get_int64(val));
-        break;
-    case json_type_object: {
-        bson_t *sub = bson_new();
-        json_object_to_bson(context, val, sub);
-        bson_append_document(b, safe_key, len, sub);
-        bson_destroy(sub);
-        break;
-    }
-    case json_type_array: {
-        bson_t *sub = bson_new();
-        int array_len = json_object_array_length(val);
-        for (int pos = 0; pos < array_len; pos++) {
-            char nk[100];
-            sprintf(nk, "%d", pos);
-            json_key_to_bson_key(context, sub, json_object_array_get_idx(val, pos), nk);
+void insert_buffer_report_failure(insert_buffer_t *buffer, size_t i, int code, const char *message)
+{
+    size_t n;
+    char* bjs = bson_as_json(buffer->entries[i].document, &n);
+    fprintf(stderr,
+            "[E] insert failed for %s document on %s: (%d) %s\n"
+            "[E] document size: %zu; value: %s\n",
+            buffer->kind, buffer->db_name, code, message, n, bjs);
+    bson_free(bjs);
+    buffer->state->updates_failed++;
+}
+
+static
+void handle_insert_error(uint32_t index, int code, const char *message, void *arg)
+{
+    insert_errors_t *errors = arg;
+    if (index >= errors->n)
+        return;
+    size_t i = errors->pending[index];
+    if (errors->retry && code == TOKU_TX_LOCK_FAILED) {
+        errors->retries[errors->num_retries++] = i;
+    } else {
+        errors->failed[i] = true;
+        insert_buffer_report_failure(errors->buffer, i, code, message);
+    }
+}
+
+static
+void insert_buffer_add(insert_buffer_t *buffer, bson_t *document, bson_t **dependents, size_t num_dependents);
+
+static
+void insert_buffer_flush(insert_buffer_t *buffer)
+{
+    size_t n = buffer->count;
+    if (n == 0)
+        return;
+
+    size_t *pending = buffer->pending, *retries = buffer->retries;
+    bool *failed = buffer->failed;
+    for (size_t i = 0; i < n; i++) {
+        pending[i] = i;
+        failed[i] = false;
+    }
+    int tries = TOKU_TX_RETRIES;
+    while (n > 0) {
+        mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation(buffer->collection, false, wc_no_wait);
+        for (size_t i = 0; i < n; i++)
+            mongoc_bulk_operation_insert(bulk, buffer->entries[pending[i]].document);
+        bson_t reply;
+        bson_error_t error;
+        insert_errors_t errors = { .buffer = buffer, .pending = pending, .n = n, .retries = retries, .retry = tries > 1, .failed = failed };
+        if (!mongoc_bulk_operation_execute(bulk, &reply, &error)) {
+            if (mongo_each_write_error(&reply, handle_insert_error, &errors) == 0) {
+                // no information about individual documents
+                fprintf(stderr, "[E] bulk insert of %zu %s documents failed on %s: (%d) %s\n",
+                        n, buffer->kind, buffer->db_name, error.code, error.message);
+                for (size_t i = 0; i < n; i++)
+                    failed[pending[i]] = true;
+                buffer->state->updates_failed += n;
+            }
         }
-        bson_append_array(b, safe_key, len, sub);
-        bson_destroy(sub);
-        break;
-    }
-    case json_type_string: {
-        const char *str = json_object_get_string(val);
-        size_t n = json_object_get_string_len(val);
-        if (bson_utf8_validate(str, n, false /* disallow embedded null characters */)) {
-            bson_append_utf8(b, safe_key, len, str, n);
-        } else {
-            fprintf(stderr,
-                    "[W] invalid utf8. context: %s,  key: %s, value[len=%d]: %*s\n",
-                    context, safe_key, (int)n, (int)n, str);
-            // bson_append_binary(b, safe_key, len, BSON_SUBTYPE_BINARY, (uint8_t*)str, n);
-            bson_append_win1252(b, safe_key, len, str, n);
+        bson_destroy(&reply);
+        mongoc_bulk_operation_destroy(bulk);
+        n = 0;
+        if (errors.num_retries > 0 && --tries > 0) {
+            fprintf(stderr, "[W] retrying %zu %s insert operations on %s\n", errors.num_retries, buffer->kind, buffer->db_name);
+            memcpy(pending, retries, errors.num_retries * sizeof(size_t));
+            n = errors.num_retries;
+        }
+    }
+
+    for (size_t i = 0; i < buffer->count; i++) {
+        buffered_document_t *entry = &buffer->entries[i];
+        for (size_t j = 0; j < entry->num_dependents; j++) {
+            if (failed[i])
+                bson_destroy(entry->dependents[j]);
+            else
+                insert_buffer_add(buffer->dependents_buffer, entry->dependents[j], NULL, 0);
         }
-        break;
+        free(entry->dependents);
+        bson_destroy(entry->document);
     }
-    case json_type_null:
-        bson_append_null(b, safe_key, len);
-        break;
-    default:
-        fprintf(stderr, "[E] unexpected json type: %s\n", json_type_to_name(type));
-        break;
+    buffer->count = 0;
+    buffer->bytes = 0;
+}
+
+// takes ownership of document, dependents and the dependents array
+static
+void insert_buffer_add(insert_buffer_t *buffer, bson_t *document, bson_t **dependents, size_t num_dependents)
+{
+    buffered_document_t *entry = &buffer->entries[buffer->count++];
+    entry->document = document;
+    entry->dependents = dependents;
+    entry->num_dependents = num_dependents;
+    buffer->bytes += document->len;
+    if (buffer->count == insert_batch_size || buffer->bytes >= insert_batch_bytes)
+        insert_buffer_flush(buffer);
+}
+
+static
+void flush_buffers(zhash_t *buffers)
+{
+    insert_buffer_t *buffer = zhash_first(buffers);
+    while (buffer) {
+        insert_buffer_flush(buffer);
+        buffer = zhash_next(buffers);
     }
 }
 
 static
-void json_object_to_bson(const char *context, json_object *j, bson_t* b)
+void request_writer_flush_buffers(request_writer_state_t *state)
 {
-  json_object_object_foreach(j, key, val) {
-      json_key_to_bson_key(context, b, val, key);
-  }
+    // requests must be flushed before metrics, as they add metrics documents
+    flush_buffers(state->request_buffers);
+    flush_buffers(state->metrics_buffers);
+    flush_buffers(state->jse_buffers);
+    flush_buffers(state->events_buffers);
 }
 
 static
@@ -248,11 +473,10 @@ bson_t* convert_metrics_for_indexing(json_object *request)
 }
 
 static
-void add_metrics_to_metrics_collection(const char* db_name, stream_info_t* stream_info, bson_t* metrics, const char* page, const char* module, int minute, const char* rid, bson_oid_t* oid, request_writer_state_t* state)
+bson_t** build_metrics_documents(bson_t* metrics, const char* page, const char* module, int minute, const char* rid, bson_oid_t* oid, size_t *count)
 {
-    mongoc_collection_t *metrics_collection = request_writer_get_metrics_collection(state, db_name, stream_info);
     size_t n = bson_count_keys(metrics);
-    bson_t *docs[n];
+    bson_t **docs = zmalloc(n * sizeof(bson_t*));
     bson_iter_t iter;
     bson_iter_init(&iter, metrics);
     bson_t** p = docs;
@@ -277,32 +501,13 @@ void add_metrics_to_metrics_collection(const char* db_name, stream_info_t* strea
         }
         p++;
     }
-    if (!dryrun) {
-        bson_t *opts = NULL;
-        bson_t reply;
-        bson_error_t error;
-        bool ok = mongoc_collection_insert_many(metrics_collection, (const bson_t**)docs, n, opts, &reply, &error);
-        if (!ok) {
-            size_t m;
-            char* bjs = bson_as_json(metrics, &m);
-            char *reply_str = bson_as_json(&reply, NULL);
-            fprintf(stderr,
-                    "[E] could not insert metrics on %s: (%d) %s\n"
-                    "[E] metrics document size: %zu; value: %s\n"
-                    "[E] reply: %s\n",
-                    db_name, error.code, error.message, n, bjs, reply_str);
-            bson_free(bjs);
-            bson_free(reply_str);
-            state->updates_failed++;
-        }
-    }
-    for (size_t i=0; i<n; i++) {
-        bson_destroy(docs[i]);
-    }
+    *count = n;
+    return docs;
 }
 
 static
-json_object* store_request(const char* db_name, stream_info_t* stream_info, json_object* request, const char* module, sampling_reason_t sampling_reason, request_writer_state_t* state)
+json_object* store_request(const char* db_name, stream_info_t* stream_info, json_object* request,
+                           const char *raw, size_t raw_len, json_object *raw_members, const char* module, sampling_reason_t sampling_reason, request_writer_state_t* state)
 {
     // dump_json_object(stdout, "[D]", request);
     bson_t *metrics = convert_metrics_for_indexing(request);
@@ -313,6 +518,7 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
         bson_free(bs);
     }
     mongoc_collection_t *requests_collection = request_writer_get_request_collection(state, db_name, stream_info);
+    insert_buffer_t *buffer = request_writer_get_buffer(state, state->request_buffers, "request", db_name, requests_collection);
     bson_t *document = bson_sized_new(2048);
 
     json_object *request_id_obj;
@@ -343,7 +549,7 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
         size_t n = 1024;
         char context[n];
         snprintf(context, n, "%s:%s", db_name, request_id);
-        json_object_to_bson(context, request, document);
+        request_to_bson(context, request, raw, raw_len, raw_members, document);
     }
 
     // size_t n;
@@ -351,40 +557,23 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
     // printf("[D] doument. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    bool update_failed = false;
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_insert(requests_collection, MONGOC_INSERT_NONE, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying request insert operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] insert failed for request document with rid '%s' on %s: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        request_id, db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-                update_failed = true;
-                state->updates_failed++;
-            }
-        }
-    }
-    bson_destroy(document);
-
+    // metrics documents get inserted once the request has been inserted
+    bson_t **metrics_docs = NULL;
+    size_t num_metrics_docs = 0;
     json_object *page_obj;
-    if (!update_failed && json_object_object_get_ex(request, "page", &page_obj)) {
+    if (json_object_object_get_ex(request, "page", &page_obj)) {
         const char* page = json_object_get_string(page_obj);
         json_object *minute_obj;
         if (json_object_object_get_ex(request, "minute", &minute_obj)) {
             int minute = json_object_get_int(minute_obj);
-            if (sampling_reason & (SAMPLE_SLOW_REQUEST|SAMPLE_HEAP_GROWTH))
-                add_metrics_to_metrics_collection(db_name, stream_info, metrics, page, module, minute, request_id, oid, state);
+            if (sampling_reason & (SAMPLE_SLOW_REQUEST|SAMPLE_HEAP_GROWTH)) {
+                mongoc_collection_t *metrics_collection = request_writer_get_metrics_collection(state, db_name, stream_info);
+                buffer->dependents_buffer = request_writer_get_buffer(state, state->metrics_buffers, "metrics", db_name, metrics_collection);
+                metrics_docs = build_metrics_documents(metrics, page, module, minute, request_id, oid, &num_metrics_docs);
+            }
         }
     }
+    insert_buffer_add(buffer, document, metrics_docs, num_metrics_docs);
 
     if (oid)
         free(oid);
@@ -397,36 +586,17 @@ static
 void store_js_exception(const char* db_name, stream_info_t *stream_info, json_object* request, request_writer_state_t* state)
 {
     mongoc_collection_t *jse_collection = request_writer_get_jse_collection(state, db_name, stream_info);
+    insert_buffer_t *buffer = request_writer_get_buffer(state, state->jse_buffers, "exception", db_name, jse_collection);
     bson_t *document = bson_sized_new(1024);
     json_object_to_bson("js_exception", request, document);
-
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_insert(jse_collection, MONGOC_INSERT_NONE, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying exception insert operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] insert failed for exception document on %s: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-                state->updates_failed++;
-            }
-        }
-    }
-    bson_destroy(document);
+    insert_buffer_add(buffer, document, NULL, 0);
 }
 
 static
 void store_event(const char* db_name, stream_info_t *stream_info, json_object* request, request_writer_state_t* state)
 {
     mongoc_collection_t *events_collection = request_writer_get_events_collection(state, db_name, stream_info);
+    insert_buffer_t *buffer = request_writer_get_buffer(state, state->events_buffers, "event", db_name, events_collection);
     bson_t *document = bson_sized_new(1024);
     json_object_to_bson("event", request, document);
 
@@ -461,27 +631,7 @@ void store_event(const char* db_name, stream_info_t *stream_info, json_object* r
         json_object_to_bson(context, request, document);
     }
 
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_insert(events_collection, MONGOC_INSERT_NONE, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying event insert operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] insert failed for event document on %s: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-                state->updates_failed++;
-            }
-        }
-    }
-    bson_destroy(document);
+    insert_buffer_add(buffer, document, NULL, 0);
 }
 
 static
@@ -562,46 +712,23 @@ void request_writer_publish_error(stream_info_t* stream_info, const char* module
 }
 
 static
-void handle_request_msg(zmsg_t* msg, request_writer_state_t* state)
-{
-    zframe_t *db_frame = zmsg_first(msg);
-    zframe_t *type_frame = zmsg_next(msg);
-    zframe_t *mod_frame = zmsg_next(msg);
-    zframe_t *body_frame = zmsg_next(msg);
-    zframe_t *stream_frame = zmsg_next(msg);
-    zframe_t *sampling_frame = zmsg_next(msg);
-
-    size_t db_name_len = zframe_size(db_frame);
-    char db_name[db_name_len+1];
-    memcpy(db_name, zframe_data(db_frame), db_name_len);
-    db_name[db_name_len] = '\0';
+void handle_writer_task(writer_task_t *task, request_writer_state_t* state)
+{
+    const char *db_name = task->db_name;
+    const char *module = task->module;
+    stream_info_t *stream_info = task->stream_info;
+    json_object *request = task->request, *request_id;
     // printf("[D] request_writer: db name: %s\n", db_name);
-
-    stream_info_t *stream_info;
-    assert(zframe_size(stream_frame) == sizeof(stream_info_t*));
-    memcpy(&stream_info, zframe_data(stream_frame), sizeof(stream_info_t*));
     // printf("[D] request_writer: stream name: %s\n", stream_info->key);
-
-    size_t mod_len = zframe_size(mod_frame);
-    char module[mod_len+1];
-    memcpy(module, zframe_data(mod_frame), mod_len);
-    module[mod_len] = '\0';
-
-    json_object *request, *request_id;
-    assert(zframe_size(body_frame) == sizeof(json_object*));
-    memcpy(&request, zframe_data(body_frame), sizeof(json_object*));
     // dump_json_object(stdout, "[D]", request);
 
-    sampling_reason_t sampling_reason = 0;
-
-    assert(zframe_size(type_frame) == 1);
-    char task_type = *((char*)zframe_data(type_frame));
+    char task_type = task->type;
 
     if (!dryrun) {
         switch (task_type) {
         case 'r':
-            memcpy(&sampling_reason, zframe_data(sampling_frame), sizeof(sampling_reason_t));
-            request_id = store_request(db_name, stream_info, request, module, sampling_reason, state);
+            request_id = store_request(db_name, stream_info, request, task->raw, task->raw_len, task->raw_members,
+                                       module, task->sampling_reason, state);
             request_writer_publish_error(stream_info, module, request, state, request_id);
             break;
         case 'j':
@@ -615,6 +742,24 @@ void handle_request_msg(zmsg_t* msg, request_writer_state_t* state)
         }
     }
     json_object_put(request);
+    if (task->raw_members)
+        json_object_put(task->raw_members);
+}
+
+// handles a limited number of tasks, so that commands on the pipe don't starve
+static
+void request_writer_handle_tasks(request_writer_state_t* state)
+{
+    writer_task_t *task;
+    for (int i = 0; i < WRITER_TASK_BATCH_SIZE && (task = mpmc_queue_pop(task_queue)); i++) {
+        int64_t start_time_us = zclock_usecs();
+        handle_writer_task(task, state);
+        writer_task_release(task);
+        __sync_sub_and_fetch(&queued_inserts, 1);
+        int64_t end_time_us = zclock_usecs();
+        state->updates_count++;
+        state->update_time += end_time_us - start_time_us;
+    }
 }
 
 static
@@ -634,6 +779,10 @@ request_writer_state_t* request_writer_state_new(zconfig_t *config, size_t id)
     state->metrics_collections = zhash_new();
     state->jse_collections = zhash_new();
     state->events_collections = zhash_new();
+    state->request_buffers = zhash_new();
+    state->metrics_buffers = zhash_new();
+    state->jse_buffers = zhash_new();
+    state->events_buffers = zhash_new();
     state->statsd_client = statsd_client_new(config, state->me);
     return state;
 }
@@ -645,6 +794,11 @@ void request_writer_state_destroy(request_writer_state_t **state_p)
     // must not destroy the pipe, as it's owned by the actor
     zsock_destroy(&state->pull_socket);
     zsock_destroy(&state->live_stream_socket);
+    request_writer_flush_buffers(state);
+    zhash_destroy(&state->request_buffers);
+    zhash_destroy(&state->metrics_buffers);
+    zhash_destroy(&state->jse_buffers);
+    zhash_destroy(&state->events_buffers);
     zhash_destroy(&state->request_collections);
     zhash_destroy(&state->metrics_collections);
     zhash_destroy(&state->jse_collections);
@@ -675,15 +829,23 @@ static void request_writer(zsock_t *pipe, void *args)
     assert(poller);
 
     while (!zsys_interrupted) {
+        request_writer_handle_tasks(state);
         // printf("[D] writer [%zu]: polling\n", id);
-        // we wait for at most one second
-        void *socket = zpoller_wait(poller, 1000);
+        // we wait for at most one second, unless tasks were queued before
+        // parsers could see that we're idle
+        __sync_add_and_fetch(&idle_writers, 1);
+        int timeout = mpmc_queue_size(task_queue) ? 0 : 1000;
+        void *socket = zpoller_wait(poller, timeout);
+        __sync_sub_and_fetch(&idle_writers, 1);
         zmsg_t *msg = NULL;
         if (socket == state->pipe) {
             msg = zmsg_recv(state->pipe);
             char *cmd = zmsg_popstr(msg);
             zmsg_destroy(&msg);
             if (streq(cmd, "tick")) {
+                int64_t start_time_us = zclock_usecs();
+                request_writer_flush_buffers(state);
+                state->update_time += zclock_usecs() - start_time_us;
                 if (verbose && (state->updates_count || state->update_time))
                     printf("[I] writer [%zu]: tick (%d requests, %d ms)\n", id, state->updates_count, state->update_time/1000);
                 statsd_client_count(state->statsd_client, "importer.inserts.count", state->updates_count);
@@ -701,6 +863,15 @@ static void request_writer(zsock_t *pipe, void *args)
                 // free collection pointers every hour
                 if (ticks % COLLECTION_REFRESH_INTERVAL == COLLECTION_REFRESH_INTERVAL - id - 1) {
                     printf("[I] writer [%zu]: freeing request collections\n", id);
+                    // buffers refer to the collections, but have just been flushed
+                    zhash_destroy(&state->request_buffers);
+                    zhash_destroy(&state->metrics_buffers);
+                    zhash_destroy(&state->jse_buffers);
+                    zhash_destroy(&state->events_buffers);
+                    state->request_buffers = zhash_new();
+                    state->metrics_buffers = zhash_new();
+                    state->jse_buffers = zhash_new();
+                    state->events_buffers = zhash_new();
                     zhash_destroy(&state->request_collections);
                     zhash_destroy(&state->jse_collections);
                     zhash_destroy(&state->events_collections);
@@ -721,16 +892,10 @@ static void request_writer(zsock_t *pipe, void *args)
                 assert(false);
             }
         } else if (socket == state->pull_socket) {
-            msg = zmsg_recv(state->pull_socket);
-            if (msg != NULL) {
-                int64_t start_time_us = zclock_usecs();
-                handle_request_msg(msg, state);
-                zmsg_destroy(&msg);
-                __sync_sub_and_fetch(&queued_inserts, 1);
-                int64_t end_time_us = zclock_usecs();
-                state->updates_count++;
-                state->update_time += end_time_us - start_time_us;
-            }
+            // swallow all pending doorbells. tasks get handled at the top of the loop.
+            char bell;
+            while (zmq_recv(zsock_resolve(state->pull_socket), &bell, sizeof(bell), ZMQ_DONTWAIT) >= 0)
+                ;
         } else if (socket) {
             // if socket is not null, something is horribly broken
             printf("[E] writer [%zu]: broken poller. committing suicide.\n", id);
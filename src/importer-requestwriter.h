@@ -2,11 +2,41 @@
 #define __LOGJAM_IMPORTER_REQUEST_WRITER_H_INCLUDED__
 
 #include "importer-common.h"
+#include "importer-streaminfo.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define WRITER_TASK_NAME_SIZE 256
+#define WRITER_QUEUE_CAPACITY (64 * 1024)
+
+// Work item handed from parsers to the request writers. Tasks are recycled
+// through a shared pool and passed to the writers through a lock free queue.
+typedef struct {
+    char type;                               // 'r' (request), 'j' (js exception) or 'e' (event)
+    sampling_reason_t sampling_reason;       // only used for requests
+    json_object *request;                    // reference owned by the task
+    stream_info_t *stream_info;
+    char *raw;                               // raw request body, kept when the task gets recycled
+    size_t raw_len;
+    json_object *raw_members;                // members built from the raw body, reference owned by the task
+    size_t raw_size;
+    char db_name[WRITER_TASK_NAME_SIZE];
+    char module[WRITER_TASK_NAME_SIZE];
+} writer_task_t;
+
+// the queue must be set up before parsers and writers are started and
+// destroyed after all of them have terminated
+extern void request_writer_queue_init();
+extern void request_writer_queue_destroy();
+
+extern writer_task_t* writer_task_new(char type, const char *db_name, const char *module, json_object *request, stream_info_t *stream_info);
+// takes ownership of raw_members (see parser_complete_request). does nothing if it is NULL.
+extern void writer_task_set_raw(writer_task_t *task, const char *raw, size_t raw_len, json_object *raw_members);
+// doorbell is a PUSH socket connected to all writers, used to wake up idle ones
+extern void writer_task_submit(writer_task_t *task, zsock_t *doorbell);
+
 extern zactor_t* request_writer_new(zconfig_t *config, size_t id);
 
 #ifdef __cplusplus
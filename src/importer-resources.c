@@ -37,6 +37,11 @@ size_t last_dom_resource_offset = 0;
 size_t allocated_objects_index, allocated_bytes_index;
 size_t total_time_index, page_time_index, ajax_time_index;
 
+int16_t resource_hash_slots[RESOURCE_HASH_MAX_SIZE];
+uint32_t resource_hash_mask = 0;
+uint32_t resource_hash_seed = 0;
+int16_t resource_next_duplicate[MAX_RESOURCE_COUNT];
+
 static
 void add_resources_of_type(zconfig_t* config, const char *type, char **type_map, size_t *type_idx, size_t *type_offset)
 {
@@ -49,7 +54,15 @@ void add_resources_of_type(zconfig_t* config, const char *type, char **type_map,
     assert(metric);
     do {
         char *resource = zconfig_name(metric);
-        zhash_insert(resource_to_int, resource, (void*)last_resource_offset);
+        // the hash maps names to their first index, later ones get chained to it
+        resource_next_duplicate[last_resource_offset] = -1;
+        if (zhash_insert(resource_to_int, resource, (void*)last_resource_offset)) {
+            fprintf(stderr, "[W] resource %s is listed more than once, also in %s\n", resource, path);
+            size_t i = r2i(resource);
+            while (resource_next_duplicate[i] >= 0)
+                i = resource_next_duplicate[i];
+            resource_next_duplicate[i] = last_resource_offset;
+        }
         int_to_resource[last_resource_offset] = resource;
         char resource_sq[256] = {'\0'};
         strcpy(resource_sq, resource);
@@ -88,6 +101,46 @@ void add_resources_of_type(zconfig_t* config, const char *type, char **type_map,
     // }
 }
 
+static
+bool try_resource_hash_seed(uint32_t seed, uint32_t mask)
+{
+    for (size_t i=0; i<=mask; i++)
+        resource_hash_slots[i] = -1;
+    for (size_t j=0; j<=last_resource_offset; j++) {
+        if (r2i(int_to_resource[j]) != j)
+            continue;
+        uint32_t slot = resource_hash(int_to_resource[j], seed) & mask;
+        if (resource_hash_slots[slot] >= 0)
+            return false;
+        resource_hash_slots[slot] = j;
+    }
+    return true;
+}
+
+static
+void setup_resource_hash()
+{
+    // start with a load factor of at most 1/4 and double the table size
+    // whenever we can't find a collision free seed after a number of tries
+    size_t size = 4;
+    while (size < 4 * (last_resource_offset + 1))
+        size *= 2;
+    for (; size <= RESOURCE_HASH_MAX_SIZE; size *= 2) {
+        uint32_t mask = size - 1;
+        for (uint32_t seed = 0; seed < 10000; seed++) {
+            if (try_resource_hash_seed(seed, mask)) {
+                resource_hash_seed = seed;
+                resource_hash_mask = mask;
+                if (debug)
+                    printf("[D] resource hash: size=%zu, seed=%u\n", size, seed);
+                return;
+            }
+        }
+    }
+    fprintf(stderr, "[E] could not construct perfect hash for resources\n");
+    assert(false);
+}
+
 static
 void dump_resource_maps()
 {
@@ -136,5 +189,70 @@ void setup_resource_maps(zconfig_t* config)
     page_time_index = r2i("page_time");
     ajax_time_index = r2i("ajax_time");
 
+    setup_resource_hash();
+
     if (debug) dump_resource_maps();
 }
+
+// sets up the resource maps from a small configuration, unless they have already
+// been set up. resources can only be set up once per process.
+void setup_test_resource_maps()
+{
+    if (resource_to_int)
+        return;
+    const char *metrics[] = {
+        "time/total_time", "time/gc_time", "time/other_time", "time/db_time", "time/view_time",
+        "call/db_calls", "call/gc_calls",
+        "memory/allocated_objects", "memory/allocated_bytes",
+        "heap/heap_size", "heap/gc_calls",
+        "frontend/page_time", "frontend/ajax_time",
+        "dom/html_nodes",
+        NULL
+    };
+    zconfig_t *config = zconfig_new("root", NULL);
+    for (const char **m = metrics; *m; m++) {
+        char path[256];
+        snprintf(path, sizeof(path), "metrics/%s", *m);
+        zconfig_put(config, path, "");
+    }
+    setup_resource_maps(config);
+    // not destroyed, as resource names point into it
+}
+
+void importer_resources_test(int verbose)
+{
+    printf(" * importer-resources: ");
+    if (verbose)
+        printf("\n");
+
+    setup_test_resource_maps();
+    assert(last_resource_offset == 13);
+    assert(last_time_resource_offset == 4);
+    assert(last_frontend_resource_offset == 12);
+
+    // every name maps to its first index, duplicates can be reached from there
+    for (size_t i = 0; i <= last_resource_offset; i++) {
+        const char *name = i2r(i);
+        int first = resource_index(name);
+        assert(first >= 0 && first <= i);
+        assert(first == r2i(name));
+        assert(streq(i2r(first), name));
+        bool found = false;
+        for (int j = first; j >= 0; j = resource_next_duplicate[j])
+            found |= j == i;
+        assert(found);
+        if (verbose)
+            printf("   %s: %zu (first %d)\n", name, i, first);
+    }
+    int gc_calls = resource_index("gc_calls");
+    assert(gc_calls == 6);
+    assert(resource_next_duplicate[gc_calls] == 10);
+    assert(resource_next_duplicate[10] == -1);
+    assert(resource_next_duplicate[resource_index("total_time")] == -1);
+
+    const char *misses[] = { "", "total", "total_tim", "total_time_", "Total_time", "lines", "gc_calls.", NULL };
+    for (const char **m = misses; *m; m++)
+        assert(resource_index(*m) == -1);
+
+    printf("OK\n");
+}
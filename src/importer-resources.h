@@ -45,20 +45,58 @@ extern size_t last_dom_resource_offset;
 extern size_t allocated_objects_index, allocated_bytes_index;
 extern size_t total_time_index, page_time_index, ajax_time_index;
 
+// perfect hash table mapping resource names to resource indexes. built once
+// by setup_resource_maps, so that we can map the keys of a request to
+// resources with exactly one probe and one string comparison.
+#define RESOURCE_HASH_MAX_SIZE 1024
+extern int16_t resource_hash_slots[RESOURCE_HASH_MAX_SIZE];
+extern uint32_t resource_hash_mask;
+extern uint32_t resource_hash_seed;
+
+// resources can be listed under several types. the hash maps their name to the
+// first index, from which the others can be reached by following this list,
+// which ends with -1.
+extern int16_t resource_next_duplicate[MAX_RESOURCE_COUNT];
+
 // setup bidirectional mapping between resource names and small integers
 extern void setup_resource_maps(zconfig_t* config);
+extern void setup_test_resource_maps();
 
 static inline size_t r2i(const char* resource)
 {
     return (size_t)zhash_lookup(resource_to_int, resource);
 }
 
+static inline uint32_t resource_hash(const char* s, uint32_t seed)
+{
+    // FNV-1a, with the offset basis perturbed by the seed
+    uint32_t h = 2166136261U ^ seed;
+    unsigned char c;
+    while ((c = *s++)) {
+        h ^= c;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// returns the first resource index for the given name, or -1 if it isn't a resource
+static inline int resource_index(const char* name)
+{
+    uint32_t h = resource_hash(name, resource_hash_seed);
+    int i = resource_hash_slots[h & resource_hash_mask];
+    if (i >= 0 && !strcmp(name, int_to_resource[i]))
+        return i;
+    return -1;
+}
+
 static inline const char* i2r(size_t i)
 {
     assert(i <= last_resource_offset);
     return (const char*)(int_to_resource[i]);
 }
 
+extern void importer_resources_test(int verbose);
+
 #ifdef __cplusplus
 }
 #endif
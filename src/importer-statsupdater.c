@@ -3,6 +3,7 @@
 #include "importer-streaminfo.h"
 #include "importer-indexer.h"
 #include "importer-resources.h"
+#include "importer-aggtable.h"
 #include "importer-mongoutils.h"
 #include "importer-parser.h"
 #include "prometheus-client.h"
@@ -33,6 +34,10 @@ typedef struct {
     int updates_count;     // updates performend since last tick
     int update_time;       // processing time since last tick (micro seconds)
     statsd_client_t *statsd_client;
+    bson_t **batch_selectors;  // selectors of the current update batch
+    bson_t **batch_documents;  // documents of the current update batch
+    size_t *batch_pending;     // used by batch_execute
+    size_t *batch_retries;
 } stats_updater_state_t;
 
 typedef struct {
@@ -43,13 +48,114 @@ typedef struct {
     mongoc_collection_t *agents;
 } stats_collections_t;
 
+// Updates are collected into batches of at most update_batch_size upserts,
+// which are sent to the database as one unordered bulk operation. The
+// callback owns selectors and documents until the batch has been executed.
 typedef struct {
     const char *db_name;
+    const char *collection_name;
     mongoc_collection_t *collection;
+    bson_t **selectors;
+    bson_t **documents;
+    size_t count;
+    size_t *pending;           // indexes of the updates to send, of size update_batch_size
+    size_t *retries;
 } collection_update_callback_t;
 
 typedef int (updater_foreach_fn) (const char *key, void *item, void *argument);
 
+static
+void report_update_failure(collection_update_callback_t *cb, int code, const char *message, bson_t *document)
+{
+    size_t n;
+    char* bjs = bson_as_json(document, &n);
+    fprintf(stderr,
+            "[E] update failed for %s on %s: (%d) %s\n"
+            "[E] document size: %zu; value: %s\n",
+            cb->db_name, cb->collection_name, code, message, n, bjs);
+    bson_free(bjs);
+}
+
+typedef struct {
+    collection_update_callback_t *cb;
+    size_t *pending;   // batch indexes of the updates sent in the last bulk operation
+    size_t n;          // number of updates sent in the last bulk operation
+    size_t *retries;   // batch indexes of updates which need to be retried
+    size_t failed;     // number of updates which need to be retried
+    bool retry;        // whether Toku lock failures should be retried
+} batch_errors_t;
+
+static
+void handle_update_error(uint32_t index, int code, const char *message, void *arg)
+{
+    batch_errors_t *errors = arg;
+    if (index >= errors->n)
+        return;
+    size_t i = errors->pending[index];
+    if (errors->retry && code == TOKU_TX_LOCK_FAILED)
+        errors->retries[errors->failed++] = i;
+    else
+        report_update_failure(errors->cb, code, message, errors->cb->documents[i]);
+}
+
+static
+void batch_execute(collection_update_callback_t *cb)
+{
+    size_t n = cb->count;
+    if (n == 0)
+        return;
+
+    if (!dryrun) {
+        size_t *pending = cb->pending, *retries = cb->retries;
+        for (size_t i = 0; i < n; i++)
+            pending[i] = i;
+        int tries = TOKU_TX_RETRIES;
+        while (n > 0) {
+            mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation(cb->collection, false, wc_no_wait);
+            for (size_t i = 0; i < n; i++)
+                mongoc_bulk_operation_update(bulk, cb->selectors[pending[i]], cb->documents[pending[i]], true);
+            bson_t reply;
+            bson_error_t error;
+            batch_errors_t errors = { .cb = cb, .pending = pending, .n = n, .retries = retries, .retry = tries > 1 };
+            if (!mongoc_bulk_operation_execute(bulk, &reply, &error)) {
+                if (mongo_each_write_error(&reply, handle_update_error, &errors) == 0)
+                    fprintf(stderr, "[E] bulk update failed for %s on %s: (%d) %s\n",
+                            cb->db_name, cb->collection_name, error.code, error.message);
+            }
+            bson_destroy(&reply);
+            mongoc_bulk_operation_destroy(bulk);
+            n = 0;
+            if (errors.failed > 0 && --tries > 0) {
+                fprintf(stderr, "[W] retrying %zu %s update operations on %s\n", errors.failed, cb->collection_name, cb->db_name);
+                memcpy(pending, retries, errors.failed * sizeof(size_t));
+                n = errors.failed;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < cb->count; i++) {
+        bson_destroy(cb->selectors[i]);
+        bson_destroy(cb->documents[i]);
+    }
+    cb->count = 0;
+}
+
+static
+void batch_add_update(collection_update_callback_t *cb, bson_t *selector, bson_t *document)
+{
+    cb->selectors[cb->count] = selector;
+    cb->documents[cb->count] = document;
+    if (++cb->count == update_batch_size)
+        batch_execute(cb);
+}
+
+static
+void append_counter_to_bson(const char *key, size_t key_len, int value, void *arg)
+{
+    bson_t *incs = arg;
+    bson_append_int32(incs, key, key_len, value);
+}
+
 static
 bson_t* increments_to_bson(const char* namespace, increments_t* increments)
 {
@@ -76,32 +182,19 @@ bson_t* increments_to_bson(const char* namespace, increments_t* increments)
 
     bool have_maxs = false;
     for (size_t i=0; i<=last_resource_offset; i++) {
-        double val = increments->metrics[i].val;
+        double val = increments->metrics.val[i];
         if (val > 0) {
             const char *name = int_to_resource[i];
             bson_append_double(incs, name, strlen(name), val);
             const char *name_sq = int_to_resource_sq[i];
-            bson_append_double(incs, name_sq, strlen(name_sq), increments->metrics[i].val_squared);
+            bson_append_double(incs, name_sq, strlen(name_sq), increments->metrics.val_squared[i]);
             have_maxs = true;
             const char *name_max = int_to_resource_max[i];
-            bson_append_double(maxs, name_max, strlen(name_max), increments->metrics[i].val_max);
+            bson_append_double(maxs, name_max, strlen(name_max), increments->metrics.val_max[i]);
         }
     }
 
-    json_object_object_foreach(increments->others, key, value_obj) {
-        size_t n = strlen(key);
-        enum json_type type = json_object_get_type(value_obj);
-        switch (type) {
-        case json_type_int:
-            bson_append_int32(incs, key, n, json_object_get_int(value_obj));
-            break;
-        case json_type_double:
-            bson_append_double(incs, key, n, json_object_get_double(value_obj));
-            break;
-        default:
-            fprintf(stderr, "[E] unsupported json type in json to bson conversion: %s, key: %s\n", json_type_to_name(type), key);
-        }
-    }
+    counters_each(&increments->others, append_counter_to_bson, incs);
 
     bson_t *document = bson_new();
     bson_append_document(document, "$inc", 4, incs);
@@ -120,23 +213,14 @@ bson_t* increments_to_bson(const char* namespace, increments_t* increments)
 }
 
 static
-int minutes_add_increments(const char* namespace, void* data, void* arg)
+void minutes_add_increments(const char* namespace, agg_key_t key, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     increments_t* increments = data;
-
-    int minute = 0;
-    char* p = (char*) namespace;
-    while (isdigit(*p)) {
-        minute *= 10;
-        minute += *(p++) - '0';
-    }
-    p++;
+    int minute = agg_key_minute(key);
 
     bson_t *selector = bson_new();
-    assert( bson_append_utf8(selector, "page", 4, p, strlen(p)) );
+    assert( bson_append_utf8(selector, "page", 4, namespace, strlen(namespace)) );
     assert( bson_append_int32(selector, "minute", 6, minute ) );
 
     // size_t n;
@@ -145,36 +229,13 @@ int minutes_add_increments(const char* namespace, void* data, void* arg)
     // bson_free(bs);
 
     bson_t *document = increments_to_bson(namespace, increments);
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying minutes update operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] update failed for %s on minutes: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-            }
-        }
-    }
-    bson_destroy(selector);
-    bson_destroy(document);
-    return 0;
+    batch_add_update(cb, selector, document);
 }
 
 static
-int totals_add_increments(const char* namespace, void* data, void* arg)
+void totals_add_increments(const char* namespace, agg_key_t key, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     increments_t* increments = data;
     assert(increments);
 
@@ -187,55 +248,25 @@ int totals_add_increments(const char* namespace, void* data, void* arg)
     // bson_free(bs);
 
     bson_t *document = increments_to_bson(namespace, increments);
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying totals update operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] update failed for %s on totals: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-            }
-        }
-    }
-
-    bson_destroy(selector);
-    bson_destroy(document);
-    return 0;
+    batch_add_update(cb, selector, document);
 }
 
 static
-int quants_add_quants(const char* namespace, void* data, void* arg)
+void quants_add_quants(const char* namespace, agg_key_t key, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
-
-    // extract keys from namespace: kind-quant-page
-    char* p = (char*) namespace;
-    char kind[2];
-    kind[0] = *(p++);
-    kind[1] = '\0';
-
-    p++; // skip '-'
-    size_t quant = 0;
-    while (isdigit(*p)) {
-        quant *= 10;
-        quant += *(p++) - '0';
+
+    char kind = agg_key_quant_kind(key);
+    size_t quant = agg_bucket_value(agg_key_quant_bucket(key));
+    // allocated bytes are stored as kind 'm', in units of KB
+    if (kind == 'b') {
+        kind = 'm';
+        quant *= 1024;
     }
-    p++; // skip '-'
 
     bson_t *selector = bson_new();
-    bson_append_utf8(selector, "page", 4, p, strlen(p));
-    bson_append_utf8(selector, "kind", 4, kind, 1);
+    bson_append_utf8(selector, "page", 4, namespace, strlen(namespace));
+    bson_append_utf8(selector, "kind", 4, &kind, 1);
     bson_append_int32(selector, "quant", 5, quant);
 
     // size_t n;
@@ -244,11 +275,11 @@ int quants_add_quants(const char* namespace, void* data, void* arg)
     // bson_free(bs);
 
     bson_t *incs = bson_new();
-    size_t *quants = data;
-    for (int i=0; i <= last_resource_offset; i++) {
-        if (quants[i] > 0) {
-            const char *resource = i2r(i);
-            bson_append_int32(incs, resource, -1, quants[i]);
+    agg_quants_t *quants = data;
+    for (size_t i=0; i < quants->count; i++) {
+        if (quants->counts[i] > 0) {
+            const char *resource = i2r(quants->first + i);
+            bson_append_int32(incs, resource, -1, quants->counts[i]);
         }
     }
     bson_t *document = bson_new();
@@ -259,61 +290,23 @@ int quants_add_quants(const char* namespace, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying quants update operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] update failed for %s on quants: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-            }
-        }
-    }
-    bson_destroy(selector);
+    batch_add_update(cb, selector, document);
     bson_destroy(incs);
-    bson_destroy(document);
-    return 0;
 }
 
 static
-int histograms_add_histograms(const char* namespace, void* data, void* arg)
+void histograms_add_histograms(const char* namespace, agg_key_t key, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
-
-    // extract details from key: minute-resource-page
-    char* p = (char*) namespace;
-    // extract minute
-    size_t minute = 0;
-    while (isdigit(*p)) {
-        minute *= 10;
-        minute += *(p++) - '0';
-    }
-    p++; // skip '-'
-    // p now points to the resource
-    char resource[256];
-    char *r = resource;
-    while (*p != '-') {
-        *(r++) = *(p++);
-    }
-    *r = 0;
-    p++; // skip '-'
 
-    // printf("[D] %s: %zu-%s-%s\n", db_name, minute, resource, p);
+    size_t minute = agg_key_minute(key);
+    const char *resource = i2r(agg_key_sub(key));
+
+    // printf("[D] %s: %zu-%s-%s\n", db_name, minute, resource, namespace);
 
     // add the increments
     bson_t *selector = bson_new();
-    bson_append_utf8(selector, "page", 4, p, strlen(p));
+    bson_append_utf8(selector, "page", 4, namespace, strlen(namespace));
     bson_append_int32(selector, "minute", 6, minute);
 
     // size_t n1;
@@ -338,38 +331,14 @@ int histograms_add_histograms(const char* namespace, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n2, bs2);
     // bson_free(bs2);
 
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying histograms update operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] update failed for %s on histograms: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-            }
-        }
-    }
-    bson_destroy(selector);
+    batch_add_update(cb, selector, document);
     bson_destroy(incs);
-    bson_destroy(document);
-
-    return 0;
 }
 
 static
 int agents_add_agent(const char* agent, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     user_agent_stats_t *stats = data;
 
     const char* agent_ptr;
@@ -417,27 +386,7 @@ int agents_add_agent(const char* agent, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    if (!dryrun) {
-        bson_error_t error;
-        int tries = TOKU_TX_RETRIES;
-    retry:
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            if ((error.code == TOKU_TX_LOCK_FAILED) && (--tries > 0)) {
-                fprintf(stderr, "[W] retrying agents update operation on %s\n", db_name);
-                goto retry;
-            } else {
-                size_t n;
-                char* bjs = bson_as_json(document, &n);
-                fprintf(stderr,
-                        "[E] update failed for %s on agents: (%d) %s\n"
-                        "[E] document size: %zu; value: %s\n",
-                        db_name, error.code, error.message, n, bjs);
-                bson_free(bjs);
-            }
-        }
-    }
-    bson_destroy(selector);
-    bson_destroy(document);
+    batch_add_update(cb, selector, document);
     return 0;
 }
 
@@ -507,6 +456,10 @@ stats_updater_state_t* stats_updater_state_new(zconfig_t *config, size_t id)
     }
     state->stats_collections = zhash_new();
     state->statsd_client = statsd_client_new(config, state->me);
+    state->batch_selectors = zmalloc(update_batch_size * sizeof(bson_t*));
+    state->batch_documents = zmalloc(update_batch_size * sizeof(bson_t*));
+    state->batch_pending = zmalloc(update_batch_size * sizeof(size_t));
+    state->batch_retries = zmalloc(update_batch_size * sizeof(size_t));
     return state;
 }
 
@@ -520,6 +473,10 @@ void stats_updater_state_destroy(stats_updater_state_t **state_p)
         mongoc_client_destroy(state->mongo_clients[i]);
     }
     statsd_client_destroy(&state->statsd_client);
+    free(state->batch_selectors);
+    free(state->batch_documents);
+    free(state->batch_pending);
+    free(state->batch_retries);
     free(state);
     *state_p = NULL;
 }
@@ -615,40 +572,58 @@ static void stats_updater(zsock_t *pipe, void *args)
             assert(zframe_size(stream_frame) == sizeof(stream_info));
             memcpy(&stream_info, zframe_data(stream_frame), sizeof(stream_info));
 
-            zhash_t *updates;
+            // agents are sent as zhash_t*, all others as agg_table_t*
+            void *updates;
             assert(zframe_size(hash_frame) == sizeof(updates));
             memcpy(&updates, zframe_data(hash_frame), sizeof(updates));
+            agg_table_t *agg_updates = updates;
+            zhash_t *hash_updates = updates;
 
             stats_collections_t *collections = stats_updater_get_collections(state, db_name, stream_info);
             collection_update_callback_t cb;
             cb.db_name = db_name;
+            cb.selectors = state->batch_selectors;
+            cb.documents = state->batch_documents;
+            cb.pending = state->batch_pending;
+            cb.retries = state->batch_retries;
+            cb.count = 0;
 
             switch (task_type) {
             case 't':
                 cb.collection = collections->totals;
-                update_collection(updates, totals_add_increments, &cb);
+                cb.collection_name = "totals";
+                agg_table_each(agg_updates, totals_add_increments, &cb);
+                agg_table_destroy(&agg_updates);
                 break;
             case 'm':
                 cb.collection = collections->minutes;
-                update_collection(updates, minutes_add_increments, &cb);
+                cb.collection_name = "minutes";
+                agg_table_each(agg_updates, minutes_add_increments, &cb);
+                agg_table_destroy(&agg_updates);
                 break;
             case 'q':
                 cb.collection = collections->quants;
-                update_collection(updates, quants_add_quants, &cb);
+                cb.collection_name = "quants";
+                agg_table_each(agg_updates, quants_add_quants, &cb);
+                agg_table_destroy(&agg_updates);
                 break;
             case 'h':
                 cb.collection = collections->histograms;
-                update_collection(updates, histograms_add_histograms, &cb);
+                cb.collection_name = "histograms";
+                agg_table_each(agg_updates, histograms_add_histograms, &cb);
+                agg_table_destroy(&agg_updates);
                 break;
             case 'a':
                 cb.collection = collections->agents;
-                update_collection(updates, agents_add_agent, &cb);
+                cb.collection_name = "agents";
+                update_collection(hash_updates, agents_add_agent, &cb);
+                zhash_destroy(&hash_updates);
                 break;
             default:
                 fprintf(stderr, "[E] updater[%zu]: unknown task type: %c\n", id, task_type);
                 assert(false);
             }
-            zhash_destroy(&updates);
+            batch_execute(&cb);
             __sync_sub_and_fetch(&queued_updates, 1);
 
             int64_t end_time_us = zclock_usecs();
@@ -6,6 +6,7 @@ int global_total_time_import_threshold = 0;
 const char* global_ignored_request_prefix = NULL;
 double global_sampling_rate_400s = 1.0;
 long int global_sampling_rate_400s_threshold = MAX_RANDOM_VALUE;
+int max_parser_group_size = 1;
 
 // all configured streams
 zhash_t *configured_streams = NULL;
@@ -142,6 +143,22 @@ void add_sampling_rate_400s_threshold_settings(zconfig_t* config, stream_info_t*
     zlist_destroy(&settings);
 }
 
+static
+void add_parser_group_size_settings(zconfig_t* config, stream_info_t* info)
+{
+    info->parser_group_size = 1;
+    zlist_t* settings = get_stream_settings(config, info, "parser_group_size");
+    zconfig_t *setting = zlist_last(settings);
+    if (setting) {
+        int n = atoi(zconfig_value(setting));
+        if (n > 1)
+            info->parser_group_size = n;
+    }
+    zlist_destroy(&settings);
+    if (info->parser_group_size > max_parser_group_size)
+        max_parser_group_size = info->parser_group_size;
+}
+
 static
 stream_info_t* stream_info_new(zconfig_t *config, zconfig_t *stream_config)
 {
@@ -184,6 +201,7 @@ stream_info_t* stream_info_new(zconfig_t *config, zconfig_t *stream_config)
     add_ignored_request_settings(config, info);
     add_backend_only_requests_settings(config, info);
     add_sampling_rate_400s_threshold_settings(config, info);
+    add_parser_group_size_settings(config, info);
 
     info->known_modules = zhash_new();
     assert(info->known_modules);
@@ -205,6 +223,7 @@ void dump_stream_info(stream_info_t *stream)
         printf("[D] module_threshold: %s = %zu\n", stream->module_thresholds[i].name, stream->module_thresholds[i].value);
     }
     printf("[D] all requests are backend only requests: %d\n", stream->all_requests_are_backend_only_requests);
+    printf("[D] parser group size: %d\n", stream->parser_group_size);
     int n = stream->backend_only_requests_size;
     printf("[D] backend only requests size: %d\n", n);
     if (n > 0) {
@@ -259,18 +278,16 @@ void setup_stream_config(zconfig_t *config, const char *pattern)
 
 #define ONE_DAY_MS (1000 * 60 * 60 * 24)
 
-void update_known_modules(stream_info_t *stream_info, zhash_t* module_hash)
+void update_known_modules(stream_info_t *stream_info, namespaces_t *namespaces)
 {
     uint64_t now = zclock_time();
     uint64_t age_threshold = now - ONE_DAY_MS;
     zhash_t *known_modules = stream_info->known_modules;
 
     // update timestamps for modules just seen
-    void *elem = zhash_first(module_hash);
-    while (elem) {
-        const char *module = zhash_cursor(module_hash);
-        zhash_update(known_modules, module, (void*)now);
-        elem = zhash_next(module_hash);
+    for (uint32_t id = 0; id < namespaces->count; id++) {
+        if (namespaces_has_flags(namespaces, id, NAMESPACE_MODULE))
+            zhash_update(known_modules, namespaces_name(namespaces, id), (void*)now);
     }
 
     // delete modules we haven't heard from for over a day
@@ -2,6 +2,7 @@
 #define __LOGJAM_IMPORTER_STREAM_INFO_H_INCLUDED__
 
 #include "importer-common.h"
+#include "importer-namespaces.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,12 +33,14 @@ typedef struct {
     int backend_only_requests_size;
     int all_requests_are_backend_only_requests;
     zhash_t *known_modules;
+    int parser_group_size;     // number of parsers sharing the stream when routing by stream
 } stream_info_t;
 
 extern int global_total_time_import_threshold;
 extern const char* global_ignored_request_prefix;
 extern double global_sampling_rate_400s;
 extern long int global_sampling_rate_400s_threshold;
+extern int max_parser_group_size;
 #define MAX_RANDOM_VALUE ((1L<<31) - 1)
 #define TEN_PERCENT_OF_MAX_RANDOM 214748364
 
@@ -51,7 +54,7 @@ extern zhash_t *configured_streams;
 extern zhash_t *stream_subscriptions;
 
 extern void setup_stream_config(zconfig_t* config, const char* pattern);
-extern void update_known_modules(stream_info_t *stream_info, zhash_t* module_hash);
+extern void update_known_modules(stream_info_t *stream_info, namespaces_t *namespaces);
 
 typedef int sampling_reason_t;
 #define SAMPLE_SLOW_REQUEST    1
@@ -18,10 +18,19 @@
  *                                   /                ^ PUSH
  *                             PULL ^                 tracker
  *                           parser(n_p)
+ *
+ * When routing by stream, the subscriber binds one PUSH socket per parser
+ * instead, and each parser connects its PULL socket to all of them.
 */
 
 #define MAX_DEVICES 4096
 
+// warn about skewed parser load when routing by stream if a parser receives
+// more than SKEW_WARNING_FACTOR times its fair share of at least
+// SKEW_WARNING_MIN_MESSAGES messages per tick
+#define SKEW_WARNING_FACTOR 2
+#define SKEW_WARNING_MIN_MESSAGES 1000
+
 // actor state
 typedef struct {
     size_t id;                                // subscriber id (value < num_subcribers)
@@ -31,6 +40,9 @@ typedef struct {
     device_tracker_t *tracker;                // tracks sequence numbers, gaps and heartbeats for devices
     zsock_t *sub_socket;                      // incoming data from logjam devices
     zsock_t *push_socket;                     // outgoing data for parsers
+    zsock_t *parser_sockets[MAX_PARSERS];     // outgoing data for individual parsers (when routing by stream)
+    size_t parser_message_counts[MAX_PARSERS];// messages routed to each parser (since last tick)
+    size_t group_rotation;                    // spreads messages of hot streams over their parser group
     zsock_t *pull_socket;                     // pull for direct connections (apps)
     zsock_t *router_socket;                   // ROUTER socket for direct connections (apps)
     zsock_t *pub_socket;                      // republish all incoming messages (optional)
@@ -149,6 +161,89 @@ zsock_t* subscriber_push_socket_new(zconfig_t* config, size_t id)
     return socket;
 }
 
+static
+zsock_t* subscriber_parser_socket_new(zconfig_t* config, size_t id, size_t parser_id)
+{
+    zsock_t *socket = zsock_new(ZMQ_PUSH);
+    assert(socket);
+    zsock_set_sndtimeo(socket, 10);
+    int rc = zsock_bind(socket, "inproc://subscriber-%zu-parser-%zu", id, parser_id);
+    assert(rc == 0);
+    return socket;
+}
+
+// Selects the parser for a message when routing by stream. All messages
+// of a stream go to the same parser, unless the stream has been configured
+// with a parser_group_size larger than one, in which case messages are
+// spread over that many consecutive parsers.
+static
+zsock_t* subscriber_select_parser_socket(subscriber_state_t *state, zmsg_t *msg)
+{
+    zframe_t *stream_frame = zmsg_first(msg);
+    const char *stream = (const char*) zframe_data(stream_frame);
+    size_t n = zframe_size(stream_frame);
+    if (n > 15 && !strncmp("request-stream-", stream, 15)) {
+        stream += 15;
+        n -= 15;
+    }
+
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)stream[i];
+        h *= 16777619U;
+    }
+    size_t parser = h % num_parsers;
+
+    if (max_parser_group_size > 1) {
+        char stream_name[n+1];
+        memcpy(stream_name, stream, n);
+        stream_name[n] = '\0';
+        stream_info_t *info = zhash_lookup(configured_streams, stream_name);
+        if (info && info->parser_group_size > 1)
+            parser = (parser + state->group_rotation++ % info->parser_group_size) % num_parsers;
+    }
+
+    state->parser_message_counts[parser]++;
+    return state->parser_sockets[parser];
+}
+
+static
+void subscriber_forward_to_parser(subscriber_state_t *state, zmsg_t **msg_p)
+{
+    zsock_t *socket = route_by_stream ? subscriber_select_parser_socket(state, *msg_p) : state->push_socket;
+
+    if (!output_socket_ready(socket, 0) && !state->message_blocks++)
+        fprintf(stderr, "[W] subscriber[%zu]: push socket not ready. blocking!\n", state->id);
+
+    int rc = zmsg_send_and_destroy(msg_p, socket);
+    if (rc) {
+        if (!state->message_drops++)
+            fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
+    }
+}
+
+static
+void subscriber_check_parser_skew(subscriber_state_t *state)
+{
+    size_t total = 0, max = 0, max_parser = 0;
+    for (size_t i = 0; i < num_parsers; i++) {
+        size_t count = state->parser_message_counts[i];
+        total += count;
+        if (count > max) {
+            max = count;
+            max_parser = i;
+        }
+        state->parser_message_counts[i] = 0;
+    }
+    if (total < SKEW_WARNING_MIN_MESSAGES || num_parsers < 2)
+        return;
+    if (max * num_parsers > SKEW_WARNING_FACTOR * total)
+        fprintf(stderr, "[W] subscriber[%zu]: parser load skew: parser[%zu] received %zu of %zu messages (%.1f%%). "
+                "consider setting parser_group_size for hot streams\n",
+                state->id, max_parser, max, total, 100.0 * max / total);
+}
+
 static
 int process_meta_information_and_handle_heartbeat(subscriber_state_t *state, zmsg_t* msg)
 {
@@ -180,6 +275,30 @@ int process_meta_information_and_handle_heartbeat(subscriber_state_t *state, zms
     return is_heartbeat;
 }
 
+// forwards the messages contained in a batch. the batch itself has already been
+// accounted for by the device tracker, as it carries a single sequence number.
+static
+void subscriber_forward_batch(subscriber_state_t *state, zmsg_t **msg_p)
+{
+    zmsg_t *msg = *msg_p;
+    zframe_t *app_env = zmsg_first(msg);
+    zmsg_next(msg);
+    zframe_t *body = zmsg_next(msg);
+
+    batch_reader_t reader;
+    batch_entry_t entry;
+    batch_reader_init(&reader, (const char*) zframe_data(body), zframe_size(body));
+    int rc;
+    while ((rc = batch_reader_next(&reader, &entry)) > 0) {
+        zmsg_t *entry_msg = batch_entry_to_zmsg(app_env, &entry);
+        subscriber_forward_to_parser(state, &entry_msg);
+    }
+    if (rc < 0)
+        fprintf(stderr, "[E] subscriber[%zu]: received corrupted batch\n", state->id);
+
+    zmsg_destroy(msg_p);
+}
+
 static
 int read_request_and_forward(zloop_t *loop, zsock_t *socket, void *callback_data)
 {
@@ -199,16 +318,13 @@ int read_request_and_forward(zloop_t *loop, zsock_t *socket, void *callback_data
                 zmsg_destroy(&msg);
                 return 0;
             }
+            if (zmsg_is_batch(msg)) {
+                subscriber_forward_batch(state, &msg);
+                return 0;
+            }
         }
 
-        if (!output_socket_ready(state->push_socket, 0) && !state->message_blocks++)
-            fprintf(stderr, "[W] subscriber[%zu]: push socket not ready. blocking!\n", state->id);
-
-        int rc = zmsg_send_and_destroy(&msg, state->push_socket);
-        if (rc) {
-            if (!state->message_drops++)
-                fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
-        }
+        subscriber_forward_to_parser(state, &msg);
     }
     return 0;
 }
@@ -258,14 +374,8 @@ int read_router_request_forward(zloop_t *loop, zsock_t *socket, void *callback_d
             goto answer;
     }
 
-    if (!output_socket_ready(state->push_socket, 0) && !state->message_blocks++)
-        fprintf(stderr, "[W] subscriber[%zu]: push socket not ready. blocking!\n", state->id);
+    subscriber_forward_to_parser(state, &msg);
 
-    int rc = zmsg_send_and_destroy(&msg, state->push_socket);
-    if (rc) {
-        if (!state->message_drops++)
-            fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
-    }
  answer:
     if (reply) {
         if (is_ping) {
@@ -317,6 +427,8 @@ int actor_command(zloop_t *loop, zsock_t *socket, void *callback_data)
             state->messages_dev_zero = 0;
             state->message_drops = 0;
             state->message_blocks = 0;
+            if (route_by_stream)
+                subscriber_check_parser_skew(state);
             if (++ticks % HEART_BEAT_INTERVAL == 0)
                 device_tracker_reconnect_stale_devices(state->tracker);
         } else {
@@ -353,7 +465,12 @@ subscriber_state_t* subscriber_state_new(zconfig_t* config, size_t id, zlist_t *
         state->pull_socket = subscriber_pull_socket_new(config, id);
         state->router_socket = subscriber_router_socket_new(config, id);
     }
-    state->push_socket = subscriber_push_socket_new(config, state->id);
+    if (route_by_stream) {
+        for (size_t i = 0; i < num_parsers; i++)
+            state->parser_sockets[i] = subscriber_parser_socket_new(config, state->id, i);
+    } else {
+        state->push_socket = subscriber_push_socket_new(config, state->id);
+    }
     state->statsd_client = statsd_client_new(config, state->me);
     return state;
 }
@@ -368,6 +485,8 @@ void subscriber_state_destroy(subscriber_state_t **state_p)
         zsock_destroy(&state->router_socket);
     }
     zsock_destroy(&state->push_socket);
+    for (size_t i = 0; i < num_parsers; i++)
+        zsock_destroy(&state->parser_sockets[i]);
     device_tracker_destroy(&state->tracker);
     statsd_client_destroy(&state->statsd_client);
     *state_p = NULL;
@@ -0,0 +1,908 @@
+#include <czmq.h>
+#include "json-view.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Stage 1 classifies the document in blocks of 64 bytes. Each block produces bit
+// masks for quotes, backslashes and the structural characters {}[]:, from which
+// escaped quotes and string contents are masked out using carry propagation and a
+// prefix xor, without branching on the input. The positions of all remaining
+// structural characters (including both quotes of every string) go into an index.
+//
+// Stage 2 walks the index, validates the grammar (including scalar tokens, which
+// live between structural characters) and records the matching closing bracket
+// for every opening bracket, so that values can be skipped in constant time.
+
+// same as the default depth of the json-c tokener, so we reject what it rejects
+#define JSON_VIEW_MAX_DEPTH 32
+
+bool json_view_use_simd = true;
+
+struct _json_view_t {
+    const char *json;
+    size_t len;
+    uint32_t *structurals;   // positions of structural characters
+    uint32_t *matches;       // index of the matching closing bracket, for opening brackets
+    size_t count;            // number of structural characters
+    size_t capacity;         // allocated size of structurals, matches and scratch
+    char *scratch;           // unescaped strings
+};
+
+json_view_t* json_view_new(void)
+{
+    json_view_t *view = zmalloc(sizeof(*view));
+    assert(view);
+    return view;
+}
+
+void json_view_destroy(json_view_t **view_p)
+{
+    json_view_t *view = *view_p;
+    if (view == NULL)
+        return;
+    free(view->structurals);
+    free(view->matches);
+    free(view->scratch);
+    free(view);
+    *view_p = NULL;
+}
+
+// ---------------------------------------------------------------------------------
+// stage 1
+
+typedef struct {
+    uint64_t ops;            // {}[]:,
+    uint64_t quotes;
+    uint64_t backslashes;
+} block_masks_t;
+
+#define OP_CHAR 1
+#define QUOTE_CHAR 2
+#define BACKSLASH_CHAR 4
+
+static const uint8_t char_classes[256] = {
+    ['{'] = OP_CHAR, ['}'] = OP_CHAR, ['['] = OP_CHAR, [']'] = OP_CHAR, [':'] = OP_CHAR, [','] = OP_CHAR,
+    ['"'] = QUOTE_CHAR, ['\\'] = BACKSLASH_CHAR,
+};
+
+static inline
+void classify_block_scalar(const char *p, block_masks_t *masks)
+{
+    uint64_t ops = 0, quotes = 0, backslashes = 0;
+    for (int i = 0; i < 64; i++) {
+        uint8_t c = char_classes[(uint8_t)p[i]];
+        uint64_t bit = 1ULL << i;
+        if (c & OP_CHAR)
+            ops |= bit;
+        else if (c & QUOTE_CHAR)
+            quotes |= bit;
+        else if (c & BACKSLASH_CHAR)
+            backslashes |= bit;
+    }
+    masks->ops = ops;
+    masks->quotes = quotes;
+    masks->backslashes = backslashes;
+}
+
+#ifdef __SSE2__
+static inline
+uint64_t block_mask(const __m128i v[4], __m128i c)
+{
+    uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v[0], c));
+    uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v[1], c));
+    uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v[2], c));
+    uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v[3], c));
+    return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+static inline
+void classify_block_simd(const char *p, block_masks_t *masks)
+{
+    __m128i v[4], lowered[4];
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for (int i = 0; i < 4; i++) {
+        v[i] = _mm_loadu_si128((const __m128i*)(p + 16*i));
+        // maps '[' to '{' and ']' to '}'
+        lowered[i] = _mm_or_si128(v[i], case_bit);
+    }
+    masks->ops = block_mask(lowered, _mm_set1_epi8('{'))
+        | block_mask(lowered, _mm_set1_epi8('}'))
+        | block_mask(v, _mm_set1_epi8(':'))
+        | block_mask(v, _mm_set1_epi8(','));
+    masks->quotes = block_mask(v, _mm_set1_epi8('"'));
+    masks->backslashes = block_mask(v, _mm_set1_epi8('\\'));
+}
+#endif
+
+// returns a mask of all characters escaped by a backslash (see simdjson)
+static inline
+uint64_t find_escaped(uint64_t backslashes, uint64_t *prev_ends_odd_backslash)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    const uint64_t odd_bits = ~even_bits;
+    uint64_t start_edges = backslashes & ~(backslashes << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_ends_odd_backslash;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = backslashes + even_starts;
+    unsigned long long odd_carries;
+    bool ends_odd_backslash = __builtin_uaddll_overflow(backslashes, odd_starts, &odd_carries);
+    odd_carries |= *prev_ends_odd_backslash;
+    *prev_ends_odd_backslash = ends_odd_backslash;
+    uint64_t even_carry_ends = even_carries & ~backslashes;
+    uint64_t odd_carry_ends = odd_carries & ~backslashes;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+static inline
+uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static
+bool build_index(json_view_t *view)
+{
+    const char *json = view->json;
+    size_t len = view->len;
+    uint32_t *structurals = view->structurals;
+    size_t count = 0;
+    uint64_t prev_ends_odd_backslash = 0;
+    uint64_t prev_in_string = 0;
+#ifdef __SSE2__
+    bool simd = json_view_use_simd;
+#endif
+
+    for (size_t base = 0; base < len; base += 64) {
+        char padded[64];
+        const char *block = json + base;
+        if (len - base < 64) {
+            memset(padded, ' ', 64);
+            memcpy(padded, block, len - base);
+            block = padded;
+        }
+
+        block_masks_t masks;
+#ifdef __SSE2__
+        if (simd)
+            classify_block_simd(block, &masks);
+        else
+#endif
+            classify_block_scalar(block, &masks);
+
+        uint64_t escaped = find_escaped(masks.backslashes, &prev_ends_odd_backslash);
+        uint64_t quotes = masks.quotes & ~escaped;
+        uint64_t in_string = prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t bits = (masks.ops & ~in_string) | quotes;
+        while (bits) {
+            structurals[count++] = base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    }
+    view->count = count;
+
+    // unterminated string
+    return prev_in_string == 0;
+}
+
+// ---------------------------------------------------------------------------------
+// stage 2
+
+static inline
+bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline
+uint32_t skip_whitespace(const json_view_t *view, uint32_t pos)
+{
+    while (pos < view->len && is_whitespace(view->json[pos]))
+        pos++;
+    return pos;
+}
+
+static inline
+bool only_whitespace(const json_view_t *view, uint32_t from, uint32_t to)
+{
+    return skip_whitespace(view, from) >= to;
+}
+
+static
+bool valid_number(const char *p, const char *end)
+{
+    if (p < end && *p == '-')
+        p++;
+    if (p == end || !isdigit((unsigned char)*p))
+        return false;
+    if (*p == '0')
+        p++;
+    else
+        while (p < end && isdigit((unsigned char)*p))
+            p++;
+    if (p < end && *p == '.') {
+        p++;
+        if (p == end || !isdigit((unsigned char)*p))
+            return false;
+        while (p < end && isdigit((unsigned char)*p))
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        if (p == end || !isdigit((unsigned char)*p))
+            return false;
+        while (p < end && isdigit((unsigned char)*p))
+            p++;
+    }
+    return p == end;
+}
+
+static
+bool valid_scalar(const json_view_t *view, uint32_t from, uint32_t to)
+{
+    while (to > from && is_whitespace(view->json[to-1]))
+        to--;
+    const char *p = view->json + from;
+    size_t n = to - from;
+    switch (n) {
+    case 3:
+        if (!memcmp(p, "NaN", 3))
+            return true;
+        break;
+    case 4:
+        if (!memcmp(p, "true", 4) || !memcmp(p, "null", 4))
+            return true;
+        break;
+    case 5:
+        if (!memcmp(p, "false", 5))
+            return true;
+        break;
+    case 8:
+        if (!memcmp(p, "Infinity", 8))
+            return true;
+        break;
+    case 9:
+        if (!memcmp(p, "-Infinity", 9))
+            return true;
+        break;
+    }
+    return valid_number(p, p + n);
+}
+
+static inline
+char structural_char(const json_view_t *view, uint32_t k)
+{
+    return view->json[view->structurals[k]];
+}
+
+// checks the escape sequences of the string opened by structural k. stage 1
+// guarantees that no backslash escapes the closing quote.
+static
+bool valid_string(const json_view_t *view, uint32_t k)
+{
+    const char *p = view->json + view->structurals[k] + 1;
+    const char *end = view->json + view->structurals[k+1];
+    while ((p = memchr(p, '\\', end - p))) {
+        p++;
+        switch (*p++) {
+        case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            break;
+        case 'u':
+            if (end - p < 4)
+                return false;
+            for (int i = 0; i < 4; i++)
+                if (!isxdigit((unsigned char)*p++))
+                    return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+int64_t validate_value(json_view_t *view, uint32_t k, uint32_t from, int depth);
+
+// validates the members of the object opened by structural k. returns the index
+// of the first structural after the object, or -1.
+static
+int64_t validate_object(json_view_t *view, uint32_t k, int depth)
+{
+    uint32_t open = k++;
+    if (k >= view->count)
+        return -1;
+    if (structural_char(view, k) == '}') {
+        if (!only_whitespace(view, view->structurals[open] + 1, view->structurals[k]))
+            return -1;
+        view->matches[open] = k;
+        return k + 1;
+    }
+    for (;;) {
+        // key, closing quote of key, colon
+        if (k + 2 >= view->count || structural_char(view, k) != '"' || structural_char(view, k+2) != ':')
+            return -1;
+        if (!only_whitespace(view, view->structurals[k-1] + 1, view->structurals[k]))
+            return -1;
+        if (!only_whitespace(view, view->structurals[k+1] + 1, view->structurals[k+2]))
+            return -1;
+        if (!valid_string(view, k))
+            return -1;
+        int64_t next = validate_value(view, k + 3, view->structurals[k+2] + 1, depth);
+        if (next < 0 || next >= view->count)
+            return -1;
+        k = next;
+        char c = structural_char(view, k);
+        if (c == '}') {
+            view->matches[open] = k;
+            return k + 1;
+        }
+        if (c != ',')
+            return -1;
+        k++;
+    }
+}
+
+static
+int64_t validate_array(json_view_t *view, uint32_t k, int depth)
+{
+    uint32_t open = k++;
+    if (k >= view->count)
+        return -1;
+    if (structural_char(view, k) == ']' && only_whitespace(view, view->structurals[open] + 1, view->structurals[k])) {
+        view->matches[open] = k;
+        return k + 1;
+    }
+    for (;;) {
+        int64_t next = validate_value(view, k, view->structurals[k-1] + 1, depth);
+        if (next < 0 || next >= view->count)
+            return -1;
+        k = next;
+        char c = structural_char(view, k);
+        if (c == ']') {
+            view->matches[open] = k;
+            return k + 1;
+        }
+        if (c != ',')
+            return -1;
+        k++;
+    }
+}
+
+// validates the value starting after position from, whose first structural is k.
+// returns the index of the first structural after the value, or -1.
+static
+int64_t validate_value(json_view_t *view, uint32_t k, uint32_t from, int depth)
+{
+    if (k >= view->count)
+        return -1;
+    uint32_t pos = skip_whitespace(view, from);
+    uint32_t structural = view->structurals[k];
+    if (pos < structural) {
+        // scalars end at the next structural, which must be a separator
+        char c = structural_char(view, k);
+        if (c != ',' && c != '}' && c != ']')
+            return -1;
+        return valid_scalar(view, pos, structural) ? k : -1;
+    }
+    switch (structural_char(view, k)) {
+    case '{':
+        return depth < JSON_VIEW_MAX_DEPTH ? validate_object(view, k, depth + 1) : -1;
+    case '[':
+        return depth < JSON_VIEW_MAX_DEPTH ? validate_array(view, k, depth + 1) : -1;
+    case '"': {
+        // the next structural is always the closing quote, followed by whitespace
+        if (k + 2 >= view->count)
+            return -1;
+        if (!only_whitespace(view, view->structurals[k+1] + 1, view->structurals[k+2]))
+            return -1;
+        if (!valid_string(view, k))
+            return -1;
+        return k + 2;
+    }
+    default:
+        return -1;
+    }
+}
+
+bool json_view_parse(json_view_t *view, const char *json, size_t len)
+{
+    if (len >= UINT32_MAX)
+        return false;
+    if (len + 1 > view->capacity) {
+        size_t capacity = len + 1;
+        free(view->structurals);
+        free(view->matches);
+        free(view->scratch);
+        view->structurals = malloc(capacity * sizeof(uint32_t));
+        view->matches = malloc(capacity * sizeof(uint32_t));
+        view->scratch = malloc(capacity);
+        assert(view->structurals && view->matches && view->scratch);
+        view->capacity = capacity;
+    }
+    view->json = json;
+    view->len = len;
+    view->count = 0;
+
+    if (!build_index(view) || view->count < 2)
+        return false;
+
+    // the document must be an object, followed by nothing but whitespace
+    uint32_t start = skip_whitespace(view, 0);
+    if (start != view->structurals[0] || json[start] != '{')
+        return false;
+    int64_t end = validate_object(view, 0, 1);
+    return end == view->count && only_whitespace(view, view->structurals[end-1] + 1, len);
+}
+
+// ---------------------------------------------------------------------------------
+// access
+
+json_view_value_t json_view_root(json_view_t *view)
+{
+    json_view_value_t root = { view->structurals[0], 0 };
+    return root;
+}
+
+enum json_type json_view_type(json_view_t *view, json_view_value_t value)
+{
+    const char *p = view->json + value.pos;
+    switch (*p) {
+    case '{':
+        return json_type_object;
+    case '[':
+        return json_type_array;
+    case '"':
+        return json_type_string;
+    case 't':
+    case 'f':
+        return json_type_boolean;
+    case 'n':
+        return json_type_null;
+    case 'N':
+    case 'I':
+        return json_type_double;
+    default: {
+        const char *end = view->json + view->structurals[value.index];
+        for (; p < end; p++) {
+            if (*p == '.' || *p == 'e' || *p == 'E' || *p == 'I')
+                return json_type_double;
+        }
+        return json_type_int;
+    }
+    }
+}
+
+// returns the index of the first structural after the given value
+static inline
+uint32_t value_end(json_view_t *view, json_view_value_t value)
+{
+    char c = view->json[value.pos];
+    if (c == '{' || c == '[')
+        return view->matches[value.index] + 1;
+    if (c == '"')
+        return value.index + 2;
+    return value.index;
+}
+
+static
+size_t unescape(const char *p, size_t n, char *out)
+{
+    size_t len = 0;
+    const char *end = p + n;
+    while (p < end) {
+        char c = *p++;
+        if (c != '\\' || p == end) {
+            out[len++] = c;
+            continue;
+        }
+        switch (c = *p++) {
+        case 'b': out[len++] = '\b'; break;
+        case 'f': out[len++] = '\f'; break;
+        case 'n': out[len++] = '\n'; break;
+        case 'r': out[len++] = '\r'; break;
+        case 't': out[len++] = '\t'; break;
+        case 'u': {
+            // stage 2 guarantees four hex digits
+            uint32_t cp = 0;
+            for (int i = 0; i < 4; i++) {
+                char h = *p++;
+                cp = (cp << 4) | (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+            }
+            // combine surrogate pairs
+            if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                uint32_t low = 0;
+                int i;
+                for (i = 2; i < 6 && isxdigit((unsigned char)p[i]); i++)
+                    low = (low << 4) | (p[i] <= '9' ? p[i] - '0' : (p[i] | 0x20) - 'a' + 10);
+                if (i == 6 && low >= 0xDC00 && low <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+            }
+            if (cp < 0x80) {
+                out[len++] = cp;
+            } else if (cp < 0x800) {
+                out[len++] = 0xC0 | (cp >> 6);
+                out[len++] = 0x80 | (cp & 0x3F);
+            } else if (cp < 0x10000) {
+                out[len++] = 0xE0 | (cp >> 12);
+                out[len++] = 0x80 | ((cp >> 6) & 0x3F);
+                out[len++] = 0x80 | (cp & 0x3F);
+            } else {
+                out[len++] = 0xF0 | (cp >> 18);
+                out[len++] = 0x80 | ((cp >> 12) & 0x3F);
+                out[len++] = 0x80 | ((cp >> 6) & 0x3F);
+                out[len++] = 0x80 | (cp & 0x3F);
+            }
+            break;
+        }
+        default:
+            // '"', '\\' and '/'
+            out[len++] = c;
+        }
+    }
+    return len;
+}
+
+bool json_view_object_get(json_view_t *view, json_view_value_t object, const char *key, json_view_value_t *value)
+{
+    if (view->json[object.pos] != '{')
+        return false;
+    size_t key_len = strlen(key);
+    uint32_t k = object.index + 1;
+    if (structural_char(view, k) == '}')
+        return false;
+    for (;;) {
+        uint32_t start = view->structurals[k] + 1;
+        json_view_value_t member = { skip_whitespace(view, view->structurals[k+2] + 1), k + 3 };
+        if (view->structurals[k+1] - start == key_len && !memcmp(view->json + start, key, key_len)) {
+            *value = member;
+            return true;
+        }
+        k = value_end(view, member);
+        if (structural_char(view, k) == '}')
+            return false;
+        k++;
+    }
+}
+
+void json_view_object_foreach(json_view_t *view, json_view_value_t object, json_view_member_fn *fn, void *arg)
+{
+    if (view->json[object.pos] != '{')
+        return;
+    uint32_t k = object.index + 1;
+    if (structural_char(view, k) == '}')
+        return;
+    for (;;) {
+        uint32_t start = view->structurals[k] + 1;
+        size_t n = view->structurals[k+1] - start;
+        // the scratch buffer can't be used, as callbacks may retrieve strings.
+        // unescaping never makes a key longer.
+        char buffer[256];
+        char *key = n < sizeof(buffer) ? buffer : malloc(n + 1);
+        assert(key);
+        size_t key_len = unescape(view->json + start, n, key);
+        key[key_len] = '\0';
+        json_view_value_t member = { skip_whitespace(view, view->structurals[k+2] + 1), k + 3 };
+        bool go_on = fn(key, key_len, member, arg);
+        if (key != buffer)
+            free(key);
+        if (!go_on)
+            return;
+        k = value_end(view, member);
+        if (structural_char(view, k) == '}')
+            return;
+        k++;
+    }
+}
+
+void json_view_array_foreach(json_view_t *view, json_view_value_t array, json_view_element_fn *fn, void *arg)
+{
+    if (view->json[array.pos] != '[')
+        return;
+    uint32_t k = array.index + 1;
+    uint32_t pos = skip_whitespace(view, array.pos + 1);
+    if (view->json[pos] == ']')
+        return;
+    for (;;) {
+        json_view_value_t element = { pos, k };
+        if (!fn(element, arg))
+            return;
+        k = value_end(view, element);
+        if (structural_char(view, k) == ']')
+            return;
+        pos = skip_whitespace(view, view->structurals[k] + 1);
+        k++;
+    }
+}
+
+static
+bool count_element(json_view_value_t value, void *arg)
+{
+    (*(size_t*)arg)++;
+    return true;
+}
+
+size_t json_view_array_length(json_view_t *view, json_view_value_t array)
+{
+    size_t n = 0;
+    json_view_array_foreach(view, array, count_element, &n);
+    return n;
+}
+
+bool json_view_get_boolean(json_view_t *view, json_view_value_t value)
+{
+    return view->json[value.pos] == 't';
+}
+
+int64_t json_view_get_int64(json_view_t *view, json_view_value_t value)
+{
+    // scalars are always followed by a structural character, so strtoll stops there
+    if (json_view_type(view, value) == json_type_double)
+        return json_view_get_double(view, value);
+    return strtoll(view->json + value.pos, NULL, 10);
+}
+
+double json_view_get_double(json_view_t *view, json_view_value_t value)
+{
+    return strtod(view->json + value.pos, NULL);
+}
+
+const char* json_view_get_string(json_view_t *view, json_view_value_t value, size_t *len)
+{
+    if (view->json[value.pos] != '"') {
+        *len = 0;
+        return NULL;
+    }
+    const char *start = view->json + value.pos + 1;
+    size_t n = view->structurals[value.index+1] - value.pos - 1;
+    if (memchr(start, '\\', n) == NULL) {
+        *len = n;
+        return start;
+    }
+    *len = unescape(start, n, view->scratch);
+    return view->scratch;
+}
+
+typedef struct {
+    json_view_t *view;
+    json_object *obj;
+} materialize_state_t;
+
+static
+bool materialize_member(const char *key, size_t key_len, json_view_value_t value, void *arg)
+{
+    materialize_state_t *state = arg;
+    json_object_object_add(state->obj, key, json_view_to_json_object(state->view, value));
+    return true;
+}
+
+static
+bool materialize_element(json_view_value_t value, void *arg)
+{
+    materialize_state_t *state = arg;
+    json_object_array_add(state->obj, json_view_to_json_object(state->view, value));
+    return true;
+}
+
+json_object* json_view_to_json_object(json_view_t *view, json_view_value_t value)
+{
+    switch (json_view_type(view, value)) {
+    case json_type_object: {
+        materialize_state_t state = { view, json_object_new_object() };
+        json_view_object_foreach(view, value, materialize_member, &state);
+        return state.obj;
+    }
+    case json_type_array: {
+        materialize_state_t state = { view, json_object_new_array() };
+        json_view_array_foreach(view, value, materialize_element, &state);
+        return state.obj;
+    }
+    case json_type_string: {
+        size_t len;
+        const char *str = json_view_get_string(view, value, &len);
+        return json_object_new_string_len(str, len);
+    }
+    case json_type_int:
+        return json_object_new_int64(json_view_get_int64(view, value));
+    case json_type_double: {
+#if defined(JSON_C_VERSION_NUM) && JSON_C_VERSION_NUM >= ((0 << 16) | (12 << 8))
+        // keep the original representation, like the json-c tokener does
+        const char *start = view->json + value.pos;
+        const char *end = view->json + view->structurals[value.index];
+        while (end > start && is_whitespace(end[-1]))
+            end--;
+        char number[end - start + 1];
+        memcpy(number, start, end - start);
+        number[end - start] = '\0';
+        return json_object_new_double_s(json_view_get_double(view, value), number);
+#else
+        return json_object_new_double(json_view_get_double(view, value));
+#endif
+    }
+    case json_type_boolean:
+        return json_object_new_boolean(json_view_get_boolean(view, value));
+    default:
+        return NULL;
+    }
+}
+
+// ---------------------------------------------------------------------------------
+// self test
+
+static
+bool json_equal(json_object *a, json_object *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    enum json_type type = json_object_get_type(a);
+    if (type != json_object_get_type(b))
+        return false;
+    switch (type) {
+    case json_type_boolean:
+        return json_object_get_boolean(a) == json_object_get_boolean(b);
+    case json_type_int:
+        return json_object_get_int64(a) == json_object_get_int64(b);
+    case json_type_double:
+        return json_object_get_double(a) == json_object_get_double(b);
+    case json_type_string:
+        return json_object_get_string_len(a) == json_object_get_string_len(b)
+            && !memcmp(json_object_get_string(a), json_object_get_string(b), json_object_get_string_len(a));
+    case json_type_array: {
+        int n = json_object_array_length(a);
+        if (n != json_object_array_length(b))
+            return false;
+        for (int i = 0; i < n; i++)
+            if (!json_equal(json_object_array_get_idx(a, i), json_object_array_get_idx(b, i)))
+                return false;
+        return true;
+    }
+    case json_type_object: {
+        if (json_object_object_length(a) != json_object_object_length(b))
+            return false;
+        json_object_object_foreach(a, key, val) {
+            json_object *other;
+            if (!json_object_object_get_ex(b, key, &other) || !json_equal(val, other))
+                return false;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+static
+void check_materialization(json_view_t *view, const char *json)
+{
+    assert(json_view_parse(view, json, strlen(json)));
+    json_object *expected = json_tokener_parse(json);
+    assert(expected);
+    json_object *actual = json_view_to_json_object(view, json_view_root(view));
+    if (!json_equal(expected, actual)) {
+        printf("\n[E] expected: %s\n", json_object_to_json_string_ext(expected, JSON_C_TO_STRING_PLAIN));
+        printf("[E] actual:   %s\n", json_object_to_json_string_ext(actual, JSON_C_TO_STRING_PLAIN));
+        assert(false);
+    }
+    json_object_put(expected);
+    json_object_put(actual);
+}
+
+static
+void json_view_test_run(int verbose)
+{
+    json_view_t *view = json_view_new();
+    assert(view);
+
+    const char *doc =
+        "{ \"action\": \"Users#show\", \"code\": 200, \"total_time\": 12.5,\n"
+        "  \"flags\": [true, false, null], \"empty\": {}, \"none\": [ ],\n"
+        "  \"nested\": { \"a\": { \"b\": [1, [2, 3], {\"c\": \"d\"}] } },\n"
+        "  \"esc\": \"say \\\"hi\\\" \\\\ \\u00e4\\ud83d\\ude00\", \"big\": -1e3 }";
+    assert(json_view_parse(view, doc, strlen(doc)));
+    json_view_value_t root = json_view_root(view);
+    assert(json_view_type(view, root) == json_type_object);
+
+    json_view_value_t v;
+    size_t len;
+    assert(json_view_object_get(view, root, "action", &v));
+    assert(json_view_type(view, v) == json_type_string);
+    const char *s = json_view_get_string(view, v, &len);
+    assert(len == 10 && !strncmp(s, "Users#show", len));
+
+    assert(json_view_object_get(view, root, "code", &v));
+    assert(json_view_type(view, v) == json_type_int);
+    assert(json_view_get_int64(view, v) == 200);
+
+    assert(json_view_object_get(view, root, "total_time", &v));
+    assert(json_view_type(view, v) == json_type_double);
+    assert(json_view_get_double(view, v) == 12.5);
+
+    assert(json_view_object_get(view, root, "big", &v));
+    assert(json_view_type(view, v) == json_type_double);
+    assert(json_view_get_double(view, v) == -1000);
+
+    assert(json_view_object_get(view, root, "flags", &v));
+    assert(json_view_type(view, v) == json_type_array);
+    assert(json_view_array_length(view, v) == 3);
+
+    assert(json_view_object_get(view, root, "none", &v));
+    assert(json_view_array_length(view, v) == 0);
+
+    assert(json_view_object_get(view, root, "nested", &v));
+    assert(json_view_object_get(view, v, "a", &v));
+    assert(json_view_object_get(view, v, "b", &v));
+    assert(json_view_array_length(view, v) == 3);
+
+    assert(json_view_object_get(view, root, "esc", &v));
+    s = json_view_get_string(view, v, &len);
+    assert(len == strlen("say \"hi\" \\ \xc3\xa4\xf0\x9f\x98\x80"));
+    assert(!memcmp(s, "say \"hi\" \\ \xc3\xa4\xf0\x9f\x98\x80", len));
+
+    assert(!json_view_object_get(view, root, "missing", &v));
+
+    check_materialization(view, doc);
+    check_materialization(view, "{}");
+    check_materialization(view, "{\"lines\":[[1,\"2019-01-01T12:00:00\",\"a \\\\\\\" b\\\\\"],[2,\"x\",\"\\\\\\\\\"]]}");
+
+    const char *invalid[] = {
+        "", "[]", "{", "{\"a\":}", "{\"a\" 1}", "{\"a\":tru}", "{\"a\":[1,2}", "{\"a\":\"x}",
+        "{\"a\":1} x", "{\"a\":1,}", "{\"a\":[1,]}", "{\"a\":01}", "{\"a\":1 2}", "{,}", "{\"a\":\"b\" \"c\"}",
+        "{\"a\":[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[1]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]}",
+        "{\"a\":\"\\q\"}", "{\"a\":\"\\u12\"}", "{\"a\":[\"\\u12g4\"]}", "{\"\\x\":1}", "{\"a\":\"x\\u\"}",
+    };
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++) {
+        if (verbose)
+            printf("   invalid: %s\n", invalid[i]);
+        assert(!json_view_parse(view, invalid[i], strlen(invalid[i])));
+    }
+
+    // random strings with quotes and backslash runs crossing block boundaries
+    srand(4711);
+    for (int i = 0; i < 500; i++) {
+        char json[2048];
+        size_t n = 0;
+        n += sprintf(json + n, "{\"k%d\":\"", i);
+        int len = rand() % 300;
+        for (int j = 0; j < len; j++) {
+            switch (rand() % 6) {
+            case 0: n += sprintf(json + n, "\\\\"); break;
+            case 1: n += sprintf(json + n, "\\\""); break;
+            case 2: n += sprintf(json + n, "{,:]"); break;
+            default: json[n++] = 'a' + rand() % 26;
+            }
+        }
+        n += sprintf(json + n, "\",\"x\":[%d]}", i);
+        json[n] = '\0';
+        check_materialization(view, json);
+    }
+
+    json_view_destroy(&view);
+    assert(view == NULL);
+}
+
+void json_view_test(int verbose)
+{
+    printf(" * json-view: ");
+    if (verbose)
+        printf("\n");
+
+    json_view_use_simd = false;
+    json_view_test_run(verbose);
+    json_view_use_simd = true;
+    json_view_test_run(verbose);
+
+    printf("OK\n");
+}
@@ -0,0 +1,64 @@
+#ifndef __LOGJAM_JSON_VIEW_H_INCLUDED__
+#define __LOGJAM_JSON_VIEW_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <json-c/json.h>
+
+// A read only view of a JSON document. Parsing only builds an index of the
+// structural characters of the document (similar to stage 1 of simdjson) and
+// validates it. Values are decoded on access, and can be materialized as json-c
+// objects when needed.
+
+typedef struct _json_view_t json_view_t;
+
+// a value inside the viewed document. only valid until the view is parsed again.
+typedef struct {
+    uint32_t pos;      // offset of the first character of the value
+    uint32_t index;    // index of the first structural character at or after pos
+} json_view_value_t;
+
+// key is unescaped and NUL terminated. return false to stop the iteration.
+typedef bool (json_view_member_fn) (const char *key, size_t key_len, json_view_value_t value, void *arg);
+typedef bool (json_view_element_fn) (json_view_value_t value, void *arg);
+
+// use SSE2 for indexing, if available (only switched off by tests)
+extern bool json_view_use_simd;
+
+extern json_view_t* json_view_new(void);
+extern void json_view_destroy(json_view_t **view_p);
+
+// indexes json[0..len), which must stay unchanged while the view is used. returns
+// false if json is not a single, well formed JSON object.
+extern bool json_view_parse(json_view_t *view, const char *json, size_t len);
+
+extern json_view_value_t json_view_root(json_view_t *view);
+extern enum json_type json_view_type(json_view_t *view, json_view_value_t value);
+
+// keys are compared without unescaping them
+extern bool json_view_object_get(json_view_t *view, json_view_value_t object, const char *key, json_view_value_t *value);
+extern void json_view_object_foreach(json_view_t *view, json_view_value_t object, json_view_member_fn *fn, void *arg);
+extern void json_view_array_foreach(json_view_t *view, json_view_value_t array, json_view_element_fn *fn, void *arg);
+extern size_t json_view_array_length(json_view_t *view, json_view_value_t array);
+
+extern bool json_view_get_boolean(json_view_t *view, json_view_value_t value);
+extern int64_t json_view_get_int64(json_view_t *view, json_view_value_t value);
+extern double json_view_get_double(json_view_t *view, json_view_value_t value);
+// returns the unescaped string, which is only valid until the next call
+extern const char* json_view_get_string(json_view_t *view, json_view_value_t value, size_t *len);
+
+// creates a json-c object for the given value
+extern json_object* json_view_to_json_object(json_view_t *view, json_view_value_t value);
+
+extern void json_view_test(int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 #include <getopt.h>
 #include "logjam-util.h"
 #include "message-compressor.h"
+#include "message-publisher.h"
 
 // shared globals
 bool verbose = false;
@@ -26,54 +27,78 @@ static int router_port = 9604;
 static int pull_port = 9605;
 static int pub_port = 9606;
 
-static size_t received_messages_count = 0;
-static size_t received_messages_bytes = 0;
-static size_t received_messages_max_bytes = 0;
-
 static size_t compressed_messages_count = 0;
 static size_t compressed_messages_bytes = 0;
 static size_t compressed_messages_max_bytes = 0;
 
 static size_t io_threads = 1;
 static size_t num_compressors = 4;
+static size_t num_shards = 1;
+static size_t batch_bytes = 0;
 
 static msg_meta_t msg_meta = META_INFO_EMPTY;
 static char device_number_s[11] = {'0', 0};
 
 #define MAX_COMPRESSORS 64
 static int compression_method = NO_COMPRESSION;
-static zchunk_t *compression_buffer;
 static uint64_t global_time = 0;
 
+// Messages get published by a separate publisher thread. Each shard owns a PULL
+// and a ROUTER socket and hands messages which don't need compression directly to
+// the publisher. With a single shard, the shard runs on the main loop and all
+// other messages go to the compressors, which pass them on to the publisher when
+// done. With more shards, every shard runs on its own thread and compresses
+// messages itself. Shard n listens on the configured ports plus n * SHARD_PORT_STRIDE.
+#define MAX_SHARDS 64
+#define SHARD_PORT_STRIDE 100
+
 typedef struct {
-    // raw zmq sockets, to avoid zsock_resolve
-    void *receiver;
-    void *router_receiver;
-    void *router_output;
-    void *publisher;
-    void *compressor_input;
-    void *compressor_output;
-} publisher_state_t;
+    size_t id;
+    zsock_t *receiver;
+    zsock_t *router_receiver;
+    void *compressor_input;        // raw zmq socket. NULL if the shard compresses itself.
+    zsock_t *doorbell;
+    zchunk_t *compression_buffer;
+    // only written by the shard, read by the timer
+    size_t received_messages_count;
+    size_t received_messages_bytes;
+    size_t received_messages_max_bytes;
+} shard_state_t;
+
+static shard_state_t *shards[MAX_SHARDS];
 
 
 static int timer_event(zloop_t *loop, int timer_id, void *arg)
 {
-    zsock_t* pub_socket = arg;
+    zactor_t* publisher = arg;
 
     static size_t last_received_count   = 0;
     static size_t last_received_bytes   = 0;
     static size_t last_compressed_count = 0;
     static size_t last_compressed_bytes = 0;
 
-    size_t message_count    = received_messages_count - last_received_count;
-    size_t message_bytes    = received_messages_bytes - last_received_bytes;
-    size_t compressed_count = compressed_messages_count - last_compressed_count;
-    size_t compressed_bytes = compressed_messages_bytes - last_compressed_bytes;
+    size_t received_messages = 0, received_total = 0, received_max_bytes = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+        shard_state_t *shard = shards[i];
+        received_messages += __sync_add_and_fetch(&shard->received_messages_count, 0);
+        received_total += __sync_add_and_fetch(&shard->received_messages_bytes, 0);
+        size_t max_bytes = __sync_lock_test_and_set(&shard->received_messages_max_bytes, 0);
+        if (max_bytes > received_max_bytes)
+            received_max_bytes = max_bytes;
+    }
+    size_t message_count    = received_messages - last_received_count;
+    size_t message_bytes    = received_total - last_received_bytes;
+    // compressed message statistics are updated by the compressor threads
+    size_t compressed_messages = __sync_add_and_fetch(&compressed_messages_count, 0);
+    size_t compressed_total = __sync_add_and_fetch(&compressed_messages_bytes, 0);
+    size_t compressed_max_bytes = __sync_lock_test_and_set(&compressed_messages_max_bytes, 0);
+    size_t compressed_count = compressed_messages - last_compressed_count;
+    size_t compressed_bytes = compressed_total - last_compressed_bytes;
 
     double avg_msg_size        = message_count ? (message_bytes / 1024.0) / message_count : 0;
-    double max_msg_size        = received_messages_max_bytes / 1024.0;
+    double max_msg_size        = received_max_bytes / 1024.0;
     double avg_compressed_size = compressed_count ? (compressed_bytes / 1024.0) / compressed_count : 0;
-    double max_compressed_size = compressed_messages_max_bytes / 1024.0;
+    double max_compressed_size = compressed_max_bytes / 1024.0;
 
     printf("[I] processed %zu messages (%.2f KB), avg: %.2f KB, max: %.2f KB\n",
            message_count, message_bytes/1024.0, avg_msg_size, max_msg_size);
@@ -81,12 +106,14 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
     printf("[I] compressd %zu messages (%.2f KB), avg: %.2f KB, max: %.2f KB\n",
            compressed_count, compressed_bytes/1024.0, avg_compressed_size, max_compressed_size);
 
-    last_received_count = received_messages_count;
-    last_received_bytes = received_messages_bytes;
-    received_messages_max_bytes = 0;
-    last_compressed_count = compressed_messages_count;
-    last_compressed_bytes = compressed_messages_bytes;
-    compressed_messages_max_bytes = 0;
+    last_received_count = received_messages;
+    last_received_bytes = received_total;
+    last_compressed_count = compressed_messages;
+    last_compressed_bytes = compressed_total;
+
+    size_t queued = message_publisher_queued();
+    if (queued)
+        printf("[I] publisher queue: %zu messages\n", queued);
 
     // update timestamp
     global_time = zclock_time();
@@ -94,161 +121,295 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
     static size_t ticks = 0;
 
     // publish heartbeat
-    if (++ticks % HEART_BEAT_INTERVAL == 0) {
-        msg_meta.compression_method = NO_COMPRESSION;
-        msg_meta.sequence_number++;
-        msg_meta.created_ms = global_time;
-        if (verbose)
-            printf("[I] sending heartbeat\n");
-        send_heartbeat(pub_socket, &msg_meta, pub_port);
-    }
+    if (++ticks % HEART_BEAT_INTERVAL == 0)
+        zstr_send(publisher, "heartbeat");
 
     return 0;
 }
 
-static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+// called on compressor and shard threads
+static void publish_compressed_message(zmsg_t **msg_p, void *arg)
 {
-    int i = 0;
-    zmq_msg_t message_parts[4];
-    publisher_state_t *state = (publisher_state_t*)callback_data;
-    void *socket = zsock_resolve(sock);
-
-    // read the message parts, possibly including the message meta info
-    while (!zsys_interrupted) {
-        // printf("[D] receiving part %d\n", i+1);
-        if (i>3) {
-            zmq_msg_t dummy_msg;
-            zmq_msg_init(&dummy_msg);
-            zmq_recvmsg(socket, &dummy_msg, 0);
-            zmq_msg_close(&dummy_msg);
-        } else {
-            zmq_msg_init(&message_parts[i]);
-            zmq_recvmsg(socket, &message_parts[i], 0);
-        }
-        if (!zsock_rcvmore(socket))
-            break;
-        i++;
-    }
-    if (i<2) {
-        if (!zsys_interrupted) {
-            fprintf(stderr, "[E] received only %d message parts\n", i);
-        }
-        goto cleanup;
-    } else if (i>3) {
-        fprintf(stderr, "[E] received more than 4 message parts\n");
-        goto cleanup;
+    zsock_t *doorbell = arg;
+    zframe_t *body = zmsg_first(*msg_p);
+    body = zmsg_next(*msg_p);
+    body = zmsg_next(*msg_p);
+    size_t msg_bytes = zframe_size(body);
+
+    __sync_add_and_fetch(&compressed_messages_count, 1);
+    __sync_add_and_fetch(&compressed_messages_bytes, msg_bytes);
+    size_t max_bytes = compressed_messages_max_bytes;
+    while (msg_bytes > max_bytes && !__sync_bool_compare_and_swap(&compressed_messages_max_bytes, max_bytes, msg_bytes))
+        max_bytes = compressed_messages_max_bytes;
+
+    message_publisher_submit(msg_p, doorbell);
+}
+
+static void compress_and_publish(shard_state_t *state, zmsg_t **msg_p)
+{
+    zmsg_t *msg = *msg_p;
+    zframe_t *app_env = zmsg_first(msg);
+    zmsg_next(msg);
+    zframe_t *body = zmsg_next(msg);
+    zframe_t *meta_frame = zmsg_next(msg);
+
+    zmq_msg_t new_body;
+    zmq_msg_init(&new_body);
+    compress_message_data(compression_method, state->compression_buffer, &new_body,
+                          (char*) zframe_data(app_env), zframe_size(app_env),
+                          (char*) zframe_data(body), zframe_size(body));
+    zframe_reset(body, zmq_msg_data(&new_body), zmq_msg_size(&new_body));
+    zmq_msg_close(&new_body);
+    ((msg_meta_t*) zframe_data(meta_frame))->compression_method = compression_method;
+
+    publish_compressed_message(msg_p, state->doorbell);
+}
+
+// takes ownership of the message, which must end with a valid meta frame
+static void forward_message_with_meta(shard_state_t *state, zmsg_t **msg_p, msg_meta_t *meta)
+{
+    zmsg_t *msg = *msg_p;
+    if (meta->created_ms == 0) {
+        zframe_t *meta_frame = zmsg_last(msg);
+        ((msg_meta_t*) zframe_data(meta_frame))->created_ms = htonll(global_time);
     }
 
-    zmq_msg_t *body = &message_parts[2];
-    msg_meta_t meta = META_INFO_EMPTY;
-    if (i==3)
-        zmq_msg_extract_meta_info(&message_parts[3], &meta);
+    zframe_t *body = zmsg_first(msg);
+    body = zmsg_next(msg);
+    body = zmsg_next(msg);
+    size_t msg_bytes = zframe_size(body);
+    state->received_messages_count++;
+    state->received_messages_bytes += msg_bytes;
+    if (msg_bytes > state->received_messages_max_bytes)
+        state->received_messages_max_bytes = msg_bytes;
 
-    // const char *prefix = socket == state->compressor_output ? "EXTERNAL MESSAGE" : "INTERNAL MESSAGE";
-    // my_zmq_msg_fprint(&message_parts[0], 3, prefix, stdout);
-    // dump_meta_info(&meta);
+    // my_zmsg_fprint(msg, "INTERNAL MESSAGE", stdout);
 
-    if (meta.created_ms)
-        msg_meta.created_ms = meta.created_ms;
-    else
-        msg_meta.created_ms = global_time;
-
-    size_t msg_bytes = zmq_msg_size(body);
-    if (socket == state->compressor_output) {
-        compressed_messages_count++;
-        compressed_messages_bytes += msg_bytes;
-        if (msg_bytes > compressed_messages_max_bytes)
-            compressed_messages_max_bytes = msg_bytes;
-    } else {
-        received_messages_count++;
-        received_messages_bytes += msg_bytes;
-        if (msg_bytes > received_messages_max_bytes)
-            received_messages_max_bytes = msg_bytes;
-    }
+    if (compression_method && !meta->compression_method) {
+        if (state->compressor_input)
+            zmsg_send(msg_p, state->compressor_input);
+        else
+            compress_and_publish(state, msg_p);
+    } else
+        message_publisher_submit(msg_p, state->doorbell);
+}
 
-    if (compression_method && !meta.compression_method) {
-        publish_on_zmq_transport(&message_parts[0], state->compressor_input, &msg_meta, 0);
-    } else {
-        msg_meta.compression_method = meta.compression_method;
-        msg_meta.sequence_number++;
-        // my_zmq_msg_fprint(&message_parts[0], 3, "OUT", stdout);
-        // dump_meta_info(&msg_meta);
-        publish_on_zmq_transport(&message_parts[0], state->publisher, &msg_meta, ZMQ_DONTWAIT);
+// takes ownership of the message
+static void forward_message(shard_state_t *state, zmsg_t **msg_p)
+{
+    zmsg_t *msg = *msg_p;
+    size_t n = zmsg_size(msg);
+    if (n < 3) {
+        if (!zsys_interrupted)
+            fprintf(stderr, "[E] received only %zu message parts\n", n);
+        zmsg_destroy(msg_p);
+        return;
+    } else if (n > 4) {
+        fprintf(stderr, "[E] received more than 4 message parts\n");
+        zmsg_destroy(msg_p);
+        return;
     }
 
- cleanup:
-    for (;i>=0;i--) {
-        zmq_msg_close(&message_parts[i]);
+    // make sure there is a valid meta frame, which the publisher can update in place
+    msg_meta_t meta = META_INFO_EMPTY;
+    if (n == 4) {
+        zframe_t *meta_frame = zmsg_last(msg);
+        if (!frame_extract_meta_info(meta_frame, &meta)) {
+            meta = (msg_meta_t) META_INFO_EMPTY;
+            zmsg_remove(msg, meta_frame);
+            zframe_destroy(&meta_frame);
+            n = 3;
+        }
+    }
+    if (n == 3) {
+        meta.created_ms = global_time;
+        zmsg_add_meta_info(msg, &meta);
     }
 
+    forward_message_with_meta(state, msg_p, &meta);
+}
+
+static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+{
+    shard_state_t *state = (shard_state_t*)callback_data;
+    zmsg_t *msg = zmsg_recv(sock);
+    if (msg)
+        forward_message(state, &msg);
     return 0;
 }
 
+// sends sender id, empty delimiter and status frames, without building a message
+static void send_router_reply(void *socket, zframe_t **sender_id_p, const char *status, const char *info)
+{
+    int rc = zframe_send(sender_id_p, socket, ZFRAME_MORE);
+    if (rc == 0)
+        rc = zmq_send(socket, "", 0, ZMQ_SNDMORE);
+    if (rc != -1)
+        rc = zmq_send(socket, status, strlen(status), info ? ZMQ_SNDMORE : 0);
+    if (rc != -1 && info)
+        rc = zmq_send(socket, info, strlen(info), 0);
+    if (rc == -1)
+        fprintf(stderr, "[E] could not send response (%d: %s)\n", errno, zmq_strerror(errno));
+    zframe_destroy(sender_id_p);
+}
+
 static int read_router_message_and_forward(zloop_t *loop, zsock_t *socket, void *callback_data)
 {
-    publisher_state_t *state = (publisher_state_t*)callback_data;
+    shard_state_t *state = (shard_state_t*)callback_data;
     zmsg_t* msg = zmsg_recv(socket);
-    assert(msg);
+    if (!msg)
+        return 0;
 
     zframe_t *sender_id = zmsg_pop(msg);
     zframe_t *empty = zmsg_first(msg);
 
-    // if the second frame is empty, we need to send a reply
-    if (zframe_size(empty) > 0)
+    // if the second frame is not empty, the message is not acknowledged
+    if (empty == NULL || zframe_size(empty) > 0) {
         zframe_destroy(&sender_id);
-    else {
-        // pop the empty frame
-        empty = zmsg_pop(msg);
-        zmsg_t *reply = zmsg_new();
-        zmsg_append(reply, &sender_id);
-        zmsg_append(reply, &empty);
-
-        // return bad request if we don't receive 4 frames and meta frame can't be decoded
-        size_t n = zmsg_size(msg);
-        msg_meta_t meta;
-        bool decodable = n==4 && msg_extract_meta_info(msg, &meta);
-
-        zframe_t *app_env = zmsg_first(msg);
-        bool is_ping = zframe_streq(app_env, "ping");
-        if (is_ping) {
-            if (decodable) {
-                zmsg_addstr(reply, "200 Pong");
-                zmsg_addstr(reply, my_fqdn());
-            } else
-                zmsg_addstr(reply, "400 Bad Request");
-        } else
-            zmsg_addstr(reply, decodable ? "202 Accepted" : "400 Bad Request");
-
-        int rc = zmsg_send_and_destroy(&reply, socket);
-        if (rc)
-            fprintf(stderr, "[E] could not send response (%d: %s)\n", errno, zmq_strerror(errno));
+        forward_message(state, &msg);
+        return 0;
+    }
 
+    // pop the empty frame
+    empty = zmsg_pop(msg);
+    zframe_destroy(&empty);
+
+    // return bad request if we don't receive 4 frames and meta frame can't be decoded
+    size_t n = zmsg_size(msg);
+    msg_meta_t meta;
+    bool decodable = n==4 && msg_extract_meta_info(msg, &meta);
+
+    zframe_t *app_env = zmsg_first(msg);
+    bool is_ping = zframe_streq(app_env, "ping");
+    void *raw_socket = zsock_resolve(socket);
+    if (is_ping) {
+        if (decodable)
+            send_router_reply(raw_socket, &sender_id, "200 Pong", my_fqdn());
+        else
+            send_router_reply(raw_socket, &sender_id, "400 Bad Request", NULL);
         // don't forward pings
-        if (is_ping) return 0;
+        zmsg_destroy(&msg);
+        return 0;
     }
+    send_router_reply(raw_socket, &sender_id, decodable ? "202 Accepted" : "400 Bad Request", NULL);
 
-    // put message back on to the event loop
-    // TODO: this is slow. refactor to forward directly.
-    int rc = zmsg_send_and_destroy(&msg, state->router_output);
-    if (rc)
-        fprintf(stderr, "[E] could not forward router message (%d: %s)\n", errno, zmq_strerror(errno));
+    // the meta frame has already been validated
+    if (decodable)
+        forward_message_with_meta(state, &msg, &meta);
+    else
+        forward_message(state, &msg);
 
     return 0;
 }
 
+static shard_state_t* shard_state_new(size_t id, void *compressor_input)
+{
+    shard_state_t *state = zmalloc(sizeof(*state));
+    state->id = id;
+    int port_offset = id * SHARD_PORT_STRIDE;
+    int rc;
+
+    // create socket to receive messages on
+    state->receiver = zsock_new(ZMQ_PULL);
+    assert_x(state->receiver != NULL, "zmq socket creation failed", __FILE__, __LINE__);
+
+    //  configure the socket
+    zsock_set_rcvhwm(state->receiver, rcv_hwm);
+
+    // bind externally
+    rc = zsock_bind(state->receiver, "tcp://%s:%d", "*", pull_port + port_offset);
+    assert_x(rc == pull_port + port_offset, "receiver socket: external bind failed", __FILE__, __LINE__);
+
+    // create and bind socket for receiving logjam messages
+    state->router_receiver = zsock_new(ZMQ_ROUTER);
+    assert_x(state->router_receiver != NULL, "zmq socket creation failed", __FILE__, __LINE__);
+    rc = zsock_bind(state->router_receiver, "tcp://%s:%d", "*", router_port + port_offset);
+    assert_x(rc == router_port + port_offset, "receiver socket: external bind failed", __FILE__, __LINE__);
+
+    state->compressor_input = compressor_input;
+    state->doorbell = message_publisher_doorbell_new();
+    if (compression_method && compressor_input == NULL)
+        state->compression_buffer = zchunk_new(NULL, INITIAL_COMPRESSION_BUFFER_SIZE);
+
+    return state;
+}
+
+static void shard_state_destroy(shard_state_t **state_p)
+{
+    shard_state_t *state = *state_p;
+    zsock_destroy(&state->receiver);
+    zsock_destroy(&state->router_receiver);
+    zsock_destroy(&state->doorbell);
+    if (state->compression_buffer)
+        zchunk_destroy(&state->compression_buffer);
+    free(state);
+    *state_p = NULL;
+}
+
+static void shard_add_readers(zloop_t *loop, shard_state_t *state)
+{
+    // setup handler for incoming messages (all from the outside)
+    int rc = zloop_reader(loop, state->receiver, read_zmq_message_and_forward, state);
+    assert(rc == 0);
+    zloop_reader_set_tolerant(loop, state->receiver);
+
+    // setup handler for event messages (all from the outside)
+    rc = zloop_reader(loop, state->router_receiver, read_router_message_and_forward, state);
+    assert(rc == 0);
+    zloop_reader_set_tolerant(loop, state->router_receiver);
+}
+
+static int shard_command(zloop_t *loop, zsock_t *pipe, void *arg)
+{
+    char *cmd = zstr_recv(pipe);
+    int rc = cmd == NULL || streq(cmd, "$TERM") ? -1 : 0;
+    free(cmd);
+    return rc;
+}
+
+static void device_shard(zsock_t *pipe, void *args)
+{
+    shard_state_t *state = args;
+    char thread_name[16];
+    snprintf(thread_name, sizeof(thread_name), "shard[%zu]", state->id);
+    set_thread_name(thread_name);
+
+    zloop_t *loop = zloop_new();
+    assert(loop);
+    int rc = zloop_reader(loop, pipe, shard_command, state);
+    assert(rc == 0);
+    shard_add_readers(loop, state);
+
+    // signal readyiness
+    zsock_signal(pipe, 0);
+
+    if (!quiet)
+        printf("[I] shard[%zu]: listening on ports %d and %d\n", state->id,
+               pull_port + (int)(state->id * SHARD_PORT_STRIDE), router_port + (int)(state->id * SHARD_PORT_STRIDE));
+
+    zloop_start(loop);
+    zloop_destroy(&loop);
+
+    if (!quiet)
+        printf("[I] shard[%zu]: terminated\n", state->id);
+}
+
 static void print_usage(char * const *argv)
 {
     fprintf(stderr,
             "usage: %s [options]\n"
             "\nOptions:\n"
+            "  -B, --batch-size N         combine messages per app-env into batches of N bytes\n"
             "  -d, --device-id N          device id (integer)\n"
             "  -i, --io-threads N         zeromq io threads\n"
+            "  -n, --shards N             number of receiver threads (ports offset by 100)\n"
             "  -p, --input-port N         port number of zeromq input socket\n"
             "  -q, --quiet                supress most output\n"
             "  -s, --compressors N        number of compressor threads\n"
             "  -t, --router-port N        port number of zeromq router socket\n"
             "  -v, --verbose              log more (use -vv for debug output)\n"
-            "  -x, --compress M           compress logjam traffic using (snappy|zlib)\n"
+            "  -x, --compress M           compress logjam traffic using (snappy|zlib|zstd|lz4)\n"
+            "  -Z, --zstd-dictionaries D  load zstd dictionaries <app-env>.dict from directory D\n"
             "  -P, --output-port N        port number of zeromq ouput socket\n"
             "  -R, --rcv-hwm N            high watermark for input socket\n"
             "  -S, --snd-hwm N            high watermark for output socket\n"
@@ -267,6 +428,7 @@ static void process_arguments(int argc, char * const *argv)
     opterr = 0;
 
     static struct option long_options[] = {
+        { "batch-size",    required_argument, 0, 'B' },
         { "compress",      required_argument, 0, 'x' },
         { "device-id",     required_argument, 0, 'd' },
         { "router-port",   required_argument, 0, 't' },
@@ -276,12 +438,14 @@ static void process_arguments(int argc, char * const *argv)
         { "output-port",   required_argument, 0, 'P' },
         { "quiet",         no_argument,       0, 'q' },
         { "rcv-hwm",       required_argument, 0, 'R' },
+        { "shards",        required_argument, 0, 'n' },
         { "snd-hwm",       required_argument, 0, 'S' },
         { "verbose",       no_argument,       0, 'v' },
+        { "zstd-dictionaries", required_argument, 0, 'Z' },
         { 0,               0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vqd:p:c:i:x:s:P:S:R:t:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vqd:p:c:i:n:x:s:B:P:S:R:t:Z:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -315,11 +479,26 @@ static void process_arguments(int argc, char * const *argv)
         case 't':
             router_port = atoi(optarg);
             break;
+        case 'n':
+            num_shards = atoi(optarg);
+            if (num_shards < 1)
+                num_shards = 1;
+            if (num_shards > MAX_SHARDS) {
+                num_shards = MAX_SHARDS;
+                printf("[I] number of shards reduced to %d\n", MAX_SHARDS);
+            }
+            break;
+        case 'B':
+            batch_bytes = atoi(optarg);
+            break;
         case 'x':
             compression_method = string_to_compression_method(optarg);
             if (compression_method)
                 printf("[I] compressing streams with: %s\n", compression_method_to_string(compression_method));
             break;
+        case 'Z':
+            compression_dictionaries_load(optarg);
+            break;
         case 'R':
             rcv_hwm = atoi(optarg);
             break;
@@ -331,7 +510,7 @@ static void process_arguments(int argc, char * const *argv)
             exit(0);
             break;
         case '?':
-            if (strchr("drpceixsPSRE", optopt))
+            if (strchr("drpceinxsBPSREZ", optopt))
                 fprintf(stderr, "option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "unknown option `-%c'.\n", optopt);
@@ -373,9 +552,11 @@ int main(int argc, char * const *argv)
            "[I] pub-port:    %d\n"
            "[I] router-port: %d\n"
            "[I] io-threads:  %lu\n"
+           "[I] shards:      %zu\n"
+           "[I] batch-size:  %zu\n"
            "[I] rcv-hwm:     %d\n"
            "[I] snd-hwm:     %d\n"
-           , argv[0], pull_port, pub_port, router_port, io_threads, rcv_hwm, snd_hwm);
+           , argv[0], pull_port, pub_port, router_port, io_threads, num_shards, batch_bytes, rcv_hwm, snd_hwm);
 
     // set global config
     zsys_init();
@@ -385,95 +566,52 @@ int main(int argc, char * const *argv)
     zsys_set_linger(100);
     zsys_set_io_threads(io_threads);
 
-    compression_buffer = zchunk_new(NULL, INITIAL_COMPRESSION_BUFFER_SIZE);
-
-    // create socket to receive messages on
-    zsock_t *receiver = zsock_new(ZMQ_PULL);
-    assert_x(receiver != NULL, "zmq socket creation failed", __FILE__, __LINE__);
-
-    //  configure the socket
-    zsock_set_rcvhwm(receiver, rcv_hwm);
-
-    // bind externally
-    rc = zsock_bind(receiver, "tcp://%s:%d", "*", pull_port);
-    assert_x(rc == pull_port, "receiver socket: external bind failed", __FILE__, __LINE__);
-
-    // bind internally
-    rc = zsock_bind(receiver, "inproc://receiver");
-    assert_x(rc != -1, "receiver socket: internal bind failed", __FILE__, __LINE__);
-
-    // create and bind socket for receiving logjam messages
-    zsock_t *router_receiver = zsock_new(ZMQ_ROUTER);
-    assert_x(router_receiver != NULL, "zmq socket creation failed", __FILE__, __LINE__);
-    rc = zsock_bind(router_receiver, "tcp://%s:%d", "*", router_port);
-    assert_x(rc == router_port, "receiver socket: external bind failed", __FILE__, __LINE__);
-
-    // create router output socket and connect to the inproc receiver
-    zsock_t *router_output = zsock_new(ZMQ_PUSH);
-    assert_x(router_output != NULL, "zmq socket creation failed", __FILE__, __LINE__);
-    rc = zsock_connect(router_output, "inproc://receiver");
-    assert(rc == 0);
-
-    // create socket for publishing
-    zsock_t *publisher = zsock_new(ZMQ_PUB);
-    assert_x(publisher != NULL, "publisher socket creation failed", __FILE__, __LINE__);
-    zsock_set_sndhwm(publisher, snd_hwm);
+    // create publisher agent, which binds the publishing socket
+    message_publisher_queue_init();
+    zactor_t *publisher = message_publisher_new(pub_port, snd_hwm, &msg_meta, batch_bytes);
 
-    rc = zsock_bind(publisher, "tcp://%s:%d", "*", pub_port);
-    assert_x(rc == pub_port, "publisher socket bind failed", __FILE__, __LINE__);
-
-    // create compressor sockets
-    zsock_t *compressor_input = zsock_new(ZMQ_PUSH);
-    assert_x(compressor_input != NULL, "compressor input socket creation failed", __FILE__, __LINE__);
-    rc = zsock_bind(compressor_input, "inproc://compressor-input");
-    assert_x(rc==0, "compressor input socket bind failed", __FILE__, __LINE__);
+    // compressor agents are only needed when the main loop runs the only shard
+    bool use_compressors = num_shards == 1;
+    zsock_t *compressor_input = NULL;
+    zactor_t *compressors[MAX_COMPRESSORS];
+    zsock_t *compressor_doorbells[MAX_COMPRESSORS];
+    if (use_compressors) {
+        // create compressor sockets
+        compressor_input = zsock_new(ZMQ_PUSH);
+        assert_x(compressor_input != NULL, "compressor input socket creation failed", __FILE__, __LINE__);
+        rc = zsock_bind(compressor_input, "inproc://compressor-input");
+        assert_x(rc==0, "compressor input socket bind failed", __FILE__, __LINE__);
+
+        // create compressor agents, which hand their results to the publisher
+        for (size_t i = 0; i < num_compressors; i++) {
+            compressor_doorbells[i] = message_publisher_doorbell_new();
+            compressors[i] = message_compressor_new_with_output(i, compression_method, publish_compressed_message, compressor_doorbells[i]);
+        }
+    }
 
-    zsock_t *compressor_output = zsock_new(ZMQ_PULL);
-    assert_x(compressor_output != NULL, "compressor output socket creation failed", __FILE__, __LINE__);
-    rc = zsock_bind(compressor_output, "inproc://compressor-output");
-    assert_x(rc==0, "compressor output socket bind failed", __FILE__, __LINE__);
+    // initialize clock
+    global_time = zclock_time();
 
-    // create compressor agents
-    zactor_t *compressors[MAX_COMPRESSORS];
-    for (size_t i = 0; i < num_compressors; i++)
-        compressors[i] = message_compressor_new(i, compression_method);
+    // create shards
+    zactor_t *shard_actors[MAX_SHARDS];
+    for (size_t i = 0; i < num_shards; i++)
+        shards[i] = shard_state_new(i, use_compressors ? zsock_resolve(compressor_input) : NULL);
+    if (num_shards > 1) {
+        for (size_t i = 0; i < num_shards; i++)
+            shard_actors[i] = zactor_new(device_shard, shards[i]);
+    }
 
     // set up event loop
     zloop_t *loop = zloop_new();
     assert(loop);
     zloop_set_verbose(loop, 0);
 
-    // setup publisher state
-    publisher_state_t publisher_state = {
-        .receiver = zsock_resolve(receiver),
-        .router_receiver = zsock_resolve(router_receiver),
-        .router_output = zsock_resolve(router_output),
-        .publisher = zsock_resolve(publisher),
-        .compressor_input = zsock_resolve(compressor_input),
-        .compressor_output = zsock_resolve(compressor_output),
-    };
-
     // calculate statistics every 1000 ms
     int timer_id = zloop_timer(loop, 1000, 0, timer_event, publisher);
     assert(timer_id != -1);
 
-    // setup handler for compression results
-    rc = zloop_reader(loop, compressor_output, read_zmq_message_and_forward, &publisher_state);
-    assert(rc == 0);
-    zloop_reader_set_tolerant(loop, compressor_output);
-
-    // setup handler for incoming messages (all from the outside)
-    rc = zloop_reader(loop, receiver, read_zmq_message_and_forward, &publisher_state);
-    assert(rc == 0);
-    zloop_reader_set_tolerant(loop, receiver);
-
-    // setup handler for event messages (all from the outside)
-    rc = zloop_reader(loop, router_receiver, read_router_message_and_forward, &publisher_state);
-    assert(rc == 0);
-    zloop_reader_set_tolerant(loop, router_receiver);
-
-    // initialize clock
-    global_time = zclock_time();
+    if (num_shards == 1)
+        shard_add_readers(loop, shards[0]);
 
     // run the loop
     if (!zsys_interrupted) {
@@ -492,18 +630,30 @@ int main(int argc, char * const *argv)
     zloop_destroy(&loop);
     assert(loop == NULL);
 
+    size_t received_messages_count = 0;
+    for (size_t i = 0; i < num_shards; i++)
+        received_messages_count += shards[i]->received_messages_count;
     printf("[I] received %zu messages\n", received_messages_count);
 
     printf("[I] shutting down\n");
 
-    zsock_destroy(&receiver);
-    zsock_destroy(&router_receiver);
-    zsock_destroy(&router_output);
-    zsock_destroy(&publisher);
-    zsock_destroy(&compressor_input);
-    zsock_destroy(&compressor_output);
-    for (size_t i = 0; i < num_compressors; i++)
-        zactor_destroy(&compressors[i]);
+    // all producers must be gone before the publisher publishes the remaining messages
+    if (num_shards > 1) {
+        for (size_t i = 0; i < num_shards; i++)
+            zactor_destroy(&shard_actors[i]);
+    }
+    for (size_t i = 0; i < num_shards; i++)
+        shard_state_destroy(&shards[i]);
+    if (use_compressors) {
+        zsock_destroy(&compressor_input);
+        for (size_t i = 0; i < num_compressors; i++) {
+            zactor_destroy(&compressors[i]);
+            zsock_destroy(&compressor_doorbells[i]);
+        }
+    }
+    zactor_destroy(&publisher);
+    message_publisher_queue_destroy();
+    compression_dictionaries_destroy();
     zsys_shutdown();
 
     printf("[I] %s terminated\n", argv[0]);
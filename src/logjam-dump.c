@@ -1,8 +1,9 @@
 #include "logjam-util.h"
 #include "device-tracker.h"
+#include "dump-file.h"
 #include <getopt.h>
 
-FILE* dump_file = NULL;
+static dump_writer_t *dump_writer = NULL;
 static char *dump_file_name = "logjam-stream.dump";
 
 static size_t io_threads = 1;
@@ -20,6 +21,7 @@ static size_t received_messages_count = 0;
 static size_t received_messages_bytes = 0;
 static size_t received_messages_max_bytes = 0;
 static size_t message_gaps = 0;
+static size_t dump_errors = 0;
 
 static device_tracker_t *tracker = NULL;
 
@@ -45,13 +47,43 @@ static int timer_event( zloop_t *loop, int timer_id, void *arg)
     return 0;
 }
 
+static void dump_message(zmsg_t *msg, uint64_t created_ms)
+{
+    if (dump_writer_write(dump_writer, msg, created_ms) && !dump_errors++)
+        fprintf(stderr, "[E] could not write to dump file: %s\n", strerror(errno));
+}
+
+// batches get dumped as the individual messages they contain
+static void dump_batch(zmsg_t *msg)
+{
+    zframe_t *app_env = zmsg_first(msg);
+    zmsg_next(msg);
+    zframe_t *body = zmsg_next(msg);
+
+    batch_reader_t reader;
+    batch_entry_t entry;
+    batch_reader_init(&reader, (const char*) zframe_data(body), zframe_size(body));
+    int rc;
+    while ((rc = batch_reader_next(&reader, &entry)) > 0) {
+        msg_meta_t meta;
+        memcpy(&meta, entry.meta, sizeof(meta));
+        meta_info_decode(&meta);
+        zmsg_t *entry_msg = batch_entry_to_zmsg(app_env, &entry);
+        dump_message(entry_msg, meta.created_ms);
+        zmsg_destroy(&entry_msg);
+    }
+    if (rc < 0)
+        fprintf(stderr, "[E] received corrupted batch\n");
+}
+
 static int read_zmq_message_and_dump(zloop_t *loop, zsock_t *socket, void *callback_data)
 {
     zmsg_t *msg = zmsg_recv(socket);
     if (!msg) return 1;
 
-    msg_meta_t meta;
-    msg_extract_meta_info(msg, &meta);
+    msg_meta_t meta = META_INFO_EMPTY;
+    if (!msg_extract_meta_info(msg, &meta))
+        meta.created_ms = 0;
 
     if (debug) {
         my_zmsg_fprint(msg, "[D]", stdout);
@@ -78,8 +110,12 @@ static int read_zmq_message_and_dump(zloop_t *loop, zsock_t *socket, void *callb
         received_messages_max_bytes = msg_bytes;
 
     // dump message to file annd free memory
-    if (!is_heartbeat)
-        zmsg_savex(msg, dump_file);
+    if (is_heartbeat)
+        ;
+    else if (zmsg_is_batch(msg))
+        dump_batch(msg);
+    else
+        dump_message(msg, meta.created_ms ? meta.created_ms : zclock_time());
     zmsg_destroy(&msg);
 
     return 0;
@@ -188,12 +224,12 @@ int main(int argc, char * const *argv)
     process_arguments(argc, argv);
 
     // open dump file
-    dump_file = fopen(dump_file_name, "w");
-    if (!dump_file) {
+    dump_writer = dump_writer_new(dump_file_name);
+    if (!dump_writer) {
         fprintf(stderr, "[E] could not open dump file: %s\n", strerror(errno));
         exit(1);
     }
-    if (verbose) printf("[I] dumping stream to %s\n", dump_file_name);
+    if (verbose) printf("[I] dumping stream to %s (format version %d)\n", dump_file_name, DUMP_FILE_VERSION);
 
     // set global config
     zsys_init();
@@ -273,7 +309,8 @@ int main(int argc, char * const *argv)
     if (verbose) printf("[I] shutting down\n");
 
     device_tracker_destroy(&tracker);
-    fclose(dump_file);
+    if (dump_writer_destroy(&dump_writer))
+        fprintf(stderr, "[E] could not write dump file index: %s\n", strerror(errno));
     zloop_destroy(&loop);
     assert(loop == NULL);
     zsock_destroy(&receiver);
@@ -327,7 +327,8 @@ void send_logjam_message(msg_data_t *data, msg_meta_t *meta)
 
     if (compression) {
         zmq_msg_init(&message_parts[2]);
-        compress_message_data(compression, compression_buffer, &message_parts[2], data->json_str, data->json_len);
+        compress_message_data(compression, compression_buffer, &message_parts[2],
+                              app_env, app_env_len, data->json_str, data->json_len);
     } else {
         zmq_msg_init_size(&message_parts[2], data->json_len);
         memcpy(zmq_msg_data(&message_parts[2]), data->json_str, data->json_len);
@@ -622,7 +623,8 @@ static void print_usage(char * const *argv)
             "  -p, --input-port N          port number of zeromq input socket\n"
             "  -q, --quiet                 supress most output\n"
             "  -v, --verbose               log more (use -vv for debug output)\n"
-            "  -x, --compress M            compress logjam traffic using (snappy|zlib)\n"
+            "  -x, --compress M            compress logjam traffic using (snappy|zlib|zstd|lz4)\n"
+            "  -Z, --zstd-dictionaries D   load zstd dictionaries <app-env>.dict from directory D\n"
             "  -D, --debug-compress        check decompressability\n"
             "  -P, --output-port N         port number of zeromq ouput socket\n"
             "  -R, --rcv-hwm N             high watermark for input socket\n"
@@ -654,10 +656,11 @@ static void process_arguments(int argc, char * const *argv)
         { "rcv-hwm",        required_argument, 0, 'R' },
         { "snd-hwm",        required_argument, 0, 'S' },
         { "verbose",        no_argument,       0, 'v' },
+        { "zstd-dictionaries", required_argument, 0, 'Z' },
         { 0,                0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vqd:p:P:c:x:R:S:i:D", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vqd:p:P:c:x:R:S:i:DZ:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -691,6 +694,9 @@ static void process_arguments(int argc, char * const *argv)
             if (compression)
                 printf("[I] compressing streams with: %s\n", compression_method_to_string(compression));
             break;
+        case 'Z':
+            compression_dictionaries_load(optarg);
+            break;
         case 'R':
             rcv_hwm = atoi(optarg);
             break;
@@ -702,7 +708,7 @@ static void process_arguments(int argc, char * const *argv)
             exit(0);
             break;
         case '?':
-            if (strchr("dpPcxRSi", optopt))
+            if (strchr("dpPcxRSiZ", optopt))
                 fprintf(stderr, "option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "unknown option `-%c'.\n", optopt);
@@ -802,6 +808,7 @@ int main(int argc, char * const *argv)
     if (!quiet)
         printf("[I] shutting down\n");
 
+    compression_dictionaries_destroy();
     zsys_shutdown();
 
     if (!quiet)
@@ -4,6 +4,7 @@
 #include "importer-mongoutils.h"
 #include "importer-processor.h"
 #include "prometheus-client.h"
+#include "simd-kernels.h"
 #include <getopt.h>
 
 int snd_hwm = -1;
@@ -30,6 +31,7 @@ static char* num_parsers_arg_value = NULL;
 static char* num_updaters_arg_value = NULL;
 static char* num_writers_arg_value = NULL;
 static size_t io_threads = 1;
+static char* zstd_dictionaries_dir = NULL;
 
 static void setup_thread_counts(zconfig_t* config)
 {
@@ -52,6 +54,16 @@ static void setup_thread_counts(zconfig_t* config)
         num_writers_arg_value = zconfig_resolve(config, "frontend/threads/writers", NULL);
     if (num_writers_arg_value)
         num_writers = strtoul(num_writers_arg_value, NULL, 0);
+
+    if (!route_by_stream) {
+        char *route_by_stream_value = zconfig_resolve(config, "frontend/threads/route_by_stream", NULL);
+        route_by_stream = route_by_stream_value && atoi(route_by_stream_value);
+    }
+
+    if (!use_json_view) {
+        char *json_view_value = zconfig_resolve(config, "frontend/parser/json_view", NULL);
+        use_json_view = json_view_value && atoi(json_view_value);
+    }
 }
 
 void print_usage(char * const *argv)
@@ -63,12 +75,14 @@ void print_usage(char * const *argv)
             "  -c, --config C             zeromq config file\n"
             "  -f, --frontend-log F       frontend timings log file\n"
             "  -h, --hosts H,I            specs of devices to connect to\n"
+            "  -j, --json-view            parse messages with the SIMD json view\n"
             "  -i, --io-threads N         zeromq io threads\n"
             "  -l, --live-stream S        zmq bind spec for publishing live stream data\n"
             "  -p, --parsers N            number of parser threads\n"
             "  -b, --subscribers N        number of subscriber threads\n"
             "  -u, --updaters N           number of db stats updater threads\n"
             "  -q, --quiet                supress most output\n"
+            "  -r, --route-by-stream      send all messages of a stream to the same parser\n"
             "  -s, --subscribe S          only process streams with S as substring\n"
             "  -t, --router-port N        port number of zeromq router socket\n"
             "  -v, --verbose              log more (use -vv for debug output)\n"
@@ -80,6 +94,7 @@ void print_usage(char * const *argv)
             "  -S, --snd-hwm N            high watermark for output socket\n"
             "  -m, --metrics-port N       port to use for prometheus path /metrics\n"
             "  -M, --metrics-ip N         ip for binding metrics endpoint\n"
+            "  -Z, --zstd-dictionaries D  load zstd dictionaries <app-env>.dict from directory D\n"
             "      --help                 display this message\n"
             "\nEnvironment: (parameters take precedence)\n"
             "  LOGJAM_DEVICES             specs of devices to connect to\n"
@@ -105,12 +120,14 @@ void process_arguments(int argc, char * const *argv)
         { "hosts",            required_argument, 0, 'h' },
         { "input-port",       required_argument, 0, 'P' },
         { "io-threads",       required_argument, 0, 'i' },
+        { "json-view",        no_argument,       0, 'j' },
         { "live-stream",      required_argument, 0, 'l' },
         { "prom-export",      required_argument, 0, 'x' },
         { "no-statsd",        no_argument,       0, 'N' },
         { "output-port",      required_argument, 0, 'P' },
         { "quiet",            no_argument,       0, 'q' },
         { "rcv-hwm",          required_argument, 0, 'R' },
+        { "route-by-stream",  no_argument,       0, 'r' },
         { "router-port",      required_argument, 0, 't' },
         { "snd-hwm",          required_argument, 0, 'S' },
         { "subscribe",        required_argument, 0, 's' },
@@ -118,10 +135,11 @@ void process_arguments(int argc, char * const *argv)
         { "metrics-port",     required_argument, 0, 'm' },
         { "metrics-ip",       required_argument, 0, 'M' },
         { "verbose",          no_argument,       0, 'v' },
+        { "zstd-dictionaries", required_argument, 0, 'Z' },
         { 0,                  0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "a:b:c:f:nm:p:qs:u:vw:x:i:P:R:S:l:h:D:t:NM:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "a:b:c:f:jnm:p:qrs:u:vw:x:i:P:R:S:l:h:D:t:NM:Z:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'n':
             dryrun = true;
@@ -222,6 +240,15 @@ void process_arguments(int argc, char * const *argv)
         case 'N':
             send_statsd_msgs = false;
             break;
+        case 'r':
+            route_by_stream = true;
+            break;
+        case 'j':
+            use_json_view = true;
+            break;
+        case 'Z':
+            zstd_dictionaries_dir = optarg;
+            break;
         case 'l':
             live_stream_connection_spec = augment_zmq_connection_spec(optarg, DEFAULT_LIVE_STREAM_PORT);
             break;
@@ -233,7 +260,7 @@ void process_arguments(int argc, char * const *argv)
             exit(0);
             break;
         case '?':
-            if (strchr("acfpsuwiPRSlhD", optopt))
+            if (strchr("acfpsuwiPRSlhDZ", optopt))
                 fprintf(stderr, "[E] option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "[E] unknown option `-%c'.\n", optopt);
@@ -324,6 +351,11 @@ int main(int argc, char * const *argv)
 
     setup_thread_counts(config);
 
+    if (zstd_dictionaries_dir == NULL)
+        zstd_dictionaries_dir = zconfig_resolve(config, "frontend/parser/zstd_dictionaries", NULL);
+    if (zstd_dictionaries_dir)
+        compression_dictionaries_load(zstd_dictionaries_dir);
+
     if (!quiet)
         printf("[I] started %s\n"
                "[I] pull-port:     %d\n"
@@ -336,8 +368,14 @@ int main(int argc, char * const *argv)
                "[I] writers:       %zu\n"
                "[I] updaters:      %zu\n"
                "[I] subscription:  %s\n"
+               "[I] routing:       %s\n"
+               "[I] json parser:   %s\n"
+               "[I] simd kernels:  %s\n"
                , argv[0], pull_port, sub_port, live_stream_connection_spec, io_threads, rcv_hwm, snd_hwm,
-               num_parsers, num_writers, num_updaters, subscription_pattern);
+               num_parsers, num_writers, num_updaters, subscription_pattern,
+               route_by_stream ? "by stream" : "round robin",
+               use_json_view ? "json view" : "json-c",
+               simd_kernels_name());
 
     initialize_mongo_db_globals(config);
     snprintf(metrics_address, sizeof(metrics_address), "%s:%d", metrics_ip, metrics_port);
@@ -137,50 +137,16 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
     return 0;
 }
 
-static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+static void forward_message(publisher_state_t *state, void *socket, zmq_msg_t *message_parts, msg_meta_t *meta)
 {
-    int i = 0;
-    zmq_msg_t message_parts[4];
-    publisher_state_t *state = (publisher_state_t*)callback_data;
-    void *socket = zsock_resolve(sock);
-
-    // read the message parts, possibly including the message meta info
-    while (!zsys_interrupted) {
-        // printf("[D] receiving part %d\n", i+1);
-        if (i>3) {
-            zmq_msg_t dummy_msg;
-            zmq_msg_init(&dummy_msg);
-            zmq_recvmsg(socket, &dummy_msg, 0);
-            zmq_msg_close(&dummy_msg);
-        } else {
-            zmq_msg_init(&message_parts[i]);
-            zmq_recvmsg(socket, &message_parts[i], 0);
-        }
-        if (!zsock_rcvmore(socket))
-            break;
-        i++;
-    }
-    if (i<2) {
-        if (!zsys_interrupted) {
-            fprintf(stderr, "[E] received only %d message parts\n", i);
-        }
-        goto cleanup;
-    } else if (i>3) {
-        fprintf(stderr, "[E] received more than 4 message parts\n");
-        goto cleanup;
-    }
-
     zmq_msg_t *body = &message_parts[2];
-    msg_meta_t meta = META_INFO_EMPTY;
-    if (i==3)
-        zmq_msg_extract_meta_info(&message_parts[3], &meta);
 
     // const char *prefix = socket == state->compressor_output ? "EXTERNAL MESSAGE" : "INTERNAL MESSAGE";
     // my_zmq_msg_fprint(&message_parts[0], 3, prefix, stdout);
-    // dump_meta_info(prefix, &meta);
+    // dump_meta_info(prefix, meta);
 
-    if (meta.created_ms)
-        msg_meta.created_ms = meta.created_ms;
+    if (meta->created_ms)
+        msg_meta.created_ms = meta->created_ms;
     else
         msg_meta.created_ms = global_time;
 
@@ -197,8 +163,8 @@ static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *call
             received_messages_max_bytes = msg_bytes;
     }
 
-    msg_meta.compression_method = meta.compression_method;
-    if (meta.compression_method) {
+    msg_meta.compression_method = meta->compression_method;
+    if (meta->compression_method) {
         // decompress
         publish_on_zmq_transport(&message_parts[0], state->compressor_input, &msg_meta, 0);
     } else {
@@ -223,6 +189,76 @@ static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *call
             }
         }
     }
+}
+
+// messages contained in a batch get forwarded individually
+static void forward_batch(publisher_state_t *state, void *socket, zmq_msg_t *message_parts)
+{
+    batch_reader_t reader;
+    batch_entry_t entry;
+    batch_reader_init(&reader, zmq_msg_data(&message_parts[2]), zmq_msg_size(&message_parts[2]));
+    int rc;
+    while ((rc = batch_reader_next(&reader, &entry)) > 0) {
+        msg_meta_t meta;
+        memcpy(&meta, entry.meta, sizeof(meta));
+        meta_info_decode(&meta);
+        zmq_msg_t entry_parts[3];
+        zmq_msg_init_size(&entry_parts[0], zmq_msg_size(&message_parts[0]));
+        memcpy(zmq_msg_data(&entry_parts[0]), zmq_msg_data(&message_parts[0]), zmq_msg_size(&message_parts[0]));
+        zmq_msg_init_size(&entry_parts[1], entry.topic_len);
+        memcpy(zmq_msg_data(&entry_parts[1]), entry.topic, entry.topic_len);
+        zmq_msg_init_size(&entry_parts[2], entry.body_len);
+        memcpy(zmq_msg_data(&entry_parts[2]), entry.body, entry.body_len);
+        forward_message(state, socket, entry_parts, &meta);
+        for (int j = 0; j < 3; j++)
+            zmq_msg_close(&entry_parts[j]);
+    }
+    if (rc < 0)
+        fprintf(stderr, "[E] received corrupted batch\n");
+}
+
+static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+{
+    int i = 0;
+    zmq_msg_t message_parts[4];
+    publisher_state_t *state = (publisher_state_t*)callback_data;
+    void *socket = zsock_resolve(sock);
+
+    // read the message parts, possibly including the message meta info
+    while (!zsys_interrupted) {
+        // printf("[D] receiving part %d\n", i+1);
+        if (i>3) {
+            zmq_msg_t dummy_msg;
+            zmq_msg_init(&dummy_msg);
+            zmq_recvmsg(socket, &dummy_msg, 0);
+            zmq_msg_close(&dummy_msg);
+        } else {
+            zmq_msg_init(&message_parts[i]);
+            zmq_recvmsg(socket, &message_parts[i], 0);
+        }
+        if (!zsock_rcvmore(socket))
+            break;
+        i++;
+    }
+    if (i<2) {
+        if (!zsys_interrupted) {
+            fprintf(stderr, "[E] received only %d message parts\n", i);
+        }
+        goto cleanup;
+    } else if (i>3) {
+        fprintf(stderr, "[E] received more than 4 message parts\n");
+        goto cleanup;
+    }
+
+    msg_meta_t meta = META_INFO_EMPTY;
+    if (i==3)
+        zmq_msg_extract_meta_info(&message_parts[3], &meta);
+
+    bool is_batch = i==3 && is_batch_topic(zmq_msg_data(&message_parts[1]), zmq_msg_size(&message_parts[1]));
+    if (is_batch)
+        forward_batch(state, socket, message_parts);
+    else
+        forward_message(state, socket, message_parts, &meta);
 
  cleanup:
     for (;i>=0;i--) {
@@ -248,6 +284,7 @@ static void print_usage(char * const *argv)
             "  -P, --output-port N        port number of zeromq ouput socket\n"
             "  -R, --rcv-hwm N            high watermark for input socket\n"
             "  -S, --snd-hwm N            high watermark for output socket\n"
+            "  -Z, --zstd-dictionaries D  load zstd dictionaries <app-env>.dict from directory D\n"
             "      --help                 display this message\n"
             "\nEnvironment: (parameters take precedence)\n"
             "  LOGJAM_DEVICES             specs of devices to connect to\n"
@@ -278,10 +315,11 @@ static void process_arguments(int argc, char * const *argv)
         { "snd-hwm",       required_argument, 0, 'S' },
         { "subscribe",     required_argument, 0, 'e' },
         { "verbose",       no_argument,       0, 'v' },
+        { "zstd-dictionaries", required_argument, 0, 'Z' },
         { 0,               0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vqd:p:P:R:S:c:e:i:s:h:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vqd:p:P:R:S:c:e:i:s:h:Z:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -332,6 +370,9 @@ static void process_arguments(int argc, char * const *argv)
                 exit(1);
             }
             break;
+        case 'Z':
+            compression_dictionaries_load(optarg);
+            break;
         case 'R':
             rcv_hwm = atoi(optarg);
             break;
@@ -343,7 +384,7 @@ static void process_arguments(int argc, char * const *argv)
             exit(0);
             break;
         case '?':
-            if (strchr("depcish", optopt))
+            if (strchr("depcishZ", optopt))
                 fprintf(stderr, "option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "unknown option `-%c'.\n", optopt);
@@ -533,6 +574,7 @@ int main(int argc, char * const *argv)
     device_tracker_destroy(&tracker);
     for (size_t i = 0; i < num_compressors; i++)
         zactor_destroy(&compressors[i]);
+    compression_dictionaries_destroy();
     zsys_shutdown();
 
     if (!quiet)
@@ -1,6 +1,9 @@
 #include "logjam-util.h"
+#include "dump-file.h"
 #include <getopt.h>
 
+static dump_reader_t *dump_reader = NULL;
+// dump files written by earlier versions of logjam-dump are read with stdio
 FILE* dump_file = NULL;
 static char *dump_file_name = "logjam-stream.dump";
 static size_t dump_file_size = 0;
@@ -19,6 +22,7 @@ static int socket_type = ZMQ_PUB;
 #define DEFAULT_CONNECTION_SPEC_DEALER "tcp://localhost:9604"
 
 static bool endless_loop = false;
+static int skip_seconds = 0;
 static int messages_per_second = 100000;
 static int message_credit = 1000000;
 
@@ -44,6 +48,68 @@ static int timer_event( zloop_t *loop, int timer_id, void *arg)
     return 0;
 }
 
+static void record_stats(size_t msg_bytes)
+{
+    replayed_messages_count++;
+    replayed_messages_bytes += msg_bytes;
+    if (msg_bytes > replayed_messages_max_bytes)
+        replayed_messages_max_bytes = msg_bytes;
+}
+
+// frames are sent without copying them out of the mapped dump file
+static void send_record(dump_record_t *record, void *socket)
+{
+    size_t n = record->frame_count;
+    zmq_msg_t parts[DUMP_FILE_MAX_FRAMES];
+    size_t msg_bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        zmq_msg_init_data(&parts[i], (void*) record->data[i], record->size[i], NULL, NULL);
+        msg_bytes += record->size[i];
+    }
+    record_stats(msg_bytes);
+
+    if (debug) {
+        my_zmq_msg_fprint(parts, n, "[D]", stdout);
+        msg_meta_t meta;
+        if (zmq_msg_extract_meta_info(&parts[n-1], &meta))
+            dump_meta_info("[D]", &meta);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        int rc = zmq_msg_send(&parts[i], socket, i + 1 < n ? ZMQ_SNDMORE : 0);
+        if (rc == -1)
+            log_zmq_error(rc, __FILE__, __LINE__);
+        zmq_msg_close(&parts[i]);
+    }
+}
+
+static int file_consume_record_and_forward(zloop_t *loop, zmq_pollitem_t *item, void* arg)
+{
+    zsock_t *socket = arg;
+
+    if (message_credit-- <= 0) {
+        zclock_sleep(1);
+        return 0;
+    }
+
+    dump_record_t record;
+    int rc = dump_reader_next(dump_reader, &record);
+    if (rc == 0 && endless_loop) {
+        if (verbose) printf("[I] end of dump file reached. rewinding.\n");
+        dump_reader_rewind(dump_reader);
+        rc = dump_reader_next(dump_reader, &record);
+    }
+    if (rc <= 0) {
+        if (rc < 0)
+            fprintf(stderr, "[E] dump file is corrupted or truncated\n");
+        zsys_interrupted = 1;
+        return 0;
+    }
+
+    send_record(&record, zsock_resolve(socket));
+    return 0;
+}
+
 static int file_consume_message_and_forward(zloop_t *loop, zmq_pollitem_t *item, void* arg)
 {
     zsock_t *socket = arg;
@@ -59,10 +125,7 @@ static int file_consume_message_and_forward(zloop_t *loop, zmq_pollitem_t *item,
     // calculate stats
     size_t msg_bytes = zmsg_content_size(msg);
     bytes_read_from_file  += sizeof(size_t) * 5 + msg_bytes;
-    replayed_messages_count++;
-    replayed_messages_bytes += msg_bytes;
-    if (msg_bytes > replayed_messages_max_bytes)
-        replayed_messages_max_bytes = msg_bytes;
+    record_stats(msg_bytes);
 
     if (debug) {
         my_zmsg_fprint(msg, "[D]", stdout);
@@ -93,6 +156,7 @@ void print_usage(char * const *argv)
             "  -i, --io-threads N         zeromq io threads\n"
             "  -l, --loop                 loop the dump file\n"
             "  -r, --msg-rate N           output message rate (per second)\n"
+            "  -s, --skip N               skip the first N seconds of the dump file\n"
             "  -v, --verbose              log more (use -vv for debug output)\n"
             "  -d, --dealer               use zqm DEALER socket for publishing\n"
             "  -p, --pub S                zmq specification for publishing socket\n"
@@ -112,12 +176,13 @@ void process_arguments(int argc, char * const *argv)
         { "msg-rate",      required_argument, 0, 'r' },
         { "io-threads",    required_argument, 0, 'i' },
         { "pub",           required_argument, 0, 'p' },
+        { "skip",          required_argument, 0, 's' },
         { "verbose",       no_argument,       0, 'v' },
         { "dealer",        no_argument,       0, 'd' },
         { 0,               0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vdlr:i:p:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vdlr:i:p:s:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -140,12 +205,15 @@ void process_arguments(int argc, char * const *argv)
         case 'p':
             connection_spec = optarg;
             break;
+        case 's':
+            skip_seconds = atoi(optarg);
+            break;
         case 0:
             print_usage(argv);
             exit(0);
             break;
         case '?':
-            if (strchr("rip", optopt))
+            if (strchr("rips", optopt))
                 fprintf(stderr, "[E] option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "[E] unknown option `-%c'.\n", optopt);
@@ -189,13 +257,34 @@ int main(int argc, char * const *argv)
     process_arguments(argc, argv);
 
     // open dump file
-    dump_file = fopen(dump_file_name, "r");
-    if (!dump_file) {
+    dump_reader = dump_reader_new(dump_file_name);
+    if (dump_reader) {
+        if (verbose) {
+            printf("[I] replaying stream from %s\n", dump_file_name);
+            size_t n = dump_reader_count(dump_reader);
+            if (n > 0)
+                printf("[I] dump file contains %zu messages spanning %.1f seconds\n",
+                       n, ((int64_t)dump_reader_created_ms(dump_reader, n-1) - (int64_t)dump_reader_created_ms(dump_reader, 0)) / 1000.0);
+            else if (!dump_reader_has_index(dump_reader))
+                printf("[I] dump file has no index\n");
+        }
+        if (skip_seconds > 0 && dump_reader_count(dump_reader) > 0) {
+            uint64_t start_ms = dump_reader_created_ms(dump_reader, 0) + 1000ULL * skip_seconds;
+            dump_reader_seek_time(dump_reader, start_ms);
+        } else if (skip_seconds > 0)
+            fprintf(stderr, "[W] dump file has no index. can't skip %d seconds\n", skip_seconds);
+    } else if (errno == EINVAL) {
+        dump_file = fopen(dump_file_name, "r");
+        if (!dump_file) {
+            fprintf(stderr, "[E] could not open dump file: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (verbose) printf("[I] replaying stream from %s (old format)\n", dump_file_name);
+        dump_file_size = zsys_file_size (dump_file_name);
+    } else {
         fprintf(stderr, "[E] could not open dump file: %s\n", strerror(errno));
         exit(1);
     }
-    if (verbose) printf("[I] replaying stream from %s\n", dump_file_name);
-    dump_file_size = zsys_file_size (dump_file_name);
 
     // set global config
     zsys_init();
@@ -233,10 +322,11 @@ int main(int argc, char * const *argv)
 
     // register FILE descriptor for pollin events
     zmq_pollitem_t dump_file_item = {
-        .fd = fileno(dump_file),
+        .fd = dump_reader ? dump_reader_fd(dump_reader) : fileno(dump_file),
         .events = ZMQ_POLLIN
     };
-    int rc = zloop_poller(loop, &dump_file_item, file_consume_message_and_forward, publisher);
+    zloop_fn *consume = dump_reader ? file_consume_record_and_forward : file_consume_message_and_forward;
+    int rc = zloop_poller(loop, &dump_file_item, consume, publisher);
     assert(rc==0);
 
     // calculate statistics every 1000 ms
@@ -263,11 +353,14 @@ int main(int argc, char * const *argv)
     // clean up
     if (verbose) printf("[I] shutting down\n");
 
-    fclose(dump_file);
+    if (dump_file)
+        fclose(dump_file);
     zloop_destroy(&loop);
     assert(loop == NULL);
     zsock_destroy(&publisher);
     zsys_shutdown();
+    // zero copy frames may reference the mapped file until the context has been terminated
+    dump_reader_destroy(&dump_reader);
 
     if (verbose) printf("[I] terminated\n");
 
@@ -3,6 +3,10 @@
 #include <limits.h>
 #include <zlib.h>
 #include <snappy-c.h>
+#include <zstd.h>
+#include <zdict.h>
+#include <lz4.h>
+#include <dirent.h>
 #include "logjam-util.h"
 
 zlist_t *split_delimited_string(const char* s)
@@ -172,6 +176,79 @@ int zmsg_clear_device_and_sequence_number(zmsg_t* msg)
     return 1;
 }
 
+bool zmsg_is_batch(zmsg_t *msg)
+{
+    if (zmsg_size(msg) != 4)
+        return false;
+    zmsg_first(msg);
+    zframe_t *topic = zmsg_next(msg);
+    return is_batch_topic((const char*) zframe_data(topic), zframe_size(topic));
+}
+
+static
+void batch_append_length(zchunk_t *batch, size_t len)
+{
+    uint32_t n = htonl(len);
+    zchunk_extend(batch, &n, sizeof(n));
+}
+
+void batch_append(zchunk_t *batch, zframe_t *topic, zframe_t *body, zframe_t *meta)
+{
+    assert(zframe_size(meta) == sizeof(msg_meta_t));
+    batch_append_length(batch, zframe_size(topic));
+    zchunk_extend(batch, zframe_data(topic), zframe_size(topic));
+    batch_append_length(batch, zframe_size(body));
+    zchunk_extend(batch, zframe_data(body), zframe_size(body));
+    zchunk_extend(batch, zframe_data(meta), sizeof(msg_meta_t));
+}
+
+void batch_reader_init(batch_reader_t *reader, const char *data, size_t len)
+{
+    reader->p = data;
+    reader->end = data + len;
+}
+
+static
+bool batch_read_length(batch_reader_t *reader, size_t *len)
+{
+    uint32_t n;
+    if (reader->end - reader->p < sizeof(n))
+        return false;
+    memcpy(&n, reader->p, sizeof(n));
+    reader->p += sizeof(n);
+    *len = ntohl(n);
+    return *len <= reader->end - reader->p;
+}
+
+int batch_reader_next(batch_reader_t *reader, batch_entry_t *entry)
+{
+    if (reader->p == reader->end)
+        return 0;
+    if (!batch_read_length(reader, &entry->topic_len))
+        return -1;
+    entry->topic = reader->p;
+    reader->p += entry->topic_len;
+    if (!batch_read_length(reader, &entry->body_len))
+        return -1;
+    entry->body = reader->p;
+    reader->p += entry->body_len;
+    if (reader->end - reader->p < sizeof(msg_meta_t))
+        return -1;
+    entry->meta = (const msg_meta_t*) reader->p;
+    reader->p += sizeof(msg_meta_t);
+    return 1;
+}
+
+zmsg_t* batch_entry_to_zmsg(zframe_t *app_env, batch_entry_t *entry)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addmem(msg, zframe_data(app_env), zframe_size(app_env));
+    zmsg_addmem(msg, entry->topic, entry->topic_len);
+    zmsg_addmem(msg, entry->body, entry->body_len);
+    zmsg_addmem(msg, entry->meta, sizeof(msg_meta_t));
+    return msg;
+}
+
 int string_to_compression_method(const char *s)
 {
     if (!strcmp("zlib", s))
@@ -180,6 +257,10 @@ int string_to_compression_method(const char *s)
         return SNAPPY_COMPRESSION;
     else if (!strcmp("brotli", s))
         return BROTLI_COMPRESSION;
+    else if (!strcmp("zstd", s))
+        return ZSTD_COMPRESSION;
+    else if (!strcmp("lz4", s))
+        return LZ4_COMPRESSION;
     else {
         fprintf(stderr, "unsupported compression method: '%s'\n", s);
         return NO_COMPRESSION;
@@ -193,6 +274,8 @@ const char* compression_method_to_string(int compression_method)
     case ZLIB_COMPRESSION:   return "zlib";
     case SNAPPY_COMPRESSION: return "snappy";
     case BROTLI_COMPRESSION: return "brotli";
+    case ZSTD_COMPRESSION:   return "zstd";
+    case LZ4_COMPRESSION:    return "lz4";
     default:                 return "unknown compression method";
     }
 }
@@ -296,7 +379,245 @@ void compress_message_data_snappy(zchunk_t* buffer, zmq_msg_t *body, char *data,
 }
 
 
-void compress_message_data(int compression_method, zchunk_t* buffer, zmq_msg_t *body, char *data, size_t data_len)
+// zstd dictionaries are shared by all threads, but contexts are per thread. the
+// dictionary tables are only written by compression_dictionaries_load.
+static zhash_t *zstd_cdicts = NULL;  // app-env -> ZSTD_CDict*
+static zhash_t *zstd_ddicts = NULL;  // dictionary id -> ZSTD_DDict*
+
+// contexts get freed when their thread exits
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} zstd_contexts_t;
+
+static pthread_key_t zstd_contexts_key;
+static pthread_once_t zstd_contexts_once = PTHREAD_ONCE_INIT;
+
+static
+void zstd_contexts_destroy(void *arg)
+{
+    zstd_contexts_t *contexts = arg;
+    if (contexts->cctx)
+        ZSTD_freeCCtx(contexts->cctx);
+    if (contexts->dctx)
+        ZSTD_freeDCtx(contexts->dctx);
+    free(contexts);
+}
+
+static
+void zstd_contexts_key_create()
+{
+    int rc = pthread_key_create(&zstd_contexts_key, zstd_contexts_destroy);
+    assert(rc == 0);
+}
+
+static
+zstd_contexts_t* zstd_thread_contexts()
+{
+    pthread_once(&zstd_contexts_once, zstd_contexts_key_create);
+    zstd_contexts_t *contexts = pthread_getspecific(zstd_contexts_key);
+    if (!contexts) {
+        contexts = zmalloc(sizeof(*contexts));
+        pthread_setspecific(zstd_contexts_key, contexts);
+    }
+    return contexts;
+}
+
+static
+ZSTD_CCtx* zstd_thread_cctx()
+{
+    zstd_contexts_t *contexts = zstd_thread_contexts();
+    if (!contexts->cctx)
+        contexts->cctx = ZSTD_createCCtx();
+    return contexts->cctx;
+}
+
+static
+ZSTD_DCtx* zstd_thread_dctx()
+{
+    zstd_contexts_t *contexts = zstd_thread_contexts();
+    if (!contexts->dctx)
+        contexts->dctx = ZSTD_createDCtx();
+    return contexts->dctx;
+}
+
+static
+void zstd_cdict_destroy(void *cdict)
+{
+    ZSTD_freeCDict(cdict);
+}
+
+static
+void zstd_ddict_destroy(void *ddict)
+{
+    ZSTD_freeDDict(ddict);
+}
+
+static
+bool read_file(const char *path, char **data, size_t *len)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool ok = false;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long size = ftell(f);
+        if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            *data = zmalloc(size);
+            *len = fread(*data, 1, size, f);
+            ok = *len == (size_t)size;
+            if (!ok)
+                free(*data);
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+int compression_dictionaries_load(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "[E] could not open zstd dictionary directory %s: %s\n", dir, strerror(errno));
+        return 0;
+    }
+    if (!zstd_cdicts) {
+        zstd_cdicts = zhash_new();
+        zstd_ddicts = zhash_new();
+    }
+
+    int loaded = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        const char *name = entry->d_name;
+        size_t n = strlen(name);
+        if (n <= 5 || strcmp(name + n - 5, ".dict"))
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        char *data;
+        size_t len;
+        if (!read_file(path, &data, &len)) {
+            fprintf(stderr, "[E] could not read zstd dictionary %s\n", path);
+            continue;
+        }
+        // raw content dictionaries have no id, so receivers could not find them
+        unsigned id = ZSTD_getDictID_fromDict(data, len);
+        if (id == 0) {
+            fprintf(stderr, "[E] ignored zstd dictionary without id: %s\n", path);
+            free(data);
+            continue;
+        }
+
+        ZSTD_CDict *cdict = ZSTD_createCDict(data, len, ZSTD_COMPRESSION_LEVEL);
+        ZSTD_DDict *ddict = ZSTD_createDDict(data, len);
+        if (!cdict || !ddict) {
+            fprintf(stderr, "[E] ignored invalid zstd dictionary: %s\n", path);
+            ZSTD_freeCDict(cdict);
+            ZSTD_freeDDict(ddict);
+            free(data);
+            continue;
+        }
+
+        char app_env[n - 4];
+        memcpy(app_env, name, n - 5);
+        app_env[n - 5] = '\0';
+        zhash_update(zstd_cdicts, app_env, cdict);
+        zhash_freefn(zstd_cdicts, app_env, zstd_cdict_destroy);
+
+        char id_str[16];
+        snprintf(id_str, sizeof(id_str), "%u", id);
+        zhash_update(zstd_ddicts, id_str, ddict);
+        zhash_freefn(zstd_ddicts, id_str, zstd_ddict_destroy);
+
+        printf("[I] loaded zstd dictionary for %s (id %u, %zu bytes)\n", app_env, id, len);
+        free(data);
+        loaded++;
+    }
+    closedir(d);
+    return loaded;
+}
+
+void compression_dictionaries_destroy()
+{
+    zhash_destroy(&zstd_cdicts);
+    zhash_destroy(&zstd_ddicts);
+    // thread specific data destructors don't run for the main thread
+    pthread_once(&zstd_contexts_once, zstd_contexts_key_create);
+    zstd_contexts_t *contexts = pthread_getspecific(zstd_contexts_key);
+    if (contexts) {
+        pthread_setspecific(zstd_contexts_key, NULL);
+        zstd_contexts_destroy(contexts);
+    }
+}
+
+static
+const ZSTD_CDict* zstd_cdict_for(const char *app_env, size_t app_env_len)
+{
+    if (!zstd_cdicts || !app_env)
+        return NULL;
+    char key[app_env_len + 1];
+    memcpy(key, app_env, app_env_len);
+    key[app_env_len] = '\0';
+    return zhash_lookup(zstd_cdicts, key);
+}
+
+static
+void compression_buffer_reserve(zchunk_t *buffer, size_t size)
+{
+    size_t buffer_size = zchunk_max_size(buffer);
+    if (buffer_size < size) {
+        size_t next_size = 2 * buffer_size;
+        while (next_size < size)
+            next_size *= 2;
+        zchunk_resize(buffer, next_size);
+    }
+}
+
+void compress_message_data_zstd(zchunk_t* buffer, zmq_msg_t *body, const ZSTD_CDict *cdict, char *data, size_t data_len)
+{
+    size_t max_compressed_len = ZSTD_compressBound(data_len);
+    compression_buffer_reserve(buffer, max_compressed_len);
+    char *compressed_data = (char*) zchunk_data(buffer);
+
+    ZSTD_CCtx *zstd_cctx = zstd_thread_cctx();
+    size_t compressed_len;
+    if (cdict)
+        compressed_len = ZSTD_compress_usingCDict(zstd_cctx, compressed_data, max_compressed_len, data, data_len, cdict);
+    else
+        compressed_len = ZSTD_compressCCtx(zstd_cctx, compressed_data, max_compressed_len, data, data_len, ZSTD_COMPRESSION_LEVEL);
+    assert(!ZSTD_isError(compressed_len));
+
+    zmq_msg_t compressed_msg;
+    zmq_msg_init_size(&compressed_msg, compressed_len);
+    memcpy(zmq_msg_data(&compressed_msg), compressed_data, compressed_len);
+    int rc = zmq_msg_move(body, &compressed_msg);
+    assert(rc != -1);
+}
+
+void compress_message_data_lz4(zchunk_t* buffer, zmq_msg_t *body, char *data, size_t data_len)
+{
+    assert(data_len <= LZ4_MAX_INPUT_SIZE);
+    size_t max_compressed_len = 4 + LZ4_compressBound(data_len);
+    compression_buffer_reserve(buffer, max_compressed_len);
+    char *compressed_data = (char*) zchunk_data(buffer);
+
+    uint32_t uncompressed_len = htonl(data_len);
+    memcpy(compressed_data, &uncompressed_len, 4);
+    int rc = LZ4_compress_default(data, compressed_data + 4, data_len, max_compressed_len - 4);
+    assert(rc > 0 || data_len == 0);
+    size_t compressed_len = 4 + rc;
+
+    zmq_msg_t compressed_msg;
+    zmq_msg_init_size(&compressed_msg, compressed_len);
+    memcpy(zmq_msg_data(&compressed_msg), compressed_data, compressed_len);
+    rc = zmq_msg_move(body, &compressed_msg);
+    assert(rc != -1);
+}
+
+void compress_message_data(int compression_method, zchunk_t* buffer, zmq_msg_t *body,
+                           const char *app_env, size_t app_env_len, char *data, size_t data_len)
 {
     switch (compression_method) {
     case ZLIB_COMPRESSION:
@@ -305,6 +626,12 @@ void compress_message_data(int compression_method, zchunk_t* buffer, zmq_msg_t *
     case SNAPPY_COMPRESSION:
         compress_message_data_snappy(buffer, body, data, data_len);
         break;
+    case ZSTD_COMPRESSION:
+        compress_message_data_zstd(buffer, body, zstd_cdict_for(app_env, app_env_len), data, data_len);
+        break;
+    case LZ4_COMPRESSION:
+        compress_message_data_lz4(buffer, body, data, data_len);
+        break;
     default:
         fprintf(stderr, "[D] unknown compression method\n");
     }
@@ -378,6 +705,125 @@ int decompress_frame_snappy(zframe_t *body_frame, zchunk_t *buffer, char **body,
     return 1;
 }
 
+static
+int zstd_uncompressed_length(const char *source, size_t source_len, size_t *length)
+{
+    unsigned long long n = ZSTD_getFrameContentSize(source, source_len);
+    if (n == ZSTD_CONTENTSIZE_ERROR || n == ZSTD_CONTENTSIZE_UNKNOWN) {
+        fprintf(stderr, "[E] zstd frame without content size\n");
+        return 0;
+    }
+    *length = n;
+    return 1;
+}
+
+static
+int zstd_decompress(ZSTD_DCtx *dctx, char *dest, size_t dest_size, const char *source, size_t source_len, size_t *body_len)
+{
+    const ZSTD_DDict *ddict = NULL;
+    unsigned id = ZSTD_getDictID_fromFrame(source, source_len);
+    if (id) {
+        char id_str[16];
+        snprintf(id_str, sizeof(id_str), "%u", id);
+        if (zstd_ddicts)
+            ddict = zhash_lookup(zstd_ddicts, id_str);
+        if (!ddict) {
+            fprintf(stderr, "[E] unknown zstd dictionary: %u\n", id);
+            return 0;
+        }
+    }
+    size_t n = ddict ?
+        ZSTD_decompress_usingDDict(dctx, dest, dest_size, source, source_len, ddict) :
+        ZSTD_decompressDCtx(dctx, dest, dest_size, source, source_len);
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, "[E] zstd decompression failed: %s\n", ZSTD_getErrorName(n));
+        return 0;
+    }
+    *body_len = n;
+    return 1;
+}
+
+static
+int lz4_uncompressed_length(const char *source, size_t source_len, size_t *length)
+{
+    uint32_t n;
+    if (source_len < 4) {
+        fprintf(stderr, "[E] lz4 frame too short\n");
+        return 0;
+    }
+    memcpy(&n, source, 4);
+    *length = ntohl(n);
+    return 1;
+}
+
+static
+int lz4_decompress(char *dest, size_t dest_size, const char *source, size_t source_len, size_t *body_len)
+{
+    size_t length;
+    lz4_uncompressed_length(source, source_len, &length);
+    assert(length <= dest_size);
+    int n = LZ4_decompress_safe(source + 4, dest, source_len - 4, length);
+    if (n < 0 || (size_t)n != length) {
+        fprintf(stderr, "[E] lz4 decompression failed\n");
+        return 0;
+    }
+    *body_len = n;
+    return 1;
+}
+
+// returns false if the buffer would have to grow beyond max_buffer_size
+static
+bool decompression_buffer_reserve(zchunk_t *buffer, size_t size)
+{
+    if (size <= zchunk_max_size(buffer))
+        return true;
+    if (size > max_buffer_size)
+        return false;
+    size_t next_size = 2 * zchunk_max_size(buffer);
+    while (next_size < size)
+        next_size *= 2;
+    if (next_size > max_buffer_size)
+        next_size = max_buffer_size;
+    zchunk_resize(buffer, next_size);
+    return true;
+}
+
+int decompress_frame_zstd(zframe_t *body_frame, zchunk_t *buffer, char **body, size_t* body_len)
+{
+    const char *source = (char*) zframe_data(body_frame);
+    size_t source_len = zframe_size(body_frame);
+    size_t length;
+
+    *body = "";
+    *body_len = 0;
+
+    if (!zstd_uncompressed_length(source, source_len, &length) || !decompression_buffer_reserve(buffer, length))
+        return 0;
+    char *dest = (char*) zchunk_data(buffer);
+    if (!zstd_decompress(zstd_thread_dctx(), dest, zchunk_max_size(buffer), source, source_len, body_len))
+        return 0;
+    *body = dest;
+    return 1;
+}
+
+int decompress_frame_lz4(zframe_t *body_frame, zchunk_t *buffer, char **body, size_t* body_len)
+{
+    const char *source = (char*) zframe_data(body_frame);
+    size_t source_len = zframe_size(body_frame);
+    size_t length;
+
+    *body = "";
+    *body_len = 0;
+
+    if (!lz4_uncompressed_length(source, source_len, &length) || !decompression_buffer_reserve(buffer, length))
+        return 0;
+    char *dest = (char*) zchunk_data(buffer);
+    if (!lz4_decompress(dest, zchunk_max_size(buffer), source, source_len, body_len))
+        return 0;
+    *body = dest;
+    return 1;
+}
+
 int decompress_frame(zframe_t *body_frame, int compression_method, zchunk_t *buffer, char **body, size_t* body_len)
 {
     switch (compression_method) {
@@ -385,10 +831,200 @@ int decompress_frame(zframe_t *body_frame, int compression_method, zchunk_t *buf
         return decompress_frame_gzip(body_frame, buffer, body, body_len);
     case SNAPPY_COMPRESSION:
         return decompress_frame_snappy(body_frame, buffer, body, body_len);
+    case ZSTD_COMPRESSION:
+        return decompress_frame_zstd(body_frame, buffer, body, body_len);
+    case LZ4_COMPRESSION:
+        return decompress_frame_lz4(body_frame, buffer, body, body_len);
+    default:
+        fprintf(stderr, "[D] unknown compression method: %d\n", compression_method);
+        return 0;
+    }
+}
+
+// compression ratios are kept in 1/16 units, per slot of a small stream hash table
+#define DECOMPRESSOR_RATIO_SLOTS 256
+#define DECOMPRESSOR_RATIO_SCALE 16
+
+struct _decompressor_t {
+    char *data;
+    size_t size;
+    z_stream zstream;
+    bool zstream_initialized;
+    ZSTD_DCtx *zstd_dctx;
+    uint32_t ratios[DECOMPRESSOR_RATIO_SLOTS];
+};
+
+decompressor_t* decompressor_new(size_t initial_size)
+{
+    decompressor_t *decompressor = zmalloc(sizeof(*decompressor));
+    assert(decompressor);
+    decompressor->data = malloc(initial_size);
+    assert(decompressor->data);
+    decompressor->size = initial_size;
+    return decompressor;
+}
+
+void decompressor_destroy(decompressor_t **decompressor_p)
+{
+    decompressor_t *decompressor = *decompressor_p;
+    if (decompressor == NULL)
+        return;
+    if (decompressor->zstream_initialized)
+        inflateEnd(&decompressor->zstream);
+    if (decompressor->zstd_dctx)
+        ZSTD_freeDCtx(decompressor->zstd_dctx);
+    free(decompressor->data);
+    free(decompressor);
+    *decompressor_p = NULL;
+}
+
+// returns false if the buffer would have to grow beyond max_buffer_size
+static
+bool decompressor_reserve(decompressor_t *decompressor, size_t size)
+{
+    if (size <= decompressor->size)
+        return true;
+    if (size > max_buffer_size)
+        return false;
+    size_t next_size = 2 * decompressor->size;
+    while (next_size < size)
+        next_size *= 2;
+    if (next_size > max_buffer_size)
+        next_size = max_buffer_size;
+    // realloc preserves the data decompressed so far
+    decompressor->data = realloc(decompressor->data, next_size);
+    assert(decompressor->data);
+    decompressor->size = next_size;
+    return true;
+}
+
+static
+int decompressor_inflate(decompressor_t *decompressor, const Bytef *source, size_t source_len, size_t *body_len)
+{
+    z_stream *zs = &decompressor->zstream;
+    if (!decompressor->zstream_initialized) {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit(zs) != Z_OK) {
+            fprintf(stderr, "[E] inflateInit failed\n");
+            return 0;
+        }
+        decompressor->zstream_initialized = true;
+    } else if (inflateReset(zs) != Z_OK) {
+        fprintf(stderr, "[E] inflateReset failed\n");
+        return 0;
+    }
+    zs->next_in = (Bytef*) source;
+    zs->avail_in = source_len;
+
+    // continue where inflate stopped when the buffer was too small, instead of starting over
+    for (;;) {
+        zs->next_out = (Bytef*) decompressor->data + zs->total_out;
+        zs->avail_out = decompressor->size - zs->total_out;
+        int rc = inflate(zs, Z_FINISH);
+        if (rc == Z_STREAM_END) {
+            *body_len = zs->total_out;
+            return 1;
+        }
+        // inflate may hold back output even after consuming all input, so we only
+        // give up if it didn't fill the buffer
+        if ((rc != Z_OK && rc != Z_BUF_ERROR) || zs->avail_out != 0)
+            return 0;
+        if (!decompressor_reserve(decompressor, 2 * decompressor->size))
+            return 0;
+    }
+}
+
+static
+int decompressor_snappy(decompressor_t *decompressor, const char *source, size_t source_len, size_t *body_len)
+{
+    size_t uncompressed_length;
+    if (SNAPPY_OK != snappy_uncompressed_length(source, source_len, &uncompressed_length)) {
+        fprintf(stderr, "[E] snappy_uncompressed_length failed\n");
+        return 0;
+    }
+    if (!decompressor_reserve(decompressor, uncompressed_length))
+        return 0;
+    size_t dest_size = decompressor->size;
+    if (SNAPPY_OK != snappy_uncompress(source, source_len, decompressor->data, &dest_size)) {
+        fprintf(stderr, "[E] snappy_uncompress failed\n");
+        return 0;
+    }
+    *body_len = dest_size;
+    return 1;
+}
+
+static
+int decompressor_zstd(decompressor_t *decompressor, const char *source, size_t source_len, size_t *body_len)
+{
+    size_t length;
+    if (!zstd_uncompressed_length(source, source_len, &length) || !decompressor_reserve(decompressor, length))
+        return 0;
+    if (!decompressor->zstd_dctx)
+        decompressor->zstd_dctx = ZSTD_createDCtx();
+    return zstd_decompress(decompressor->zstd_dctx, decompressor->data, decompressor->size, source, source_len, body_len);
+}
+
+static
+int decompressor_lz4(decompressor_t *decompressor, const char *source, size_t source_len, size_t *body_len)
+{
+    size_t length;
+    if (!lz4_uncompressed_length(source, source_len, &length) || !decompressor_reserve(decompressor, length))
+        return 0;
+    return lz4_decompress(decompressor->data, decompressor->size, source, source_len, body_len);
+}
+
+int decompressor_run(decompressor_t *decompressor, zframe_t *body_frame, int compression_method,
+                     const char *stream, size_t stream_len, char **body, size_t* body_len)
+{
+    const char *source = (const char*) zframe_data(body_frame);
+    size_t source_len = zframe_size(body_frame);
+
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < stream_len; i++) {
+        h ^= (unsigned char)stream[i];
+        h *= 16777619U;
+    }
+    uint32_t *ratio = &decompressor->ratios[h % DECOMPRESSOR_RATIO_SLOTS];
+
+    // presize the buffer with some headroom, so that inflate usually runs only once
+    if (*ratio) {
+        size_t predicted = source_len * *ratio / DECOMPRESSOR_RATIO_SCALE;
+        decompressor_reserve(decompressor, predicted + predicted / 4);
+    }
+
+    int rc;
+    *body = "";
+    *body_len = 0;
+    switch (compression_method) {
+    case ZLIB_COMPRESSION:
+        rc = decompressor_inflate(decompressor, (const Bytef*) source, source_len, body_len);
+        break;
+    case SNAPPY_COMPRESSION:
+        rc = decompressor_snappy(decompressor, source, source_len, body_len);
+        break;
+    case ZSTD_COMPRESSION:
+        rc = decompressor_zstd(decompressor, source, source_len, body_len);
+        break;
+    case LZ4_COMPRESSION:
+        rc = decompressor_lz4(decompressor, source, source_len, body_len);
+        break;
     default:
         fprintf(stderr, "[D] unknown compression method: %d\n", compression_method);
         return 0;
     }
+    if (!rc)
+        return 0;
+    *body = decompressor->data;
+
+    // exponentially weighted moving average of the compression ratio
+    if (source_len > 0) {
+        uint64_t current = (uint64_t) *body_len * DECOMPRESSOR_RATIO_SCALE / source_len;
+        if (current > UINT32_MAX / 4)
+            current = UINT32_MAX / 4;
+        *ratio = *ratio ? (3 * (uint64_t) *ratio + current) / 4 : current;
+    }
+    return 1;
 }
 
 json_object* parse_json_data(const char *json_data, size_t json_data_len, json_tokener* tokener)
@@ -479,40 +1115,12 @@ void my_zmq_msg_fprint(zmq_msg_t* msg, size_t n, const char* prefix, FILE* file
     }
 }
 
-//  --------------------------------------------------------------------------
-//  Save message to an open file, return 0 if OK, else -1. The message is
-//  saved as a series of frames, each with length and data. Note that the
-//  file is NOT guaranteed to be portable between operating systems, not
-//  versions of CZMQ. The file format is at present undocumented and liable
-//  to arbitrary change.
-
-int
-zmsg_savex (zmsg_t *self, FILE *file)
-{
-    assert (self);
-    assert (zmsg_is (self));
-    assert (file);
-
-    size_t frame_count = zmsg_size (self);
-    if (fwrite (&frame_count, sizeof (frame_count), 1, file) != 1)
-        return -1;
-
-    zframe_t *frame = zmsg_first (self);
-    while (frame) {
-        size_t frame_size = zframe_size (frame);
-        if (fwrite (&frame_size, sizeof (frame_size), 1, file) != 1)
-            return -1;
-        if (fwrite (zframe_data (frame), frame_size, 1, file) != 1)
-            return -1;
-        frame = zmsg_next (self);
-    }
-    return 0;
-}
-
 //  --------------------------------------------------------------------------
 //  Load/append an open file into message, create new message if
 //  null message provided. Returns NULL if the message could not be
-//  loaded.
+//  loaded. Only used for dump files written before the introduction of
+//  the format described in dump-file.h: frames are stored with native
+//  size_t lengths.
 
 zmsg_t *
 zmsg_loadx (zmsg_t *self, FILE *file)
@@ -677,6 +1285,214 @@ static void test_htonll (int verbose)
     assert(ntohll(htonll(0xffffffffffffffff))   == 0xffffffffffffffff);
 }
 
+static void test_decompressor (int verbose)
+{
+    decompressor_t *decompressor = decompressor_new(16);
+    size_t n = 100000;
+    char *data = malloc(n);
+    for (size_t i = 0; i < n; i++)
+        data[i] = 'a' + (i * i) % 23;
+
+    uLongf compressed_len = compressBound(n);
+    Bytef *compressed = malloc(compressed_len);
+    int rc = compress(compressed, &compressed_len, (Bytef*) data, n);
+    assert(rc == Z_OK);
+    zframe_t *frame = zframe_new(compressed, compressed_len);
+
+    size_t snappy_len = snappy_max_compressed_length(n);
+    char *snappy_data = malloc(snappy_len);
+    rc = snappy_compress(data, n, snappy_data, &snappy_len);
+    assert(rc == SNAPPY_OK);
+    zframe_t *snappy_frame = zframe_new(snappy_data, snappy_len);
+
+    zchunk_t *buffer = zchunk_new(NULL, 16);
+    zmq_msg_t zstd_msg, lz4_msg;
+    zmq_msg_init(&zstd_msg);
+    zmq_msg_init(&lz4_msg);
+    compress_message_data(ZSTD_COMPRESSION, buffer, &zstd_msg, "app-env", 7, data, n);
+    compress_message_data(LZ4_COMPRESSION, buffer, &lz4_msg, "app-env", 7, data, n);
+    zframe_t *zstd_frame = zframe_new(zmq_msg_data(&zstd_msg), zmq_msg_size(&zstd_msg));
+    zframe_t *lz4_frame = zframe_new(zmq_msg_data(&lz4_msg), zmq_msg_size(&lz4_msg));
+    zmq_msg_close(&zstd_msg);
+    zmq_msg_close(&lz4_msg);
+
+    // the first run grows the buffer, later ones are presized and reuse the zlib stream
+    for (int i = 0; i < 3; i++) {
+        char *body;
+        size_t body_len;
+        rc = decompressor_run(decompressor, frame, ZLIB_COMPRESSION, "app-env", 7, &body, &body_len);
+        assert(rc == 1);
+        assert(body_len == n);
+        assert(memcmp(body, data, n) == 0);
+        rc = decompressor_run(decompressor, snappy_frame, SNAPPY_COMPRESSION, "app-env2", 8, &body, &body_len);
+        assert(rc == 1);
+        assert(body_len == n);
+        assert(memcmp(body, data, n) == 0);
+        rc = decompressor_run(decompressor, zstd_frame, ZSTD_COMPRESSION, "app-env3", 8, &body, &body_len);
+        assert(rc == 1);
+        assert(body_len == n);
+        assert(memcmp(body, data, n) == 0);
+        rc = decompressor_run(decompressor, lz4_frame, LZ4_COMPRESSION, "app-env4", 8, &body, &body_len);
+        assert(rc == 1);
+        assert(body_len == n);
+        assert(memcmp(body, data, n) == 0);
+    }
+    if (verbose)
+        printf("\tdecompressor: buffer size %zu\n", decompressor->size);
+
+    // zchunk based decompression of the new methods
+    char *body;
+    size_t body_len;
+    zchunk_resize(buffer, 16);
+    rc = decompress_frame(zstd_frame, ZSTD_COMPRESSION, buffer, &body, &body_len);
+    assert(rc == 1 && body_len == n && memcmp(body, data, n) == 0);
+    rc = decompress_frame(lz4_frame, LZ4_COMPRESSION, buffer, &body, &body_len);
+    assert(rc == 1 && body_len == n && memcmp(body, data, n) == 0);
+
+    // corrupted data fails without breaking the next run
+    zframe_t *corrupted = zframe_new(compressed, compressed_len / 2);
+    rc = decompressor_run(decompressor, corrupted, ZLIB_COMPRESSION, "app-env", 7, &body, &body_len);
+    assert(rc == 0);
+    rc = decompressor_run(decompressor, frame, ZLIB_COMPRESSION, "app-env", 7, &body, &body_len);
+    assert(rc == 1 && body_len == n);
+
+    zframe_destroy(&corrupted);
+    zframe_destroy(&frame);
+    zframe_destroy(&snappy_frame);
+    zframe_destroy(&zstd_frame);
+    zframe_destroy(&lz4_frame);
+    zchunk_destroy(&buffer);
+    free(snappy_data);
+    free(compressed);
+    free(data);
+    decompressor_destroy(&decompressor);
+    assert(decompressor == NULL);
+}
+
+static void test_zstd_dictionaries (int verbose)
+{
+    // train a dictionary on similar messages
+    enum { SAMPLES = 2000 };
+    char *samples = malloc(SAMPLES * 200);
+    size_t sample_sizes[SAMPLES];
+    size_t offset = 0;
+    for (size_t i = 0; i < SAMPLES; i++) {
+        sample_sizes[i] = sprintf(samples + offset,
+                                  "{\"action\":\"Foo::Bar#%zu\",\"code\":200,\"total_time\":%zu.5,\"db_time\":%zu,\"request_id\":\"%08zx\"}",
+                                  i % 17, i * 7 % 1000, i % 31, i * 2654435761u % 0xffffffff);
+        offset += sample_sizes[i];
+    }
+    char dict[16384];
+    size_t dict_len = ZDICT_trainFromBuffer(dict, sizeof(dict), samples, sample_sizes, SAMPLES);
+    assert(!ZDICT_isError(dict_len));
+    unsigned dict_id = ZSTD_getDictID_fromDict(dict, dict_len);
+    assert(dict_id != 0);
+
+    char dir[] = "/tmp/logjam-util-test-XXXXXX";
+    assert(mkdtemp(dir));
+    char path[PATH_MAX], invalid_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/app-env.dict", dir);
+    snprintf(invalid_path, sizeof(invalid_path), "%s/other-env.dict", dir);
+    FILE *f = fopen(path, "w");
+    assert(f);
+    assert(fwrite(dict, 1, dict_len, f) == dict_len);
+    fclose(f);
+    // no dictionary id
+    f = fopen(invalid_path, "w");
+    assert(f);
+    fputs("not a dictionary", f);
+    fclose(f);
+
+    int loaded = compression_dictionaries_load(dir);
+    assert(loaded == 1);
+
+    const char *data = samples + sample_sizes[0];
+    size_t data_len = sample_sizes[1];
+    zchunk_t *buffer = zchunk_new(NULL, 16);
+    zmq_msg_t plain_msg, dict_msg;
+    zmq_msg_init(&plain_msg);
+    zmq_msg_init(&dict_msg);
+    compress_message_data(ZSTD_COMPRESSION, buffer, &plain_msg, "unknown-env", 11, (char*)data, data_len);
+    compress_message_data(ZSTD_COMPRESSION, buffer, &dict_msg, "app-env", 7, (char*)data, data_len);
+    assert(ZSTD_getDictID_fromFrame(zmq_msg_data(&plain_msg), zmq_msg_size(&plain_msg)) == 0);
+    assert(ZSTD_getDictID_fromFrame(zmq_msg_data(&dict_msg), zmq_msg_size(&dict_msg)) == dict_id);
+    assert(zmq_msg_size(&dict_msg) < zmq_msg_size(&plain_msg));
+    if (verbose)
+        printf("\tzstd: %zu bytes, %zu compressed, %zu with dictionary\n",
+               data_len, zmq_msg_size(&plain_msg), zmq_msg_size(&dict_msg));
+
+    zframe_t *frame = zframe_new(zmq_msg_data(&dict_msg), zmq_msg_size(&dict_msg));
+    decompressor_t *decompressor = decompressor_new(16);
+    char *body;
+    size_t body_len;
+    int rc = decompressor_run(decompressor, frame, ZSTD_COMPRESSION, "app-env", 7, &body, &body_len);
+    assert(rc == 1 && body_len == data_len && memcmp(body, data, data_len) == 0);
+    decompressor_destroy(&decompressor);
+
+    // without the dictionary, the frame can't be decompressed
+    compression_dictionaries_destroy();
+    decompressor = decompressor_new(16);
+    rc = decompressor_run(decompressor, frame, ZSTD_COMPRESSION, "app-env", 7, &body, &body_len);
+    assert(rc == 0);
+    decompressor_destroy(&decompressor);
+
+    zframe_destroy(&frame);
+    zmq_msg_close(&plain_msg);
+    zmq_msg_close(&dict_msg);
+    zchunk_destroy(&buffer);
+    unlink(path);
+    unlink(invalid_path);
+    rmdir(dir);
+    free(samples);
+}
+
+static void test_batches (int verbose)
+{
+    zchunk_t *batch = zchunk_new(NULL, 16);
+    msg_meta_t meta = META_INFO_EMPTY;
+    for (int i = 0; i < 3; i++) {
+        zframe_t *topic = zframe_new("logs.app.env", 12);
+        char body[32];
+        zframe_t *body_frame = zframe_new(body, snprintf(body, sizeof(body), "{\"i\":%d}", i));
+        meta.created_ms = i;
+        msg_meta_t m = meta;
+        meta_info_encode(&m);
+        zframe_t *meta_frame = zframe_new(&m, sizeof(m));
+        batch_append(batch, topic, body_frame, meta_frame);
+        zframe_destroy(&topic);
+        zframe_destroy(&body_frame);
+        zframe_destroy(&meta_frame);
+    }
+
+    zframe_t *app_env = zframe_new("app-env", 7);
+    batch_reader_t reader;
+    batch_entry_t entry;
+    batch_reader_init(&reader, (const char*) zchunk_data(batch), zchunk_size(batch));
+    int n = 0;
+    while (batch_reader_next(&reader, &entry) == 1) {
+        zmsg_t *msg = batch_entry_to_zmsg(app_env, &entry);
+        assert(zmsg_size(msg) == 4);
+        assert(!zmsg_is_batch(msg));
+        msg_meta_t decoded;
+        assert(msg_extract_meta_info(msg, &decoded));
+        assert(decoded.created_ms == (uint64_t)n);
+        assert(entry.topic_len == 12 && entry.body_len == 7);
+        zmsg_destroy(&msg);
+        n++;
+    }
+    assert(n == 3);
+
+    // truncated batches are detected
+    batch_reader_init(&reader, (const char*) zchunk_data(batch), zchunk_size(batch) - 1);
+    int rc;
+    while ((rc = batch_reader_next(&reader, &entry)) == 1)
+        ;
+    assert(rc == -1);
+
+    zframe_destroy(&app_env);
+    zchunk_destroy(&batch);
+}
+
 static void test_my_fqdn (int verbose)
 {
     for (int i=0; i++ < 30;) {
@@ -700,6 +1516,9 @@ void logjam_util_test (int verbose)
     test_uint64wrap (verbose);
     test_gap_calc (verbose);
     test_negative_numbers_conversion_to_sizet (verbose);
+    test_decompressor (verbose);
+    test_zstd_dictionaries (verbose);
+    test_batches (verbose);
     test_my_fqdn (verbose);
 
     printf ("OK\n");
@@ -37,6 +37,12 @@ extern void augment_zmq_connection_specs(zlist_t** specs, int default_port);
 #define SNAPPY_COMPRESSION 2
 // brotli not yet supported
 #define BROTLI_COMPRESSION 3
+// zstd frames carry the id of the dictionary used to compress them (if any)
+#define ZSTD_COMPRESSION   4
+// lz4 blocks, prefixed with the uncompressed length (uint32, network byte order)
+#define LZ4_COMPRESSION    5
+
+#define ZSTD_COMPRESSION_LEVEL 3
 
 #define INITIAL_COMPRESSION_BUFFER_SIZE (16 * 1024)
 #define INITIAL_DECOMPRESSION_BUFFER_SIZE (32 * 1024)
@@ -105,6 +111,39 @@ extern int msg_extract_meta_info(zmsg_t *msg, msg_meta_t *meta);
 extern int frame_extract_meta_info(zframe_t *frame, msg_meta_t *meta);
 extern int zmsg_clear_device_and_sequence_number(zmsg_t* msg);
 
+// Batches combine several messages of one app-env into a single message with topic
+// "batch". The body of a batch is a sequence of entries, each consisting of the topic
+// length, topic, body length and body of a message (lengths are uint32 in network
+// byte order), followed by its meta frame. A batch uses a single sequence number,
+// which all of its entries share.
+#define BATCH_TOPIC "batch"
+
+typedef struct {
+    const char *topic;
+    size_t topic_len;
+    const char *body;
+    size_t body_len;
+    const msg_meta_t *meta;   // network byte order, possibly unaligned
+} batch_entry_t;
+
+typedef struct {
+    const char *p;
+    const char *end;
+} batch_reader_t;
+
+static inline bool is_batch_topic(const char *topic, size_t topic_len)
+{
+    return topic_len == sizeof(BATCH_TOPIC) - 1 && memcmp(topic, BATCH_TOPIC, topic_len) == 0;
+}
+
+extern bool zmsg_is_batch(zmsg_t *msg);
+extern void batch_append(zchunk_t *batch, zframe_t *topic, zframe_t *body, zframe_t *meta);
+extern void batch_reader_init(batch_reader_t *reader, const char *data, size_t len);
+// returns 1 if an entry was read, 0 at the end of the batch and -1 if the batch is corrupted
+extern int batch_reader_next(batch_reader_t *reader, batch_entry_t *entry);
+// creates a regular message from an entry of a batch published by app_env
+extern zmsg_t* batch_entry_to_zmsg(zframe_t *app_env, batch_entry_t *entry);
+
 extern int string_to_compression_method(const char *s);
 extern const char* compression_method_to_string(int compression_method);
 
@@ -112,12 +151,32 @@ extern bool output_socket_ready(zsock_t *socket, int msecs);
 
 extern int publish_on_zmq_transport(zmq_msg_t *message_parts, void *socket, msg_meta_t *msg_meta, int flags);
 
-extern void compress_message_data(int compression_method, zchunk_t* buffer, zmq_msg_t *body, char *data, size_t data_len);
+// Loads zstd dictionaries from files named <app-env>.dict in the given directory.
+// Messages from an app-env with a dictionary get compressed using it, and frames
+// referring to a loaded dictionary can be decompressed. Must be called before any
+// threads using compression get started. Returns the number of dictionaries loaded.
+extern int compression_dictionaries_load(const char *dir);
+// call at shutdown, after all threads using compression have been stopped. also frees
+// the zstd contexts of the calling thread.
+extern void compression_dictionaries_destroy(void);
+
+extern void compress_message_data(int compression_method, zchunk_t* buffer, zmq_msg_t *body,
+                                  const char *app_env, size_t app_env_len, char *data, size_t data_len);
 
 extern int decompress_frame(zframe_t *body_frame, int compression_method, zchunk_t *buffer, char **body, size_t* body_len);
 
 extern int decompress_message_data(zmq_msg_t *msg, int compression_method, zchunk_t *buffer, char **body, size_t* body_len);
 
+// Decompresses frames into a buffer owned by the decompressor, which stays valid until
+// the next call. Keeps the zlib and zstd stream state between calls and presizes the buffer
+// from the compression ratios recently seen on the stream the frame came from.
+typedef struct _decompressor_t decompressor_t;
+
+extern decompressor_t* decompressor_new(size_t initial_size);
+extern void decompressor_destroy(decompressor_t **decompressor_p);
+extern int decompressor_run(decompressor_t *decompressor, zframe_t *body_frame, int compression_method,
+                            const char *stream, size_t stream_len, char **body, size_t* body_len);
+
 extern json_object* parse_json_data(const char *json_data, size_t json_data_len, json_tokener* tokener);
 
 extern void dump_json_object(FILE *f, const char* prefix, json_object *jobj);
@@ -193,7 +252,6 @@ static inline zmsg_t* zmsg_recv_with_retry(zsock_t *socket)
 
 extern void setup_subscriptions_for_sub_socket(zlist_t *subscriptions, zsock_t *socket, size_t id);
 
-extern int zmsg_savex (zmsg_t *self, FILE *file);
 extern zmsg_t* zmsg_loadx (zmsg_t *self, FILE *file);
 
 extern void logjam_util_test (int verbose);
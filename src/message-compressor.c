@@ -12,7 +12,9 @@
  */
 
 // Message compressor takes logjam messages and compresses the body part. One
-// could envision a generalisation to doing decompression as well.
+// could envision a generalisation to doing decompression as well. Instead of
+// sending results to the consumer, compressors can hand them to an output
+// function, which is called on the compressor thread.
 
 extern bool verbose;
 extern bool quiet;
@@ -25,6 +27,8 @@ typedef struct {
     int compression_method;
     zchunk_t *compression_buffer;
     bool decompress;
+    message_compressor_output_fn *output;
+    void *output_arg;
 } compressor_state_t;
 
 #define COMPRESS false
@@ -51,12 +55,17 @@ zsock_t *compressor_push_socket_new()
 }
 
 static
-compressor_state_t* compressor_state_new(size_t id, int compression_method, bool decompress)
+compressor_state_t* compressor_state_new(size_t id, int compression_method, bool decompress,
+                                         message_compressor_output_fn *output, void *output_arg)
 {
     compressor_state_t *state = zmalloc(sizeof(*state));
     state->id = id;
     state->pull_socket = compressor_pull_socket_new();
-    state->push_socket = compressor_push_socket_new();
+    if (output) {
+        state->output = output;
+        state->output_arg = output_arg;
+    } else
+        state->push_socket = compressor_push_socket_new();
     state->compression_method = compression_method;
     state->compression_buffer = zchunk_new(NULL, INITIAL_COMPRESSION_BUFFER_SIZE);
     state->decompress = decompress;
@@ -110,13 +119,19 @@ void handle_compressor_request(zmsg_t *msg, compressor_state_t *state)
     } else {
         zmq_msg_t new_body;
         zmq_msg_init(&new_body);
-        compress_message_data(state->compression_method, state->compression_buffer, &new_body, data, data_len);
+        const char *app_env = (const char*) zframe_data(stream_frame);
+        size_t app_env_len = zframe_size(stream_frame);
+        compress_message_data(state->compression_method, state->compression_buffer, &new_body,
+                              app_env, app_env_len, data, data_len);
         zframe_reset(body_frame, zmq_msg_data(&new_body), zmq_msg_size(&new_body));
         zmq_msg_close(&new_body);
         meta->compression_method = state->compression_method;
     }
 
-    zmsg_send(&msg, state->push_socket);
+    if (state->output)
+        state->output(&msg, state->output_arg);
+    else
+        zmsg_send(&msg, state->push_socket);
 }
 
 static
@@ -188,12 +203,19 @@ void message_compressor(zsock_t *pipe, void *args)
 
 zactor_t* message_compressor_new(size_t id, int compression_method)
 {
-    compressor_state_t *state = compressor_state_new(id, compression_method, COMPRESS);
+    compressor_state_t *state = compressor_state_new(id, compression_method, COMPRESS, NULL, NULL);
+    return zactor_new(message_compressor, state);
+}
+
+zactor_t* message_compressor_new_with_output(size_t id, int compression_method,
+                                             message_compressor_output_fn *output, void *output_arg)
+{
+    compressor_state_t *state = compressor_state_new(id, compression_method, COMPRESS, output, output_arg);
     return zactor_new(message_compressor, state);
 }
 
 zactor_t* message_decompressor_new(size_t id)
 {
-    compressor_state_t *state = compressor_state_new(id, NO_COMPRESSION, DECOMPRESS);
+    compressor_state_t *state = compressor_state_new(id, NO_COMPRESSION, DECOMPRESS, NULL, NULL);
     return zactor_new(message_compressor, state);
 }
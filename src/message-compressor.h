@@ -7,7 +7,13 @@
 extern "C" {
 #endif
 
+// compressed messages get passed to output, which takes ownership of them
+typedef void (message_compressor_output_fn) (zmsg_t **msg_p, void *arg);
+
 extern zactor_t* message_compressor_new(size_t id, int compression_method);
+// instead of sending results to inproc://compressor-output, hands them to output
+extern zactor_t* message_compressor_new_with_output(size_t id, int compression_method,
+                                                    message_compressor_output_fn *output, void *output_arg);
 extern zactor_t* message_decompressor_new(size_t id);
 
 #ifdef __cplusplus
@@ -0,0 +1,360 @@
+#include "message-publisher.h"
+#include "mpmc-queue.h"
+
+/*
+ * connections: "o" = bind, "[<>v^]" = connect
+ *
+ *                                  controller
+ *                                      |
+ *                                     PIPE
+ *                  PUSH    PULL        |
+ *  producers(n)  >----------o      publisher      o---------- consumers
+ *                                                PUB
+ */
+
+// Messages don't travel over the PUSH/PULL connection: producers put them into a lock
+// free queue. Empty messages sent over the connection only serve as a doorbell, which
+// producers ring when the publisher waits for work.
+
+extern bool verbose;
+extern bool quiet;
+
+static mpmc_queue_t *message_queue = NULL;
+static int publisher_idle = 0;
+
+// messages of one app-env waiting to be published as a batch
+typedef struct {
+    zlist_t *messages;
+    size_t bytes;
+    int64_t started_us;
+} pending_batch_t;
+
+typedef struct {
+    zsock_t *pipe;
+    zsock_t *doorbell;
+    zsock_t *publisher;
+    msg_meta_t msg_meta;
+    int pub_port;
+    size_t published;
+    size_t batch_bytes;
+    zhash_t *batches;               // app-env -> pending_batch_t
+    size_t pending;                 // number of messages in pending batches
+    zchunk_t *batch_buffer;
+} publisher_state_t;
+
+static
+void pending_batch_destroy(void *item)
+{
+    pending_batch_t *batch = item;
+    zmsg_t *msg;
+    while ((msg = zlist_pop(batch->messages)))
+        zmsg_destroy(&msg);
+    zlist_destroy(&batch->messages);
+    free(batch);
+}
+
+static
+publisher_state_t* publisher_state_new(int pub_port, int snd_hwm, msg_meta_t *msg_meta, size_t batch_bytes)
+{
+    publisher_state_t *state = zmalloc(sizeof(*state));
+    state->msg_meta = *msg_meta;
+    state->pub_port = pub_port;
+    state->batch_bytes = batch_bytes;
+    if (batch_bytes) {
+        state->batches = zhash_new();
+        state->batch_buffer = zchunk_new(NULL, batch_bytes + 4096);
+    }
+
+    state->doorbell = zsock_new(ZMQ_PULL);
+    assert_x(state->doorbell != NULL, "publisher doorbell socket creation failed", __FILE__, __LINE__);
+    int rc = zsock_bind(state->doorbell, "inproc://publisher-doorbell");
+    assert_x(rc == 0, "publisher doorbell socket bind failed", __FILE__, __LINE__);
+
+    state->publisher = zsock_new(ZMQ_PUB);
+    assert_x(state->publisher != NULL, "publisher socket creation failed", __FILE__, __LINE__);
+    zsock_set_sndhwm(state->publisher, snd_hwm);
+    rc = zsock_bind(state->publisher, "tcp://%s:%d", "*", pub_port);
+    assert_x(rc == pub_port, "publisher socket bind failed", __FILE__, __LINE__);
+
+    return state;
+}
+
+static
+void publisher_state_destroy(publisher_state_t **state_p)
+{
+    publisher_state_t *state = *state_p;
+    zsock_destroy(&state->doorbell);
+    zsock_destroy(&state->publisher);
+    zhash_destroy(&state->batches);
+    if (state->batch_buffer)
+        zchunk_destroy(&state->batch_buffer);
+    free(state);
+    *state_p = NULL;
+}
+
+void message_publisher_queue_init()
+{
+    assert(message_queue == NULL);
+    message_queue = mpmc_queue_new(PUBLISHER_QUEUE_CAPACITY);
+}
+
+void message_publisher_queue_destroy()
+{
+    zmsg_t *msg;
+    size_t dropped = 0;
+    while ((msg = mpmc_queue_pop(message_queue))) {
+        zmsg_destroy(&msg);
+        dropped++;
+    }
+    if (dropped)
+        fprintf(stderr, "[W] publisher: dropped %zu unpublished messages\n", dropped);
+    mpmc_queue_destroy(&message_queue);
+}
+
+zsock_t* message_publisher_doorbell_new()
+{
+    zsock_t *socket = zsock_new(ZMQ_PUSH);
+    assert(socket);
+    int rc = zsock_connect(socket, "inproc://publisher-doorbell");
+    assert(rc == 0);
+    return socket;
+}
+
+void message_publisher_submit(zmsg_t **msg_p, zsock_t *doorbell)
+{
+    zmsg_t *msg = *msg_p;
+    *msg_p = NULL;
+    assert(zmsg_size(msg) == 4);
+    if (!mpmc_queue_push(message_queue, msg)) {
+        fprintf(stderr, "[W] publisher: message queue full\n");
+        do {
+            zclock_sleep(1);
+        } while (!mpmc_queue_push(message_queue, msg));
+    }
+    // full barrier: either we see the publisher idle, or it sees the message
+    if (__sync_add_and_fetch(&publisher_idle, 0) > 0)
+        zmq_send(zsock_resolve(doorbell), "", 0, ZMQ_DONTWAIT);
+}
+
+size_t message_publisher_queued()
+{
+    return message_queue ? mpmc_queue_size(message_queue) : 0;
+}
+
+// stamps the meta frame with device number and the given sequence number
+static
+void stamp_meta_frame(publisher_state_t *state, zmsg_t *msg, uint64_t sequence_number, uint64_t now)
+{
+    zframe_t *meta_frame = zmsg_last(msg);
+    msg_meta_t *meta = (msg_meta_t*) zframe_data(meta_frame);
+    meta_info_decode(meta);
+    meta->device_number = state->msg_meta.device_number;
+    meta->sequence_number = sequence_number;
+    if (meta->created_ms == 0)
+        meta->created_ms = now;
+    meta_info_encode(meta);
+}
+
+static
+void publish_message(publisher_state_t *state, zmsg_t *msg, uint64_t now)
+{
+    stamp_meta_frame(state, msg, ++state->msg_meta.sequence_number, now);
+    // PUB sockets drop messages instead of blocking when the high water mark is reached
+    zmsg_send(&msg, state->publisher);
+    state->published++;
+}
+
+static
+void publish_batch(publisher_state_t *state, pending_batch_t *batch, uint64_t now)
+{
+    size_t n = zlist_size(batch->messages);
+    if (n == 1) {
+        publish_message(state, zlist_pop(batch->messages), now);
+        return;
+    }
+
+    uint64_t sequence_number = ++state->msg_meta.sequence_number;
+    zchunk_t *buffer = state->batch_buffer;
+    zchunk_set(buffer, NULL, 0);
+    zframe_t *app_env = NULL;
+    zmsg_t *msg;
+    while ((msg = zlist_pop(batch->messages))) {
+        stamp_meta_frame(state, msg, sequence_number, now);
+        zframe_t *first = zmsg_first(msg);
+        zframe_t *topic = zmsg_next(msg);
+        zframe_t *body = zmsg_next(msg);
+        zframe_t *meta = zmsg_next(msg);
+        batch_append(buffer, topic, body, meta);
+        if (app_env == NULL)
+            app_env = zframe_dup(first);
+        zmsg_destroy(&msg);
+    }
+
+    msg_meta_t meta = state->msg_meta;
+    meta.compression_method = NO_COMPRESSION;
+    meta.created_ms = now;
+    zmsg_t *batch_msg = zmsg_new();
+    zmsg_append(batch_msg, &app_env);
+    zmsg_addstr(batch_msg, BATCH_TOPIC);
+    zmsg_addmem(batch_msg, zchunk_data(buffer), zchunk_size(buffer));
+    zmsg_add_meta_info(batch_msg, &meta);
+    zmsg_send(&batch_msg, state->publisher);
+    state->published += n;
+}
+
+static
+void add_to_batch(publisher_state_t *state, zmsg_t *msg, uint64_t now)
+{
+    zframe_t *app_env_frame = zmsg_first(msg);
+    size_t n = zframe_size(app_env_frame);
+    char app_env[n+1];
+    memcpy(app_env, zframe_data(app_env_frame), n);
+    app_env[n] = '\0';
+
+    pending_batch_t *batch = zhash_lookup(state->batches, app_env);
+    if (batch == NULL) {
+        batch = zmalloc(sizeof(*batch));
+        batch->messages = zlist_new();
+        zhash_insert(state->batches, app_env, batch);
+        zhash_freefn(state->batches, app_env, pending_batch_destroy);
+    }
+    if (zlist_size(batch->messages) == 0) {
+        batch->started_us = zclock_usecs();
+        batch->bytes = 0;
+    }
+    zlist_append(batch->messages, msg);
+    batch->bytes += zmsg_content_size(msg);
+    state->pending++;
+
+    if (batch->bytes >= state->batch_bytes) {
+        state->pending -= zlist_size(batch->messages);
+        publish_batch(state, batch, now);
+    }
+}
+
+// publishes all pending batches, or only those which have been waiting too long
+static
+void flush_batches(publisher_state_t *state, bool expired_only)
+{
+    int64_t deadline = zclock_usecs() - PUBLISHER_BATCH_MAX_DELAY_US;
+    uint64_t now = zclock_time();
+    pending_batch_t *batch = zhash_first(state->batches);
+    while (batch) {
+        size_t n = zlist_size(batch->messages);
+        if (n > 0 && (!expired_only || batch->started_us < deadline)) {
+            state->pending -= n;
+            publish_batch(state, batch, now);
+        }
+        batch = zhash_next(state->batches);
+    }
+}
+
+static
+void publish_messages(publisher_state_t *state)
+{
+    uint64_t now = zclock_time();
+    zmsg_t *msg;
+    int i;
+    for (i = 0; i < PUBLISHER_BATCH_SIZE && (msg = mpmc_queue_pop(message_queue)); i++) {
+        if (state->batches)
+            add_to_batch(state, msg, now);
+        else
+            publish_message(state, msg, now);
+    }
+    if (state->pending) {
+        // don't hold back messages when there's nothing else to do
+        flush_batches(state, i == PUBLISHER_BATCH_SIZE);
+    }
+}
+
+static
+void send_device_heartbeat(publisher_state_t *state)
+{
+    msg_meta_t *meta = &state->msg_meta;
+    meta->compression_method = NO_COMPRESSION;
+    meta->sequence_number++;
+    meta->created_ms = zclock_time();
+    if (verbose)
+        printf("[I] publisher: sending heartbeat\n");
+    send_heartbeat(state->publisher, meta, state->pub_port);
+}
+
+static
+void message_publisher(zsock_t *pipe, void *args)
+{
+    publisher_state_t *state = args;
+    state->pipe = pipe;
+    set_thread_name("publisher");
+
+    if (!quiet)
+        printf("[I] publisher: starting\n");
+
+    // signal readyiness
+    zsock_signal(pipe, 0);
+
+    zpoller_t *poller = zpoller_new(state->pipe, state->doorbell, NULL);
+    assert(poller);
+
+    // only $TERM stops the publisher: producers might still submit messages after
+    // an interrupt, and all queued messages get published before we terminate
+    while (true) {
+        publish_messages(state);
+        // we wait for at most one second, unless messages were queued before
+        // producers could see that we're idle
+        __sync_add_and_fetch(&publisher_idle, 1);
+        int timeout = mpmc_queue_size(message_queue) ? 0 : 1000;
+        void *socket = zpoller_wait(poller, timeout);
+        __sync_sub_and_fetch(&publisher_idle, 1);
+        if (socket == state->pipe) {
+            zmsg_t *msg = zmsg_recv(state->pipe);
+            char *cmd = zmsg_popstr(msg);
+            zmsg_destroy(&msg);
+            if (streq(cmd, "heartbeat")) {
+                send_device_heartbeat(state);
+            } else if (streq(cmd, "$TERM")) {
+                if (verbose)
+                    printf("[D] publisher: received $TERM command\n");
+                free(cmd);
+                break;
+            } else {
+                printf("[E] publisher: received unknown command: %s\n", cmd);
+                assert(false);
+            }
+            free(cmd);
+        } else if (socket == state->doorbell) {
+            // swallow all pending doorbells. messages get published at the top of the loop.
+            char bell;
+            while (zmq_recv(zsock_resolve(state->doorbell), &bell, sizeof(bell), ZMQ_DONTWAIT) >= 0)
+                ;
+        } else if (socket) {
+            // if socket is not null, something is horribly broken
+            printf("[E] publisher: broken poller. committing suicide.\n");
+            assert(false);
+        }
+        else {
+            // timeout, or interrupted by signal handler
+        }
+    }
+
+    // producers have been stopped before us
+    while (mpmc_queue_size(message_queue))
+        publish_messages(state);
+    if (state->pending)
+        flush_batches(state, false);
+
+    if (!quiet)
+        printf("[I] publisher: shutting down (published %zu messages)\n", state->published);
+
+    zpoller_destroy(&poller);
+    publisher_state_destroy(&state);
+
+    if (!quiet)
+        printf("[I] publisher: terminated\n");
+}
+
+zactor_t* message_publisher_new(int pub_port, int snd_hwm, msg_meta_t *msg_meta, size_t batch_bytes)
+{
+    assert(message_queue != NULL);
+    publisher_state_t *state = publisher_state_new(pub_port, snd_hwm, msg_meta, batch_bytes);
+    return zactor_new(message_publisher, state);
+}
@@ -0,0 +1,46 @@
+#ifndef __LOGJAM_MESSAGE_PUBLISHER_H_INCLUDED__
+#define __LOGJAM_MESSAGE_PUBLISHER_H_INCLUDED__
+
+#include "logjam-util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The message publisher owns the PUB socket of a device. Any thread can queue
+// messages for it, which get published in batches. Sequence numbers are assigned
+// by the publisher, so they stay gap free no matter how many threads produce
+// messages.
+
+#define PUBLISHER_QUEUE_CAPACITY (256 * 1024)
+#define PUBLISHER_BATCH_SIZE 256
+
+// Optionally, messages of the same app-env get combined into batches (see
+// BATCH_TOPIC), which are flushed when they reach the given size, when no more
+// messages are queued or when their oldest message has waited for
+// PUBLISHER_BATCH_MAX_DELAY_US.
+#define PUBLISHER_BATCH_MAX_DELAY_US 500
+
+// the queue must outlive the publisher and all threads submitting messages
+extern void message_publisher_queue_init();
+extern void message_publisher_queue_destroy();
+
+// msg_meta provides the device number. the publisher sends a heartbeat when it
+// receives the command "heartbeat" on its pipe. batch_bytes of zero disables batching.
+extern zactor_t* message_publisher_new(int pub_port, int snd_hwm, msg_meta_t *msg_meta, size_t batch_bytes);
+
+// each thread submitting messages needs its own doorbell socket
+extern zsock_t* message_publisher_doorbell_new();
+
+// takes ownership of the message, which must consist of four frames, the last one
+// being a valid meta frame. a created_ms of zero gets replaced by the current time.
+extern void message_publisher_submit(zmsg_t **msg_p, zsock_t *doorbell);
+
+// number of messages waiting to be published
+extern size_t message_publisher_queued();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
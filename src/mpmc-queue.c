@@ -0,0 +1,212 @@
+#include <czmq.h>
+#include <pthread.h>
+#include "mpmc-queue.h"
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    size_t sequence;
+    void *item;
+} cell_t;
+
+struct _mpmc_queue_t {
+    cell_t *cells;
+    size_t mask;
+    char pad0[CACHE_LINE_SIZE];
+    size_t push_pos;
+    char pad1[CACHE_LINE_SIZE];
+    size_t pop_pos;
+    char pad2[CACHE_LINE_SIZE];
+};
+
+mpmc_queue_t *
+mpmc_queue_new (size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    mpmc_queue_t *self = (mpmc_queue_t *) zmalloc (sizeof (mpmc_queue_t));
+    assert (self);
+    self->cells = (cell_t *) zmalloc (size * sizeof (cell_t));
+    assert (self->cells);
+    self->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        self->cells [i].sequence = i;
+    return self;
+}
+
+void
+mpmc_queue_destroy (mpmc_queue_t **self_p)
+{
+    mpmc_queue_t *self = *self_p;
+    if (self == NULL)
+        return;
+    free (self->cells);
+    free (self);
+    *self_p = NULL;
+}
+
+bool
+mpmc_queue_push (mpmc_queue_t *self, void *item)
+{
+    cell_t *cell;
+    size_t pos = __atomic_load_n (&self->push_pos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &self->cells [pos & self->mask];
+        size_t sequence = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            //  the slot is free for this round, try to claim it
+            if (__atomic_compare_exchange_n (&self->push_pos, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else
+        if (diff < 0)
+            //  the slot still holds an item from the previous round
+            return false;
+        else
+            pos = __atomic_load_n (&self->push_pos, __ATOMIC_RELAXED);
+    }
+    cell->item = item;
+    __atomic_store_n (&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *
+mpmc_queue_pop (mpmc_queue_t *self)
+{
+    cell_t *cell;
+    size_t pos = __atomic_load_n (&self->pop_pos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &self->cells [pos & self->mask];
+        size_t sequence = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n (&self->pop_pos, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else
+        if (diff < 0)
+            //  nothing has been pushed into the slot yet
+            return NULL;
+        else
+            pos = __atomic_load_n (&self->pop_pos, __ATOMIC_RELAXED);
+    }
+    void *item = cell->item;
+    //  hand the slot to the producers of the next round
+    __atomic_store_n (&cell->sequence, pos + self->mask + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+size_t
+mpmc_queue_size (mpmc_queue_t *self)
+{
+    size_t push_pos = __atomic_load_n (&self->push_pos, __ATOMIC_RELAXED);
+    size_t pop_pos = __atomic_load_n (&self->pop_pos, __ATOMIC_RELAXED);
+    return push_pos > pop_pos ? push_pos - pop_pos : 0;
+}
+
+size_t
+mpmc_queue_capacity (mpmc_queue_t *self)
+{
+    return self->mask + 1;
+}
+
+#define TEST_THREADS 4
+#define TEST_ITEMS_PER_THREAD 100000
+
+typedef struct {
+    mpmc_queue_t *queue;
+    size_t id;
+    size_t sum;
+    size_t count;
+} test_worker_t;
+
+static void *
+s_test_producer (void *arg)
+{
+    test_worker_t *worker = (test_worker_t *) arg;
+    for (size_t i = 1; i <= TEST_ITEMS_PER_THREAD; i++) {
+        size_t item = worker->id * TEST_ITEMS_PER_THREAD + i;
+        while (!mpmc_queue_push (worker->queue, (void *) item))
+            sched_yield ();
+    }
+    return NULL;
+}
+
+static void *
+s_test_consumer (void *arg)
+{
+    test_worker_t *worker = (test_worker_t *) arg;
+    while (worker->count < TEST_ITEMS_PER_THREAD) {
+        size_t item = (size_t) mpmc_queue_pop (worker->queue);
+        if (item == 0) {
+            sched_yield ();
+            continue;
+        }
+        worker->sum += item;
+        worker->count++;
+    }
+    return NULL;
+}
+
+void
+mpmc_queue_test (int verbose)
+{
+    printf (" * mpmc_queue: ");
+    if (verbose)
+        printf ("\n");
+
+    mpmc_queue_t *queue = mpmc_queue_new (3);
+    assert (queue);
+    assert (mpmc_queue_capacity (queue) == 4);
+    assert (mpmc_queue_size (queue) == 0);
+    assert (mpmc_queue_pop (queue) == NULL);
+
+    char *cheese = "boursin";
+    char *bread = "baguette";
+    char *wine = "bordeaux";
+
+    //  items come out in fifo order, also after wrapping around
+    for (int round = 0; round < 3; round++) {
+        assert (mpmc_queue_push (queue, cheese));
+        assert (mpmc_queue_push (queue, bread));
+        assert (mpmc_queue_push (queue, wine));
+        assert (mpmc_queue_size (queue) == 3);
+        assert (mpmc_queue_pop (queue) == cheese);
+        assert (mpmc_queue_pop (queue) == bread);
+        assert (mpmc_queue_pop (queue) == wine);
+        assert (mpmc_queue_pop (queue) == NULL);
+    }
+    for (int i = 0; i < 4; i++)
+        assert (mpmc_queue_push (queue, cheese));
+    assert (!mpmc_queue_push (queue, bread));
+    assert (mpmc_queue_size (queue) == 4);
+    mpmc_queue_destroy (&queue);
+    assert (queue == NULL);
+
+    //  concurrent producers and consumers see every item exactly once
+    queue = mpmc_queue_new (1024);
+    pthread_t threads [2 * TEST_THREADS];
+    test_worker_t workers [2 * TEST_THREADS];
+    for (size_t i = 0; i < 2 * TEST_THREADS; i++) {
+        workers [i] = (test_worker_t) { queue, i % TEST_THREADS, 0, 0 };
+        int rc = pthread_create (&threads [i], NULL,
+                                 i < TEST_THREADS ? s_test_producer : s_test_consumer, &workers [i]);
+        assert (rc == 0);
+    }
+    size_t sum = 0;
+    for (size_t i = 0; i < 2 * TEST_THREADS; i++) {
+        pthread_join (threads [i], NULL);
+        sum += workers [i].sum;
+    }
+    size_t n = TEST_THREADS * TEST_ITEMS_PER_THREAD;
+    assert (sum == n * (n + 1) / 2);
+    assert (mpmc_queue_size (queue) == 0);
+    mpmc_queue_destroy (&queue);
+
+    printf ("OK\n");
+}
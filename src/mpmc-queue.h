@@ -0,0 +1,40 @@
+#ifndef __MPMC_QUEUE_H_INCLUDED__
+#define __MPMC_QUEUE_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A bounded, lock free queue of pointers for any number of producer and
+// consumer threads (Dmitry Vyukov's array based design). Each slot carries a
+// sequence number, so producers and consumers only contend on the two
+// position counters, and there's no ABA problem.
+
+typedef struct _mpmc_queue_t mpmc_queue_t;
+
+// capacity gets rounded up to a power of two
+extern mpmc_queue_t* mpmc_queue_new (size_t capacity);
+
+extern void mpmc_queue_destroy (mpmc_queue_t **self_p);
+
+// returns false if the queue is full
+extern bool mpmc_queue_push (mpmc_queue_t *self, void *item);
+
+// returns NULL if the queue is empty
+extern void* mpmc_queue_pop (mpmc_queue_t *self);
+
+// only a snapshot, as other threads may modify the queue concurrently
+extern size_t mpmc_queue_size (mpmc_queue_t *self);
+
+extern size_t mpmc_queue_capacity (mpmc_queue_t *self);
+
+extern void mpmc_queue_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+#include <czmq.h>
+#include "simd-kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static void
+s_add_doubles_scalar (double *target, const double *source, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        target [i] += source [i];
+}
+
+static void
+s_max_doubles_scalar (double *target, const double *source, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (target [i] < source [i])
+            target [i] = source [i];
+}
+
+static void
+s_add_counts_scalar (size_t *target, const size_t *source, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        target [i] += source [i];
+}
+
+static void
+s_add_counts32_scalar (uint32_t *target, const uint32_t *source, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        target [i] += source [i];
+}
+
+#ifdef HAVE_X86_KERNELS
+
+//  the max kernels keep the target value when either operand is NaN, like the scalar version
+
+__attribute__ ((target ("sse2"))) static void
+s_add_doubles_sse2 (double *target, const double *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd (target + i, _mm_add_pd (_mm_loadu_pd (target + i), _mm_loadu_pd (source + i)));
+    s_add_doubles_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("sse2"))) static void
+s_max_doubles_sse2 (double *target, const double *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd (target + i, _mm_max_pd (_mm_loadu_pd (source + i), _mm_loadu_pd (target + i)));
+    s_max_doubles_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("sse2"))) static void
+s_add_counts_sse2 (size_t *target, const size_t *source, size_t n)
+{
+    size_t i = 0;
+    if (sizeof (size_t) == 8) {
+        for (; i + 2 <= n; i += 2) {
+            __m128i sum = _mm_add_epi64 (_mm_loadu_si128 ((const __m128i *) (target + i)),
+                                         _mm_loadu_si128 ((const __m128i *) (source + i)));
+            _mm_storeu_si128 ((__m128i *) (target + i), sum);
+        }
+    }
+    s_add_counts_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("sse2"))) static void
+s_add_counts32_sse2 (uint32_t *target, const uint32_t *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i sum = _mm_add_epi32 (_mm_loadu_si128 ((const __m128i *) (target + i)),
+                                     _mm_loadu_si128 ((const __m128i *) (source + i)));
+        _mm_storeu_si128 ((__m128i *) (target + i), sum);
+    }
+    s_add_counts32_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+s_add_doubles_avx2 (double *target, const double *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd (target + i, _mm256_add_pd (_mm256_loadu_pd (target + i), _mm256_loadu_pd (source + i)));
+    s_add_doubles_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+s_max_doubles_avx2 (double *target, const double *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd (target + i, _mm256_max_pd (_mm256_loadu_pd (source + i), _mm256_loadu_pd (target + i)));
+    s_max_doubles_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+s_add_counts_avx2 (size_t *target, const size_t *source, size_t n)
+{
+    size_t i = 0;
+    if (sizeof (size_t) == 8) {
+        for (; i + 4 <= n; i += 4) {
+            __m256i sum = _mm256_add_epi64 (_mm256_loadu_si256 ((const __m256i *) (target + i)),
+                                            _mm256_loadu_si256 ((const __m256i *) (source + i)));
+            _mm256_storeu_si256 ((__m256i *) (target + i), sum);
+        }
+    }
+    s_add_counts_scalar (target + i, source + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+s_add_counts32_avx2 (uint32_t *target, const uint32_t *source, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i sum = _mm256_add_epi32 (_mm256_loadu_si256 ((const __m256i *) (target + i)),
+                                        _mm256_loadu_si256 ((const __m256i *) (source + i)));
+        _mm256_storeu_si256 ((__m256i *) (target + i), sum);
+    }
+    s_add_counts32_scalar (target + i, source + i, n - i);
+}
+
+#endif
+
+simd_add_doubles_fn *simd_add_doubles = s_add_doubles_scalar;
+simd_max_doubles_fn *simd_max_doubles = s_max_doubles_scalar;
+simd_add_counts_fn *simd_add_counts = s_add_counts_scalar;
+simd_add_counts32_fn *simd_add_counts32 = s_add_counts32_scalar;
+static const char *s_kernels_name = "scalar";
+
+//  runs before main, so no other threads can observe the pointers changing
+__attribute__ ((constructor)) static void
+s_select_kernels (void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        simd_add_doubles = s_add_doubles_avx2;
+        simd_max_doubles = s_max_doubles_avx2;
+        simd_add_counts = s_add_counts_avx2;
+        simd_add_counts32 = s_add_counts32_avx2;
+        s_kernels_name = "avx2";
+    }
+    else
+    if (__builtin_cpu_supports ("sse2")) {
+        simd_add_doubles = s_add_doubles_sse2;
+        simd_max_doubles = s_max_doubles_sse2;
+        simd_add_counts = s_add_counts_sse2;
+        simd_add_counts32 = s_add_counts32_sse2;
+        s_kernels_name = "sse2";
+    }
+#endif
+}
+
+const char *
+simd_kernels_name (void)
+{
+    return s_kernels_name;
+}
+
+static void
+s_test_kernels (const char *name, simd_add_doubles_fn *add_doubles,
+                simd_max_doubles_fn *max_doubles, simd_add_counts_fn *add_counts,
+                simd_add_counts32_fn *add_counts32, int verbose)
+{
+    if (verbose)
+        printf ("   testing %s kernels\n", name);
+    //  odd sizes exercise the scalar tails
+    for (size_t n = 0; n < 19; n++) {
+        double a [n + 1], b [n + 1], m [n + 1];
+        size_t c [n + 1], d [n + 1];
+        uint32_t e [n + 1], f [n + 1];
+        for (size_t i = 0; i < n; i++) {
+            a [i] = m [i] = i * 1.5;
+            b [i] = (i % 3) * 4.0;
+            c [i] = i;
+            d [i] = ((size_t) 1 << 40) + i;
+            e [i] = i;
+            f [i] = 3000000000U + i;
+        }
+        add_doubles (a, b, n);
+        max_doubles (m, b, n);
+        add_counts (c, d, n);
+        add_counts32 (e, f, n);
+        for (size_t i = 0; i < n; i++) {
+            assert (a [i] == i * 1.5 + (i % 3) * 4.0);
+            double expected_max = i * 1.5 > (i % 3) * 4.0 ? i * 1.5 : (i % 3) * 4.0;
+            assert (m [i] == expected_max);
+            assert (c [i] == ((size_t) 1 << 40) + 2 * i);
+            assert (e [i] == 3000000000U + 2 * i);
+        }
+    }
+}
+
+void
+simd_kernels_test (int verbose)
+{
+    printf (" * simd_kernels: ");
+    if (verbose)
+        printf ("\n   selected %s kernels\n", simd_kernels_name ());
+
+    s_test_kernels ("scalar", s_add_doubles_scalar, s_max_doubles_scalar, s_add_counts_scalar,
+                    s_add_counts32_scalar, verbose);
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2"))
+        s_test_kernels ("sse2", s_add_doubles_sse2, s_max_doubles_sse2, s_add_counts_sse2,
+                        s_add_counts32_sse2, verbose);
+    if (__builtin_cpu_supports ("avx2"))
+        s_test_kernels ("avx2", s_add_doubles_avx2, s_max_doubles_avx2, s_add_counts_avx2,
+                        s_add_counts32_avx2, verbose);
+#endif
+    s_test_kernels ("selected", simd_add_doubles, simd_max_doubles, simd_add_counts,
+                    simd_add_counts32, verbose);
+
+    printf ("OK\n");
+}
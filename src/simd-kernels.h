@@ -0,0 +1,38 @@
+#ifndef __SIMD_KERNELS_H_INCLUDED__
+#define __SIMD_KERNELS_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Element wise kernels over arrays, used for merging increments, quants and
+// histograms. The implementation (AVX2, SSE2 or plain C) is selected once at
+// program start, based on what the CPU supports.
+
+typedef void (simd_add_doubles_fn) (double *target, const double *source, size_t n);
+typedef void (simd_max_doubles_fn) (double *target, const double *source, size_t n);
+typedef void (simd_add_counts_fn) (size_t *target, const size_t *source, size_t n);
+typedef void (simd_add_counts32_fn) (uint32_t *target, const uint32_t *source, size_t n);
+
+// target[i] += source[i]
+extern simd_add_doubles_fn *simd_add_doubles;
+// target[i] = max(target[i], source[i])
+extern simd_max_doubles_fn *simd_max_doubles;
+// target[i] += source[i]
+extern simd_add_counts_fn *simd_add_counts;
+// target[i] += source[i]
+extern simd_add_counts32_fn *simd_add_counts32;
+
+// name of the selected implementation
+extern const char* simd_kernels_name (void);
+
+extern void simd_kernels_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif